@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "consumer.h"
+#include "memtrack.h"
+
+static uint64_t hashKey(const char *key, size_t len) {
+    // FNV-1a; 0 is reserved for free slots
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static int allocateTable(aggregator *agg, size_t capacity) {
+    agg->hashes = (uint64_t *)memCalloc(MEM_AGGREGATE, capacity, sizeof(uint64_t));
+    agg->slots = (aggregateSlot *)memAlloc(MEM_AGGREGATE, capacity * sizeof(aggregateSlot));
+    if (agg->hashes == NULL || agg->slots == NULL) {
+        memFree(agg->hashes);
+        memFree(agg->slots);
+        return -1;
+    }
+    agg->capacity = capacity;
+    agg->used = 0;
+    return 0;
+}
+
+int aggregatorInit(aggregator *agg, const char *field, int window, int slide, int64_t now) {
+    memset(agg, 0, sizeof(*agg));
+    if (window <= 0 || slide <= 0 || window % slide != 0) {
+        fprintf(stderr, "Error: the window must be a multiple of the slide\n");
+        return -1;
+    }
+    agg->field = field;
+    agg->window = window;
+    agg->slide = slide;
+    agg->pane_start = now - now % slide;
+    agg->pane_totals = (uint64_t *)memCalloc(MEM_AGGREGATE, window / slide, sizeof(uint64_t));
+    if (agg->pane_totals == NULL || allocateTable(agg, AGGREGATE_INITIAL_KEYS) != 0) {
+        memFree(agg->pane_totals);
+        return -1;
+    }
+    return 0;
+}
+
+void aggregatorFree(aggregator *agg) {
+    memFree(agg->hashes);
+    memFree(agg->slots);
+    memFree(agg->pane_totals);
+    memset(agg, 0, sizeof(*agg));
+}
+
+// Linear probing over the hash array keeps a probe sequence within a cache line or two;
+// slots are only touched on a hash match
+static size_t findSlot(const aggregator *agg, uint64_t hash, const char *key, size_t len) {
+    size_t mask = agg->capacity - 1;
+    size_t i = hash & mask;
+    while (agg->hashes[i] != 0) {
+        if (agg->hashes[i] == hash && agg->slots[i].key_len == len && memcmp(agg->slots[i].key, key, len) == 0) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int grow(aggregator *agg) {
+    uint64_t *hashes = agg->hashes;
+    aggregateSlot *slots = agg->slots;
+    size_t capacity = agg->capacity;
+
+    if (allocateTable(agg, capacity * 2) != 0) {
+        agg->hashes = hashes;
+        agg->slots = slots;
+        agg->capacity = capacity;
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        if (hashes[i] != 0) {
+            size_t j = findSlot(agg, hashes[i], slots[i].key, slots[i].key_len);
+            agg->hashes[j] = hashes[i];
+            agg->slots[j] = slots[i];
+            agg->used++;
+        }
+    }
+    memFree(hashes);
+    memFree(slots);
+    return 0;
+}
+
+int aggregatorAdd(aggregator *agg, const char *key, size_t key_len) {
+    if (key_len > AGGREGATE_MAX_KEY_SIZE) {
+        return -1; // Counting a prefix would merge it with other keys; the caller dead-letters the message
+    }
+    if ((agg->used + 1) * 10 > agg->capacity * 7 && grow(agg) != 0) {
+        return -1;
+    }
+
+    uint64_t hash = hashKey(key, key_len);
+    size_t i = findSlot(agg, hash, key, key_len);
+    if (agg->hashes[i] == 0) {
+        agg->hashes[i] = hash;
+        agg->slots[i].count = 0;
+        agg->slots[i].key_len = (uint32_t)key_len;
+        memcpy(agg->slots[i].key, key, key_len);
+        agg->used++;
+    }
+    agg->slots[i].count++;
+    agg->pane_messages++;
+    agg->messages++;
+    return 0;
+}
+
+static int writePaneCounts(aggregator *agg, sink *output_sink) {
+    int panes = agg->window / agg->slide;
+    char hash_key[128];
+    char count[24];
+
+    // The pane belongs to the windows starting at most (panes - 1) panes before it
+    for (int p = 0; p < panes && agg->used > 0; p++) {
+        int64_t window_start = agg->pane_start - (int64_t)p * agg->slide;
+        snprintf(hash_key, sizeof(hash_key), "%s%s:%lld", AGGREGATE_KEY_PREFIX, agg->field, (long long)window_start);
+
+        for (size_t i = 0; i < agg->capacity; i++) {
+            if (agg->hashes[i] == 0) {
+                continue;
+            }
+            sinkEntry entry;
+            aggregateSlot *slot = &agg->slots[i];
+            char field[AGGREGATE_MAX_KEY_SIZE + 1];
+            memcpy(field, slot->key, slot->key_len);
+            field[slot->key_len] = '\0';
+
+            sinkCommandInit(&entry, "HINCRBY", hash_key);
+            sinkEntryAdd(&entry, field, count, snprintf(count, sizeof(count), "%llu", (unsigned long long)slot->count));
+            if (sinkWrite(output_sink, &entry) != 0) {
+                return -1;
+            }
+            agg->writes++;
+        }
+        sinkEntry entry;
+        char ttl[16];
+        sinkCommandInit(&entry, "EXPIRE", hash_key);
+        sinkEntryAdd(&entry, NULL, ttl, snprintf(ttl, sizeof(ttl), "%d", agg->window + AGGREGATE_TTL));
+        sinkWrite(output_sink, &entry);
+        agg->writes++;
+    }
+    return 0;
+}
+
+static int flushPane(aggregator *agg, sink *output_sink) {
+    int panes = agg->window / agg->slide;
+    int64_t pane_number = agg->pane_start / agg->slide;
+    char hash_key[128];
+
+    if (writePaneCounts(agg, output_sink) != 0) {
+        return -1;
+    }
+
+    // Announce the window that ends with this pane; it has now received all of its panes
+    agg->pane_totals[pane_number % panes] = agg->pane_messages;
+    uint64_t total = 0;
+    for (int p = 0; p < panes; p++) {
+        total += agg->pane_totals[p];
+    }
+    if (total == 0) {
+        return 0; // Nothing to announce for an empty window
+    }
+
+    sinkEntry entry;
+    char start[24], end[24], messages[24];
+    int64_t window_end = agg->pane_start + agg->slide;
+    snprintf(hash_key, sizeof(hash_key), "%s%s:%lld", AGGREGATE_KEY_PREFIX, agg->field, (long long)(window_end - agg->window));
+    sinkEntryInit(&entry, AGGREGATE_STREAM_KEY);
+    sinkEntryAdd(&entry, "field", agg->field, strlen(agg->field));
+    sinkEntryAdd(&entry, "window_start", start, snprintf(start, sizeof(start), "%lld", (long long)(window_end - agg->window)));
+    sinkEntryAdd(&entry, "window_end", end, snprintf(end, sizeof(end), "%lld", (long long)window_end));
+    sinkEntryAdd(&entry, "messages", messages, snprintf(messages, sizeof(messages), "%llu", (unsigned long long)total));
+    sinkEntryAdd(&entry, "counts", hash_key, strlen(hash_key));
+    agg->writes++;
+    return sinkWrite(output_sink, &entry);
+}
+
+int aggregatorAdvance(aggregator *agg, sink *output_sink, int64_t now) {
+    int result = 0;
+    while (now >= agg->pane_start + agg->slide) {
+        if (flushPane(agg, output_sink) != 0) {
+            result = -1;
+        }
+        memset(agg->hashes, 0, agg->capacity * sizeof(uint64_t));
+        agg->used = 0;
+        agg->pane_messages = 0;
+        agg->pane_start += agg->slide;
+
+        // Once no window holds messages any more there is nothing left to announce; skip idle panes
+        uint64_t pending = 0;
+        for (int p = 0; p < agg->window / agg->slide; p++) {
+            pending += agg->pane_totals[p];
+        }
+        if (pending == 0 && agg->pane_start + agg->slide <= now) {
+            agg->pane_start = now - now % agg->slide;
+        }
+    }
+    return result;
+}
+
+int aggregatorDrain(aggregator *agg, sink *output_sink) {
+    int result = writePaneCounts(agg, output_sink);
+    memset(agg->hashes, 0, agg->capacity * sizeof(uint64_t));
+    agg->used = 0;
+    return result;
+}
+
+int aggregatorTimeout(const aggregator *agg, int64_t now_ms) {
+    int64_t close_ms = (agg->pane_start + agg->slide) * 1000;
+    return close_ms > now_ms ? (int)(close_ms - now_ms) : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _AGGREGATE_H
+#define _AGGREGATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sink.h"
+
+// Windowed message counts per key (consumer_id or the value of a payload field).
+// Time is split into panes of `slide` seconds; a window spans `window` seconds, i.e.
+// window / slide consecutive panes (one for tumbling windows). Only the current pane is
+// counted in memory. When it closes its counts are added with HINCRBY to the hash of every
+// window containing it, and the window that ends with it is announced on AGGREGATE_STREAM_KEY.
+
+#define AGGREGATE_MAX_KEY_SIZE 64
+
+typedef struct {
+    uint64_t count;
+    uint32_t key_len;
+    char key[AGGREGATE_MAX_KEY_SIZE];
+} aggregateSlot;
+
+typedef struct {
+    const char *field;       // What is counted, for key names and rollup entries
+    int window;              // Seconds
+    int slide;               // Seconds, divides window
+    int64_t pane_start;      // Epoch seconds of the pane being counted
+    uint64_t pane_messages;
+    uint64_t *pane_totals;   // Messages of the last window / slide panes, ring indexed by pane number
+    uint64_t *hashes;        // Open addressing index, 0 marks a free slot
+    aggregateSlot *slots;
+    size_t capacity;         // Power of two
+    size_t used;
+    uint64_t messages;       // Statistics
+    uint64_t writes;
+} aggregator;
+
+int aggregatorInit(aggregator *agg, const char *field, int window, int slide, int64_t now);
+void aggregatorFree(aggregator *agg);
+// Counts a message for key; -1 when the table cannot grow or the key is longer than AGGREGATE_MAX_KEY_SIZE
+int aggregatorAdd(aggregator *agg, const char *key, size_t key_len);
+// Flushes every pane that ended by `now` into the sink
+int aggregatorAdvance(aggregator *agg, sink *output_sink, int64_t now);
+// Adds the counts of the open pane to its window hashes without announcing the window, so a
+// consumer shutting down mid-pane loses none of them
+int aggregatorDrain(aggregator *agg, sink *output_sink);
+// Milliseconds until the current pane closes
+int aggregatorTimeout(const aggregator *agg, int64_t now_ms);
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "batch.h"
+#include "uuid.h"
+#include "clock.h"
+#include "hugemem.h"
+
+const char *batch_stage_names[BATCH_STAGES] = {
+    "parse", "ids", "dedup", "enrich", "output", "store"
+};
+
+// Columns are carved out of one arena, each starting on a cache line
+#define BATCH_COLUMN_ALIGN 64
+
+static void *carveColumn(messageBatch *batch, size_t *used, size_t size) {
+    void *column = batch->arena != NULL ? (char *)batch->arena + *used : NULL;
+    *used += (size + BATCH_COLUMN_ALIGN - 1) / BATCH_COLUMN_ALIGN * BATCH_COLUMN_ALIGN;
+    return column;
+}
+
+// First pass sizes the arena, second pass assigns the columns
+static size_t carveColumns(messageBatch *batch) {
+    size_t used = 0;
+    size_t capacity = (size_t)batch->capacity;
+    batch->offsets = (uint32_t *)carveColumn(batch, &used, capacity * sizeof(uint32_t));
+    batch->lengths = (uint32_t *)carveColumn(batch, &used, capacity * sizeof(uint32_t));
+    batch->ids = (unsigned char (*)[UUID_BINARY_SIZE])carveColumn(batch, &used, capacity * UUID_BINARY_SIZE);
+    batch->id_text = (char (*)[UUID_TEXT_SIZE + 1])carveColumn(batch, &used, capacity * (UUID_TEXT_SIZE + 1));
+    batch->id_valid = (uint8_t *)carveColumn(batch, &used, capacity);
+    batch->hashes = (uint64_t *)carveColumn(batch, &used, capacity * sizeof(uint64_t));
+    batch->partitions = (uint16_t *)carveColumn(batch, &used, capacity * sizeof(uint16_t));
+    batch->status = (uint8_t *)carveColumn(batch, &used, capacity);
+    batch->docs = (jsonDocument *)carveColumn(batch, &used, capacity * sizeof(jsonDocument));
+    batch->output_offsets = (uint32_t *)carveColumn(batch, &used, capacity * sizeof(uint32_t));
+    return used;
+}
+
+int messageBatchInit(messageBatch *batch, int capacity, int partition_count) {
+    memset(batch, 0, sizeof(*batch));
+    batch->capacity = capacity;
+    batch->partition_count = partition_count;
+    batch->arena_size = carveColumns(batch);
+    batch->arena = hugeAlloc(MEM_BATCH, batch->arena_size);
+    if (batch->arena == NULL) {
+        messageBatchFree(batch);
+        return -1;
+    }
+    carveColumns(batch);
+    return 0;
+}
+
+void messageBatchFree(messageBatch *batch) {
+    hugeFree(MEM_BATCH, batch->arena, batch->arena_size);
+    jsonBufferFree(&batch->output);
+    memset(batch, 0, sizeof(*batch));
+}
+
+void messageBatchReset(messageBatch *batch, const char *base) {
+    batch->count = 0;
+    batch->base = base;
+    batch->output.len = 0;
+}
+
+int messageBatchAdd(messageBatch *batch, const char *payload, size_t len) {
+    if (batch->count == batch->capacity) {
+        return -1;
+    }
+    int i = batch->count++;
+    batch->offsets[i] = (uint32_t)(payload - batch->base);
+    batch->lengths[i] = (uint32_t)len;
+    batch->status[i] = 0;
+    return 0;
+}
+
+void messageBatchDecodeIds(messageBatch *batch) {
+    // Unparsed messages have zeroed id text, so the kernel runs over the whole column unbranched
+    uuidDecodeBatch(batch->id_text[0], sizeof(batch->id_text[0]), batch->count, batch->ids, batch->hashes, batch->id_valid);
+    for (int i = 0; i < batch->count; i++) {
+        if ((batch->status[i] & MESSAGE_PARSED) && !batch->id_valid[i]) {
+            batch->status[i] = MESSAGE_INVALID_ID;
+        }
+    }
+    for (int i = 0; i < batch->count; i++) {
+        batch->partitions[i] = (uint16_t)(batch->hashes[i] % batch->partition_count);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLE_UNIT "cycles"
+
+uint64_t cycleCount(void) {
+    return __rdtsc();
+}
+#else
+#define CYCLE_UNIT "ns"
+
+uint64_t cycleCount(void) {
+    return monotonicNanos();
+}
+#endif
+
+void messageBatchReport(messageBatch *batch) {
+    if (batch->messages == 0) {
+        return;
+    }
+    printf("Pipeline stages (batches of up to %d), %s per message:", batch->capacity, CYCLE_UNIT);
+    for (int s = 0; s < BATCH_STAGES; s++) {
+        printf("%s %s %.0f", s > 0 ? "," : "", batch_stage_names[s], (double)batch->stage_cycles[s] / batch->messages);
+        batch->stage_cycles[s] = 0;
+    }
+    printf("\n");
+    batch->messages = 0;
+}
@@ -0,0 +1,83 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "records.h"
+#include "jsonscan.h"
+#include "jsonbackend.h"
+
+// A burst of messages stored as columns, so each pipeline stage runs over the whole batch in one
+// tight loop instead of taking every message through all stages in turn. Payloads are not copied:
+// they stay in the receive buffer and are addressed by offset from its start.
+
+// Status flags
+#define MESSAGE_PARSED 0x01        // Valid, with a 36 character message_id and a parsed document
+#define MESSAGE_DUPLICATE 0x02     // Already processed by this consumer
+#define MESSAGE_OUTPUT 0x04        // Processed payload built
+#define MESSAGE_DONE 0x08          // Stored or counted, and tracked as processed
+#define MESSAGE_CLAIMED 0x10       // Claimed in the host dedup table, released unless it ends up done
+#define MESSAGE_INVALID_ID 0x10    // Parsed, but message_id is not a UUID
+
+// Pipeline stages, in order, for the per-stage cost report
+enum {
+    STAGE_PARSE,
+    STAGE_IDS,
+    STAGE_DEDUP,
+    STAGE_ENRICH,
+    STAGE_OUTPUT,
+    STAGE_STORE,
+    BATCH_STAGES
+};
+
+extern const char *batch_stage_names[BATCH_STAGES];
+
+typedef struct {
+    int count;
+    int capacity;
+    const char *base;                       // Buffer the payloads live in
+    uint32_t *offsets;                      // Payloads, NUL terminated in place
+    uint32_t *lengths;
+    unsigned char (*ids)[UUID_BINARY_SIZE];
+    char (*id_text)[UUID_TEXT_SIZE + 1];    // message_id as received
+    uint8_t *id_valid;
+    uint64_t *hashes;                       // Of the binary id
+    uint16_t *partitions;                   // Hash partition, for spreading messages over workers
+    uint8_t *status;                        // MESSAGE_* flags
+    jsonDocument *docs;                     // Parsed payloads, released once the output is built
+    jsonBuffer output;                      // Processed payloads back to back, each NUL terminated
+    uint32_t *output_offsets;
+    int partition_count;
+    void *arena;                            // Backs all the columns above
+    size_t arena_size;
+    // Statistics
+    uint64_t stage_cycles[BATCH_STAGES];
+    uint64_t messages;                      // Messages the cycles were spent on
+} messageBatch;
+
+int messageBatchInit(messageBatch *batch, int capacity, int partition_count);
+void messageBatchFree(messageBatch *batch);
+// Empties the batch; payloads added next must lie in base
+void messageBatchReset(messageBatch *batch, const char *base);
+// Returns -1 when the batch is full
+int messageBatchAdd(messageBatch *batch, const char *payload, size_t len);
+
+static inline const char *messageBatchPayload(const messageBatch *batch, int i) {
+    return batch->base + batch->offsets[i];
+}
+
+static inline const char *messageBatchOutput(const messageBatch *batch, int i) {
+    return batch->output.buf + batch->output_offsets[i];
+}
+
+// Validates, decodes and hashes the ids of the parsed messages a column at a time, flagging the
+// ones that are not UUIDs with MESSAGE_INVALID_ID instead of MESSAGE_PARSED, and fills the
+// partition column
+void messageBatchDecodeIds(messageBatch *batch);
+
+// Cheap timestamp for per-stage costs: TSC cycles on x86, nanoseconds elsewhere
+uint64_t cycleCount(void);
+void messageBatchReport(messageBatch *batch);
+
+#endif
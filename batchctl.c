@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "batchctl.h"
+#include "consumer.h"
+
+// Buckets keep 3 mantissa bits per power of two, so each bucket spans at most 12.5% of its value
+static int bucketOf(uint64_t ns) {
+    if (ns < 8) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int mantissa = (ns >> (exponent - 3)) & 7;
+    return (exponent - 2) * 8 + mantissa;
+}
+
+static uint64_t bucketUpperBound(int bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    int exponent = bucket / 8 + 2;
+    uint64_t mantissa = bucket % 8;
+    return ((8 + mantissa + 1) << (exponent - 3)) - 1;
+}
+
+void latencyHistogramAdd(latencyHistogram *h, uint64_t ns, uint64_t count) {
+    h->counts[bucketOf(ns)] += count;
+    h->total += count;
+}
+
+uint64_t latencyHistogramPercentile(const latencyHistogram *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(h->total * percentile / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            return bucketUpperBound(i);
+        }
+    }
+    return bucketUpperBound(LATENCY_BUCKETS - 1);
+}
+
+void batchControllerInit(batchController *bc, uint64_t target_p99_ns, int min_batch, int max_batch, uint64_t now_ns) {
+    memset(bc, 0, sizeof(*bc));
+    bc->target_p99_ns = target_p99_ns;
+    bc->min_batch = min_batch;
+    bc->max_batch = max_batch;
+    // Start from the fixed pipeline depth and let the controller move away from it
+    bc->batch_size = SINK_PIPELINE_DEPTH < min_batch ? min_batch : SINK_PIPELINE_DEPTH > max_batch ? max_batch : SINK_PIPELINE_DEPTH;
+    bc->min_deadline_ns = BATCH_CONTROL_MIN_DEADLINE_MS * 1000000ULL;
+    // Leave the other half of the budget to the round trip itself
+    bc->max_deadline_ns = target_p99_ns / 2 > bc->min_deadline_ns ? target_p99_ns / 2 : bc->min_deadline_ns;
+    bc->flush_deadline_ns = bc->min_deadline_ns;
+    bc->window_start_ns = now_ns;
+}
+
+static void adjust(batchController *bc) {
+    uint64_t p99 = latencyHistogramPercentile(&bc->window, 99.0);
+    bc->last_p99_ns = p99;
+
+    if (p99 > bc->target_p99_ns) {
+        bc->batch_size = bc->batch_size / 2 > bc->min_batch ? bc->batch_size / 2 : bc->min_batch;
+        bc->flush_deadline_ns = bc->flush_deadline_ns / 2 > bc->min_deadline_ns ? bc->flush_deadline_ns / 2 : bc->min_deadline_ns;
+        bc->decreases++;
+    } else if (p99 < bc->target_p99_ns * 8 / 10) {
+        // Only grow with headroom, so the controller settles just below the target instead of oscillating across it
+        bc->batch_size = bc->batch_size + BATCH_CONTROL_STEP < bc->max_batch ? bc->batch_size + BATCH_CONTROL_STEP : bc->max_batch;
+        uint64_t step = bc->max_deadline_ns / 16 > 0 ? bc->max_deadline_ns / 16 : 1;
+        bc->flush_deadline_ns = bc->flush_deadline_ns + step < bc->max_deadline_ns ? bc->flush_deadline_ns + step : bc->max_deadline_ns;
+        bc->increases++;
+    }
+}
+
+void batchControllerObserve(batchController *bc, uint64_t latency_ns, int entries, uint64_t now_ns) {
+    // The oldest entry's latency stands in for the whole batch, which errs on the safe side
+    latencyHistogramAdd(&bc->window, latency_ns, entries);
+
+    if (now_ns - bc->window_start_ns >= BATCH_CONTROL_INTERVAL_MS * 1000000ULL && bc->window.total >= BATCH_CONTROL_MIN_SAMPLES) {
+        adjust(bc);
+        memset(&bc->window, 0, sizeof(bc->window));
+        bc->window_start_ns = now_ns;
+    }
+}
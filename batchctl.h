@@ -0,0 +1,40 @@
+#ifndef _BATCHCTL_H
+#define _BATCHCTL_H
+
+#include <stdint.h>
+
+// Adaptive write batching. Entry latencies (queued to acknowledged) are collected into a
+// log-linear histogram; every BATCH_CONTROL_INTERVAL_MS the controller compares their p99
+// with the target and adjusts batch size and flush deadline AIMD style: additive increase
+// while under target, multiplicative decrease as soon as the target is exceeded.
+
+#define LATENCY_BUCKETS 496
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+} latencyHistogram;
+
+typedef struct {
+    int batch_size;
+    int min_batch;
+    int max_batch;
+    uint64_t flush_deadline_ns;
+    uint64_t min_deadline_ns;
+    uint64_t max_deadline_ns;
+    uint64_t target_p99_ns;
+    uint64_t window_start_ns;
+    uint64_t last_p99_ns;
+    latencyHistogram window;
+    uint64_t increases;
+    uint64_t decreases;
+} batchController;
+
+void latencyHistogramAdd(latencyHistogram *h, uint64_t ns, uint64_t count);
+uint64_t latencyHistogramPercentile(const latencyHistogram *h, double percentile);
+
+void batchControllerInit(batchController *bc, uint64_t target_p99_ns, int min_batch, int max_batch, uint64_t now_ns);
+// Records that `entries` entries were acknowledged, the oldest after latency_ns
+void batchControllerObserve(batchController *bc, uint64_t latency_ns, int entries, uint64_t now_ns);
+
+#endif
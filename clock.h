@@ -0,0 +1,15 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic clock for deadlines, latencies and benchmarks. Kept out of sink.h so leaf modules
+// can time themselves without pulling in hiredis.
+static inline uint64_t monotonicNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
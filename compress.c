@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "compress.h"
+#include "consumer.h"
+#include "records.h"
+#include "memtrack.h"
+
+int parseCodec(const char *name) {
+    if (strcmp(name, "none") == 0) return CODEC_NONE;
+    if (strcmp(name, "lz4") == 0) return CODEC_LZ4;
+    if (strcmp(name, "zstd") == 0) return CODEC_ZSTD;
+    return -1;
+}
+
+const char *codecName(int codec) {
+    switch (codec) {
+        case CODEC_LZ4: return "lz4";
+        case CODEC_ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+int codecAvailable(int codec) {
+    switch (codec) {
+        case CODEC_NONE: return 1;
+#ifdef HAVE_LZ4
+        case CODEC_LZ4: return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: return 1;
+#endif
+        default: return 0;
+    }
+}
+
+int compressorInit(payloadCompressor *c, int codec, int level) {
+    memset(c, 0, sizeof(*c));
+    if (!codecAvailable(codec)) {
+        fprintf(stderr, "Error: %s compression was not enabled at build time\n", codecName(codec));
+        return -1;
+    }
+    c->codec = codec;
+    c->level = level;
+
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        c->cctx = ZSTD_createCCtx();
+        c->dctx = ZSTD_createDCtx();
+        c->samples = (char *)memAlloc(MEM_OUTPUT, COMPRESSION_DICT_SAMPLE_BYTES);
+        c->sample_sizes = (size_t *)memAlloc(MEM_OUTPUT, sizeof(size_t) * COMPRESSION_DICT_SAMPLES);
+        if (c->cctx == NULL || c->dctx == NULL || c->samples == NULL || c->sample_sizes == NULL) {
+            compressorFree(c);
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+void compressorFree(payloadCompressor *c) {
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx((ZSTD_CCtx *)c->cctx);
+    ZSTD_freeDCtx((ZSTD_DCtx *)c->dctx);
+    ZSTD_freeCDict((ZSTD_CDict *)c->cdict);
+    ZSTD_freeDDict((ZSTD_DDict *)c->ddict);
+#endif
+    memFree(c->samples);
+    memFree(c->sample_sizes);
+    memset(c, 0, sizeof(*c));
+}
+
+size_t compressBound(const payloadCompressor *c, size_t len) {
+    switch (c->codec) {
+#ifdef HAVE_LZ4
+        case CODEC_LZ4: return 10 + LZ4_compressBound((int)len);
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: return 10 + ZSTD_compressBound(len);
+#endif
+        default: return len;
+    }
+}
+
+static uint64_t elapsedNanos(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ULL + (now.tv_nsec - start->tv_nsec);
+}
+
+long compressPayload(payloadCompressor *c, const char *src, size_t len, char *dst, size_t capacity) {
+    if (c->codec == CODEC_NONE) {
+        if (len > capacity) {
+            return -1;
+        }
+        memcpy(dst, src, len);
+        return (long)len;
+    }
+    if (capacity < compressBound(c, len)) {
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t header = varintEncode(len, (unsigned char *)dst);
+    long n = -1;
+#ifdef HAVE_LZ4
+    if (c->codec == CODEC_LZ4) {
+        int written = LZ4_compress_default(src, dst + header, (int)len, (int)(capacity - header));
+        n = written > 0 ? written : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (c->codec == CODEC_ZSTD) {
+        size_t written = c->cdict != NULL
+            ? ZSTD_compress_usingCDict((ZSTD_CCtx *)c->cctx, dst + header, capacity - header, src, len, (ZSTD_CDict *)c->cdict)
+            : ZSTD_compressCCtx((ZSTD_CCtx *)c->cctx, dst + header, capacity - header, src, len, c->level);
+        if (ZSTD_isError(written)) {
+            fprintf(stderr, "Error compressing payload: %s\n", ZSTD_getErrorName(written));
+        } else {
+            n = (long)written;
+        }
+    }
+#endif
+    if (n < 0) {
+        return -1;
+    }
+
+    c->compress_ns += elapsedNanos(&start);
+    c->bytes_in += len;
+    c->bytes_out += header + n;
+    return (long)header + n;
+}
+
+long storedPayloadSize(const char *src, size_t len) {
+    uint64_t size;
+    if (varintDecode((const unsigned char *)src, len, &size) < 0) {
+        return -1;
+    }
+    return (long)size;
+}
+
+unsigned storedPayloadDictId(const char *src, size_t len) {
+#ifdef HAVE_ZSTD
+    uint64_t size;
+    int header = varintDecode((const unsigned char *)src, len, &size);
+    if (header > 0) {
+        return ZSTD_getDictID_fromFrame(src + header, len - header);
+    }
+#endif
+    return 0;
+}
+
+long decompressPayload(payloadCompressor *c, int codec, const char *src, size_t len, char *dst, size_t capacity) {
+    if (codec == CODEC_NONE) {
+        if (len > capacity) {
+            return -1;
+        }
+        memcpy(dst, src, len);
+        return (long)len;
+    }
+
+    uint64_t size;
+    int header = varintDecode((const unsigned char *)src, len, &size);
+    if (header < 0 || size > capacity) {
+        return -1;
+    }
+    src += header;
+    len -= header;
+
+#ifdef HAVE_LZ4
+    if (codec == CODEC_LZ4) {
+        int n = LZ4_decompress_safe(src, dst, (int)len, (int)size);
+        return n == (int)size ? n : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD && c->dctx != NULL) {
+        unsigned dict_id = ZSTD_getDictID_fromFrame(src, len);
+        if (dict_id != 0 && dict_id != c->dict_id) {
+            fprintf(stderr, "Error: payload needs compression dictionary %u\n", dict_id);
+            return -1;
+        }
+        size_t n = dict_id != 0
+            ? ZSTD_decompress_usingDDict((ZSTD_DCtx *)c->dctx, dst, size, src, len, (ZSTD_DDict *)c->ddict)
+            : ZSTD_decompressDCtx((ZSTD_DCtx *)c->dctx, dst, size, src, len);
+        return ZSTD_isError(n) || n != size ? -1 : (long)n;
+    }
+#endif
+    fprintf(stderr, "Error: %s decompression is not available\n", codecName(codec));
+    return -1;
+}
+
+int compressorAddSample(payloadCompressor *c, const char *src, size_t len) {
+    if (c->codec != CODEC_ZSTD || c->cdict != NULL || c->sample_count >= COMPRESSION_DICT_SAMPLES) {
+        return c->sample_count >= COMPRESSION_DICT_SAMPLES;
+    }
+    if (c->samples_len + len > COMPRESSION_DICT_SAMPLE_BYTES) {
+        return 1; // Sample buffer is full
+    }
+    memcpy(c->samples + c->samples_len, src, len);
+    c->samples_len += len;
+    c->sample_sizes[c->sample_count++] = len;
+    return c->sample_count >= COMPRESSION_DICT_SAMPLES;
+}
+
+// Trains a dictionary from the collected samples into dict and starts using it. Returns its size or -1.
+long compressorTrain(payloadCompressor *c, char *dict, size_t capacity) {
+#ifdef HAVE_ZSTD
+    size_t size = ZDICT_trainFromBuffer(dict, capacity, c->samples, c->sample_sizes, c->sample_count);
+    c->sample_count = 0;
+    c->samples_len = 0;
+    if (ZDICT_isError(size)) {
+        fprintf(stderr, "Error training compression dictionary: %s\n", ZDICT_getErrorName(size));
+        return -1;
+    }
+    if (compressorLoadDictionary(c, dict, size) != 0) {
+        return -1;
+    }
+    return (long)size;
+#else
+    return -1;
+#endif
+}
+
+// Goes back to compressing without a dictionary, and collects samples for another try
+void compressorDropDictionary(payloadCompressor *c) {
+#ifdef HAVE_ZSTD
+    ZSTD_freeCDict((ZSTD_CDict *)c->cdict);
+    ZSTD_freeDDict((ZSTD_DDict *)c->ddict);
+#endif
+    c->cdict = NULL;
+    c->ddict = NULL;
+    c->dict_id = 0;
+}
+
+int compressorLoadDictionary(payloadCompressor *c, const char *dict, size_t len) {
+#ifdef HAVE_ZSTD
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict, len, c->level);
+    ZSTD_DDict *ddict = ZSTD_createDDict(dict, len);
+    if (cdict == NULL || ddict == NULL) {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+        fprintf(stderr, "Error loading compression dictionary\n");
+        return -1;
+    }
+    ZSTD_freeCDict((ZSTD_CDict *)c->cdict);
+    ZSTD_freeDDict((ZSTD_DDict *)c->ddict);
+    c->cdict = cdict;
+    c->ddict = ddict;
+    c->dict_id = ZDICT_getDictID(dict, len);
+    return 0;
+#else
+    return -1;
+#endif
+}
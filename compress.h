@@ -0,0 +1,60 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Payload compression for stored records. LZ4 is built with -DHAVE_LZ4 and zstd with -DHAVE_ZSTD.
+// Compressed payloads are stored as: varint original length | codec output.
+// zstd frames produced with a trained dictionary carry its id, which readers use to
+// fetch the dictionary from COMPRESSION_DICT_KEY_PREFIX<id>.
+
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+
+typedef struct {
+    int codec;
+    int level;
+    void *cctx;           // ZSTD_CCtx
+    void *dctx;           // ZSTD_DCtx
+    void *cdict;          // ZSTD_CDict of the current dictionary, NULL until one is trained or loaded
+    void *ddict;          // ZSTD_DDict of the current dictionary
+    unsigned dict_id;
+
+    // Samples collected for dictionary training
+    char *samples;
+    size_t samples_len;
+    size_t *sample_sizes;
+    unsigned sample_count;
+
+    // Statistics
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t compress_ns;
+} payloadCompressor;
+
+int parseCodec(const char *name);
+const char *codecName(int codec);
+int codecAvailable(int codec);
+
+int compressorInit(payloadCompressor *c, int codec, int level);
+void compressorFree(payloadCompressor *c);
+
+size_t compressBound(const payloadCompressor *c, size_t len);
+// Returns the stored size, or -1 on error
+long compressPayload(payloadCompressor *c, const char *src, size_t len, char *dst, size_t capacity);
+// Returns the original size, or -1 on error (including a missing dictionary)
+long decompressPayload(payloadCompressor *c, int codec, const char *src, size_t len, char *dst, size_t capacity);
+// Original size of a stored payload, or -1 if the header is malformed
+long storedPayloadSize(const char *src, size_t len);
+// Dictionary id a stored zstd payload was compressed with, 0 for none
+unsigned storedPayloadDictId(const char *src, size_t len);
+
+// Dictionary training (zstd only). compressorAddSample returns 1 once enough samples are collected.
+int compressorAddSample(payloadCompressor *c, const char *src, size_t len);
+long compressorTrain(payloadCompressor *c, char *dict, size_t capacity);
+int compressorLoadDictionary(payloadCompressor *c, const char *dict, size_t len);
+void compressorDropDictionary(payloadCompressor *c);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "connection.h"
+#include "consumer.h"
+
+static int setSocketOption(int fd, int level, int name, int value, const char *label) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+        perror(label);
+        return -1;
+    }
+    return 0;
+}
+
+void rearmQuickAck(int fd, const connectionOptions *options) {
+    if (options->tcp_quickack && options->unix_socket == NULL) {
+        int value = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &value, sizeof(value));
+    }
+}
+
+int applySocketOptions(redisContext *c, const connectionOptions *options) {
+    if (options->rcvbuf > 0 && setSocketOption(c->fd, SOL_SOCKET, SO_RCVBUF, options->rcvbuf, "SO_RCVBUF") != 0) {
+        return -1;
+    }
+    if (options->sndbuf > 0 && setSocketOption(c->fd, SOL_SOCKET, SO_SNDBUF, options->sndbuf, "SO_SNDBUF") != 0) {
+        return -1;
+    }
+    // TCP level options do not apply to unix domain sockets
+    if (options->unix_socket != NULL) {
+        return 0;
+    }
+    if (options->tcp_nodelay && setSocketOption(c->fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY") != 0) {
+        return -1;
+    }
+    if (options->tcp_quickack && setSocketOption(c->fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+redisContext *connectRedis(const connectionOptions *options) {
+    // The timeout stays with the context, so redisReconnect() is bounded by it as well
+    struct timeval timeout = {REDIS_CONNECT_TIMEOUT_MS / 1000, (REDIS_CONNECT_TIMEOUT_MS % 1000) * 1000};
+    redisContext *c;
+    if (options->unix_socket != NULL) {
+        c = redisConnectUnixWithTimeout(options->unix_socket, timeout);
+    } else {
+        c = redisConnectWithTimeout(options->host, options->port, timeout);
+    }
+
+    if (c == NULL) {
+        fprintf(stderr, "Error allocating redis context\n");
+        return NULL;
+    } else if (c->err) {
+        fprintf(stderr, "Error connecting to redis server: %s\n", c->errstr);
+        redisFree(c);
+        return NULL;
+    }
+
+    if (applySocketOptions(c, options) != 0) {
+        fprintf(stderr, "Error applying socket options\n");
+        redisFree(c);
+        return NULL;
+    }
+    return c;
+}
@@ -0,0 +1,25 @@
+#ifndef _CONNECTION_H
+#define _CONNECTION_H
+
+#include <hiredis.h>
+
+// How the consumer reaches Redis, and the socket tuning every connection gets, including the ones
+// sinks re-establish after an error.
+
+typedef struct {
+    const char *host;
+    int port;
+    const char *unix_socket; // When set, host and port are ignored
+    int rcvbuf;              // 0 keeps the OS default
+    int sndbuf;              // 0 keeps the OS default
+    int tcp_nodelay;
+    int tcp_quickack;
+} connectionOptions;
+
+// Linux clears TCP_QUICKACK after the next ACK, so it has to be re-armed after every read
+void rearmQuickAck(int fd, const connectionOptions *options);
+int applySocketOptions(redisContext *c, const connectionOptions *options);
+// Connects within REDIS_CONNECT_TIMEOUT_MS and applies the socket options; NULL on error
+redisContext *connectRedis(const connectionOptions *options);
+
+#endif
@@ -1,16 +1,90 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <hiredis.h>
 #include <getopt.h>
 #include <time.h>
 #include <signal.h>
-#include <jansson.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include "consumer.h"
+#include "connection.h"
+#include "receiver.h"
+#include "records.h"
+#include "compress.h"
+#include "sink.h"
+#include "aggregate.h"
+#include "enrich.h"
+#include "jsonscan.h"
+#include "jsonbackend.h"
+#include "transform.h"
+#include "batch.h"
+#include "uuid.h"
+#include "dedup.h"
+#include "shmdedup.h"
+#include "hugemem.h"
+#include "memtrack.h"
+#include "memhooks.h"
+#include "hll.h"
+#include "dedupkey.h"
+#include "control.h"
+#include "dispatch.h"
 
 redisContext *global_redis_context = NULL;
+redisContext *global_write_context = NULL;
+redisContext *global_lookup_context = NULL;
+
+// Long-only command-line options
+enum {
+    OPT_RCVBUF = 256,
+    OPT_SNDBUF,
+    OPT_TCP_NODELAY,
+    OPT_TCP_QUICKACK,
+    OPT_RECORD_TIMESTAMP,
+    OPT_RECORD_PAYLOAD_LENGTH,
+    OPT_STORE_PAYLOAD,
+    OPT_COMPRESS,
+    OPT_COMPRESS_BATCHES,
+    OPT_SINK,
+    OPT_SINK_FILE,
+    OPT_RETRY_MAX_BYTES,
+    OPT_LATENCY_TARGET,
+    OPT_AGGREGATE,
+    OPT_WINDOW,
+    OPT_SLIDE,
+    OPT_ENRICH,
+    OPT_ENRICH_PREFIX,
+    OPT_ENRICH_FIELDS,
+    OPT_ENRICH_CACHE_SIZE,
+    OPT_TRANSFORM,
+    OPT_JSON_BACKEND,
+    OPT_JSON_BENCHMARK,
+    OPT_PROCESS_BATCH_SIZE,
+    OPT_UUID_BENCHMARK,
+    OPT_DEDUP_DIR,
+    OPT_DEDUP_HOT_ENTRIES,
+    OPT_DEDUP_BENCHMARK,
+    OPT_HOST_DEDUP,
+    OPT_HOST_DEDUP_ENTRIES,
+    OPT_HOST_DEDUP_BENCHMARK,
+    OPT_HUGE_PAGES,
+    OPT_LOCK_MEMORY,
+    OPT_MEMORY_BUDGET,
+    OPT_HLL_BENCHMARK,
+    OPT_DEDUP_KEY,
+    OPT_DEDUP_KEY_BENCHMARK,
+    OPT_DRAIN_TIMEOUT,
+    OPT_CONTROL_SOCKET,
+    OPT_WORKERS,
+    OPT_ORDER_KEY,
+    OPT_DISPATCH_BENCHMARK,
+    OPT_DEAD_LETTER_BENCHMARK,
+    OPT_RETRY_BENCHMARK
+};
 
 void help(const char *program) {
     printf("Usage: %s [options]\n", program);
@@ -22,144 +96,1446 @@ void help(const char *program) {
     printf("  -g, --group-size     Consumer group size (integer)\n");
     printf("  -h, --host           Redis host (default: %s)\n", REDIS_HOST);
     printf("  -p, --port           Redis port (default: %d)\n", REDIS_PORT);
-    printf("  -v, --verbose        Enable verbose output\n");
+    printf("  -s, --unix-socket    Redis unix socket path, overrides host and port\n");
+    printf("      --rcvbuf         Socket receive buffer size in bytes (default: OS setting)\n");
+    printf("      --sndbuf         Socket send buffer size in bytes (default: OS setting)\n");
+    printf("      --tcp-nodelay    Disable Nagle's algorithm on TCP connections\n");
+    printf("      --tcp-quickack   Acknowledge TCP segments immediately on the subscribe connection\n");
+    printf("  -k, --records-per-entry  Pack this many processed records into one stream entry (default: %d)\n", RECORDS_PER_ENTRY);
+    printf("  -f, --record-format  Stream record format: text or binary (default: text)\n");
+    printf("      --record-timestamp       Add the processing time to binary records\n");
+    printf("      --record-payload-length  Add the original payload length to binary records\n");
+    printf("      --store-payload          Add the processed JSON payload to binary records\n");
+    printf("      --compress               Stored payload compression: none, lz4 or zstd (default: none)\n");
+    printf("      --compress-batches       Compress whole packed entries instead of each payload\n");
+    printf("      --sink                   Output sink: redis, file or null (default: redis)\n");
+    printf("      --sink-file              File the file sink appends to (default: %s)\n", SINK_FILE_PATH);
+    printf("      --retry-max-bytes        Memory for failed writes, and the writes queued behind them, before they are dead-lettered (default: %d)\n", RETRY_MAX_BYTES);
+    printf("      --retry-benchmark        Inject write errors from a stand-in Redis, check that every write lands once and in order and exit\n");
+    printf("      --latency-target         Adapt write batch size and flush deadline to keep p99 write latency under this many ms\n");
+    printf("      --aggregate              Count messages per window by consumer_id or a payload field instead of writing them\n");
+    printf("      --window                 Aggregation window in seconds (default: %d)\n", AGGREGATE_WINDOW);
+    printf("      --slide                  Aggregation window slide in seconds, dividing the window (default: tumbling windows)\n");
+    printf("      --enrich                 Add metadata from the hash named by this payload field (or consumer_id) to each message\n");
+    printf("      --enrich-prefix          Key prefix of the enrichment hashes (default: %s)\n", ENRICH_KEY_PREFIX);
+    printf("      --enrich-fields          Comma separated hash fields to add (default: %s)\n", ENRICH_FIELDS);
+    printf("      --enrich-cache-size      Cached enrichment hashes, 0 looks every message up (default: %d)\n", ENRICH_CACHE_ENTRIES);
+    printf("      --transform              Process payloads with the rules in this file instead of only adding consumer_id\n");
+    printf("      --json-backend           JSON parser: %s (default: %s)\n", jsonBackendNames(), jsonDefaultBackend()->name);
+    printf("      --json-benchmark         Benchmark the JSON backends over a file of one message per line and exit\n");
+    printf("      --dead-letter-benchmark  Check that malformed messages are only dead-lettered, compare throughput with and without them and exit\n");
+    printf("      --process-batch-size     Messages taken through the pipeline together, 1 processes them one at a time (default: %d)\n", PROCESS_BATCH_SIZE);
+    printf("      --uuid-benchmark         Check the message_id decoding kernels against each other, benchmark them and exit\n");
+    printf("      --dedup-dir              Spill processed message ids to sorted run files under this directory, one subdirectory per consumer\n");
+    printf("      --dedup-hot-entries      Processed message ids kept in memory (default: %d, or %d with --dedup-dir)\n", MAX_PROCESSED_MSGS, DEDUP_HOT_ENTRIES);
+    printf("      --dedup-key              Dedup on id, payload (all but message_id) or fields:NAME,... hashed to 128 bits (default: id)\n");
+    printf("      --dedup-key-benchmark    Benchmark content key hashing by payload size and against message_id keys and exit\n");
+    printf("      --dedup-benchmark        Insert this many ids into a dedup store, report lookup latency and memory use and exit\n");
+    printf("      --host-dedup             Also dedup against every consumer on this host through this shared memory table, e.g. /consumer-dedup\n");
+    printf("      --host-dedup-entries     Slots of a newly created host dedup table (default: %d)\n", SHARED_DEDUP_ENTRIES);
+    printf("      --host-dedup-benchmark   Benchmark host dedup claims from 1 to %d processes, check crash safety and exit\n", SHARED_DEDUP_BENCHMARK_PROCESSES);
+    printf("      --huge-pages             Back the dedup table, receive buffer and batch columns with huge pages: off, transparent or explicit (default: off)\n");
+    printf("      --lock-memory            Pre-fault and lock those regions in memory\n");
+    printf("      --memory-budget          MiB of tracked memory; above it the dedup hot table is halved until use fits (default: no budget)\n");
+    printf("      --hll-benchmark          Benchmark the distinct message id estimator, check its accuracy and exit\n");
+    printf("      --workers                Threads building and writing processed messages, each with its own write connection (default: 1)\n");
+    printf("      --order-key              What keeps messages in order across workers: id, id-prefix:N or field:NAME (default: id)\n");
+    printf("      --dispatch-benchmark     Check per-key order across workers, benchmark throughput by worker count and exit\n");
+    printf("      --control-socket         Accept runtime commands (status, set, pause, resume, snapshot) on this Unix socket\n");
+    printf("      --drain-timeout          Milliseconds to drain, flush and await writes after SIGTERM or Ctrl+C before exiting (default: %d)\n", DRAIN_TIMEOUT_MS);
+    printf("  -v, --verbose        Log every message and control command (log level debug)\n");
     printf("  -?, --help           Show this help message\n");
 }
 
 typedef struct {
-    char message_id[37]; // UUID is 36 characters + 1 for null terminator; this will be used for the json parser
-} Message;
-
-typedef struct {
-    char **processed_message_ids;
-    int processed_message_count;
+    dedupStore processed;
+    sharedDedupTable *host;  // Host-wide table shared with the other consumers, or NULL
+    dedupKey key;            // What the processed ids are: message ids or content hashes
 } consumerState;
 
 consumerState *global_consumer_state = NULL;
 
+typedef struct {
+    int records_per_entry;   // 1 writes one entry per message
+    int record_flags;        // Optional binary record fields (RECORD_HAS_*)
+    int compress_batches;    // Compress whole packed entries instead of each payload
+    payloadCompressor compressor;
+    char *scratch;           // Compressed payloads and entries
+    size_t scratch_capacity;
+    recordBatch batch;       // Records waiting to be packed into the next entry
+    sink *sink;              // Where stream entries go
+    aggregator *aggregator;  // When set, messages are counted into windowed rollups instead of written
+    long long entries_written;
+    long long bytes_written; // Record bytes sent to Redis, excluding field names
+} outputState;
+
+outputState *global_output_state = NULL;
+
+typedef struct {
+    const char *field;       // Message field whose value names the hash to look up
+    enricher lookups;
+} enrichmentState;
+
+enrichmentState *global_enrichment_state = NULL;
+
+// Buffers for building processed payloads, reused for every message
+typedef struct {
+    const jsonBackend *backend; // Parses payloads and builds the built-in output
+    transformProgram *program;  // Transform rules, NULL for the built-in processing
+    jsonBuffer extra;           // Members appended to the payload
+} processingState;
+
+processingState global_processing_state;
+
+// Messages received in one drain, processed stage by stage
+messageBatch global_message_batch;
+
+// One per --workers thread, each writing its share of the processed messages. Worker 0 is the main
+// thread and writes through global_output_state; the others own a write connection, sink and output state.
+typedef struct {
+    redisContext *c;
+    outputState *output;
+    jsonBuffer extra;
+    jsonBuffer payload;         // Processed payload of the current message
+    batchController controller;
+    int consumer_id;
+} outputWorker;
+
+outputWorker *global_output_workers = NULL;
+int global_output_worker_count = 0;
+dispatcher *global_dispatcher = NULL;  // Only with more than one worker
+
+// Distinct message ids against those the dedup window caught, for sizing the window
+typedef struct {
+    hyperLogLog interval;    // Since the last report
+    hyperLogLog total;       // Since startup, merged from the intervals
+    uint64_t ids;            // Valid message ids seen in the interval
+    uint64_t dedup_hits;     // Of those, skipped as already processed
+} idStatistics;
+
+idStatistics global_id_statistics;
+
+// Knobs the control socket can change while running; the rest live in the structures they tune
+typedef struct {
+    int log_level;          // LOG_*
+    int report_interval;    // Seconds between throughput reports
+    int paused;             // The subscribe connection is not read; Redis buffers what is published meanwhile
+    uint64_t resume_ms;     // When a pause ends by itself
+} runtimeSettings;
+
+runtimeSettings global_settings = { .log_level = LOG_INFO, .report_interval = REPORT_INTERVAL, .paused = 0 };
+controlChannel *global_control = NULL;
+
+uint64_t currentTimeMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void freeConsumerState(consumerState *state) {
     if (state != NULL) {
-        for (int i = 0; i < state->processed_message_count; i++) {
-            free(state->processed_message_ids[i]);
+        dedupStoreFree(&state->processed);
+        dedupKeyFree(&state->key);
+        if (state->host != NULL) {
+            sharedDedupDetach(state->host);
+            memFree(state->host);
         }
-        free(state->processed_message_ids);
-        free(state);
+        memFree(state);
     }
 }
 
-consumerState* createConsumerState() {
-    consumerState *state = (consumerState*)malloc(sizeof(consumerState));
-    state->processed_message_ids = (char**)malloc(sizeof(char*) * MAX_PROCESSED_MSGS);
-    state->processed_message_count = 0;
-    
+// dedup_dir, if set, keeps the ids that do not fit in memory and those of earlier runs
+consumerState* createConsumerState(const char *dedup_dir, size_t hot_entries) {
+    consumerState *state = (consumerState*)memAlloc(MEM_DEDUP, sizeof(consumerState));
+    if (state == NULL || dedupStoreInit(&state->processed, hot_entries, dedup_dir) != 0) {
+        memFree(state);
+        return NULL;
+    }
+    state->host = NULL;
+    memset(&state->key, 0, sizeof(state->key));
     return state;
 }
 
-int isMessageProcessed(const char *message_id) {
-    for (int i = 0; i < global_consumer_state->processed_message_count; i++) {
-        if (strcmp(global_consumer_state->processed_message_ids[i], message_id) == 0) {
-            return 1;  // Message already processed
+int isMessageProcessed(const unsigned char *id, uint64_t hash) {
+    return dedupStoreContains(&global_consumer_state->processed, id, hash);
+}
+
+void addProcessedMessage(const unsigned char *id, uint64_t hash) {
+    dedupStoreAdd(&global_consumer_state->processed, id, hash);
+}
+
+// Parse failure classes, counted separately and recorded with every dead-lettered message. An
+// aggregation key too long to count is rejected the same way rather than merged with its prefix.
+typedef enum {
+    PARSE_OK = 0,
+    PARSE_INVALID_JSON,
+    PARSE_MISSING_MESSAGE_ID,
+    PARSE_INVALID_MESSAGE_ID,
+    PARSE_KEY_TOO_LONG,
+    PARSE_ERROR_CLASSES
+} parseError;
+
+const char *parse_error_names[PARSE_ERROR_CLASSES] = {
+    "ok", "invalid_json", "missing_message_id", "invalid_message_id", "aggregate_key_too_long"
+};
+
+long long parse_error_counts[PARSE_ERROR_CLASSES];
+
+// Parses the payload into doc, which the caller releases whatever the result, and returns the
+// message_id in id_text. Whether it is a UUID is checked for the whole batch at once afterwards.
+parseError parseMessage(jsonDocument *doc, const char *json_string, size_t len, char *id_text,
+        char *error_text, size_t error_size) {
+    int res = jsonParse(global_processing_state.backend, doc, json_string, len, error_text, error_size);
+    if (res == JSON_PARSE_INVALID) {
+        return PARSE_INVALID_JSON;
+    }
+    // Valid JSON that is not an object has no message_id either
+    char id[6 * MSG_ID_SIZE + 1];
+    size_t id_len = 0;
+    int found = res == JSON_PARSE_OK ? jsonGetString(doc, "message_id", id, sizeof(id), &id_len) : 0;
+    if (found == 0) {
+        snprintf(error_text, error_size, "'message_id' is missing");
+        return PARSE_MISSING_MESSAGE_ID;
+    }
+
+    // Message ids must be UUIDs, anything else would be truncated or rejected by the binary format
+    if (found < 0 || id_len != MSG_ID_SIZE) {
+        snprintf(error_text, error_size, "'message_id' is not a UUID string");
+        return PARSE_INVALID_MESSAGE_ID;
+    }
+
+    memcpy(id_text, id, MSG_ID_SIZE);
+    id_text[MSG_ID_SIZE] = '\0';
+    return PARSE_OK;
+}
+
+outputState *createOutputState(sink *output_sink, int records_per_entry, int record_format, int record_flags, int codec, int compress_batches) {
+    outputState *state = (outputState *)memCalloc(MEM_OUTPUT, 1, sizeof(outputState));
+    if (state == NULL) {
+        return NULL;
+    }
+    state->sink = output_sink;
+    state->records_per_entry = records_per_entry;
+    state->record_flags = record_flags;
+    state->compress_batches = compress_batches;
+    if (compressorInit(&state->compressor, codec, COMPRESSION_LEVEL) != 0) {
+        memFree(state);
+        return NULL;
+    }
+    if (recordBatchInit(&state->batch, record_format, RECORD_MAX_ENCODED_SIZE * records_per_entry) != 0) {
+        compressorFree(&state->compressor);
+        memFree(state);
+        return NULL;
+    }
+    return state;
+}
+
+// The sink named by --sink, writing through c, connected with options, when it is the Redis stream sink
+sink *createOutputSink(const char *name, const char *file, redisContext *c, const connectionOptions *options,
+        size_t retry_max_bytes) {
+    if (strcmp(name, "file") == 0) {
+        return createFileSink(file);
+    } else if (strcmp(name, "null") == 0) {
+        return createNullSink();
+    }
+    return createRedisStreamSink(c, options, retry_max_bytes);
+}
+
+void freeOutputState(outputState *state) {
+    if (state != NULL) {
+        if (state->aggregator != NULL) {
+            aggregatorFree(state->aggregator);
+            memFree(state->aggregator);
+        }
+        sinkClose(state->sink);
+        recordBatchFree(&state->batch);
+        compressorFree(&state->compressor);
+        memFree(state->scratch);
+        memFree(state);
+    }
+}
+
+// Scratch space for compressed payloads and entries
+char *outputScratch(outputState *state, size_t size) {
+    if (size > state->scratch_capacity) {
+        char *scratch = (char *)memRealloc(MEM_OUTPUT, state->scratch, size);
+        if (scratch == NULL) {
+            fprintf(stderr, "Error allocating %zu bytes of compression buffer\n", size);
+            return NULL;
+        }
+        state->scratch = scratch;
+        state->scratch_capacity = size;
+    }
+    return state->scratch;
+}
+
+// Uses the shared zstd dictionary if another consumer already trained one
+void loadCompressionDictionary(redisContext *c, payloadCompressor *compressor) {
+    redisReply *reply = redisCommand(c, "GET %s", COMPRESSION_DICT_LATEST_KEY);
+    if (reply == NULL || reply->type != REDIS_REPLY_STRING) {
+        if (reply) freeReplyObject(reply);
+        return;
+    }
+    unsigned dict_id = (unsigned)strtoul(reply->str, NULL, 10);
+    freeReplyObject(reply);
+
+    reply = redisCommand(c, "GET %s%u", COMPRESSION_DICT_KEY_PREFIX, dict_id);
+    if (reply != NULL && reply->type == REDIS_REPLY_STRING && compressorLoadDictionary(compressor, reply->str, reply->len) == 0) {
+        printf("Loaded compression dictionary %u\n", dict_id);
+    }
+    if (reply) freeReplyObject(reply);
+}
+
+// Trains a zstd dictionary once enough payloads were sampled and publishes it as the latest version
+void trainCompressionDictionary(redisContext *c, payloadCompressor *compressor) {
+    char *dict = (char *)memAlloc(MEM_OUTPUT, COMPRESSION_DICT_SIZE);
+    if (dict == NULL) {
+        return;
+    }
+    long size = compressorTrain(compressor, dict, COMPRESSION_DICT_SIZE);
+    if (size > 0) {
+        // Readers look dictionaries up by the id in each frame, so only one dictionary may ever be stored
+        // under an id: if another consumer got there first, compress with the one it stored instead
+        unsigned dict_id = compressor->dict_id;
+        redisReply *reply = redisCommand(c, "SET %s%u %b NX", COMPRESSION_DICT_KEY_PREFIX, dict_id, dict, (size_t)size);
+        int stored = reply != NULL && reply->type == REDIS_REPLY_STATUS;
+        int exists = reply != NULL && reply->type == REDIS_REPLY_NIL;
+        if (reply) freeReplyObject(reply);
+        if (stored) {
+            reply = redisCommand(c, "SET %s %u", COMPRESSION_DICT_LATEST_KEY, dict_id);
+            if (reply) freeReplyObject(reply);
+            printf("Trained compression dictionary %u (%ld bytes)\n", dict_id, size);
+        } else {
+            reply = exists ? redisCommand(c, "GET %s%u", COMPRESSION_DICT_KEY_PREFIX, dict_id) : NULL;
+            if (reply != NULL && reply->type == REDIS_REPLY_STRING && compressorLoadDictionary(compressor, reply->str, reply->len) == 0) {
+                printf("Compression dictionary %u was already stored by another consumer, using that one\n", dict_id);
+            } else {
+                fprintf(stderr, "Error storing compression dictionary %u, compressing without it\n", dict_id);
+                compressorDropDictionary(compressor);
+            }
+            if (reply) freeReplyObject(reply);
         }
     }
-    return 0;  // Message not processed
+    memFree(dict);
+}
+
+// Queues the pending records as a single stream entry
+int flushOutputBatch(outputState *state) {
+    if (state->batch.count == 0) {
+        return 0;
+    }
+
+    const char *entry = state->batch.buf;
+    size_t len = state->batch.len;
+    int compressed = 0;
+    if (state->compress_batches && state->compressor.codec != CODEC_NONE && state->records_per_entry > 1) {
+        char *scratch = outputScratch(state, compressBound(&state->compressor, len));
+        long n = scratch ? compressPayload(&state->compressor, entry, len, scratch, state->scratch_capacity) : -1;
+        if (n > 0) {
+            entry = scratch;
+            len = n;
+            compressed = 1;
+        }
+    }
+
+    sinkEntry sink_entry;
+    char count[16];
+    sinkEntryInit(&sink_entry, STREAM_KEY);
+    if (state->records_per_entry == 1) {
+        sinkEntryAdd(&sink_entry, RECORD_FIELD, entry, len);
+    } else {
+        const char *codec = codecName(state->compressor.codec);
+        sinkEntryAdd(&sink_entry, RECORDS_COUNT_FIELD, count, snprintf(count, sizeof(count), "%d", state->batch.count));
+        if (compressed) {
+            sinkEntryAdd(&sink_entry, RECORDS_CODEC_FIELD, codec, strlen(codec));
+        }
+        sinkEntryAdd(&sink_entry, state->batch.format == RECORD_FORMAT_BINARY ? RECORDS_BINARY_FIELD : RECORDS_FIELD, entry, len);
+    }
+
+    int records = state->batch.count;
+    recordBatchReset(&state->batch);
+    if (sinkWrite(state->sink, &sink_entry) != 0) {
+        fprintf(stderr, "Error storing %d packed messages\n", records);
+        return -1;
+    }
+    state->entries_written++;
+    state->bytes_written += len;
+    return 0;
+}
+
+int storeProcessedMessage(redisContext *c, outputState *state, const char *message_id, int consumer_id,
+        const char *message, const char *modified_message) {
+    if (state->records_per_entry == 1 && state->batch.format == RECORD_FORMAT_TEXT) {
+        sinkEntry entry;
+        char consumer[16];
+        int consumer_len = snprintf(consumer, sizeof(consumer), "%d", consumer_id);
+        sinkEntryInit(&entry, STREAM_KEY);
+        sinkEntryAdd(&entry, "message_id", message_id, strlen(message_id));
+        sinkEntryAdd(&entry, "consumer_id", consumer, consumer_len);
+        if (sinkWrite(state->sink, &entry) != 0) {
+            fprintf(stderr, "Error storing processed message: %s\n", message_id);
+            return -1;
+        }
+        state->entries_written++;
+        state->bytes_written += strlen(message_id) + consumer_len;
+        return 0;
+    }
+
+    streamRecord record;
+    strncpy(record.message_id, message_id, sizeof(record.message_id) - 1);
+    record.message_id[sizeof(record.message_id) - 1] = '\0';
+    record.consumer_id = consumer_id;
+    record.flags = state->record_flags;
+    record.timestamp_ms = (state->record_flags & RECORD_HAS_TIMESTAMP) ? currentTimeMillis() : 0;
+    record.payload_len = strlen(message);
+    record.payload = NULL;
+    record.payload_size = 0;
+
+    if (state->record_flags & RECORD_HAS_PAYLOAD) {
+        payloadCompressor *compressor = &state->compressor;
+        size_t len = strlen(modified_message);
+        // Whole entries are compressed at flush time instead when batch compression is on
+        int codec = state->compress_batches && state->records_per_entry > 1 ? CODEC_NONE : compressor->codec;
+
+        if (compressor->codec == CODEC_ZSTD && compressorAddSample(compressor, modified_message, len)) {
+            trainCompressionDictionary(c, compressor);
+        }
+        if (codec != CODEC_NONE) {
+            char *scratch = outputScratch(state, compressBound(compressor, len));
+            long n = scratch ? compressPayload(compressor, modified_message, len, scratch, state->scratch_capacity) : -1;
+            if (n < 0) {
+                fprintf(stderr, "Error compressing payload of message: %s\n", message_id);
+                return -1;
+            }
+            record.payload = scratch;
+            record.payload_size = n;
+            record.flags |= codec << RECORD_CODEC_SHIFT;
+        } else {
+            record.payload = modified_message;
+            record.payload_size = len;
+        }
+    }
+
+    if (recordBatchAppend(&state->batch, &record) != 0) {
+        return -1;
+    }
+    if (state->batch.count >= state->records_per_entry) {
+        return flushOutputBatch(state);
+    }
+    return 0;
+}
+
+// Queues an unparseable message on the dead-letter stream, in the same pipeline as processed entries
+int deadLetterMessage(outputState *state, const char *message, parseError error_class, const char *error_text) {
+    sinkEntry entry;
+    char timestamp[24];
+    const char *error_name = parse_error_names[error_class];
+
+    sinkEntryInit(&entry, DEAD_LETTER_KEY);
+    sinkEntryAdd(&entry, "payload", message, strlen(message));
+    sinkEntryAdd(&entry, "error_class", error_name, strlen(error_name));
+    sinkEntryAdd(&entry, "error", error_text, strlen(error_text));
+    sinkEntryAdd(&entry, "timestamp", timestamp, snprintf(timestamp, sizeof(timestamp), "%llu", (unsigned long long)currentTimeMillis()));
+    return sinkWrite(state->sink, &entry);
+}
+
+// Value of the field messages are grouped or looked up by, read from the raw payload; consumer_id
+// names this consumer. Strings with escapes are decoded into buf when they fit.
+size_t messageKeyField(const char *message, const char *name, int consumer_id, char *buf, size_t size, const char **value) {
+    jsonMember field;
+    *value = buf;
+    if (strcmp(name, "consumer_id") == 0) {
+        return snprintf(buf, size, "%d", consumer_id);
+    }
+    if (jsonObjectFind(message, strlen(message), name, strlen(name), &field)) {
+        int kind = jsonValueKind(field.value);
+        if (kind == JSON_KIND_STRING) {
+            if (memchr(field.value, '\\', field.value_len) == NULL || field.value_len > size) {
+                *value = field.value + 1;
+                return field.value_len - 2;
+            }
+            return jsonStringValue(field.value, field.value_len, buf);
+        }
+        if (kind == JSON_KIND_NUMBER && memchr(field.value, '.', field.value_len) == NULL
+                && memchr(field.value, 'e', field.value_len) == NULL && memchr(field.value, 'E', field.value_len) == NULL) {
+            *value = field.value;
+            return field.value_len;
+        }
+    }
+    *value = "null";
+    return 4;
+}
+
+const enrichEntry *lookupEnrichment(const char *message, int consumer_id) {
+    enrichmentState *enrichment = global_enrichment_state;
+    char buf[ENRICH_MAX_KEY_SIZE];
+    const char *value;
+    size_t len = messageKeyField(message, enrichment->field, consumer_id, buf, sizeof(buf), &value);
+    return enricherLookup(&enrichment->lookups, value, len);
+}
+
+// The looked up hash fields as an "enrichment" member in raw JSON, appended to out
+int formatEnrichment(const enrichEntry *entry, jsonBuffer *out) {
+    enricher *lookups = &global_enrichment_state->lookups;
+    size_t size = 16;
+    for (int f = 0; f < lookups->field_count; f++) {
+        size += 6 * (strlen(lookups->fields[f]) + entry->value_lens[f]) + 6;
+    }
+    if (jsonBufferReserve(out, out->len + size) != 0) {
+        return -1;
+    }
+
+    char *p = out->buf + out->len;
+    int members = 0;
+    p += sprintf(p, "\"enrichment\":{");
+    for (int f = 0; f < lookups->field_count; f++) {
+        if (entry->values[f] != NULL) {
+            if (members++ > 0) {
+                *p++ = ',';
+            }
+            p += jsonWriteString(p, lookups->fields[f], strlen(lookups->fields[f]));
+            *p++ = ':';
+            p += jsonWriteString(p, entry->values[f], entry->value_lens[f]);
+        }
+    }
+    *p++ = '}';
+    out->len = p - out->buf;
+    return 0;
+}
+
+void rejectMessage(messageBatch *batch, int i, parseError parse_error, const char *error_text) {
+    // Counted by class in the periodic report; the dead-letter stream keeps the payload and error
+    if (global_settings.log_level >= LOG_DEBUG) {
+        fprintf(stderr, "Failed to parse the JSON: %s\n", error_text);
+    }
+    parse_error_counts[parse_error]++;
+    deadLetterMessage(global_output_state, messageBatchPayload(batch, i), parse_error, error_text);
+    jsonRelease(&batch->docs[i]);
+}
+
+// Parses every payload of the batch. Failures are dead-lettered right away and get a zeroed id.
+void parseStage(messageBatch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        const char *message = messageBatchPayload(batch, i);
+        char error_text[256];
+        if (global_settings.log_level >= LOG_DEBUG) {
+            printf("Received message: %s\n", message);
+        }
+
+        parseError parse_error = parseMessage(&batch->docs[i], message, batch->lengths[i], batch->id_text[i],
+                error_text, sizeof(error_text));
+        if (parse_error != PARSE_OK) {
+            rejectMessage(batch, i, parse_error, error_text);
+            memset(batch->id_text[i], 0, sizeof(batch->id_text[i]));
+            continue;
+        }
+        if (global_settings.log_level >= LOG_DEBUG) {
+            printf("Parsed message_id: %s\n", batch->id_text[i]);
+        }
+        batch->status[i] = MESSAGE_PARSED;
+    }
+}
+
+// Validates, decodes and hashes the message ids of the whole batch; ids that are not UUIDs are
+// dead-lettered like parse failures. With a content dedup key the ids are then replaced by it.
+void idStage(messageBatch *batch) {
+    messageBatchDecodeIds(batch);
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->status[i] & MESSAGE_INVALID_ID) {
+            rejectMessage(batch, i, PARSE_INVALID_MESSAGE_ID, "'message_id' is not a UUID string");
+        }
+    }
+    dedupKeyBatch(&global_consumer_state->key, batch);
+}
+
+// Marks messages this consumer already processed, including repeats within the batch. With a host
+// table the rest are claimed there, so a message sent to several consumers on the host is only
+// processed by the first to claim it.
+void dedupStage(messageBatch *batch, int consumer_id) {
+    sharedDedupTable *host = global_consumer_state->host;
+    idStatistics *statistics = &global_id_statistics;
+    for (int i = 0; i < batch->count; i++) {
+        if (!(batch->status[i] & MESSAGE_PARSED)) {
+            continue;
+        }
+        hllAdd(&statistics->interval, batch->hashes[i]);
+        statistics->ids++;
+        int duplicate = isMessageProcessed(batch->ids[i], batch->hashes[i]);
+        for (int j = 0; j < i && !duplicate; j++) {
+            duplicate = batch->hashes[j] == batch->hashes[i]
+                    && (batch->status[j] & (MESSAGE_PARSED | MESSAGE_DUPLICATE)) == MESSAGE_PARSED
+                    && memcmp(batch->ids[j], batch->ids[i], UUID_BINARY_SIZE) == 0;
+        }
+        const char *where = "";
+        if (!duplicate && host != NULL) {
+            int claim = sharedDedupClaim(host, batch->ids[i], batch->hashes[i]);
+            if (claim == SHARED_DEDUP_CLAIMED) {
+                batch->status[i] |= MESSAGE_CLAIMED;
+            }
+            duplicate = claim == SHARED_DEDUP_PRESENT;
+            where = " on this host";
+        }
+        if (duplicate) {
+            if (global_settings.log_level >= LOG_DEBUG) {
+                printf("Consumer %d skipping message already processed%s: %s\n", consumer_id, where, batch->id_text[i]);
+            }
+            batch->status[i] |= MESSAGE_DUPLICATE;
+        }
+        statistics->dedup_hits += (batch->status[i] & MESSAGE_DUPLICATE) != 0;
+    }
+}
+
+// Requests the enrichment hashes of the batch first, so all cache misses are fetched in a single
+// pipelined round trip
+void enrichStage(messageBatch *batch, int consumer_id) {
+    enrichmentState *enrichment = global_enrichment_state;
+    if (enrichment == NULL || enrichment->lookups.max_entries == 0) {
+        return;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        if ((batch->status[i] & (MESSAGE_PARSED | MESSAGE_DUPLICATE)) == MESSAGE_PARSED) {
+            char buf[ENRICH_MAX_KEY_SIZE];
+            const char *value;
+            size_t len = messageKeyField(messageBatchPayload(batch, i), enrichment->field, consumer_id, buf, sizeof(buf), &value);
+            enricherPrefetch(&enrichment->lookups, value, len);
+        }
+    }
+    enricherResolve(&enrichment->lookups);
+}
+
+// Appends the processed payload of message i, NUL terminated, to output and releases its parsed document
+int buildProcessedMessage(messageBatch *batch, int i, int consumer_id, jsonBuffer *extra, jsonBuffer *output) {
+    const char *message = messageBatchPayload(batch, i);
+
+    // Messages whose enrichment lookup failed pass unchanged
+    const enrichEntry *enrichment = NULL;
+    if (global_enrichment_state != NULL) {
+        enrichment = lookupEnrichment(message, consumer_id);
+    }
+
+    // Simulate processing by adding consumer ID, or run the transform rules over the payload
+    processingState *processing = &global_processing_state;
+    size_t start = output->len;
+    int built = 0;
+    extra->len = 0;
+    if (processing->program != NULL) {
+        if (enrichment == NULL || formatEnrichment(enrichment, extra) == 0) {
+            built = transformApply(processing->program, message, batch->lengths[i], consumer_id, extra->buf, extra->len, output) == 0;
+        }
+    } else if (jsonBufferReserve(extra, 32) == 0) {
+        // Replace consumer_id and enrichment with the new members. message_id never needs rewriting:
+        // it was validated as a UUID, so whatever its escaping it reads back as the same string.
+        const char *replaced[] = { "consumer_id", "enrichment" };
+        extra->len = sprintf(extra->buf, "\"consumer_id\":%d", consumer_id);
+        if (enrichment != NULL) {
+            extra->buf[extra->len++] = ',';
+        }
+        built = (enrichment == NULL || formatEnrichment(enrichment, extra) == 0)
+                && jsonSerialize(&batch->docs[i], replaced, enrichment != NULL ? 2 : 1, extra->buf, extra->len, output) >= 0;
+    }
+    jsonRelease(&batch->docs[i]);
+
+    if (!built) {
+        output->len = start;
+        fprintf(stderr, "Error serializing JSON object for message: %s\n", batch->id_text[i]);
+        return -1;
+    }
+    // Keep the terminating NUL, the next payload starts after it
+    output->len++;
+    return 0;
+}
+
+// Builds the processed payloads into the batch output, or counts the messages when aggregating.
+// The parsed documents are released here, as nothing after this stage needs them.
+void outputStage(messageBatch *batch, int consumer_id) {
+    aggregator *agg = global_output_state->aggregator;
+    jsonBuffer *extra = &global_processing_state.extra;
+    jsonBuffer *output = &batch->output;
+
+    for (int i = 0; i < batch->count; i++) {
+        if (!(batch->status[i] & MESSAGE_PARSED)) {
+            continue;
+        }
+        const char *message = messageBatchPayload(batch, i);
+        if (batch->status[i] & MESSAGE_DUPLICATE) {
+            jsonRelease(&batch->docs[i]);
+            continue;
+        }
+
+        // In aggregation mode the message only contributes to its window's count
+        if (agg != NULL) {
+            char key[AGGREGATE_MAX_KEY_SIZE + 1];
+            const char *value;
+            size_t len = messageKeyField(message, agg->field, consumer_id, key, sizeof(key), &value);
+            if (len > AGGREGATE_MAX_KEY_SIZE) {
+                char error_text[64];
+                snprintf(error_text, sizeof(error_text), "%s is longer than %d bytes", agg->field, AGGREGATE_MAX_KEY_SIZE);
+                rejectMessage(batch, i, PARSE_KEY_TOO_LONG, error_text);
+                continue;
+            }
+            if (aggregatorAdd(agg, value, len) == 0) {
+                addProcessedMessage(batch->ids[i], batch->hashes[i]);
+                batch->status[i] |= MESSAGE_DONE;
+            }
+            jsonRelease(&batch->docs[i]);
+            continue;
+        }
+
+        size_t start = output->len;
+        if (buildProcessedMessage(batch, i, consumer_id, extra, output) != 0) {
+            continue;
+        }
+        batch->output_offsets[i] = start;
+        batch->status[i] |= MESSAGE_OUTPUT;
+    }
+}
+
+// Stores the processed payloads, possibly packed together, and tracks them as processed
+void storeStage(redisContext *c, messageBatch *batch, int consumer_id) {
+    for (int i = 0; i < batch->count; i++) {
+        if (!(batch->status[i] & MESSAGE_OUTPUT)) {
+            continue;
+        }
+        const char *modified_message = messageBatchOutput(batch, i);
+        if (global_settings.log_level >= LOG_DEBUG) {
+            printf("Processed message: %s\n", modified_message);
+        }
+        if (storeProcessedMessage(c, global_output_state, batch->id_text[i], consumer_id,
+                    messageBatchPayload(batch, i), modified_message) == 0) {
+            addProcessedMessage(batch->ids[i], batch->hashes[i]);
+            batch->status[i] |= MESSAGE_DONE;
+        }
+    }
+}
+
+// Builds and writes the messages of the batch routed to one worker, or without a batch writes out
+// what the worker has queued. Worker 0 is the main thread and writes through global_output_state,
+// whose flushing the main loop already takes care of.
+void outputWorkerRun(void *ctx, messageBatch *batch, int worker, int flags) {
+    outputWorker *w = (outputWorker *)ctx;
+    if (batch == NULL) {
+        if (worker > 0) {
+            sink *output_sink = w->output->sink;
+            flushOutputBatch(w->output);
+            sinkPoll(output_sink);
+            if (flags & DISPATCH_FORCE) {
+                sinkFlush(output_sink, SINK_FLUSH_IDLE);
+            } else if (sinkFlushWait(output_sink) == 0) {
+                sinkFlush(output_sink, output_sink->controller || output_sink->flush_deadline_ns ? SINK_FLUSH_DEADLINE : SINK_FLUSH_IDLE);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->partitions[i] != worker || !(batch->status[i] & MESSAGE_PARSED)) {
+            continue;
+        }
+        if (batch->status[i] & MESSAGE_DUPLICATE) {
+            jsonRelease(&batch->docs[i]);
+            continue;
+        }
+        w->payload.len = 0;
+        if (buildProcessedMessage(batch, i, w->consumer_id, &w->extra, &w->payload) != 0) {
+            continue;
+        }
+        if (global_settings.log_level >= LOG_DEBUG) {
+            printf("Processed message: %s\n", w->payload.buf);
+        }
+        batch->status[i] |= MESSAGE_OUTPUT;
+        if (storeProcessedMessage(w->c, w->output, batch->id_text[i], w->consumer_id,
+                    messageBatchPayload(batch, i), w->payload.buf) == 0) {
+            batch->status[i] |= MESSAGE_DONE;
+        }
+    }
+}
+
+// Sinks of the extra workers: whether all writes are done, and how long until one needs attention
+int outputWorkersIdle(void) {
+    for (int i = 1; global_dispatcher != NULL && i < global_dispatcher->workers; i++) {
+        sink *output_sink = global_output_workers[i].output->sink;
+        if (output_sink->pending > 0 || sinkPollTimeout(output_sink) >= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int outputWorkersTimeout(int timeout) {
+    for (int i = 1; global_dispatcher != NULL && i < global_dispatcher->workers; i++) {
+        sink *output_sink = global_output_workers[i].output->sink;
+        int waits[2] = { sinkPollTimeout(output_sink), sinkFlushWait(output_sink) };
+        for (int k = 0; k < 2; k++) {
+            if (waits[k] >= 0 && (timeout < 0 || waits[k] < timeout)) {
+                timeout = waits[k];
+            }
+        }
+    }
+    return timeout;
+}
+
+// Gives up the host claims of messages that were not stored after all, so the tiers agree and a
+// redelivery is processed again rather than skipped as a duplicate on this host
+void releaseHostClaims(messageBatch *batch) {
+    sharedDedupTable *host = global_consumer_state->host;
+    for (int i = 0; host != NULL && i < batch->count; i++) {
+        if ((batch->status[i] & (MESSAGE_CLAIMED | MESSAGE_DONE)) == MESSAGE_CLAIMED) {
+            sharedDedupRelease(host, batch->ids[i], batch->hashes[i]);
+        }
+    }
+}
+
+// Takes one drain of messages through the pipeline a stage at a time, timing each stage
+void processBatch(redisContext *c, messageBatch *batch, int consumer_id) {
+    uint64_t stage_start[BATCH_STAGES + 1];
+    stage_start[STAGE_PARSE] = cycleCount();
+    parseStage(batch);
+    stage_start[STAGE_IDS] = cycleCount();
+    idStage(batch);
+    stage_start[STAGE_DEDUP] = cycleCount();
+    dedupStage(batch, consumer_id);
+    stage_start[STAGE_ENRICH] = cycleCount();
+    enrichStage(batch, consumer_id);
+    stage_start[STAGE_OUTPUT] = cycleCount();
+    if (global_dispatcher != NULL) {
+        // Workers build and store their share together, so the store stage only tracks what they wrote
+        dispatcherRoute(global_dispatcher, batch);
+        dispatcherRun(global_dispatcher, batch, 0);
+        stage_start[STAGE_STORE] = cycleCount();
+        for (int i = 0; i < batch->count; i++) {
+            if (batch->status[i] & MESSAGE_DONE) {
+                addProcessedMessage(batch->ids[i], batch->hashes[i]);
+            }
+        }
+    } else {
+        outputStage(batch, consumer_id);
+        stage_start[STAGE_STORE] = cycleCount();
+        storeStage(c, batch, consumer_id);
+    }
+    releaseHostClaims(batch);
+    stage_start[BATCH_STAGES] = cycleCount();
+
+    for (int s = 0; s < BATCH_STAGES; s++) {
+        batch->stage_cycles[s] += stage_start[s + 1] - stage_start[s];
+    }
+    batch->messages += batch->count;
+}
+
+// Malformed payloads of the dead-letter benchmark and the class each must be dead-lettered as
+typedef struct {
+    const char *format;     // printf format taking the message number, where it has one
+    parseError error_class;
+} malformedMessage;
+
+const malformedMessage malformed_messages[] = {
+    { "{\"message_id\":\"00000000-0000-4000-8000-%012x\",\"seq\":", PARSE_INVALID_JSON },
+    { "{\"message_id\":\"00000000-0000-4000-8000-%012x\" \"seq\":1}", PARSE_INVALID_JSON },
+    { "[1,2,3]", PARSE_MISSING_MESSAGE_ID },
+    { "{\"id\":\"00000000-0000-4000-8000-%012x\",\"seq\":1}", PARSE_MISSING_MESSAGE_ID },
+    { "{\"message_id\":%d,\"seq\":1}", PARSE_INVALID_MESSAGE_ID },
+    { "{\"message_id\":\"message-%d\",\"seq\":1}", PARSE_INVALID_MESSAGE_ID },
+    { "{\"message_id\":\"zzzzzzzz-zzzz-zzzz-zzzz-%012d\",\"seq\":1}", PARSE_INVALID_MESSAGE_ID }
+};
+
+// NUL separated payloads; every fourth is malformed when mixed. The pass number goes into the
+// ids so later passes are not deduplicated against earlier ones.
+char *deadLetterCorpus(int pass, int mixed, uint32_t *offsets, long long *expected) {
+    char *corpus = (char *)memAlloc(MEM_OTHER, DEAD_LETTER_BENCHMARK_MESSAGES * 128);
+    if (corpus == NULL) {
+        return NULL;
+    }
+    size_t len = 0;
+    int count = sizeof(malformed_messages) / sizeof(malformed_messages[0]);
+    for (int i = 0; i < DEAD_LETTER_BENCHMARK_MESSAGES; i++) {
+        offsets[i] = (uint32_t)len;
+        if (mixed && i % 4 == 3) {
+            const malformedMessage *bad = &malformed_messages[(i / 4) % count];
+            len += sprintf(corpus + len, bad->format, i);
+            expected[bad->error_class]++;
+        } else {
+            len += sprintf(corpus + len, "{\"message_id\":\"%08x-0000-4000-8000-%012x\",\"seq\":%d,\"value\":\"v%d\"}",
+                    pass, i, i, i);
+            expected[PARSE_OK]++;
+        }
+        corpus[len++] = '\0';
+    }
+    return corpus;
+}
+
+// Runs a corpus through the whole pipeline into global_output_state, a batch at a time
+void deadLetterRun(messageBatch *batch, const char *corpus, const uint32_t *offsets) {
+    for (int i = 0; i < DEAD_LETTER_BENCHMARK_MESSAGES; i += batch->capacity) {
+        messageBatchReset(batch, corpus);
+        for (int k = i; k < DEAD_LETTER_BENCHMARK_MESSAGES && k < i + batch->capacity; k++) {
+            messageBatchAdd(batch, corpus + offsets[k], strlen(corpus + offsets[k]));
+        }
+        processBatch(NULL, batch, 1);
+    }
+    flushOutputBatch(global_output_state);
+    sinkFlush(global_output_state->sink, SINK_FLUSH_IDLE);
+}
+
+// Value of a field of a replayed XADD, or NULL
+const char *commandField(const char **argv, const size_t *lens, int argc, const char *field, size_t *len) {
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (lens[i] == strlen(field) && memcmp(argv[i], field, lens[i]) == 0) {
+            *len = lens[i + 1];
+            return argv[i + 1];
+        }
+    }
+    return NULL;
+}
+
+// Replays what the file sink wrote for a mixed corpus: every well-formed message must be on STREAM_KEY
+// exactly once as a valid object with its own id, and every malformed one on DEAD_LETTER_KEY with its class
+int checkDeadLetterOutput(const char *path, const long long *expected) {
+    FILE *f = fopen(path, "rb");
+    char *buf = NULL;
+    long size = -1;
+    if (f != NULL && fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        buf = (char *)memAlloc(MEM_OTHER, size + 1);
+    }
+    if (buf == NULL || fread(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Error reading back %s\n", path);
+        if (f) fclose(f);
+        memFree(buf);
+        return -1;
+    }
+    fclose(f);
+
+    unsigned char seen[DEAD_LETTER_BENCHMARK_MESSAGES] = { 0 };
+    long long processed = 0, dead_lettered[PARSE_ERROR_CLASSES] = { 0 }, failures = 0;
+    const char *argv[2 * SINK_MAX_FIELDS + 3];
+    size_t lens[2 * SINK_MAX_FIELDS + 3];
+    size_t pos = 0;
+    int argc;
+    while ((argc = sinkReadCommand(buf, size, &pos, argv, lens, 2 * SINK_MAX_FIELDS + 3)) > 0) {
+        size_t value_len;
+        const char *value;
+        if (argc >= 3 && lens[1] == strlen(DEAD_LETTER_KEY) && memcmp(argv[1], DEAD_LETTER_KEY, lens[1]) == 0) {
+            value = commandField(argv, lens, argc, "error_class", &value_len);
+            int error_class = PARSE_OK;
+            for (int k = PARSE_OK + 1; value != NULL && k < PARSE_ERROR_CLASSES; k++) {
+                if (value_len == strlen(parse_error_names[k]) && memcmp(value, parse_error_names[k], value_len) == 0) {
+                    error_class = k;
+                }
+            }
+            if (error_class == PARSE_OK || commandField(argv, lens, argc, "payload", &value_len) == NULL) {
+                fprintf(stderr, "Dead letter without payload or error class\n");
+                failures++;
+            }
+            dead_lettered[error_class]++;
+            continue;
+        }
+        if (argc < 3 || lens[1] != strlen(STREAM_KEY) || memcmp(argv[1], STREAM_KEY, lens[1]) != 0
+                || (value = commandField(argv, lens, argc, RECORD_FIELD, &value_len)) == NULL) {
+            fprintf(stderr, "Unexpected command %.*s %.*s in the output\n", (int)lens[0], argv[0], argc > 1 ? (int)lens[1] : 0, argc > 1 ? argv[1] : "");
+            failures++;
+            continue;
+        }
+
+        // A record of a well-formed message, whose payload must be that message, processed
+        streamRecord record;
+        size_t record_pos = 0;
+        jsonMember member;
+        unsigned index = 0;
+        if (recordBatchNext(RECORD_FORMAT_BINARY, value, value_len, &record_pos, &record) != 1 || record.payload == NULL
+                || sscanf(record.message_id, "%*8x-0000-4000-8000-%12x", &index) != 1 || index >= DEAD_LETTER_BENCHMARK_MESSAGES
+                || !jsonObjectFind(record.payload, record.payload_size, "message_id", 10, &member)
+                || member.value_len != MSG_ID_SIZE + 2 || memcmp(member.value + 1, record.message_id, MSG_ID_SIZE) != 0
+                || !jsonObjectFind(record.payload, record.payload_size, "consumer_id", 11, &member)) {
+            fprintf(stderr, "Malformed record reached %s: %.*s\n", STREAM_KEY, (int)value_len, value);
+            failures++;
+            continue;
+        }
+        if (seen[index]++) {
+            fprintf(stderr, "Message %s was written twice\n", record.message_id);
+            failures++;
+        }
+        processed++;
+    }
+    if (argc < 0 || pos != (size_t)size) {
+        fprintf(stderr, "The file sink output is not a sequence of commands\n");
+        failures++;
+    }
+    memFree(buf);
+
+    printf("Output: %lld processed (expected %lld), dead-lettered %s %lld/%lld, %s %lld/%lld, %s %lld/%lld\n",
+            processed, expected[PARSE_OK],
+            parse_error_names[PARSE_INVALID_JSON], dead_lettered[PARSE_INVALID_JSON], expected[PARSE_INVALID_JSON],
+            parse_error_names[PARSE_MISSING_MESSAGE_ID], dead_lettered[PARSE_MISSING_MESSAGE_ID], expected[PARSE_MISSING_MESSAGE_ID],
+            parse_error_names[PARSE_INVALID_MESSAGE_ID], dead_lettered[PARSE_INVALID_MESSAGE_ID], expected[PARSE_INVALID_MESSAGE_ID]);
+    if (processed != expected[PARSE_OK]) {
+        failures++;
+    }
+    for (int k = PARSE_OK + 1; k < PARSE_ERROR_CLASSES; k++) {
+        if (dead_lettered[k] != expected[k] || parse_error_counts[k] != expected[k]) {
+            fprintf(stderr, "%s: %lld dead letters, %lld counted, %lld expected\n", parse_error_names[k],
+                    dead_lettered[k], parse_error_counts[k], expected[k]);
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : -1;
+}
+
+// Checks that a mixed corpus of well-formed and malformed messages leaves nothing malformed on the
+// processed stream, then compares throughput with and without the malformed quarter. Returns -1 if
+// anything ended up in the wrong place.
+int deadLetterBenchmark(void) {
+    char path[] = "/tmp/dead-letter-benchmark-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("Error creating the benchmark output file");
+        return -1;
+    }
+    close(fd);
+
+    messageBatch *batch = &global_message_batch;
+    uint32_t *offsets = (uint32_t *)memAlloc(MEM_OTHER, DEAD_LETTER_BENCHMARK_MESSAGES * sizeof(uint32_t));
+    global_consumer_state = createConsumerState(NULL, DEDUP_HOT_ENTRIES);
+    sink *output_sink = createFileSink(path);
+    global_output_state = output_sink != NULL ? createOutputState(output_sink, 1, RECORD_FORMAT_BINARY, RECORD_HAS_PAYLOAD, CODEC_NONE, 0) : NULL;
+    if (offsets == NULL || global_consumer_state == NULL || global_output_state == NULL
+            || messageBatchInit(batch, PROCESS_BATCH_SIZE, 1) != 0) {
+        fprintf(stderr, "Error setting up the dead-letter benchmark\n");
+        unlink(path);
+        return -1;
+    }
+    printf("Dead-letter benchmark: %d messages per pass, a quarter of them malformed in %zu ways (%s)\n",
+            DEAD_LETTER_BENCHMARK_MESSAGES, sizeof(malformed_messages) / sizeof(malformed_messages[0]),
+            global_processing_state.backend->name);
+
+    long long expected[PARSE_ERROR_CLASSES] = { 0 };
+    memset(parse_error_counts, 0, sizeof(parse_error_counts));
+    char *corpus = deadLetterCorpus(0, 1, offsets, expected);
+    int res = -1;
+    if (corpus != NULL) {
+        deadLetterRun(batch, corpus, offsets);
+        res = checkDeadLetterOutput(path, expected);
+        memFree(corpus);
+    }
+    freeOutputState(global_output_state);
+    unlink(path);
+
+    // Throughput without output costs, each pass with fresh ids
+    global_output_state = createOutputState(createNullSink(), 1, RECORD_FORMAT_BINARY, RECORD_HAS_PAYLOAD, CODEC_NONE, 0);
+    double rates[2] = { 0, 0 };
+    for (int mixed = 0; mixed < 2 && global_output_state != NULL; mixed++) {
+        uint64_t elapsed = 0;
+        for (int pass = 1; pass <= DEAD_LETTER_BENCHMARK_PASSES; pass++) {
+            long long counts[PARSE_ERROR_CLASSES] = { 0 };
+            corpus = deadLetterCorpus(mixed * DEAD_LETTER_BENCHMARK_PASSES + pass, mixed, offsets, counts);
+            if (corpus == NULL) {
+                break;
+            }
+            uint64_t start = monotonicNanos();
+            deadLetterRun(batch, corpus, offsets);
+            elapsed += monotonicNanos() - start;
+            memFree(corpus);
+        }
+        rates[mixed] = (double)DEAD_LETTER_BENCHMARK_MESSAGES * DEAD_LETTER_BENCHMARK_PASSES / (elapsed / 1e9);
+    }
+    printf("Well-formed only: %.0f messages/s; with 25%% malformed: %.0f messages/s (%.2fx)\n",
+            rates[0], rates[1], rates[0] > 0 ? rates[1] / rates[0] : 0);
+    printf("Malformed messages %s\n", res == 0 ? "were only dead-lettered" : "reached the processed stream or went missing");
+
+    freeOutputState(global_output_state);
+    global_output_state = NULL;
+    freeConsumerState(global_consumer_state);
+    global_consumer_state = NULL;
+    messageBatchFree(batch);
+    memFree(offsets);
+    return res;
+}
+
+// Periodic report of processing and output throughput
+void reportThroughput(int processed_messages, double seconds) {
+    long long entries_written = global_output_state->entries_written;
+    long long bytes_written = global_output_state->bytes_written;
+    int workers = global_dispatcher != NULL ? global_dispatcher->workers : 1;
+    for (int i = 1; i < workers; i++) {
+        entries_written += global_output_workers[i].output->entries_written;
+        bytes_written += global_output_workers[i].output->bytes_written;
+    }
+    printf("Processed messages per second: %d, stream entries written: %lld, record bytes written: %lld\n",
+            (int)(processed_messages / seconds), entries_written, bytes_written);
+    for (int i = 0; i < workers; i++) {
+        sinkReport(i == 0 ? global_output_state->sink : global_output_workers[i].output->sink, seconds);
+    }
+    if (global_dispatcher != NULL) {
+        dispatcherReport(global_dispatcher);
+    }
+
+    long long dead_lettered = 0;
+    for (int i = PARSE_OK + 1; i < PARSE_ERROR_CLASSES; i++) {
+        dead_lettered += parse_error_counts[i];
+    }
+    if (dead_lettered > 0) {
+        printf("Dead-lettered messages: %lld (%s: %lld, %s: %lld, %s: %lld, %s: %lld)\n", dead_lettered,
+                parse_error_names[PARSE_INVALID_JSON], parse_error_counts[PARSE_INVALID_JSON],
+                parse_error_names[PARSE_MISSING_MESSAGE_ID], parse_error_counts[PARSE_MISSING_MESSAGE_ID],
+                parse_error_names[PARSE_INVALID_MESSAGE_ID], parse_error_counts[PARSE_INVALID_MESSAGE_ID],
+                parse_error_names[PARSE_KEY_TOO_LONG], parse_error_counts[PARSE_KEY_TOO_LONG]);
+    }
+
+    messageBatchReport(&global_message_batch);
+
+    // Duplicates the estimate sees but dedup missed arrived further apart than the dedup window
+    idStatistics *statistics = &global_id_statistics;
+    if (statistics->ids > 0) {
+        double distinct = hllEstimate(&statistics->interval);
+        distinct = distinct < statistics->ids ? distinct : statistics->ids;
+        hllMerge(&statistics->total, &statistics->interval);
+        printf("Message ids: %llu, ~%.0f distinct (~%.1f%% duplicates), %llu dedup hits (%.1f%%), ~%.0f distinct since start\n",
+                (unsigned long long)statistics->ids, distinct, 100.0 * (1 - distinct / statistics->ids),
+                (unsigned long long)statistics->dedup_hits, 100.0 * statistics->dedup_hits / statistics->ids,
+                hllEstimate(&statistics->total));
+        hllReset(&statistics->interval);
+        statistics->ids = statistics->dedup_hits = 0;
+    }
+
+    dedupStoreReport(&global_consumer_state->processed);
+    if (global_consumer_state->host != NULL) {
+        sharedDedupReport(global_consumer_state->host);
+    }
+
+    if (global_enrichment_state != NULL) {
+        enricherReport(&global_enrichment_state->lookups, seconds);
+    }
+
+    aggregator *agg = global_output_state->aggregator;
+    if (agg != NULL) {
+        printf("Aggregation by %s: %llu messages counted, %llu writes issued\n", agg->field,
+                (unsigned long long)agg->messages, (unsigned long long)agg->writes);
+    }
+
+    payloadCompressor *compressor = &global_output_state->compressor;
+    if (compressor->bytes_in > 0) {
+        printf("Compression (%s): ratio %.2f, %.1f MB/s\n", codecName(compressor->codec),
+                (double)compressor->bytes_in / compressor->bytes_out,
+                compressor->bytes_in / 1e6 / (compressor->compress_ns / 1e9));
+    }
+
+    memTrackReport(seconds);
+}
+
+// Halves the processed id table until tracked memory fits the budget again, so memory is given
+// back here instead of by the OOM killer
+void enforceMemoryBudget(consumerState *state) {
+    static int warned = 0;
+    while (memOverBudget()) {
+        dedupStore *store = &state->processed;
+        size_t freed = dedupStoreShrink(store);
+        if (freed == 0) {
+            if (!warned) {
+                fprintf(stderr, "Warning: %.1f MiB in use is over the %.1f MiB memory budget and the dedup table cannot shrink further\n",
+                        memTotalBytes() / 1048576.0, memBudget() / 1048576.0);
+                warned = 1;
+            }
+            return;
+        }
+        fprintf(stderr, "Warning: over the memory budget, dedup hot table shrunk to %zu ids (%.1f MiB freed%s)\n",
+                store->max_entries, freed / 1048576.0, store->dir != NULL ? "" : ", ids that did not fit forgotten");
+    }
+}
+
+const char *log_level_names[] = { "quiet", "info", "debug" };
+
+// Settings changed by one control command. All are checked, and a new batch allocated, before any is applied.
+typedef struct {
+    messageBatch batch;       // Resized batch, when batch_size changes
+    int batch_size;           // 0 for unchanged
+    int write_batch;          // 0 for unchanged
+    long flush_deadline_ms;   // -1 for unchanged
+    int log_level;            // -1 for unchanged
+    int report_interval;      // 0 for unchanged
+} settingChanges;
+
+int parseControlNumber(const char *text, long min, long max, long *value) {
+    char *end;
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return errno == 0 && end != text && *end == '\0' && *value >= min && *value <= max ? 0 : -1;
+}
+
+int parseSetting(settingChanges *changes, const char *name, const char *value, char *reply, size_t reply_size) {
+    long n;
+    if (strcmp(name, "batch-size") == 0 && parseControlNumber(value, 1, UINT16_MAX, &n) == 0) {
+        changes->batch_size = (int)n;
+    } else if (strcmp(name, "write-batch") == 0 && parseControlNumber(value, 1, BATCH_CONTROL_MAX_BATCH, &n) == 0) {
+        changes->write_batch = (int)n;
+    } else if (strcmp(name, "flush-deadline") == 0 && parseControlNumber(value, 0, 60000, &n) == 0) {
+        changes->flush_deadline_ms = n;
+    } else if (strcmp(name, "report-interval") == 0 && parseControlNumber(value, 1, 86400, &n) == 0) {
+        changes->report_interval = (int)n;
+    } else if (strcmp(name, "log-level") == 0) {
+        for (int level = LOG_QUIET; level <= LOG_DEBUG; level++) {
+            if (strcmp(value, log_level_names[level]) == 0) {
+                changes->log_level = level;
+                return 0;
+            }
+        }
+        snprintf(reply, reply_size, "log-level is quiet, info or debug");
+        return -1;
+    } else {
+        snprintf(reply, reply_size, "invalid setting %s %s", name, value);
+        return -1;
+    }
+    return 0;
+}
+
+void applySettings(settingChanges *changes) {
+    if (changes->batch_size > 0) {
+        // Only called between batches, so the old one holds no messages
+        messageBatchFree(&global_message_batch);
+        global_message_batch = changes->batch;
+    }
+    // Workers are idle between batches too, so their sinks can be changed from here
+    int workers = global_dispatcher != NULL ? global_dispatcher->workers : 1;
+    for (int i = 0; i < workers; i++) {
+        sink *output_sink = i == 0 ? global_output_state->sink : global_output_workers[i].output->sink;
+        batchController *controller = output_sink->controller;
+        if (changes->write_batch > 0) {
+            // Pins the size an adaptive controller would otherwise move
+            if (controller != NULL) {
+                controller->min_batch = controller->max_batch = controller->batch_size = changes->write_batch;
+            }
+            output_sink->max_pending = changes->write_batch;
+        }
+        if (changes->flush_deadline_ms >= 0) {
+            uint64_t deadline_ns = (uint64_t)changes->flush_deadline_ms * 1000000;
+            if (controller != NULL) {
+                controller->min_deadline_ns = controller->max_deadline_ns = controller->flush_deadline_ns = deadline_ns;
+            } else {
+                output_sink->flush_deadline_ns = deadline_ns;
+            }
+        }
+    }
+    if (changes->log_level >= 0) {
+        global_settings.log_level = changes->log_level;
+    }
+    if (changes->report_interval > 0) {
+        global_settings.report_interval = changes->report_interval;
+    }
+}
+
+// Redis's client-output-buffer-limit for subscribers as hard/soft/soft-seconds, which bounds how
+// much can pile up during a pause, or "unknown" where CONFIG is not available
+void pubsubBufferLimit(char *buf, size_t size) {
+    redisReply *reply = global_write_context != NULL ? redisCommand(global_write_context, "CONFIG GET client-output-buffer-limit") : NULL;
+    long long hard, soft, seconds;
+    const char *limit;
+    snprintf(buf, size, "unknown");
+    if (reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 && reply->element[1]->type == REDIS_REPLY_STRING
+            && (limit = strstr(reply->element[1]->str, "pubsub ")) != NULL
+            && sscanf(limit, "pubsub %lld %lld %lld", &hard, &soft, &seconds) == 3) {
+        snprintf(buf, size, "%lld/%lld/%lld", hard, soft, seconds);
+    }
+    freeReplyObject(reply);
+}
+
+void describeSettings(char *reply, size_t reply_size) {
+    sink *output_sink = global_output_state->sink;
+    uint64_t deadline_ns = output_sink->controller != NULL ? output_sink->controller->flush_deadline_ns : output_sink->flush_deadline_ns;
+    dedupStore *store = &global_consumer_state->processed;
+    uint64_t now = currentTimeMillis();
+    uint64_t pause_left = global_settings.paused && global_settings.resume_ms > now ? global_settings.resume_ms - now : 0;
+    char limit[64];
+    pubsubBufferLimit(limit, sizeof(limit));
+    snprintf(reply, reply_size, "batch-size %d write-batch %d flush-deadline %llu log-level %s report-interval %d "
+            "paused %d pause-left %llu pubsub-buffer-limit %s adaptive %d dedup-hot-ids %zu dedup-run-ids %llu",
+            global_message_batch.capacity, output_sink->max_pending, (unsigned long long)(deadline_ns / 1000000),
+            log_level_names[global_settings.log_level], global_settings.report_interval, global_settings.paused,
+            (unsigned long long)(pause_left + 999) / 1000, limit, output_sink->controller != NULL, store->count,
+            (unsigned long long)dedupStoreRunIds(store));
+}
+
+// Runs one control socket command between batches
+int handleControlCommand(void *ctx, int argc, char **argv, char *reply, size_t reply_size) {
+    (void)ctx;
+    int res = 0;
+    if (strcmp(argv[0], "status") == 0 && argc == 1) {
+        describeSettings(reply, reply_size);
+    } else if (strcmp(argv[0], "set") == 0 && argc >= 3 && argc % 2 == 1) {
+        settingChanges changes = { .flush_deadline_ms = -1, .log_level = -1 };
+        for (int i = 1; i < argc && res == 0; i += 2) {
+            res = parseSetting(&changes, argv[i], argv[i + 1], reply, reply_size);
+        }
+        if (changes.batch_size == global_message_batch.capacity) {
+            changes.batch_size = 0;
+        }
+        if (res == 0 && changes.batch_size > 0
+                && messageBatchInit(&changes.batch, changes.batch_size, global_message_batch.partition_count) != 0) {
+            snprintf(reply, reply_size, "cannot allocate a batch of %d messages", changes.batch_size);
+            res = -1;
+        }
+        if (res == 0) {
+            applySettings(&changes);
+            describeSettings(reply, reply_size);
+        }
+    } else if (strcmp(argv[0], "pause") == 0 && argc <= 2) {
+        int seconds = argc == 2 ? atoi(argv[1]) : PAUSE_MAX_SECONDS;
+        if (seconds <= 0 || seconds > PAUSE_MAX_SECONDS) {
+            snprintf(reply, reply_size, "a pause lasts 1 to %d seconds", PAUSE_MAX_SECONDS);
+            res = -1;
+        } else {
+            char limit[64];
+            pubsubBufferLimit(limit, sizeof(limit));
+            global_settings.paused = 1;
+            global_settings.resume_ms = currentTimeMillis() + (uint64_t)seconds * 1000;
+            snprintf(reply, reply_size, "resuming in %d s; Redis drops the subscription if the backlog passes "
+                    "pubsub-buffer-limit %s (hard/soft/seconds)", seconds, limit);
+        }
+    } else if (strcmp(argv[0], "resume") == 0 && argc == 1) {
+        global_settings.paused = 0;
+    } else if (strcmp(argv[0], "snapshot") == 0 && argc == 1) {
+        dedupStore *store = &global_consumer_state->processed;
+        size_t ids = store->count;
+        if (store->dir == NULL) {
+            snprintf(reply, reply_size, "snapshots need --dedup-dir");
+            res = -1;
+        } else if (dedupStoreSnapshot(store) != 0) {
+            snprintf(reply, reply_size, "writing the dedup run failed");
+            res = -1;
+        } else {
+            snprintf(reply, reply_size, "%zu ids written, %llu ids in runs", ids, (unsigned long long)dedupStoreRunIds(store));
+        }
+    } else {
+        snprintf(reply, reply_size, "commands: status, set NAME VALUE..., pause [SECONDS], resume, snapshot; settings: batch-size, "
+                "write-batch, flush-deadline (ms), log-level, report-interval (s)");
+        res = -1;
+    }
+    if (global_settings.log_level >= LOG_DEBUG) {
+        printf("Control: %s: %s %s\n", argv[0], res == 0 ? "OK" : "ERR", reply);
+    }
+    return res;
 }
 
-void addProcessedMessage(const char *message_id) {
-    if (global_consumer_state->processed_message_count < MAX_PROCESSED_MSGS) {
-        global_consumer_state->processed_message_ids[global_consumer_state->processed_message_count] = (char *)malloc(sizeof(char)* (strlen(message_id) + 1));
-        strncpy(global_consumer_state->processed_message_ids[global_consumer_state->processed_message_count], message_id, strlen(message_id));
-        global_consumer_state->processed_message_count++;
-    } else {
-        // Handle memory overflow by skipping new messages
-        fprintf(stderr, "Warning: Processed message limit reached for consumer. Skipping adding new IDs.\n");
+// Set by the first SIGTERM or SIGINT; the main loop then drains before exiting. A second one exits at once.
+volatile sig_atomic_t global_shutdown_signal = 0;
+
+void requestShutdown(int signum) {
+    if (global_shutdown_signal != 0) {
+        _exit(EXIT_FAILURE);
     }
+    global_shutdown_signal = signum;
 }
 
-int parseMessage(const char *json_string, Message *message) {
-    json_t *root;
-    json_error_t error;
+// Progress of a graceful shutdown, from the stop request to exit
+typedef struct {
+    int active;
+    int unsubscribed;        // The unsubscribe confirmation arrived: no message can follow it
+    uint64_t started_ms;
+    uint64_t deadline_ms;
+    long long drained;       // Messages processed after the stop request
+} drainState;
 
-    root = json_loads(json_string, 0, &error);
+// Stops the subscription without closing the connection, so messages Redis already sent still arrive,
+// followed by the confirmation
+int startDrain(redisContext *c, drainState *drain, int timeout_ms) {
+    drain->active = 1;
+    drain->unsubscribed = 0;
+    drain->started_ms = currentTimeMillis();
+    drain->deadline_ms = drain->started_ms + timeout_ms;
+    drain->drained = 0;
+    printf("\n%s received, draining for up to %d ms\n", strsignal(global_shutdown_signal), timeout_ms);
 
-    if (!root) {
-        fprintf(stderr, "Error parsing JSON on line %d: %s\n", error.line, error.text);
+    int done = 0;
+    if (redisAppendCommand(c, "UNSUBSCRIBE %s", PUBLISH_CHANNEL) != REDIS_OK) {
         return -1;
     }
-
-    // Get the "message_id" field
-    json_t *message_id = json_object_get(root, "message_id");
-    if (!json_is_string(message_id)) {
-        fprintf(stderr, "Error: 'message_id' is missing or not a string\n");
-        json_decref(root);
-        return -1;
+    while (!done) {
+        if (redisBufferWrite(c, &done) != REDIS_OK) {
+            fprintf(stderr, "Error unsubscribing: %s\n", c->errstr);
+            return -1;
+        }
     }
-
-    strncpy(message->message_id, json_string_value(message_id), sizeof(message->message_id) - 1);
-    message->message_id[sizeof(message->message_id) - 1] = '\0';
-
-    json_decref(root); // Free the JSON object
     return 0;
 }
 
-void processMessage(redisContext *c, const char *message, int consumer_id) {
-    printf("Received message: %s\n", message);
-
-    json_error_t error;
-    json_t *json_msg = json_loads(message, 0, &error);
-
-    Message parsed_message;
-
-    // Parse the JSON and populate the struct
-    if (parseMessage(message, &parsed_message) == 0) {
-        printf("Parsed message_id: %s\n", parsed_message.message_id);
-    } else {
-        printf("Failed to parse the JSON\n");
+// Messages still in the receive buffer when the drain gave up
+int countUnreadMessages(receiveBuffer *rb) {
+    pubsubFrame frame;
+    int unread = 0;
+    while (receiveBufferNextFrame(rb, &frame) == 1) {
+        if (frame.payload != NULL && strcmp(frame.kind, "message") == 0) {
+            unread++;
+        }
     }
+    return unread;
+}
 
-    // Check if the message has already been processed
-    if (isMessageProcessed(parsed_message.message_id)) {
-        printf("Consumer %d skipping already processed message: %s\n", consumer_id, parsed_message.message_id);
-        return;
+void reportDrain(const drainState *drain, int unread, int timed_out) {
+    int workers = global_dispatcher != NULL ? global_dispatcher->workers : 1;
+    int pending = 0;
+    int retrying = 0;
+    for (int i = 0; i < workers; i++) {
+        sink *output_sink = i == 0 ? global_output_state->sink : global_output_workers[i].output->sink;
+        pending += output_sink->pending;
+        retrying |= sinkPollTimeout(output_sink) >= 0;
     }
-
-    // Simulate processing by adding consumer ID
-    json_object_set_new(json_msg, "message_id", json_string(parsed_message.message_id));
-    json_object_set_new(json_msg, "consumer_id", json_integer(consumer_id));
-
-    // Convert the JSON object back to a string
-    char *modified_message = json_dumps(json_msg, JSON_COMPACT);
-    if (!modified_message) {
-        fprintf(stderr, "Error serializing JSON object for message: %s\n", parsed_message.message_id);
-        json_decref(json_msg); // Free JSON object
-        return;
+    printf("Drained %lld messages in %llu ms%s; left behind: %d received messages, %d unflushed entries%s\n",
+            drain->drained, (unsigned long long)(currentTimeMillis() - drain->started_ms),
+            timed_out ? " (deadline reached)" : "", unread, pending, retrying ? ", writes awaiting retry" : "");
+    if (timed_out && !drain->unsubscribed) {
+        printf("Messages still in flight on the subscribe connection were not read\n");
     }
-
-    // Print the processed message
-    printf("Processed message: %s\n", modified_message);
-
-    // Store the processed message in Redis
-    redisReply *reply = redisCommand(c, "XADD %s * message_id %s consumer_id %d", STREAM_KEY, parsed_message.message_id, consumer_id);
-    if (!reply || c->err) {
-        fprintf(stderr, "Error storing processed message in Redis: %s\n", c->errstr);
-        if (reply) freeReplyObject(reply);
-        free(modified_message);
-        return;
+    for (int i = 0; i < workers; i++) {
+        sinkReport(i == 0 ? global_output_state->sink : global_output_workers[i].output->sink,
+                (currentTimeMillis() - drain->started_ms) / 1000.0);
     }
-
-    freeReplyObject(reply);
-
-    // Track the message ID as processed locally
-    addProcessedMessage(parsed_message.message_id);
-
-    // Free dynamically allocated resources
-    free(modified_message);
 }
 
-void shutdown(int signum) {
+// Releases everything and exits; the dedup hot table is written out as a run when --dedup-dir is set
+void shutdownConsumer(int signum) {
+    if (global_control != NULL) {
+        controlClose(global_control);
+    }
     if (global_redis_context != NULL) {
         printf("\nCleaning up redis context...\n");
         redisFree(global_redis_context);
     }
+    // Stop the worker threads before their output goes away; worker 0 shares global_output_state
+    if (global_dispatcher != NULL) {
+        dispatcherFree(global_dispatcher);
+        memFree(global_dispatcher->contexts);
+        memFree(global_dispatcher);
+    }
+    for (int i = 0; i < global_output_worker_count; i++) {
+        outputWorker *w = &global_output_workers[i];
+        if (i > 0 && w->output != NULL) {
+            flushOutputBatch(w->output);
+            freeOutputState(w->output);
+        }
+        if (i > 0 && w->c != NULL) {
+            redisFree(w->c);
+        }
+        jsonBufferFree(&w->extra);
+        jsonBufferFree(&w->payload);
+    }
+    memFree(global_output_workers);
+    if (global_output_state != NULL) {
+        flushOutputBatch(global_output_state);
+        freeOutputState(global_output_state);
+    }
+    if (global_write_context != NULL) {
+        printf("\nCleaning up redis write context...\n");
+        redisFree(global_write_context);
+    }
+    if (global_enrichment_state != NULL) {
+        enricherFree(&global_enrichment_state->lookups);
+        memFree(global_enrichment_state);
+    }
+    if (global_processing_state.program != NULL) {
+        transformFree(global_processing_state.program);
+        free(global_processing_state.program);
+    }
+    jsonBufferFree(&global_processing_state.extra);
+    messageBatchFree(&global_message_batch);
+    if (global_lookup_context != NULL) {
+        printf("\nCleaning up redis lookup context...\n");
+        redisFree(global_lookup_context);
+    }
     if (global_consumer_state != NULL) {
         printf("\nCleaning up consumer state...\n");
         freeConsumerState(global_consumer_state);
@@ -168,11 +1544,60 @@ void shutdown(int signum) {
 }
 
 int main(int argc, char **argv) {
+    // Before hiredis or jansson allocate anything
+    memTrackHooks();
+
     int consumer_group_size = -1;
     int consumer_id = -1;
-    const char *redis_host = REDIS_HOST;
-    int redis_port = REDIS_PORT;
-    int verbose = 0;
+    connectionOptions connection_options = {
+        .host = REDIS_HOST,
+        .port = REDIS_PORT,
+        .unix_socket = NULL,
+        .rcvbuf = REDIS_SOCKET_BUFFER_SIZE,
+        .sndbuf = REDIS_SOCKET_BUFFER_SIZE,
+        .tcp_nodelay = 0,
+        .tcp_quickack = 0
+    };
+    int records_per_entry = RECORDS_PER_ENTRY;
+    int record_format = RECORD_FORMAT_TEXT;
+    int record_flags = 0;
+    int codec = CODEC_NONE;
+    int compress_batches = 0;
+    const char *sink_name = "redis";
+    const char *sink_file = SINK_FILE_PATH;
+    long retry_max_bytes = RETRY_MAX_BYTES;
+    double latency_target_ms = 0;
+    const char *aggregate_field = NULL;
+    int aggregate_window = AGGREGATE_WINDOW;
+    int aggregate_slide = 0;
+    const char *enrich_field = NULL;
+    const char *enrich_prefix = ENRICH_KEY_PREFIX;
+    const char *enrich_fields = ENRICH_FIELDS;
+    long enrich_cache_size = ENRICH_CACHE_ENTRIES;
+    const char *transform_rules = NULL;
+    const char *json_backend = NULL;
+    const char *json_benchmark = NULL;
+    int process_batch_size = PROCESS_BATCH_SIZE;
+    int uuid_benchmark = 0;
+    const char *dedup_dir = NULL;
+    long dedup_hot_entries = 0;
+    long long dedup_benchmark = 0;
+    const char *host_dedup = NULL;
+    long long host_dedup_entries = SHARED_DEDUP_ENTRIES;
+    int host_dedup_benchmark = 0;
+    int huge_pages = HUGE_PAGES_OFF;
+    int lock_memory = 0;
+    long memory_budget = 0;
+    int hll_benchmark = 0;
+    dedupKey dedup_key = { .mode = DEDUP_KEY_ID };
+    int dedup_key_benchmark = 0;
+    int drain_timeout = DRAIN_TIMEOUT_MS;
+    const char *control_socket = NULL;
+    int workers = 1;
+    orderKey order_key = { .mode = ORDER_KEY_ID };
+    int dispatch_benchmark = 0;
+    int dead_letter_benchmark = 0;
+    int retry_benchmark = 0;
     
     // Command-line arguments options for parsing
     static struct option long_options[] = {
@@ -180,6 +1605,53 @@ int main(int argc, char **argv) {
         {"group-size", required_argument, NULL, 'g'},
         {"host", required_argument, NULL, 'h'},
         {"port", required_argument, NULL, 'p'},
+        {"unix-socket", required_argument, NULL, 's'},
+        {"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+        {"sndbuf", required_argument, NULL, OPT_SNDBUF},
+        {"tcp-nodelay", no_argument, NULL, OPT_TCP_NODELAY},
+        {"tcp-quickack", no_argument, NULL, OPT_TCP_QUICKACK},
+        {"records-per-entry", required_argument, NULL, 'k'},
+        {"record-format", required_argument, NULL, 'f'},
+        {"record-timestamp", no_argument, NULL, OPT_RECORD_TIMESTAMP},
+        {"record-payload-length", no_argument, NULL, OPT_RECORD_PAYLOAD_LENGTH},
+        {"store-payload", no_argument, NULL, OPT_STORE_PAYLOAD},
+        {"compress", required_argument, NULL, OPT_COMPRESS},
+        {"compress-batches", no_argument, NULL, OPT_COMPRESS_BATCHES},
+        {"sink", required_argument, NULL, OPT_SINK},
+        {"sink-file", required_argument, NULL, OPT_SINK_FILE},
+        {"retry-max-bytes", required_argument, NULL, OPT_RETRY_MAX_BYTES},
+        {"latency-target", required_argument, NULL, OPT_LATENCY_TARGET},
+        {"aggregate", required_argument, NULL, OPT_AGGREGATE},
+        {"window", required_argument, NULL, OPT_WINDOW},
+        {"slide", required_argument, NULL, OPT_SLIDE},
+        {"enrich", required_argument, NULL, OPT_ENRICH},
+        {"enrich-prefix", required_argument, NULL, OPT_ENRICH_PREFIX},
+        {"enrich-fields", required_argument, NULL, OPT_ENRICH_FIELDS},
+        {"enrich-cache-size", required_argument, NULL, OPT_ENRICH_CACHE_SIZE},
+        {"transform", required_argument, NULL, OPT_TRANSFORM},
+        {"json-backend", required_argument, NULL, OPT_JSON_BACKEND},
+        {"json-benchmark", required_argument, NULL, OPT_JSON_BENCHMARK},
+        {"process-batch-size", required_argument, NULL, OPT_PROCESS_BATCH_SIZE},
+        {"uuid-benchmark", no_argument, NULL, OPT_UUID_BENCHMARK},
+        {"dedup-dir", required_argument, NULL, OPT_DEDUP_DIR},
+        {"dedup-hot-entries", required_argument, NULL, OPT_DEDUP_HOT_ENTRIES},
+        {"dedup-benchmark", required_argument, NULL, OPT_DEDUP_BENCHMARK},
+        {"host-dedup", required_argument, NULL, OPT_HOST_DEDUP},
+        {"host-dedup-entries", required_argument, NULL, OPT_HOST_DEDUP_ENTRIES},
+        {"host-dedup-benchmark", no_argument, NULL, OPT_HOST_DEDUP_BENCHMARK},
+        {"huge-pages", required_argument, NULL, OPT_HUGE_PAGES},
+        {"lock-memory", no_argument, NULL, OPT_LOCK_MEMORY},
+        {"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+        {"hll-benchmark", no_argument, NULL, OPT_HLL_BENCHMARK},
+        {"dedup-key", required_argument, NULL, OPT_DEDUP_KEY},
+        {"dedup-key-benchmark", no_argument, NULL, OPT_DEDUP_KEY_BENCHMARK},
+        {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+        {"control-socket", required_argument, NULL, OPT_CONTROL_SOCKET},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"order-key", required_argument, NULL, OPT_ORDER_KEY},
+        {"dispatch-benchmark", no_argument, NULL, OPT_DISPATCH_BENCHMARK},
+        {"dead-letter-benchmark", no_argument, NULL, OPT_DEAD_LETTER_BENCHMARK},
+        {"retry-benchmark", no_argument, NULL, OPT_RETRY_BENCHMARK},
         {"verbose", no_argument, NULL, 'v'},
         {"help", no_argument, NULL, '?'},
         {NULL, 0, NULL, 0}
@@ -187,7 +1659,7 @@ int main(int argc, char **argv) {
 
     int option_index = 0;
     int opt;
-    while ((opt = getopt_long(argc, argv, "c:g:h:p:v?", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "c:g:h:p:s:k:f:v?", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'g':
                 consumer_group_size = atoi(optarg);
@@ -209,13 +1681,262 @@ int main(int argc, char **argv) {
                 }
                 break;
             case 'h':
-                redis_host = optarg;
+                connection_options.host = optarg;
                 break;
             case 'p':
-                redis_port = atoi(optarg);
+                connection_options.port = atoi(optarg);
+                break;
+            case 's':
+                connection_options.unix_socket = optarg;
+                break;
+            case OPT_RCVBUF:
+            case OPT_SNDBUF: {
+                int size = atoi(optarg);
+                if (size <= 0) {
+                    fprintf(stderr, "Invalid socket buffer size\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                if (opt == OPT_RCVBUF) {
+                    connection_options.rcvbuf = size;
+                } else {
+                    connection_options.sndbuf = size;
+                }
+                break;
+            }
+            case OPT_TCP_NODELAY:
+                connection_options.tcp_nodelay = 1;
+                break;
+            case OPT_TCP_QUICKACK:
+                connection_options.tcp_quickack = 1;
+                break;
+            case 'k':
+                records_per_entry = atoi(optarg);
+                if (records_per_entry <= 0) {
+                    fprintf(stderr, "Invalid number of records per entry\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0) {
+                    record_format = RECORD_FORMAT_TEXT;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    record_format = RECORD_FORMAT_BINARY;
+                } else {
+                    fprintf(stderr, "Invalid record format\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_RECORD_TIMESTAMP:
+                record_flags |= RECORD_HAS_TIMESTAMP;
+                break;
+            case OPT_RECORD_PAYLOAD_LENGTH:
+                record_flags |= RECORD_HAS_PAYLOAD_LENGTH;
+                break;
+            case OPT_STORE_PAYLOAD:
+                record_flags |= RECORD_HAS_PAYLOAD;
+                break;
+            case OPT_COMPRESS:
+                codec = parseCodec(optarg);
+                if (codec < 0 || !codecAvailable(codec)) {
+                    fprintf(stderr, "Invalid or unavailable compression codec: %s\n", optarg);
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_COMPRESS_BATCHES:
+                compress_batches = 1;
+                break;
+            case OPT_SINK:
+                if (strcmp(optarg, "redis") != 0 && strcmp(optarg, "file") != 0 && strcmp(optarg, "null") != 0) {
+                    fprintf(stderr, "Invalid sink: %s\n", optarg);
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                sink_name = optarg;
+                break;
+            case OPT_SINK_FILE:
+                sink_file = optarg;
+                break;
+            case OPT_RETRY_MAX_BYTES:
+                retry_max_bytes = atol(optarg);
+                if (retry_max_bytes < 0) {
+                    fprintf(stderr, "Invalid retry memory limit\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_LATENCY_TARGET:
+                latency_target_ms = atof(optarg);
+                if (latency_target_ms <= 0) {
+                    fprintf(stderr, "Invalid latency target\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_AGGREGATE:
+                aggregate_field = optarg;
+                break;
+            case OPT_WINDOW:
+            case OPT_SLIDE: {
+                int seconds = atoi(optarg);
+                if (seconds <= 0) {
+                    fprintf(stderr, "Invalid aggregation window\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                if (opt == OPT_WINDOW) {
+                    aggregate_window = seconds;
+                } else {
+                    aggregate_slide = seconds;
+                }
+                break;
+            }
+            case OPT_ENRICH:
+                enrich_field = optarg;
+                break;
+            case OPT_ENRICH_PREFIX:
+                enrich_prefix = optarg;
+                break;
+            case OPT_ENRICH_FIELDS:
+                enrich_fields = optarg;
+                break;
+            case OPT_ENRICH_CACHE_SIZE:
+                enrich_cache_size = atol(optarg);
+                if (enrich_cache_size < 0 || enrich_cache_size > UINT32_MAX) {
+                    fprintf(stderr, "Invalid enrichment cache size\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_TRANSFORM:
+                transform_rules = optarg;
+                break;
+            case OPT_JSON_BACKEND:
+                json_backend = optarg;
+                if (jsonBackendByName(json_backend) == NULL) {
+                    fprintf(stderr, "Invalid or unavailable JSON backend: %s\n", json_backend);
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_JSON_BENCHMARK:
+                json_benchmark = optarg;
+                break;
+            case OPT_UUID_BENCHMARK:
+                uuid_benchmark = 1;
+                break;
+            case OPT_DEDUP_DIR:
+                dedup_dir = optarg;
+                break;
+            case OPT_DEDUP_HOT_ENTRIES:
+                dedup_hot_entries = atol(optarg);
+                if (dedup_hot_entries <= 0 || dedup_hot_entries > UINT32_MAX) {
+                    fprintf(stderr, "Invalid dedup hot table size\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_DEDUP_BENCHMARK:
+                dedup_benchmark = atoll(optarg);
+                if (dedup_benchmark <= 0) {
+                    fprintf(stderr, "Invalid dedup benchmark size\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_HOST_DEDUP:
+                host_dedup = optarg;
+                break;
+            case OPT_HOST_DEDUP_ENTRIES:
+                host_dedup_entries = atoll(optarg);
+                if (host_dedup_entries <= 0) {
+                    fprintf(stderr, "Invalid host dedup table size\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_HOST_DEDUP_BENCHMARK:
+                host_dedup_benchmark = 1;
+                break;
+            case OPT_HUGE_PAGES:
+                huge_pages = hugeMemMode(optarg);
+                if (huge_pages < 0) {
+                    fprintf(stderr, "Invalid huge pages mode: %s\n", optarg);
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_LOCK_MEMORY:
+                lock_memory = 1;
+                break;
+            case OPT_DEDUP_KEY:
+                dedupKeyFree(&dedup_key);
+                if (dedupKeyInit(&dedup_key, optarg) != 0) {
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_DEDUP_KEY_BENCHMARK:
+                dedup_key_benchmark = 1;
+                break;
+            case OPT_HLL_BENCHMARK:
+                hll_benchmark = 1;
+                break;
+            case OPT_WORKERS:
+                workers = atoi(optarg);
+                if (workers < 1 || workers > DISPATCH_MAX_WORKERS) {
+                    fprintf(stderr, "Invalid number of workers\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ORDER_KEY:
+                if (orderKeyInit(&order_key, optarg) != 0) {
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_DISPATCH_BENCHMARK:
+                dispatch_benchmark = 1;
+                break;
+            case OPT_DEAD_LETTER_BENCHMARK:
+                dead_letter_benchmark = 1;
+                break;
+            case OPT_RETRY_BENCHMARK:
+                retry_benchmark = 1;
+                break;
+            case OPT_CONTROL_SOCKET:
+                control_socket = optarg;
+                break;
+            case OPT_DRAIN_TIMEOUT:
+                drain_timeout = atoi(optarg);
+                if (drain_timeout < 0) {
+                    fprintf(stderr, "Invalid drain timeout\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MEMORY_BUDGET:
+                memory_budget = atol(optarg);
+                if (memory_budget <= 0) {
+                    fprintf(stderr, "Invalid memory budget\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_PROCESS_BATCH_SIZE:
+                process_batch_size = atoi(optarg);
+                if (process_batch_size <= 0 || process_batch_size > UINT16_MAX) {
+                    fprintf(stderr, "Invalid process batch size\n");
+                    help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
                 break;
             case 'v':
-                verbose = 1;
+                global_settings.log_level = LOG_DEBUG;
                 break;
             case '?':
                 help(argv[0]);
@@ -227,50 +1948,106 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Before anything is allocated, benchmarks included
+    hugeMemConfigure(huge_pages, lock_memory);
+    memSetBudget((uint64_t)memory_budget * 1024 * 1024);
+
+    if (json_benchmark != NULL) {
+        exit(jsonBackendBenchmark(json_benchmark) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (uuid_benchmark) {
+        exit(uuidBenchmark() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (hll_benchmark) {
+        exit(hllBenchmark() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (dispatch_benchmark) {
+        exit(dispatcherBenchmark() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (retry_benchmark) {
+        exit(sinkRetryBenchmark() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (dedup_key_benchmark) {
+        exit(dedupKeyBenchmark() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (dedup_hot_entries == 0) {
+        dedup_hot_entries = dedup_dir != NULL || dedup_benchmark > 0 ? DEDUP_HOT_ENTRIES : MAX_PROCESSED_MSGS;
+    }
+    if (dedup_benchmark > 0) {
+        int res = dedupStoreBenchmark((uint64_t)dedup_benchmark, (size_t)dedup_hot_entries, dedup_dir);
+        exit(res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (host_dedup_benchmark) {
+        exit(sharedDedupBenchmark(SHARED_DEDUP_BENCHMARK_PROCESSES) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    global_processing_state.backend = json_backend != NULL ? jsonBackendByName(json_backend) : jsonDefaultBackend();
+    if (dead_letter_benchmark) {
+        exit(deadLetterBenchmark() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (record_flags != 0 && record_format != RECORD_FORMAT_BINARY) {
+        fprintf(stderr, "Record timestamp, payload length and payload require the binary record format\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((codec != CODEC_NONE || compress_batches) && record_format != RECORD_FORMAT_BINARY) {
+        fprintf(stderr, "Compression requires the binary record format\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((enrich_field != NULL || transform_rules != NULL) && aggregate_field != NULL) {
+        fprintf(stderr, "Enrichment and transform rules do not apply to aggregated messages\n");
+        exit(EXIT_FAILURE);
+    }
+    // Aggregation windows and the enrichment cache are updated in place, from one thread only
+    if (workers > 1 && (aggregate_field != NULL || enrich_field != NULL)) {
+        fprintf(stderr, "Aggregation and enrichment require a single worker\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (consumer_group_size == -1 || consumer_id == -1) {
         fprintf(stderr, "Consumer group size and consumer id are mandatory\n");
         help(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    // Setup signal handlers for graceful shutdown
-    signal(SIGINT, shutdown);  // Catch user interruption signal - Ctrl+C
-    signal(SIGTERM, shutdown); // Catch process termination signal
+    // Setup signal handlers for graceful shutdown; without SA_RESTART a blocked read or poll returns right away
+    struct sigaction shutdown_action;
+    memset(&shutdown_action, 0, sizeof(shutdown_action));
+    shutdown_action.sa_handler = requestShutdown;
+    sigemptyset(&shutdown_action.sa_mask);
+    sigaction(SIGINT, &shutdown_action, NULL);  // Catch user interruption signal - Ctrl+C
+    sigaction(SIGTERM, &shutdown_action, NULL); // Catch process termination signal
 
-    // Connect to Redis server
-    redisContext *c = redisConnect(redis_host, redis_port);
+    // Connect to Redis server; a subscribed connection cannot issue XADD, so writes get their own connection
+    redisContext *c = connectRedis(&connection_options);
     if (c == NULL) {
-        fprintf(stderr, "Error allocating redis context\n");
-        exit(EXIT_FAILURE);
-    } else if (c && c->err) {
-        fprintf(stderr, "Error connecting to redis server: %s\n", c->errstr);
         exit(EXIT_FAILURE);
     }
     global_redis_context = c; // Store the global context for cleanup
 
-    // Create a consumer group (if it doesn't aleady exist)
-    redisReply *reply = redisCommand(c, "XGROUP CREATE %s %s 0 MKSTREAM", STREAM_KEY, CONSUMER_GROUP);
-    if (reply == NULL || c->err) {
-        fprintf(stderr, "Error creating consumer group: %s\n", c->errstr);
+    redisContext *wc = connectRedis(&connection_options);
+    if (wc == NULL) {
         redisFree(c);
         exit(EXIT_FAILURE);
     }
-    freeReplyObject(reply);
+    global_write_context = wc;
 
-    // Create redisReader
-    redisReader *reader = redisReaderCreate();
-    if (!reader) {
-        fprintf(stderr, "Error creating redisReader\n");
+    // Create a consumer group (if it doesn't aleady exist)
+    redisReply *reply = redisCommand(wc, "XGROUP CREATE %s %s 0 MKSTREAM", STREAM_KEY, CONSUMER_GROUP);
+    if (reply == NULL || wc->err) {
+        fprintf(stderr, "Error creating consumer group: %s\n", wc->errstr);
         redisFree(c);
+        redisFree(wc);
         exit(EXIT_FAILURE);
     }
+    freeReplyObject(reply);
 
     // Subscribe to the publish channel
     reply = redisCommand(c, "SUBSCRIBE %s", PUBLISH_CHANNEL);
     if (reply == NULL || c->err) {
         fprintf(stderr, "Error subscribing to channel: %s\n", c->errstr);
         redisFree(c);
-        redisReaderFree(reader);
+        redisFree(wc);
         exit(EXIT_FAILURE);
     }
 
@@ -281,54 +2058,336 @@ int main(int argc, char **argv) {
     }
     freeReplyObject(reply);
 
+    // From here on the subscribe connection is read directly; hand over anything hiredis already buffered
+    receiveBuffer receive_buffer;
+    if (receiveBufferInit(&receive_buffer, MESSAGES_BUFFER_SIZE) != 0) {
+        fprintf(stderr, "Error allocating receive buffer\n");
+        redisFree(c);
+        redisFree(wc);
+        exit(EXIT_FAILURE);
+    }
+    if (c->reader->len > c->reader->pos) {
+        receiveBufferAppend(&receive_buffer, c->reader->buf + c->reader->pos, c->reader->len - c->reader->pos);
+    }
+
     // Create consumer state
-    global_consumer_state = createConsumerState();
+    char dedup_path[PATH_MAX];
+    if (dedup_dir != NULL) {
+        if (mkdir(dedup_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error creating dedup directory %s: %s\n", dedup_dir, strerror(errno));
+            shutdownConsumer(0);
+        }
+        snprintf(dedup_path, sizeof(dedup_path), "%s/consumer-%d", dedup_dir, consumer_id);
+    }
+    global_consumer_state = createConsumerState(dedup_dir != NULL ? dedup_path : NULL, (size_t)dedup_hot_entries);
+    if (global_consumer_state == NULL) {
+        fprintf(stderr, "Error setting up the processed message table\n");
+        shutdownConsumer(0);
+    }
+    global_consumer_state->key = dedup_key;
+    if (dedup_key.mode != DEDUP_KEY_ID) {
+        printf("Deduplicating on %s hashes (%s)\n", dedup_key.mode == DEDUP_KEY_PAYLOAD ? "payload" : "field", dedupKeyHashName());
+    }
+    if (host_dedup != NULL) {
+        global_consumer_state->host = (sharedDedupTable *)memAlloc(MEM_DEDUP, sizeof(sharedDedupTable));
+        if (global_consumer_state->host == NULL
+                || sharedDedupAttach(global_consumer_state->host, host_dedup, (uint64_t)host_dedup_entries) != 0) {
+            fprintf(stderr, "Error attaching the host dedup table\n");
+            memFree(global_consumer_state->host);
+            global_consumer_state->host = NULL;
+            shutdownConsumer(0);
+        }
+    }
+    sink *output_sink = createOutputSink(sink_name, sink_file, wc, &connection_options, retry_max_bytes);
+    if (output_sink == NULL) {
+        fprintf(stderr, "Error creating %s sink\n", sink_name);
+        shutdownConsumer(0);
+    }
+
+    batchController batch_controller;
+    if (latency_target_ms > 0) {
+        batchControllerInit(&batch_controller, (uint64_t)(latency_target_ms * 1e6), 1, BATCH_CONTROL_MAX_BATCH, monotonicNanos());
+        sinkSetController(output_sink, &batch_controller);
+    }
+
+    global_output_state = createOutputState(output_sink, records_per_entry, record_format, record_flags, codec, compress_batches);
+    if (global_output_state == NULL) {
+        fprintf(stderr, "Error allocating output state\n");
+        sinkClose(output_sink);
+        shutdownConsumer(0);
+    }
+    if (codec == CODEC_ZSTD) {
+        loadCompressionDictionary(wc, &global_output_state->compressor);
+    }
+    if (aggregate_field != NULL) {
+        aggregator *agg = (aggregator *)memAlloc(MEM_AGGREGATE, sizeof(aggregator));
+        if (agg == NULL || aggregatorInit(agg, aggregate_field, aggregate_window,
+                    aggregate_slide > 0 ? aggregate_slide : aggregate_window, time(NULL)) != 0) {
+            fprintf(stderr, "Error setting up aggregation\n");
+            memFree(agg);
+            shutdownConsumer(0);
+        }
+        global_output_state->aggregator = agg;
+    }
+
+    if (transform_rules != NULL) {
+        transformProgram *program = (transformProgram *)malloc(sizeof(transformProgram));
+        if (program == NULL || transformCompile(program, transform_rules, PUBLISH_CHANNEL) != 0) {
+            fprintf(stderr, "Error loading transform rules from %s\n", transform_rules);
+            free(program);
+            shutdownConsumer(0);
+        }
+        global_processing_state.program = program;
+    }
+
+    // Lookups get a connection of their own: with tracking on it also carries invalidation pushes
+    if (enrich_field != NULL) {
+        global_lookup_context = connectRedis(&connection_options);
+        global_enrichment_state = (enrichmentState *)memCalloc(MEM_ENRICH, 1, sizeof(enrichmentState));
+        if (global_lookup_context == NULL || global_enrichment_state == NULL) {
+            fprintf(stderr, "Error setting up enrichment\n");
+            shutdownConsumer(0);
+        }
+        global_enrichment_state->field = enrich_field;
+        if (enricherInit(&global_enrichment_state->lookups, global_lookup_context, enrich_prefix,
+                    enrich_fields, (size_t)enrich_cache_size) != 0) {
+            fprintf(stderr, "Error setting up enrichment\n");
+            shutdownConsumer(0);
+        }
+    }
+
+    // Extra workers write through connections and sinks of their own, so each keeps its messages in order
+    if (workers > 1) {
+        global_output_workers = (outputWorker *)memCalloc(MEM_OUTPUT, workers, sizeof(outputWorker));
+        global_dispatcher = (dispatcher *)memCalloc(MEM_OUTPUT, 1, sizeof(dispatcher));
+        void **contexts = (void **)memAlloc(MEM_OUTPUT, workers * sizeof(void *));
+        if (global_output_workers == NULL || global_dispatcher == NULL || contexts == NULL) {
+            fprintf(stderr, "Error allocating %d workers\n", workers);
+            memFree(contexts);
+            memFree(global_dispatcher);
+            global_dispatcher = NULL;
+            shutdownConsumer(0);
+        }
+        global_dispatcher->contexts = contexts;
+        global_output_worker_count = workers;
+        for (int i = 0; i < workers; i++) {
+            outputWorker *w = &global_output_workers[i];
+            w->consumer_id = consumer_id;
+            contexts[i] = w;
+            if (i == 0) {
+                w->c = wc;
+                w->output = global_output_state;
+                continue;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s.%d", sink_file, i);
+            w->c = connectRedis(&connection_options);
+            sink *worker_sink = w->c != NULL ? createOutputSink(sink_name, path, w->c, &connection_options, retry_max_bytes) : NULL;
+            if (worker_sink == NULL) {
+                fprintf(stderr, "Error creating %s sink for worker %d\n", sink_name, i);
+                shutdownConsumer(0);
+            }
+            if (latency_target_ms > 0) {
+                batchControllerInit(&w->controller, (uint64_t)(latency_target_ms * 1e6), 1, BATCH_CONTROL_MAX_BATCH, monotonicNanos());
+                sinkSetController(worker_sink, &w->controller);
+            }
+            w->output = createOutputState(worker_sink, records_per_entry, record_format, record_flags, codec, compress_batches);
+            if (w->output == NULL) {
+                fprintf(stderr, "Error allocating output state\n");
+                sinkClose(worker_sink);
+                shutdownConsumer(0);
+            }
+            if (codec == CODEC_ZSTD) {
+                loadCompressionDictionary(w->c, &w->output->compressor);
+            }
+        }
+        if (dispatcherInit(global_dispatcher, workers, &order_key, outputWorkerRun, contexts) != 0) {
+            fprintf(stderr, "Error starting %d workers\n", workers);
+            shutdownConsumer(0);
+        }
+        printf("Writing with %d workers, ordered by %s\n", workers,
+                order_key.mode == ORDER_KEY_ID ? "message id" : order_key.mode == ORDER_KEY_ID_PREFIX ? "message id prefix" : order_key.field);
+    }
+
+    messageBatch *batch = &global_message_batch;
+    if (messageBatchInit(batch, process_batch_size, workers) != 0) {
+        fprintf(stderr, "Error allocating the message batch\n");
+        shutdownConsumer(0);
+    }
+    hugeMemReport();
+    enforceMemoryBudget(global_consumer_state);
+
+    controlChannel control;
+    if (control_socket != NULL) {
+        if (controlOpen(&control, control_socket) != 0) {
+            shutdownConsumer(0);
+        }
+        global_control = &control;
+        printf("Accepting control commands on %s\n", control_socket);
+    }
 
     // Monitor processed messages
     time_t start_time = time(NULL);
     int processed_messages = 0;
+    int running = 1;
+    drainState drain = { 0 };
+    int drain_timed_out = 0;
 
-    while (1) {
-        redisReply *reply = NULL;
-        size_t bytes_read;
-        char messages[MESSAGES_BUFFER_SIZE];
-        int n = read(c->fd, messages, sizeof(messages));
-
-        if (n > 0) {
-            redisReaderFeed(reader, messages, n);
-            int res = redisReaderGetReply(reader, (void**)&reply);
+    while (running) {
+        pubsubFrame frame;
+        int res;
 
-            if (res == REDIS_OK && reply) {
-                if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 3) {
-                    const char *message = reply->element[2]->str;
+        if (global_shutdown_signal != 0 && !drain.active && startDrain(c, &drain, drain_timeout) != 0) {
+            drain.unsubscribed = 1; // Nothing more can be read; flush what is here
+        }
 
-                    processMessage(c, message, consumer_id);
-                    processed_messages++;
+        // Process every complete frame before blocking on the socket again; payloads stay valid until the next read
+        messageBatchReset(batch, receive_buffer.buf);
+        do {
+            res = receiveBufferNextFrame(&receive_buffer, &frame);
+            if (res == 1 && frame.payload != NULL && strcmp(frame.kind, "message") == 0) {
+                messageBatchAdd(batch, frame.payload, frame.payload_len);
+            } else if (res == 1 && drain.active && strcmp(frame.kind, "unsubscribe") == 0) {
+                drain.unsubscribed = 1;
+            }
+            if (batch->count == batch->capacity || (res != 1 && batch->count > 0)) {
+                processBatch(wc, batch, consumer_id);
+                processed_messages += batch->count;
+                if (drain.active) {
+                    drain.drained += batch->count;
+                }
+                messageBatchReset(batch, receive_buffer.buf);
 
-                    time_t current_time = time(NULL);
-                    if (difftime(current_time, start_time) >= 3) {
-                        printf("Processed messages per second: %d\n", processed_messages / 3);
-                        processed_messages = 0;
-                        start_time = current_time;
+                time_t current_time = time(NULL);
+                if (difftime(current_time, start_time) >= global_settings.report_interval) {
+                    if (global_settings.log_level >= LOG_INFO) {
+                        reportThroughput(processed_messages, difftime(current_time, start_time));
                     }
+                    processed_messages = 0;
+                    start_time = current_time;
                 }
+            }
+        } while (res == 1);
+        if (res < 0) {
+            fprintf(stderr, "Error reading reply: protocol error\n");
+            break;
+        }
+
+        // Nothing left to process: queue any partially packed entry, closed aggregation windows and due
+        // retries, then flush right away, or once the oldest entry reaches the flush deadline when batching adaptively
+        sink *output_sink = global_output_state->sink;
+        aggregator *agg = global_output_state->aggregator;
+        flushOutputBatch(global_output_state);
+        if (agg != NULL) {
+            aggregatorAdvance(agg, output_sink, time(NULL));
+        }
+        sinkPoll(output_sink);
+        if (global_dispatcher != NULL) {
+            dispatcherRun(global_dispatcher, NULL, drain.active && drain.unsubscribed ? DISPATCH_FORCE : 0);
+        }
+        // Merge dedup runs a step at a time, without blocking on the socket while merges remain
+        int merging = dedupStoreMaintain(&global_consumer_state->processed, DEDUP_COMPACT_STEP) > 0;
+        enforceMemoryBudget(global_consumer_state);
 
-                freeReplyObject(reply);
-            } else if (res == REDIS_ERR) {
-                fprintf(stderr, "Error reading reply: %s\n", c->errstr);
+        int flush_wait = sinkFlushWait(output_sink);
+        if (drain.active && drain.unsubscribed) {
+            // All input is in: write out the open aggregation pane and everything queued, then wait only for retries
+            if (agg != NULL) {
+                aggregatorDrain(agg, output_sink);
+            }
+            sinkFlush(output_sink, SINK_FLUSH_IDLE);
+            if (output_sink->pending == 0 && sinkPollTimeout(output_sink) < 0 && outputWorkersIdle()) {
                 break;
             }
-        } else if (n == 0) {
-            fprintf(stderr, "Connection closed by server\n");
-            break;
-        } else {
-            fprintf(stderr, "Error reading from socket");
-            break;
+            flush_wait = -1;
+        } else if (flush_wait == 0) {
+            sinkFlush(output_sink, output_sink->controller || output_sink->flush_deadline_ns ? SINK_FLUSH_DEADLINE : SINK_FLUSH_IDLE);
+            flush_wait = -1;
+        }
+
+        // Wake up for the flush deadline and for retries that come due while no input arrives
+        int timeout = sinkPollTimeout(output_sink);
+        if (flush_wait >= 0 && (timeout < 0 || flush_wait < timeout)) {
+            timeout = flush_wait;
+        }
+        timeout = outputWorkersTimeout(timeout);
+        if (agg != NULL) {
+            int window_wait = aggregatorTimeout(agg, (int64_t)currentTimeMillis());
+            if (timeout < 0 || window_wait < timeout) {
+                timeout = window_wait;
+            }
+        }
+        if (merging) {
+            timeout = 0;
+        }
+        if (global_settings.paused) {
+            // A pause ends by itself before Redis would drop the subscription for its backlog
+            uint64_t now = currentTimeMillis();
+            if (now >= global_settings.resume_ms) {
+                fprintf(stderr, "Pause ended after its time limit, reading messages again\n");
+                global_settings.paused = 0;
+            } else if (timeout < 0 || (uint64_t)timeout > global_settings.resume_ms - now) {
+                timeout = (int)(global_settings.resume_ms - now);
+            }
         }
+        if (drain.active) {
+            uint64_t now = currentTimeMillis();
+            if (now >= drain.deadline_ms) {
+                drain_timed_out = 1;
+                break;
+            }
+            if (timeout < 0 || (uint64_t)timeout > drain.deadline_ms - now) {
+                timeout = (int)(drain.deadline_ms - now);
+            }
+        }
+        // Invalidations for cached enrichment data can arrive at any time, so watch the lookup connection too,
+        // and control commands, which are applied here between batches
+        redisContext *lc = global_lookup_context;
+        int watch_lookups = global_enrichment_state != NULL && global_enrichment_state->lookups.max_entries > 0 && lc->err == 0;
+        int read_input = !drain.unsubscribed && (!global_settings.paused || drain.active);
+        if (timeout >= 0 || watch_lookups || global_control != NULL || !read_input) {
+            struct pollfd pfds[3] = {
+                { .fd = read_input ? c->fd : -1, .events = POLLIN },
+                { .fd = watch_lookups ? lc->fd : -1, .events = POLLIN },
+                { .fd = global_control != NULL ? controlFd(global_control) : -1, .events = POLLIN }
+            };
+            if (poll(pfds, 3, timeout) <= 0) {
+                continue;
+            }
+            if (pfds[1].revents != 0) {
+                enricherPoll(&global_enrichment_state->lookups);
+            }
+            if (pfds[2].revents != 0) {
+                controlPoll(global_control, handleControlCommand, NULL);
+            }
+            if (pfds[0].revents == 0) {
+                continue;
+            }
+        }
+
+        ssize_t n = receiveBufferRead(&receive_buffer, c->fd);
+        rearmQuickAck(c->fd, &connection_options);
 
-        usleep(1000); 
+        if (n < 0 && errno == EINTR) {
+            continue; // Interrupted by a shutdown request
+        }
+        if (n == 0) {
+            fprintf(stderr, "Connection closed by server\n");
+        } else if (n < 0) {
+            perror("Error reading from socket");
+        }
+        if (n <= 0) {
+            if (!drain.active) {
+                running = 0;
+            }
+            drain.unsubscribed = 1; // Nothing more will arrive; still flush what was processed
+        }
     }
 
-    shutdown(0);
+    if (drain.active) {
+        reportDrain(&drain, countUnreadMessages(&receive_buffer), drain_timed_out);
+    }
+    receiveBufferFree(&receive_buffer);
+    shutdownConsumer(0);
     return 0;
 }
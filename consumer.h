@@ -3,13 +3,87 @@
 
 #define REDIS_HOST "localhost"
 #define REDIS_PORT 6379
+// 0 keeps the kernel default for SO_RCVBUF/SO_SNDBUF
+#define REDIS_SOCKET_BUFFER_SIZE 0
+// Bounds connecting and reconnecting, so a sink polling for its connection back never blocks for long
+#define REDIS_CONNECT_TIMEOUT_MS 1000
 #define PUBLISH_CHANNEL "messages:published"
 #define CONSUMER_GROUP "test_group"
 #define STREAM_KEY "messages:processed"
+#define DEAD_LETTER_KEY "messages:deadletter"
+// --dead-letter-benchmark: messages per corpus, a quarter of them malformed, and timed passes over it
+#define DEAD_LETTER_BENCHMARK_MESSAGES 4096
+#define DEAD_LETTER_BENCHMARK_PASSES 16
 
-#define MESSAGES_BUFFER_SIZE 1024
+// Initial receive buffer size; it grows to fit the largest pending frame
+#define MESSAGES_BUFFER_SIZE (64 * 1024)
 
 #define MAX_PROCESSED_MSGS 10000
+// Processed message ids kept in memory when they spill to run files (--dedup-dir)
+#define DEDUP_HOT_ENTRIES (1024 * 1024)
+// Slots of the host-wide shared memory dedup table (--host-dedup), 16 bytes each
+#define SHARED_DEDUP_ENTRIES (4 * 1024 * 1024)
+// Processed records packed into one stream entry; 1 keeps one entry per message
+#define RECORDS_PER_ENTRY 1
+
+// Output sinks: XADDs pipelined per flush, and the buffered append-only file sink
+#define SINK_PIPELINE_DEPTH 64
+#define SINK_FILE_PATH "messages-processed.aof"
+#define SINK_FILE_BUFFER_SIZE (1024 * 1024)
+#define SINK_FILE_MAX_PENDING 4096
+
+// Adaptive batching towards a p99 latency target (--latency-target)
+#define BATCH_CONTROL_INTERVAL_MS 100
+#define BATCH_CONTROL_MIN_SAMPLES 32
+#define BATCH_CONTROL_STEP 8
+#define BATCH_CONTROL_MAX_BATCH 4096
+#define BATCH_CONTROL_MIN_DEADLINE_MS 1
+
+// Windowed aggregation (--aggregate): per-window count hashes and the stream announcing closed windows
+#define AGGREGATE_KEY_PREFIX "messages:rollup:"
+#define AGGREGATE_STREAM_KEY "messages:rollups"
+#define AGGREGATE_INITIAL_KEYS 1024
+#define AGGREGATE_WINDOW 10
+#define AGGREGATE_TTL 3600
+
+// Enrichment (--enrich): metadata hashes named by a message field, cached with client-side tracking
+#define ENRICH_KEY_PREFIX "tenants:"
+#define ENRICH_FIELDS "settings,route"
+#define ENRICH_CACHE_ENTRIES 65536
+#define PROCESS_BATCH_SIZE 256       // Messages per drain taken through the pipeline stage by stage
+
+// Failed writes are retried with exponential backoff, then dead-lettered
+#define RETRY_TICK_MS 10
+#define RETRY_BASE_BACKOFF_MS 50
+#define RETRY_MAX_BACKOFF_MS 5000
+#define RETRY_MAX_ATTEMPTS 8
+#define RETRY_MAX_BYTES (64 * 1024 * 1024)
+// --retry-benchmark: entries written before, during and after a burst during which every third write fails
+#define RETRY_BENCHMARK_ENTRIES 20000
+#define RETRY_BENCHMARK_BURST_MS 500
+#define RETRY_BENCHMARK_FAIL_EVERY 3
+#define RETRY_BENCHMARK_TIMEOUT_MS 30000
+
+// Stored payload compression; zstd dictionaries are trained from the first samples and kept in Redis
+#define COMPRESSION_LEVEL 3
+#define COMPRESSION_DICT_SIZE (16 * 1024)
+#define COMPRESSION_DICT_SAMPLES 1000
+#define COMPRESSION_DICT_SAMPLE_BYTES (4 * 1024 * 1024)
+#define COMPRESSION_DICT_KEY_PREFIX STREAM_KEY ":dict:"
+#define COMPRESSION_DICT_LATEST_KEY STREAM_KEY ":dict:latest"
+// Periodic report, and what else is logged; both can be changed over the control socket
+#define REPORT_INTERVAL 3            // Seconds
+#define LOG_QUIET 0                  // Errors and warnings only
+#define LOG_INFO 1                   // Periodic reports
+#define LOG_DEBUG 2                  // Every message and control command too
+
+// Longest pause of the control socket. Redis buffers what is published meanwhile and drops the
+// subscription past client-output-buffer-limit pubsub, by default 8 MB for 60 s or 32 MB at once.
+#define PAUSE_MAX_SECONDS 30
+
+// Graceful shutdown: time allowed after SIGTERM to drain, flush and await writes
+#define DRAIN_TIMEOUT_MS 10000
+
 // Message ids will be only UUID4 format for simplicity and avoiding memory fragmentation
 #define MSG_ID_SIZE 36
 
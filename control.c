@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "memtrack.h"
+
+int controlOpen(controlChannel *cc, const char *path) {
+    struct sockaddr_un addr;
+    memset(cc, 0, sizeof(*cc));
+    cc->listen_fd = cc->client_fd = -1;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // A socket file left by a consumer that did not exit cleanly would fail the bind
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating control socket");
+        return -1;
+    }
+    // Only the owner may retune the consumer
+    mode_t mask = umask(0077);
+    int res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (res != 0 || listen(fd, 4) != 0) {
+        fprintf(stderr, "Error listening on control socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    cc->path = memStrdup(MEM_OTHER, path);
+    cc->listen_fd = fd;
+    return 0;
+}
+
+void controlClose(controlChannel *cc) {
+    if (cc->client_fd >= 0) {
+        close(cc->client_fd);
+    }
+    if (cc->listen_fd >= 0) {
+        close(cc->listen_fd);
+        unlink(cc->path);
+    }
+    memFree(cc->path);
+    cc->path = NULL;
+    cc->listen_fd = cc->client_fd = -1;
+}
+
+int controlFd(const controlChannel *cc) {
+    return cc->client_fd >= 0 ? cc->client_fd : cc->listen_fd;
+}
+
+static void disconnect(controlChannel *cc) {
+    close(cc->client_fd);
+    cc->client_fd = -1;
+    cc->len = 0;
+    cc->overflow = 0;
+}
+
+static void reply(controlChannel *cc, int ok, const char *text) {
+    char buf[CONTROL_REPLY_MAX + 8];
+    int len = snprintf(buf, sizeof(buf), "%s%s%s\n", ok ? "OK" : "ERR", *text != '\0' ? " " : "", text);
+    if (len >= (int)sizeof(buf)) {
+        len = sizeof(buf) - 1;
+        buf[len - 1] = '\n';
+    }
+    // Replies are short; a client that does not read them is dropped rather than waited for
+    if (send(cc->client_fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+        disconnect(cc);
+    }
+}
+
+static void runCommand(controlChannel *cc, char *line, controlHandler handler, void *ctx) {
+    char *argv[CONTROL_MAX_ARGS];
+    int argc = 0;
+    char *save = NULL;
+    for (char *arg = strtok_r(line, " \t\r", &save); arg != NULL; arg = strtok_r(NULL, " \t\r", &save)) {
+        if (argc == CONTROL_MAX_ARGS) {
+            reply(cc, 0, "too many arguments");
+            return;
+        }
+        argv[argc++] = arg;
+    }
+    if (argc == 0) {
+        return;
+    }
+    char text[CONTROL_REPLY_MAX];
+    text[0] = '\0';
+    int res = handler(ctx, argc, argv, text, sizeof(text));
+    cc->commands++;
+    reply(cc, res == 0, text);
+}
+
+void controlPoll(controlChannel *cc, controlHandler handler, void *ctx) {
+    if (cc->client_fd < 0) {
+        int fd = accept(cc->listen_fd, NULL, NULL);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            cc->client_fd = fd;
+        }
+        return;
+    }
+
+    ssize_t n = recv(cc->client_fd, cc->line + cc->len, sizeof(cc->line) - cc->len, 0);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            disconnect(cc);
+        }
+        return;
+    }
+    cc->len += n;
+
+    // Run every complete line, keeping a partial one for the next read
+    size_t start = 0;
+    char *newline;
+    while (cc->client_fd >= 0 && (newline = memchr(cc->line + start, '\n', cc->len - start)) != NULL) {
+        *newline = '\0';
+        if (cc->overflow) {
+            reply(cc, 0, "line too long");
+            cc->overflow = 0;
+        } else {
+            runCommand(cc, cc->line + start, handler, ctx);
+        }
+        start = newline - cc->line + 1;
+    }
+    if (cc->client_fd < 0) {
+        return;
+    }
+    memmove(cc->line, cc->line + start, cc->len - start);
+    cc->len -= start;
+    if (cc->len == sizeof(cc->line)) {
+        cc->overflow = 1;
+        cc->len = 0;
+    }
+}
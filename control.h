@@ -0,0 +1,36 @@
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stddef.h>
+
+// Local control channel: a Unix stream socket taking one command per line and answering each
+// with one line, "OK ..." or "ERR ...". One client is served at a time; others wait in the
+// listen backlog. The socket is only read when the main loop polls it between batches, so
+// commands never interleave with a batch in flight and cost the hot path nothing while idle.
+
+#define CONTROL_LINE_MAX 512
+#define CONTROL_MAX_ARGS 16
+#define CONTROL_REPLY_MAX 1024
+
+// Fills reply (without the trailing newline) and returns 0, or -1 to answer "ERR reply"
+typedef int (*controlHandler)(void *ctx, int argc, char **argv, char *reply, size_t reply_size);
+
+typedef struct {
+    char *path;
+    int listen_fd;
+    int client_fd;           // -1 while no client is connected
+    char line[CONTROL_LINE_MAX];
+    size_t len;
+    int overflow;            // The line being read is too long and is skipped up to its newline
+    unsigned long long commands;
+} controlChannel;
+
+int controlOpen(controlChannel *cc, const char *path);
+// Removes the socket file
+void controlClose(controlChannel *cc);
+// The descriptor to poll for POLLIN: the client's while one is connected, the listening one otherwise
+int controlFd(const controlChannel *cc);
+// Accepts a client or runs its complete command lines through handler; call when controlFd is readable
+void controlPoll(controlChannel *cc, controlHandler handler, void *ctx);
+
+#endif
@@ -0,0 +1,888 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "dedup.h"
+#include "uuid.h"
+#include "clock.h"
+#include "consumer.h"
+#include "hugemem.h"
+
+#define DEDUP_PAGE_SIZE 4096
+#define DEDUP_BLOOM_MIX 0xBF58476D1CE4E5B9ULL
+
+static uint64_t idPrefix(const unsigned char *id) {
+    uint64_t prefix;
+    memcpy(&prefix, id, sizeof(prefix));
+    return be64toh(prefix);
+}
+
+// Bloom filter blocks are cache lines, so a lookup costs one miss per run; the block is picked by
+// the high half of the hash, the bits inside it by a remix of the whole hash
+static uint64_t bloomBlocks(uint64_t count) {
+    uint64_t blocks = (count * DEDUP_BLOOM_BITS_PER_ID + 511) / 512;
+    return blocks > 0 ? blocks : 1;
+}
+
+static uint64_t bloomBlockIndex(uint64_t blocks, uint64_t hash) {
+    return ((hash >> 32) * blocks) >> 32;
+}
+
+static void bloomSet(uint64_t *block, uint64_t hash) {
+    uint64_t bits = (hash ^ (hash >> 31)) * DEDUP_BLOOM_MIX;
+    for (int k = 0; k < DEDUP_BLOOM_PROBES; k++, bits >>= 9) {
+        block[(bits >> 6) & 7] |= 1ULL << (bits & 63);
+    }
+}
+
+static int bloomTest(const uint64_t *block, uint64_t hash) {
+    uint64_t bits = (hash ^ (hash >> 31)) * DEDUP_BLOOM_MIX;
+    for (int k = 0; k < DEDUP_BLOOM_PROBES; k++, bits >>= 9) {
+        if (!(block[(bits >> 6) & 7] & (1ULL << (bits & 63)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Byte offset of the ids in a run of count ids, and the size of its file
+static uint64_t runLayout(uint64_t count, uint64_t bloom_blocks, uint64_t *ids_offset) {
+    uint64_t fence_count = (count + DEDUP_FENCE_INTERVAL - 1) / DEDUP_FENCE_INTERVAL;
+    uint64_t end = sizeof(dedupRunHeader) + bloom_blocks * 64 + fence_count * sizeof(uint64_t);
+    *ids_offset = (end + DEDUP_PAGE_SIZE - 1) / DEDUP_PAGE_SIZE * DEDUP_PAGE_SIZE;
+    return *ids_offset + count * UUID_BINARY_SIZE;
+}
+
+static char *runPath(const char *dir, uint64_t sequence, const char *suffix) {
+    size_t size = strlen(dir) + 32;
+    char *path = (char *)memAlloc(MEM_DEDUP, size);
+    if (path != NULL) {
+        snprintf(path, size, "%s/%016llx.%s", dir, (unsigned long long)sequence, suffix);
+    }
+    return path;
+}
+
+static dedupRun *runOpen(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error opening dedup run %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = size >= sizeof(dedupRunHeader) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping dedup run %s: %s\n", path, size < sizeof(dedupRunHeader) ? "truncated" : strerror(errno));
+        return NULL;
+    }
+
+    const dedupRunHeader *header = (const dedupRunHeader *)map;
+    // The ids offset may leave room to spare: merges size the filter for their inputs before dropping repeats
+    uint64_t ids_offset = 0;
+    int valid = memcmp(header->magic, DEDUP_RUN_MAGIC, sizeof(header->magic)) == 0
+            && header->version == DEDUP_RUN_VERSION
+            && header->level < DEDUP_MAX_RUNS
+            && header->count <= size / UUID_BINARY_SIZE
+            && header->bloom_blocks > 0 && header->bloom_blocks <= size / 64
+            && header->fence_count == (header->count + DEDUP_FENCE_INTERVAL - 1) / DEDUP_FENCE_INTERVAL
+            && header->ids_offset <= size && header->ids_offset % DEDUP_PAGE_SIZE == 0;
+    if (valid) {
+        runLayout(header->count, header->bloom_blocks, &ids_offset);
+        valid = ids_offset <= header->ids_offset && header->ids_offset + header->count * UUID_BINARY_SIZE == size;
+    }
+    dedupRun *run = valid ? (dedupRun *)memCalloc(MEM_DEDUP, 1, sizeof(dedupRun)) : NULL;
+    if (run == NULL || (run->path = memStrdup(MEM_DEDUP, path)) == NULL) {
+        fprintf(stderr, "Error: %s is not a valid dedup run\n", path);
+        memFree(run);
+        munmap(map, size);
+        return NULL;
+    }
+    // Lookups touch one page here and there: readahead would only evict useful pages
+    madvise(map, size, MADV_RANDOM);
+    run->level = (int)header->level;
+    run->sequence = header->sequence;
+    run->count = header->count;
+    run->bloom = (const uint64_t *)((const char *)map + sizeof(dedupRunHeader));
+    run->bloom_blocks = header->bloom_blocks;
+    run->fences = run->bloom + header->bloom_blocks * 8;
+    run->fence_count = header->fence_count;
+    run->ids = (const unsigned char (*)[UUID_BINARY_SIZE])((const char *)map + header->ids_offset);
+    run->map = map;
+    run->map_size = size;
+    return run;
+}
+
+static void runClose(dedupRun *run, int remove) {
+    munmap(run->map, run->map_size);
+    if (remove && unlink(run->path) != 0) {
+        fprintf(stderr, "Error removing merged dedup run %s: %s\n", run->path, strerror(errno));
+    }
+    memFree(run->path);
+    memFree(run);
+}
+
+static int runContains(dedupStore *store, const dedupRun *run, const unsigned char *id, uint64_t hash) {
+    if (!bloomTest(run->bloom + bloomBlockIndex(run->bloom_blocks, hash) * 8, hash)) {
+        return 0;
+    }
+    store->run_searches++;
+    // The id can only lie between the last fence below its prefix and the first one above it
+    uint64_t prefix = idPrefix(id);
+    uint64_t lo = 0, hi = run->fence_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (run->fences[mid] < prefix) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    uint64_t last = lo;
+    while (last < run->fence_count && run->fences[last] == prefix) {
+        last++;
+    }
+    uint64_t low_key = run->fence_count > 0 ? run->fences[lo > 0 ? lo - 1 : 0] : 0;
+    uint64_t high_key = last < run->fence_count ? run->fences[last] : UINT64_MAX;
+    lo = lo > 0 ? (lo - 1) * DEDUP_FENCE_INTERVAL : 0;
+    hi = last * DEDUP_FENCE_INTERVAL < run->count ? last * DEDUP_FENCE_INTERVAL : run->count;
+    if (lo >= hi) {
+        store->false_positives++;
+        return 0;
+    }
+
+    // A binary search of the block would touch a cache line per step. Interpolating between the
+    // fences instead lands within a few entries of random ids; gallop from there to bound the search.
+    uint64_t pos = lo + (uint64_t)((double)(prefix - low_key) / ((double)(high_key - low_key) + 1) * (hi - lo));
+    if (pos >= hi) {
+        // Fences more than 2^53 apart lose the + 1 to rounding, so the ratio can reach 1
+        pos = hi - 1;
+    }
+    int cmp = memcmp(run->ids[pos], id, UUID_BINARY_SIZE);
+    if (cmp == 0) {
+        return 1;
+    }
+    uint64_t step = 1;
+    if (cmp < 0) {
+        lo = pos + 1;
+        while (pos + step < hi && memcmp(run->ids[pos + step], id, UUID_BINARY_SIZE) < 0) {
+            lo = pos + step + 1;
+            step *= 2;
+        }
+        if (pos + step < hi) {
+            hi = pos + step + 1;
+        }
+    } else {
+        hi = pos;
+        while (pos >= lo + step && memcmp(run->ids[pos - step], id, UUID_BINARY_SIZE) > 0) {
+            hi = pos - step;
+            step *= 2;
+        }
+        if (pos >= lo + step) {
+            lo = pos - step;
+        }
+    }
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(run->ids[mid], id, UUID_BINARY_SIZE);
+        if (cmp == 0) {
+            return 1;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    store->false_positives++;
+    return 0;
+}
+
+static void runWriterAbort(dedupRunWriter *w) {
+    if (w->map != NULL) {
+        munmap(w->map, w->map_size);
+    }
+    if (w->fd >= 0) {
+        close(w->fd);
+        unlink(w->path);
+    }
+    memFree(w->path);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
+
+// The file is sized for max_count ids and truncated to the ids actually written when finished
+static int runWriterOpen(dedupStore *store, dedupRunWriter *w, uint64_t max_count) {
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    w->sequence = store->next_sequence++;
+    w->path = runPath(store->dir, w->sequence, "tmp");
+    if (w->path == NULL) {
+        return -1;
+    }
+    w->max_count = max_count;
+    w->bloom_blocks = bloomBlocks(max_count);
+    w->map_size = runLayout(max_count, w->bloom_blocks, &w->ids_offset);
+    w->fd = open(w->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0 || ftruncate(w->fd, (off_t)w->map_size) != 0) {
+        fprintf(stderr, "Error creating dedup run %s: %s\n", w->path, strerror(errno));
+        runWriterAbort(w);
+        return -1;
+    }
+    w->map = (unsigned char *)mmap(NULL, w->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (w->map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping dedup run %s: %s\n", w->path, strerror(errno));
+        w->map = NULL;
+        runWriterAbort(w);
+        return -1;
+    }
+    w->ids = (unsigned char (*)[UUID_BINARY_SIZE])(w->map + w->ids_offset);
+    return 0;
+}
+
+// Ids come in ascending order; repeats are dropped
+static void runWriterAppend(dedupRunWriter *w, const unsigned char *id) {
+    if (w->count > 0 && memcmp(w->ids[w->count - 1], id, UUID_BINARY_SIZE) == 0) {
+        return;
+    }
+    memcpy(w->ids[w->count++], id, UUID_BINARY_SIZE);
+}
+
+// Builds the filter and fences over the written ids, makes the file durable and gives it its
+// final name, then maps it back read-only
+static dedupRun *runWriterFinish(dedupStore *store, dedupRunWriter *w, int level) {
+    uint64_t *bloom = (uint64_t *)(w->map + sizeof(dedupRunHeader));
+    uint64_t *fences = bloom + w->bloom_blocks * 8;
+    for (uint64_t i = 0; i < w->count; i++) {
+        uint64_t hash = uuidHash(w->ids[i]);
+        bloomSet(bloom + bloomBlockIndex(w->bloom_blocks, hash) * 8, hash);
+        if (i % DEDUP_FENCE_INTERVAL == 0) {
+            fences[i / DEDUP_FENCE_INTERVAL] = idPrefix(w->ids[i]);
+        }
+    }
+    dedupRunHeader *header = (dedupRunHeader *)w->map;
+    memcpy(header->magic, DEDUP_RUN_MAGIC, sizeof(header->magic));
+    header->version = DEDUP_RUN_VERSION;
+    header->level = (uint32_t)level;
+    header->sequence = w->sequence;
+    header->count = w->count;
+    header->bloom_blocks = w->bloom_blocks;
+    header->fence_count = (w->count + DEDUP_FENCE_INTERVAL - 1) / DEDUP_FENCE_INTERVAL;
+    header->ids_offset = w->ids_offset;
+
+    char *path = runPath(store->dir, w->sequence, "run");
+    munmap(w->map, w->map_size);
+    w->map = NULL;
+    if (path == NULL || ftruncate(w->fd, (off_t)(w->ids_offset + w->count * UUID_BINARY_SIZE)) != 0
+            || fsync(w->fd) != 0 || rename(w->path, path) != 0) {
+        fprintf(stderr, "Error writing dedup run %s: %s\n", w->path, strerror(errno));
+        memFree(path);
+        runWriterAbort(w);
+        return NULL;
+    }
+    close(w->fd);
+    memFree(w->path);
+    w->fd = -1;
+    w->path = NULL;
+    dedupRun *run = runOpen(path);
+    memFree(path);
+    return run;
+}
+
+// LSD radix sort on the 8-byte prefixes, 16 bits per pass, then insertion sort for the ids that
+// share a prefix; an even number of passes leaves the result in ids
+static void sortIds(unsigned char (*ids)[UUID_BINARY_SIZE], unsigned char (*tmp)[UUID_BINARY_SIZE], size_t *counts, size_t n) {
+    unsigned char (*src)[UUID_BINARY_SIZE] = ids;
+    unsigned char (*dst)[UUID_BINARY_SIZE] = tmp;
+    for (int shift = 0; shift < 64; shift += 16) {
+        memset(counts, 0, 65536 * sizeof(size_t));
+        for (size_t i = 0; i < n; i++) {
+            counts[(idPrefix(src[i]) >> shift) & 0xffff]++;
+        }
+        size_t sum = 0;
+        for (size_t d = 0; d < 65536; d++) {
+            size_t c = counts[d];
+            counts[d] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            memcpy(dst[counts[(idPrefix(src[i]) >> shift) & 0xffff]++], src[i], UUID_BINARY_SIZE);
+        }
+        unsigned char (*swap)[UUID_BINARY_SIZE] = src;
+        src = dst;
+        dst = swap;
+    }
+    for (size_t i = 1; i < n; i++) {
+        for (size_t j = i; j > 0 && memcmp(ids[j - 1], ids[j], UUID_BINARY_SIZE) > 0; j--) {
+            unsigned char id[UUID_BINARY_SIZE];
+            memcpy(id, ids[j], UUID_BINARY_SIZE);
+            memcpy(ids[j], ids[j - 1], UUID_BINARY_SIZE);
+            memcpy(ids[j - 1], id, UUID_BINARY_SIZE);
+        }
+    }
+}
+
+static int compareRunSequence(const void *a, const void *b) {
+    const dedupRun *x = *(dedupRun *const *)a;
+    const dedupRun *y = *(dedupRun *const *)b;
+    return x->sequence < y->sequence ? -1 : x->sequence > y->sequence;
+}
+
+// Leftover temporary files are from an interrupted flush or merge whose inputs are still there
+static int openRuns(dedupStore *store, const char *dir) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating dedup directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "Error opening dedup directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    struct dirent *entry;
+    int res = 0;
+    while (res == 0 && (entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len != 20 || (strcmp(entry->d_name + 16, ".run") != 0 && strcmp(entry->d_name + 16, ".tmp") != 0)) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (strcmp(entry->d_name + 16, ".tmp") == 0) {
+            unlink(path);
+        } else if (store->run_count == DEDUP_MAX_RUNS) {
+            fprintf(stderr, "Error: more than %d dedup runs in %s\n", DEDUP_MAX_RUNS, dir);
+            res = -1;
+        } else if ((store->runs[store->run_count] = runOpen(path)) == NULL) {
+            res = -1;
+        } else {
+            store->run_count++;
+        }
+    }
+    closedir(d);
+    qsort(store->runs, store->run_count, sizeof(dedupRun *), compareRunSequence);
+    for (int r = 0; r < store->run_count; r++) {
+        if (store->runs[r]->sequence >= store->next_sequence) {
+            store->next_sequence = store->runs[r]->sequence + 1;
+        }
+    }
+    return res;
+}
+
+static void releaseStore(dedupStore *store) {
+    dedupCompaction *m = &store->compaction;
+    if (m->active) {
+        runWriterAbort(&m->writer);
+    }
+    for (int r = 0; r < store->run_count; r++) {
+        runClose(store->runs[r], 0);
+    }
+    hugeFree(MEM_DEDUP, store->hashes, store->capacity * sizeof(uint64_t));
+    hugeFree(MEM_DEDUP, store->ids, store->capacity * UUID_BINARY_SIZE);
+    hugeFree(MEM_DEDUP, store->sort_buffer, store->max_entries * UUID_BINARY_SIZE);
+    memFree(store->sort_counts);
+    memset(store, 0, sizeof(*store));
+}
+
+int dedupStoreInit(dedupStore *store, size_t max_entries, const char *dir) {
+    memset(store, 0, sizeof(*store));
+    store->max_entries = max_entries;
+    store->capacity = 1;
+    while (store->capacity < max_entries * 2) {
+        store->capacity <<= 1;
+    }
+    // Every lookup probes a random spot of the table: see hugemem.h
+    store->hashes = (uint64_t *)hugeAlloc(MEM_DEDUP, store->capacity * sizeof(uint64_t));
+    store->ids = (unsigned char (*)[UUID_BINARY_SIZE])hugeAlloc(MEM_DEDUP, store->capacity * UUID_BINARY_SIZE);
+    if (dir != NULL) {
+        store->sort_buffer = (unsigned char (*)[UUID_BINARY_SIZE])hugeAlloc(MEM_DEDUP, max_entries * UUID_BINARY_SIZE);
+        store->sort_counts = (size_t *)memAlloc(MEM_DEDUP, 65536 * sizeof(size_t));
+    }
+    if (store->hashes == NULL || store->ids == NULL
+            || (dir != NULL && (store->sort_buffer == NULL || store->sort_counts == NULL))) {
+        fprintf(stderr, "Error allocating the processed message table\n");
+        releaseStore(store);
+        return -1;
+    }
+    if (dir != NULL && openRuns(store, dir) != 0) {
+        releaseStore(store);
+        return -1;
+    }
+    store->dir = dir;
+    return 0;
+}
+
+static int flushHotTable(dedupStore *store) {
+    // Merges fell behind: finish them before adding another run
+    while (store->run_count == DEDUP_MAX_RUNS) {
+        if (dedupStoreMaintain(store, SIZE_MAX) <= 0 && store->run_count == DEDUP_MAX_RUNS) {
+            fprintf(stderr, "Error: %d dedup runs and none can be merged\n", DEDUP_MAX_RUNS);
+            return -1;
+        }
+    }
+    dedupRunWriter w;
+    if (runWriterOpen(store, &w, store->count) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < store->capacity; i++) {
+        if (store->hashes[i] != 0) {
+            memcpy(w.ids[w.count++], store->ids[i], UUID_BINARY_SIZE);
+        }
+    }
+    sortIds(w.ids, store->sort_buffer, store->sort_counts, w.count);
+    dedupRun *run = runWriterFinish(store, &w, 0);
+    if (run == NULL) {
+        return -1;
+    }
+    store->runs[store->run_count++] = run;
+    memset(store->hashes, 0, store->capacity * sizeof(uint64_t));
+    store->count = 0;
+    store->flushes++;
+    return 0;
+}
+
+void dedupStoreFree(dedupStore *store) {
+    if (store->dir != NULL && store->count > 0) {
+        flushHotTable(store);
+    }
+    releaseStore(store);
+}
+
+int dedupStoreSnapshot(dedupStore *store) {
+    if (store->dir == NULL) {
+        return -1;
+    }
+    return store->count > 0 ? flushHotTable(store) : 0;
+}
+
+// Bytes of the hot table and sort buffer as mapped, so huge page rounding counts
+static size_t hotTableBytes(const dedupStore *store, size_t capacity, size_t max_entries) {
+    size_t bytes = hugeRoundSize(capacity * sizeof(uint64_t)) + hugeRoundSize(capacity * UUID_BINARY_SIZE);
+    return bytes + (store->dir != NULL ? hugeRoundSize(max_entries * UUID_BINARY_SIZE) : 0);
+}
+
+size_t dedupStoreShrink(dedupStore *store) {
+    size_t max_entries = store->max_entries / 2;
+    size_t capacity = store->capacity / 2;
+    if (max_entries < DEDUP_MIN_HOT_ENTRIES) {
+        return 0;
+    }
+    size_t freed = hotTableBytes(store, store->capacity, store->max_entries) - hotTableBytes(store, capacity, max_entries);
+    if (freed == 0) {
+        return 0;
+    }
+    if (store->dir != NULL && store->count > 0 && flushHotTable(store) != 0) {
+        return 0;
+    }
+    uint64_t *hashes = (uint64_t *)hugeAlloc(MEM_DEDUP, capacity * sizeof(uint64_t));
+    unsigned char (*ids)[UUID_BINARY_SIZE] = (unsigned char (*)[UUID_BINARY_SIZE])hugeAlloc(MEM_DEDUP, capacity * UUID_BINARY_SIZE);
+    unsigned char (*sort_buffer)[UUID_BINARY_SIZE] = NULL;
+    if (store->dir != NULL) {
+        sort_buffer = (unsigned char (*)[UUID_BINARY_SIZE])hugeAlloc(MEM_DEDUP, max_entries * UUID_BINARY_SIZE);
+    }
+    if (hashes == NULL || ids == NULL || (store->dir != NULL && sort_buffer == NULL)) {
+        hugeFree(MEM_DEDUP, hashes, capacity * sizeof(uint64_t));
+        hugeFree(MEM_DEDUP, ids, capacity * UUID_BINARY_SIZE);
+        hugeFree(MEM_DEDUP, sort_buffer, max_entries * UUID_BINARY_SIZE);
+        return 0;
+    }
+    // Without a directory the ids that no longer fit are forgotten
+    size_t count = 0;
+    for (size_t i = 0; i < store->capacity; i++) {
+        if (store->hashes[i] == 0) {
+            continue;
+        }
+        if (count == max_entries) {
+            store->evicted++;
+            continue;
+        }
+        size_t slot = store->hashes[i] & (capacity - 1);
+        while (hashes[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        hashes[slot] = store->hashes[i];
+        memcpy(ids[slot], store->ids[i], UUID_BINARY_SIZE);
+        count++;
+    }
+    hugeFree(MEM_DEDUP, store->hashes, store->capacity * sizeof(uint64_t));
+    hugeFree(MEM_DEDUP, store->ids, store->capacity * UUID_BINARY_SIZE);
+    hugeFree(MEM_DEDUP, store->sort_buffer, store->max_entries * UUID_BINARY_SIZE);
+    store->hashes = hashes;
+    store->ids = ids;
+    store->sort_buffer = sort_buffer;
+    store->capacity = capacity;
+    store->count = count;
+    store->max_entries = max_entries;
+    return freed;
+}
+
+static size_t hotSlot(const dedupStore *store, const unsigned char *id, uint64_t hash) {
+    size_t mask = store->capacity - 1;
+    size_t i = hash & mask;
+    while (store->hashes[i] != 0) {
+        if (store->hashes[i] == hash && memcmp(store->ids[i], id, UUID_BINARY_SIZE) == 0) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+int dedupStoreContains(dedupStore *store, const unsigned char *id, uint64_t hash) {
+    store->lookups++;
+    // 0 is reserved for free slots
+    if (store->hashes[hotSlot(store, id, hash ? hash : 1)] != 0) {
+        return 1;
+    }
+    // Newest first: repeats tend to follow the original closely
+    for (int r = store->run_count - 1; r >= 0; r--) {
+        if (runContains(store, store->runs[r], id, hash)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int dedupStoreAdd(dedupStore *store, const unsigned char *id, uint64_t hash) {
+    if (store->count == store->max_entries) {
+        if (store->dir == NULL) {
+            // Handle memory overflow by skipping new messages
+            fprintf(stderr, "Warning: Processed message limit reached for consumer. Skipping adding new IDs.\n");
+            return -1;
+        }
+        if (flushHotTable(store) != 0) {
+            return -1;
+        }
+    }
+    hash = hash ? hash : 1;
+    size_t i = hotSlot(store, id, hash);
+    if (store->hashes[i] == 0) {
+        store->hashes[i] = hash;
+        memcpy(store->ids[i], id, UUID_BINARY_SIZE);
+        store->count++;
+    }
+    return 0;
+}
+
+// Picks the oldest DEDUP_COMPACT_FANIN runs of the lowest level that has that many
+static int startCompaction(dedupStore *store) {
+    dedupCompaction *m = &store->compaction;
+    int per_level[DEDUP_MAX_RUNS] = {0};
+    int level = -1;
+    for (int r = 0; r < store->run_count && level < 0; r++) {
+        if (++per_level[store->runs[r]->level] == DEDUP_COMPACT_FANIN) {
+            level = store->runs[r]->level;
+        }
+    }
+    if (level < 0 || m->failed) {
+        return 0;
+    }
+    uint64_t total = 0;
+    m->input_count = 0;
+    for (int r = 0; r < store->run_count && m->input_count < DEDUP_COMPACT_FANIN; r++) {
+        if (store->runs[r]->level == level) {
+            m->positions[m->input_count] = 0;
+            m->inputs[m->input_count++] = store->runs[r];
+            total += store->runs[r]->count;
+        }
+    }
+    if (runWriterOpen(store, &m->writer, total) != 0) {
+        m->failed = 1;
+        return -1;
+    }
+    for (int k = 0; k < m->input_count; k++) {
+        m->inputs[k]->merging = 1;
+    }
+    m->level = level + 1;
+    m->active = 1;
+    return 1;
+}
+
+// Replaces the inputs with the merged run, which comes last like a new flush
+static int finishCompaction(dedupStore *store) {
+    dedupCompaction *m = &store->compaction;
+    m->active = 0;
+    dedupRun *merged = runWriterFinish(store, &m->writer, m->level);
+    if (merged == NULL) {
+        for (int k = 0; k < m->input_count; k++) {
+            m->inputs[k]->merging = 0;
+        }
+        m->failed = 1;
+        return -1;
+    }
+    int n = 0;
+    for (int r = 0; r < store->run_count; r++) {
+        if (store->runs[r]->merging) {
+            runClose(store->runs[r], 1);
+        } else {
+            store->runs[n++] = store->runs[r];
+        }
+    }
+    store->runs[n++] = merged;
+    store->run_count = n;
+    store->compactions++;
+    return 0;
+}
+
+int dedupStoreMaintain(dedupStore *store, size_t step) {
+    dedupCompaction *m = &store->compaction;
+    if (store->dir == NULL) {
+        return 0;
+    }
+    if (!m->active) {
+        int res = startCompaction(store);
+        if (res <= 0) {
+            return res;
+        }
+    }
+    for (size_t done = 0; done < step; done++) {
+        int next = -1;
+        for (int k = 0; k < m->input_count; k++) {
+            if (m->positions[k] < m->inputs[k]->count && (next < 0
+                    || memcmp(m->inputs[k]->ids[m->positions[k]], m->inputs[next]->ids[m->positions[next]], UUID_BINARY_SIZE) < 0)) {
+                next = k;
+            }
+        }
+        if (next < 0) {
+            return finishCompaction(store) == 0 ? 1 : -1;
+        }
+        runWriterAppend(&m->writer, m->inputs[next]->ids[m->positions[next]++]);
+    }
+    return 1;
+}
+
+uint64_t dedupStoreRunIds(const dedupStore *store) {
+    uint64_t count = 0;
+    for (int r = 0; r < store->run_count; r++) {
+        count += store->runs[r]->count;
+    }
+    return count;
+}
+
+static size_t runBytes(const dedupStore *store) {
+    size_t bytes = 0;
+    for (int r = 0; r < store->run_count; r++) {
+        bytes += store->runs[r]->map_size;
+    }
+    return bytes;
+}
+
+void dedupStoreReport(dedupStore *store) {
+    if (store->dir == NULL || store->lookups == 0) {
+        return;
+    }
+    printf("Dedup: %zu hot ids, %d runs holding %llu ids (%.1f MiB), %.2f run searches per lookup (%.2f false positives), %llu flushes, %llu merges%s\n",
+            store->count, store->run_count, (unsigned long long)dedupStoreRunIds(store), runBytes(store) / 1048576.0,
+            (double)store->run_searches / store->lookups, (double)store->false_positives / store->lookups,
+            (unsigned long long)store->flushes, (unsigned long long)store->compactions,
+            store->compaction.active ? ", merging" : "");
+    store->lookups = store->run_searches = store->false_positives = 0;
+    store->flushes = store->compactions = 0;
+}
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// The n-th id of a benchmark set; set 0 is inserted, set 1 never is
+static void benchmarkId(uint64_t n, int set, unsigned char *id) {
+    uint64_t state = n * 2 + ((uint64_t)set << 62);
+    uint64_t halves[2] = { splitmix64(&state), splitmix64(&state) };
+    memcpy(id, halves, UUID_BINARY_SIZE);
+}
+
+// Ids at the ends of the key space, where the fences around an id are furthest apart: 0 the nil
+// UUID, 1 ffffffff-ffff-ffff-ffff-ffffffffffff, 2 and 3 with the other half flipped. 4 and 5, next
+// to 1 and 0, are never inserted.
+#define EDGE_IDS 6
+#define EDGE_IDS_PRESENT 4
+
+static void edgeId(int n, unsigned char *id) {
+    memset(id, n % 2 ? 0xff : 0x00, UUID_BINARY_SIZE);
+    if (n == 2 || n == 3) {
+        memset(id + UUID_BINARY_SIZE / 2, n % 2 ? 0x00 : 0xff, UUID_BINARY_SIZE / 2);
+    } else if (n == 4) {
+        id[UUID_BINARY_SIZE - 1] = 0xfe;
+    } else if (n == 5) {
+        id[UUID_BINARY_SIZE - 1] = 0x01;
+    }
+}
+
+static void removeRuns(const char *dir);
+
+// Looks the edge ids up in a run of random ids; returns the number of wrong answers
+static uint64_t benchmarkEdges(void) {
+    char dir[] = "/tmp/dedup-edges-XXXXXX";
+    dedupStore store;
+    if (mkdtemp(dir) == NULL) {
+        perror("Error creating a benchmark directory");
+        return 1;
+    }
+    if (dedupStoreInit(&store, DEDUP_BENCHMARK_EDGE_RUN, dir) != 0) {
+        rmdir(dir);
+        return 1;
+    }
+    unsigned char id[UUID_BINARY_SIZE];
+    uint64_t wrong = 0;
+    for (int n = 0; n < DEDUP_BENCHMARK_EDGE_RUN; n++) {
+        if (n < EDGE_IDS_PRESENT) {
+            edgeId(n, id);
+        } else {
+            benchmarkId(n, 0, id);
+        }
+        wrong += dedupStoreAdd(&store, id, uuidHash(id)) != 0;
+    }
+    wrong += flushHotTable(&store) != 0;
+    for (int n = 0; n < EDGE_IDS; n++) {
+        edgeId(n, id);
+        wrong += dedupStoreContains(&store, id, uuidHash(id)) != (n < EDGE_IDS_PRESENT);
+    }
+    printf("Key space edges: %d ids looked up in a run, %llu wrong answers\n", EDGE_IDS, (unsigned long long)wrong);
+    releaseStore(&store);
+    removeRuns(dir);
+    return wrong;
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t benchmarkLookups(dedupStore *store, uint64_t count, int set, uint64_t *latencies) {
+    uint64_t state = 42 + set;
+    uint64_t wrong = 0;
+    double total = 0;
+    int tlb = hugeTlbCounterOpen();
+    uint64_t tlb_start = hugeTlbCounterRead(tlb);
+    for (int i = 0; i < DEDUP_BENCHMARK_LOOKUPS; i++) {
+        unsigned char id[UUID_BINARY_SIZE];
+        benchmarkId(splitmix64(&state) % count, set, id);
+        uint64_t start = monotonicNanos();
+        int found = dedupStoreContains(store, id, uuidHash(id));
+        latencies[i] = monotonicNanos() - start;
+        total += latencies[i];
+        wrong += found != (set == 0);
+    }
+    uint64_t tlb_misses = hugeTlbCounterRead(tlb) - tlb_start;
+    if (tlb >= 0) {
+        close(tlb);
+    }
+    qsort(latencies, DEDUP_BENCHMARK_LOOKUPS, sizeof(uint64_t), compareLatency);
+    printf("%s ids: %.0f ns average, p50 %llu ns, p99 %llu ns, p99.9 %llu ns, %llu wrong answers\n",
+            set == 0 ? "Present" : "Absent", total / DEDUP_BENCHMARK_LOOKUPS,
+            (unsigned long long)latencies[DEDUP_BENCHMARK_LOOKUPS / 2],
+            (unsigned long long)latencies[DEDUP_BENCHMARK_LOOKUPS / 100 * 99],
+            (unsigned long long)latencies[DEDUP_BENCHMARK_LOOKUPS / 1000 * 999], (unsigned long long)wrong);
+    if (tlb >= 0) {
+        printf("%s ids: %.2f dTLB misses per lookup\n", set == 0 ? "Present" : "Absent",
+                (double)tlb_misses / DEDUP_BENCHMARK_LOOKUPS);
+    } else {
+        printf("%s ids: dTLB misses unavailable (no hardware cache counters)\n", set == 0 ? "Present" : "Absent");
+    }
+    return wrong;
+}
+
+static void removeRuns(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+int dedupStoreBenchmark(uint64_t count, size_t max_entries, const char *dir) {
+    char template[] = "/tmp/dedup-benchmark-XXXXXX";
+    int temporary = dir == NULL;
+    if (temporary && (dir = mkdtemp(template)) == NULL) {
+        perror("Error creating a benchmark directory");
+        return -1;
+    }
+    dedupStore store;
+    if (dedupStoreInit(&store, max_entries, dir) != 0) {
+        return -1;
+    }
+    if (store.run_count > 0) {
+        fprintf(stderr, "Error: %s already holds dedup runs\n", dir);
+        dedupStoreFree(&store);
+        return -1;
+    }
+
+    uint64_t false_duplicates = 0;
+    uint64_t wrong = benchmarkEdges();
+    int failed = 0;
+    uint64_t start = monotonicNanos();
+    for (uint64_t n = 0; n < count; n++) {
+        unsigned char id[UUID_BINARY_SIZE];
+        benchmarkId(n, 0, id);
+        uint64_t hash = uuidHash(id);
+        if (dedupStoreContains(&store, id, hash)) {
+            false_duplicates++;
+        } else if (dedupStoreAdd(&store, id, hash) != 0) {
+            failed = 1;
+            break;
+        }
+        // The consumer does merge work once per drain
+        if (n % PROCESS_BATCH_SIZE == 0) {
+            dedupStoreMaintain(&store, DEDUP_COMPACT_STEP);
+        }
+        if ((n + 1) % (count / 10 > 0 ? count / 10 : 1) == 0) {
+            printf("Dedup benchmark: %llu ids inserted, %d runs, %.1f s\n", (unsigned long long)(n + 1),
+                    store.run_count, (monotonicNanos() - start) / 1e9);
+            fflush(stdout);
+        }
+    }
+    double seconds = (monotonicNanos() - start) / 1e9;
+    printf("Inserted %llu ids in %.1f s (%.0f ids/s): %d runs holding %llu ids, %zu hot ids, %llu flushes, %llu merges, %llu false duplicates\n",
+            (unsigned long long)count, seconds, count / seconds, store.run_count,
+            (unsigned long long)dedupStoreRunIds(&store), store.count, (unsigned long long)store.flushes,
+            (unsigned long long)store.compactions, (unsigned long long)false_duplicates);
+
+    uint64_t *latencies = (uint64_t *)malloc(DEDUP_BENCHMARK_LOOKUPS * sizeof(uint64_t));
+    if (latencies != NULL && count > 0 && !failed) {
+        store.lookups = store.run_searches = store.false_positives = 0;
+        wrong += benchmarkLookups(&store, count, 0, latencies);
+        wrong += benchmarkLookups(&store, count, 1, latencies);
+        printf("Run searches per absent lookup: %.3f (Bloom filter false positives)\n",
+                (double)store.false_positives / DEDUP_BENCHMARK_LOOKUPS);
+    }
+    free(latencies);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t heap = store.capacity * (sizeof(uint64_t) + UUID_BINARY_SIZE) + max_entries * UUID_BINARY_SIZE;
+    size_t mapped = runBytes(&store);
+    printf("Memory: hot table and sort buffer %.1f MiB, runs %.1f MiB mapped (%.2f bytes per id), peak RSS %.1f MiB\n",
+            heap / 1048576.0, mapped / 1048576.0, count > 0 ? (double)mapped / count : 0.0, usage.ru_maxrss / 1024.0);
+    hugeMemReport();
+
+    if (temporary) {
+        releaseStore(&store);
+        removeRuns(dir);
+    } else {
+        dedupStoreFree(&store);
+    }
+    return !failed && false_duplicates == 0 && wrong == 0 ? 0 : -1;
+}
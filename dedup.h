@@ -0,0 +1,137 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "records.h"
+
+// Processed message ids, in tiers. New ids go to the hot table, a bounded in-memory hash set.
+// When a directory is set, a full hot table is written out as an immutable run file and emptied:
+// the ids sorted, a fence index holding the leading 8 bytes of every DEDUP_FENCE_INTERVAL-th id,
+// and a blocked Bloom filter. Runs are mmap'd, so their pages live in the page cache instead of
+// the heap. DEDUP_COMPACT_FANIN runs of one level are merged into a run of the next level, at
+// most DEDUP_COMPACT_STEP ids per dedupStoreMaintain() call so the merge runs between drains.
+// A lookup checks the hot table, then the filter of every run, and binary searches the fenced
+// block of the runs whose filter matches. Without a directory only the hot table is kept and
+// ids beyond its size are not tracked.
+//
+// Run file layout, all offsets from the start of the file:
+//   dedupRunHeader | Bloom filter, 64-byte blocks | fences | ids, sorted, from a page boundary
+
+#define DEDUP_RUN_MAGIC "DEDUPRUN"
+#define DEDUP_RUN_VERSION 1
+#define DEDUP_FENCE_INTERVAL 256      // Ids per fenced block: one 4 KiB page
+#define DEDUP_BLOOM_BITS_PER_ID 10
+#define DEDUP_BLOOM_PROBES 7          // Bits set per id, all in the same 512-bit block
+#define DEDUP_COMPACT_FANIN 4
+#define DEDUP_COMPACT_STEP 65536
+#define DEDUP_MAX_RUNS 64
+#define DEDUP_BENCHMARK_LOOKUPS 1000000
+#define DEDUP_BENCHMARK_EDGE_RUN 4096  // Ids in the run the key space edges are looked up in
+#define DEDUP_MIN_HOT_ENTRIES 4096    // dedupStoreShrink stops here
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t level;           // 0 for flushed hot tables, n + 1 for merges of level n
+    uint64_t sequence;        // Order of creation, also the file name
+    uint64_t count;
+    uint64_t bloom_blocks;
+    uint64_t fence_count;
+    uint64_t ids_offset;
+    uint64_t reserved;
+} dedupRunHeader;
+
+typedef struct {
+    char *path;
+    int level;
+    uint64_t sequence;
+    uint64_t count;
+    const uint64_t *bloom;    // bloom_blocks blocks of 8 words
+    uint64_t bloom_blocks;
+    const uint64_t *fences;   // Leading 8 bytes of the ids read big endian, so they order like the ids
+    uint64_t fence_count;
+    const unsigned char (*ids)[UUID_BINARY_SIZE];
+    void *map;
+    size_t map_size;
+    int merging;
+} dedupRun;
+
+// A run file being written through a shared mapping sized for max_count ids
+typedef struct {
+    int fd;
+    char *path;               // Temporary name, renamed when complete
+    uint64_t sequence;
+    unsigned char *map;
+    size_t map_size;
+    uint64_t bloom_blocks;
+    uint64_t ids_offset;
+    uint64_t max_count;
+    uint64_t count;
+    unsigned char (*ids)[UUID_BINARY_SIZE];
+} dedupRunWriter;
+
+typedef struct {
+    dedupRun *inputs[DEDUP_COMPACT_FANIN];
+    uint64_t positions[DEDUP_COMPACT_FANIN];
+    int input_count;
+    int level;
+    dedupRunWriter writer;
+    int active;
+    int failed;               // No more merges are started after a failed one
+} dedupCompaction;
+
+typedef struct {
+    // Hot table, open addressing with linear probing
+    uint64_t *hashes;         // 0 marks a free slot
+    unsigned char (*ids)[UUID_BINARY_SIZE];
+    size_t capacity;          // Power of two, at least twice max_entries
+    size_t count;
+    size_t max_entries;
+    // Runs, oldest first
+    const char *dir;          // NULL keeps the hot table only
+    dedupRun *runs[DEDUP_MAX_RUNS];
+    int run_count;
+    uint64_t next_sequence;
+    unsigned char (*sort_buffer)[UUID_BINARY_SIZE];  // Flushes radix sort through it
+    size_t *sort_counts;
+    dedupCompaction compaction;
+    // Statistics since the last dedupStoreReport
+    uint64_t lookups;
+    uint64_t run_searches;    // Binary searches of a run whose filter matched
+    uint64_t false_positives; // Of those, searches that did not find the id
+    uint64_t flushes;
+    uint64_t compactions;
+    uint64_t evicted;         // Forgotten by dedupStoreShrink without a directory, never reset
+} dedupStore;
+
+// Opens the runs left in dir, if set, from an earlier run of the consumer
+int dedupStoreInit(dedupStore *store, size_t max_entries, const char *dir);
+// Writes the hot table out as a run when a directory is set, so the ids outlive the process
+void dedupStoreFree(dedupStore *store);
+// Writes the hot table out as a run now, so a crash loses none of its ids. Needs a directory.
+int dedupStoreSnapshot(dedupStore *store);
+
+// Halves the hot table to give memory back, unless that would take it below
+// DEDUP_MIN_HOT_ENTRIES or free nothing. With a directory the hot ids are written out as a run first; without one
+// the ids that no longer fit are forgotten. Returns the bytes freed, 0 when nothing was.
+size_t dedupStoreShrink(dedupStore *store);
+
+// hash is uuidHash(id)
+int dedupStoreContains(dedupStore *store, const unsigned char *id, uint64_t hash);
+// The id must not be in the store yet. Returns -1 when it cannot be tracked.
+int dedupStoreAdd(dedupStore *store, const unsigned char *id, uint64_t hash);
+
+// Does up to step ids of pending merge work. Returns 1 while merges remain, 0 when idle and -1
+// when a merge failed.
+int dedupStoreMaintain(dedupStore *store, size_t step);
+uint64_t dedupStoreRunIds(const dedupStore *store);
+void dedupStoreReport(dedupStore *store);
+
+// Fills a store with count random ids, checking each first as the consumer does, then reports
+// insert throughput, lookup latency for present and absent ids, and memory and disk use. Uses
+// a temporary directory when dir is NULL. Ids at both ends of the key space are checked first.
+int dedupStoreBenchmark(uint64_t count, size_t max_entries, const char *dir);
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+#include "dedupkey.h"
+#include "uuid.h"
+#include "clock.h"
+#include "jsonbackend.h"
+#include "memtrack.h"
+
+// Multiply-fold constants, from wyhash
+#define KEY_P0 0xa0761d6478bd642fULL
+#define KEY_P1 0xe7037ed1a0b428dbULL
+#define KEY_P2 0x8ebc6af09c88c6e3ULL
+#define KEY_P3 0x589965cc75374cc3ULL
+
+int dedupKeyInit(dedupKey *key, const char *spec) {
+    memset(key, 0, sizeof(*key));
+    if (strcmp(spec, "id") == 0) {
+        key->mode = DEDUP_KEY_ID;
+        return 0;
+    }
+    if (strcmp(spec, "payload") == 0) {
+        key->mode = DEDUP_KEY_PAYLOAD;
+        return 0;
+    }
+    if (strncmp(spec, "fields:", 7) != 0) {
+        fprintf(stderr, "Error: dedup key must be id, payload or fields:NAME,...\n");
+        return -1;
+    }
+    key->mode = DEDUP_KEY_FIELDS;
+    key->field_list = memStrdup(MEM_DEDUP, spec + 7);
+    if (key->field_list == NULL) {
+        return -1;
+    }
+    char *saveptr = NULL;
+    for (char *name = strtok_r(key->field_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+        if (key->field_count == DEDUP_KEY_MAX_FIELDS) {
+            fprintf(stderr, "Error: more than %d dedup key fields\n", DEDUP_KEY_MAX_FIELDS);
+            dedupKeyFree(key);
+            return -1;
+        }
+        key->fields[key->field_count] = name;
+        key->field_lens[key->field_count++] = strlen(name);
+    }
+    if (key->field_count == 0) {
+        fprintf(stderr, "Error: no dedup key fields given\n");
+        dedupKeyFree(key);
+        return -1;
+    }
+    return 0;
+}
+
+void dedupKeyFree(dedupKey *key) {
+    memFree(key->field_list);
+    memset(key, 0, sizeof(*key));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 64x64 bit multiply, high and low halves folded together
+static inline uint64_t fold(uint64_t a, uint64_t b) {
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// Two lanes of 16 bytes per step, the tail read with overlapping loads
+static void foldHash(const void *data, size_t len, uint64_t seed, unsigned char *out) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t n = len;
+    uint64_t h1 = seed ^ KEY_P0;
+    uint64_t h2 = seed ^ KEY_P1 ^ len;
+    while (n >= 32) {
+        h1 = fold(read64(p) ^ KEY_P1, read64(p + 8) ^ h1);
+        h2 = fold(read64(p + 16) ^ KEY_P2, read64(p + 24) ^ h2);
+        p += 32;
+        n -= 32;
+    }
+    if (n >= 16) {
+        h1 = fold(read64(p) ^ KEY_P1, read64(p + 8) ^ h1);
+        p += 16;
+        n -= 16;
+    }
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (n >= 8) {
+        a = read64(p);
+        b = read64(p + n - 8);
+    } else if (n >= 4) {
+        a = read32(p);
+        b = read32(p + n - 4);
+    } else if (n > 0) {
+        a = ((uint64_t)p[0] << 16) | ((uint64_t)p[n / 2] << 8) | p[n - 1];
+    }
+    h2 = fold(a ^ KEY_P2 ^ h2, b ^ KEY_P3);
+    // h1 is still seed ^ KEY_P0 for inputs under 16 bytes: mix it with another constant, or it cancels out
+    uint64_t lo = fold(h1 ^ KEY_P2, h2 ^ KEY_P1);
+    uint64_t hi = fold(h2 ^ KEY_P2, h1 ^ lo ^ KEY_P3);
+    memcpy(out, &lo, sizeof(lo));
+    memcpy(out + sizeof(lo), &hi, sizeof(hi));
+}
+
+const char *dedupKeyHashName(void) {
+#ifdef HAVE_XXHASH
+    return "XXH3-128";
+#else
+    return "multiply-fold";
+#endif
+}
+
+void dedupKeyHash(const void *data, size_t len, uint64_t seed, unsigned char *out) {
+#ifdef HAVE_XXHASH
+    XXH128_hash_t h = XXH3_128bits_withSeed(data, len, seed);
+    memcpy(out, &h.low64, sizeof(h.low64));
+    memcpy(out + sizeof(h.low64), &h.high64, sizeof(h.high64));
+#else
+    foldHash(data, len, seed, out);
+#endif
+}
+
+// Where the message_id text sits in the payload, or NULL
+static const char *findId(const char *payload, size_t len, const char *id) {
+    const char *end = payload + len;
+    for (const char *p = payload; end - p >= UUID_TEXT_SIZE; p++) {
+        p = (const char *)memchr(p, id[0], end - p - UUID_TEXT_SIZE + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p, id, UUID_TEXT_SIZE) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// The payload on either side of the message_id value, the second part seeded with the first
+static void payloadKey(const char *payload, size_t len, const char *id_text, unsigned char *out) {
+    const char *id = findId(payload, len, id_text);
+    size_t before = id != NULL ? (size_t)(id - payload) : len;
+    size_t after = id != NULL ? len - before - UUID_TEXT_SIZE : 0;
+    unsigned char prefix[UUID_BINARY_SIZE];
+    dedupKeyHash(payload, before, 0, prefix);
+    dedupKeyHash(payload + len - after, after, read64(prefix) ^ read64(prefix + 8), out);
+}
+
+typedef struct {
+    const dedupKey *key;
+    unsigned char values[DEDUP_KEY_MAX_FIELDS][UUID_BINARY_SIZE];
+    uint32_t found;
+} fieldKeyContext;
+
+static int hashField(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len) {
+    fieldKeyContext *fk = (fieldKeyContext *)ctx;
+    for (int f = 0; f < fk->key->field_count; f++) {
+        if (name_len == fk->key->field_lens[f] && memcmp(name, fk->key->fields[f], name_len) == 0) {
+            dedupKeyHash(value, value_len, (uint64_t)f + 1, fk->values[f]);
+            fk->found |= 1u << f;
+        }
+    }
+    return 0;
+}
+
+// The field value hashes in order, seeded with which fields were present
+static void fieldsKey(const dedupKey *key, jsonDocument *doc, unsigned char *out) {
+    fieldKeyContext ctx;
+    ctx.key = key;
+    ctx.found = 0;
+    memset(ctx.values, 0, (size_t)key->field_count * UUID_BINARY_SIZE);
+    jsonIterate(doc, hashField, &ctx);
+    dedupKeyHash(ctx.values, (size_t)key->field_count * UUID_BINARY_SIZE, ctx.found, out);
+}
+
+void dedupKeyBatch(const dedupKey *key, messageBatch *batch) {
+    if (key->mode == DEDUP_KEY_ID) {
+        return;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        if (!(batch->status[i] & MESSAGE_PARSED)) {
+            continue;
+        }
+        if (key->mode == DEDUP_KEY_PAYLOAD) {
+            payloadKey(messageBatchPayload(batch, i), batch->lengths[i], batch->id_text[i], batch->ids[i]);
+        } else {
+            fieldsKey(key, &batch->docs[i], batch->ids[i]);
+        }
+        batch->hashes[i] = uuidHash(batch->ids[i]);
+        batch->partitions[i] = (uint16_t)(batch->hashes[i] % batch->partition_count);
+    }
+}
+
+// Benchmark
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Keeps the hashes from being optimized away
+static volatile uint64_t benchmark_sink;
+
+typedef void (*keyHashFn)(const void *data, size_t len, uint64_t seed, unsigned char *out);
+
+static double hashThroughput(keyHashFn fn, const char *data, size_t size, size_t total) {
+    unsigned char out[UUID_BINARY_SIZE];
+    uint64_t sink = 0;
+    uint64_t hashed = 0;
+    uint64_t start = monotonicNanos();
+    uint64_t elapsed;
+    do {
+        for (size_t offset = 0; offset + size <= total; offset += size) {
+            fn(data + offset, size, sink, out);
+            sink ^= read64(out);
+            hashed += size;
+        }
+        elapsed = monotonicNanos() - start;
+    } while (elapsed < DEDUP_KEY_BENCHMARK_NS);
+    benchmark_sink = sink;
+    return hashed / (double)elapsed;
+}
+
+// Nanoseconds per message to derive the keys of the whole batch: message_id decoding alone, or
+// followed by the content key
+static double keyCost(const dedupKey *key, messageBatch *batch) {
+    uint64_t messages = 0;
+    uint64_t start = monotonicNanos();
+    uint64_t elapsed;
+    do {
+        messageBatchDecodeIds(batch);
+        dedupKeyBatch(key, batch);
+        messages += batch->count;
+        elapsed = monotonicNanos() - start;
+    } while (elapsed < DEDUP_KEY_BENCHMARK_NS);
+    return (double)elapsed / messages;
+}
+
+int dedupKeyBenchmark(void) {
+    size_t total = 1 << 20;
+    char *data = (char *)malloc(total);
+    char *payloads = (char *)malloc((size_t)DEDUP_KEY_BENCHMARK_MESSAGES * 512);
+    messageBatch batch;
+    if (data == NULL || payloads == NULL || messageBatchInit(&batch, DEDUP_KEY_BENCHMARK_MESSAGES, 1) != 0) {
+        fprintf(stderr, "Error allocating the dedup key benchmark\n");
+        free(data);
+        free(payloads);
+        return -1;
+    }
+    uint64_t state = 1;
+    for (size_t i = 0; i < total; i += sizeof(uint64_t)) {
+        uint64_t v = splitmix64(&state);
+        memcpy(data + i, &v, sizeof(v));
+    }
+
+    printf("Dedup key hash: %s\n", dedupKeyHashName());
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        double active = hashThroughput(dedupKeyHash, data, sizes[s], total);
+        printf("%6zu bytes: %.2f GB/s, %.1f ns per hash", sizes[s], active, sizes[s] / active);
+#ifdef HAVE_XXHASH
+        double fallback = hashThroughput(foldHash, data, sizes[s], total);
+        printf(" (multiply-fold %.2f GB/s, %.1f ns)", fallback, sizes[s] / fallback);
+#endif
+        printf("\n");
+    }
+
+    // Messages shaped like the published ones, about 250 bytes
+    messageBatchReset(&batch, payloads);
+    char *p = payloads;
+    for (int i = 0; i < DEDUP_KEY_BENCHMARK_MESSAGES; i++) {
+        uint64_t a = splitmix64(&state);
+        uint64_t b = splitmix64(&state);
+        int len = sprintf(p, "{\"message_id\": \"%08x-%04x-4%03x-a%03x-%012llx\", \"tenant\": \"t%d\", \"value\": %.4f, "
+                "\"source\": \"sensor-%d\", \"tags\": [\"alpha\", \"beta\", \"gamma\"], \"note\": \"%.*s\"}",
+                (unsigned)a, (unsigned)(a >> 32) & 0xffff, (unsigned)(a >> 48) & 0xfff, (unsigned)b & 0xfff,
+                (unsigned long long)(b >> 16) & 0xffffffffffffULL, (int)(b % 100), (double)(a % 100000) / 7,
+                (int)(a % 1000), (int)(b % 64) + 32,
+                "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+        messageBatchAdd(&batch, p, (size_t)len);
+        char error_text[256];
+        size_t id_len;
+        if (jsonParse(jsonDefaultBackend(), &batch.docs[i], p, (size_t)len, error_text, sizeof(error_text)) != JSON_PARSE_OK
+                || jsonGetString(&batch.docs[i], "message_id", batch.id_text[i], sizeof(batch.id_text[i]), &id_len) != 1) {
+            fprintf(stderr, "Error parsing benchmark message: %s\n", p);
+        }
+        batch.status[i] = MESSAGE_PARSED;
+        p += len + 1;
+    }
+
+    dedupKey id_key;
+    dedupKey payload_key;
+    dedupKey fields_key;
+    dedupKeyInit(&id_key, "id");
+    dedupKeyInit(&payload_key, "payload");
+    int res = dedupKeyInit(&fields_key, "fields:tenant,source,value");
+    if (res == 0) {
+        double id_ns = keyCost(&id_key, &batch);
+        double payload_ns = keyCost(&payload_key, &batch);
+        double fields_ns = keyCost(&fields_key, &batch);
+        printf("Keys per message (%s JSON backend): message_id %.1f ns, payload %.1f ns (+%.1f), fields %.1f ns (+%.1f)\n",
+                jsonDefaultBackend()->name, id_ns, payload_ns, payload_ns - id_ns, fields_ns, fields_ns - id_ns);
+
+        // Resending a payload under a fresh id must give the same key; the id follows {"message_id": "
+        char resent[512];
+        size_t len = batch.lengths[0];
+        memcpy(resent, messageBatchPayload(&batch, 0), len + 1);
+        char *resent_id = resent + 16;
+        memset(resent_id + 24, 'f', 12);
+        unsigned char first[UUID_BINARY_SIZE];
+        unsigned char second[UUID_BINARY_SIZE];
+        payloadKey(messageBatchPayload(&batch, 0), len, batch.id_text[0], first);
+        payloadKey(resent, len, resent_id, second);
+        if (memcmp(first, second, UUID_BINARY_SIZE) != 0) {
+            fprintf(stderr, "Error: a payload resent under a new message_id got a different key\n");
+            res = -1;
+        }
+        dedupKeyFree(&fields_key);
+    }
+
+    for (int i = 0; i < batch.count; i++) {
+        jsonRelease(&batch.docs[i]);
+    }
+    messageBatchFree(&batch);
+    free(data);
+    free(payloads);
+    return res;
+}
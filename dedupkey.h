@@ -0,0 +1,51 @@
+#ifndef _DEDUPKEY_H
+#define _DEDUPKEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "batch.h"
+
+// What makes two messages duplicates. By default the binary message_id; a content key instead
+// replaces it, in the ids column, with a 128-bit hash of the payload or of chosen fields, so
+// the dedup stage, the processed id stores and the host table work on it unchanged. Keys hash
+// the bytes as received: payloads differing only in whitespace or member order are distinct.
+//
+//   payload        The whole payload except the message_id value, so resends under fresh ids match
+//   fields:a,b,c   The raw values of the named top level members, in that order; missing ones count
+//
+// The hash is XXH3-128 when built with -DHAVE_XXHASH, and otherwise a multiply-fold hash of the
+// same width.
+
+#define DEDUP_KEY_ID 0
+#define DEDUP_KEY_PAYLOAD 1
+#define DEDUP_KEY_FIELDS 2
+
+#define DEDUP_KEY_MAX_FIELDS 16
+#define DEDUP_KEY_BENCHMARK_MESSAGES 4096
+#define DEDUP_KEY_BENCHMARK_NS 200000000ULL   // Minimum run time of each measurement
+
+typedef struct {
+    int mode;
+    char *field_list;                         // Owns the names below
+    const char *fields[DEDUP_KEY_MAX_FIELDS];
+    size_t field_lens[DEDUP_KEY_MAX_FIELDS];
+    int field_count;
+} dedupKey;
+
+// spec is "id", "payload" or "fields:" followed by comma separated member names
+int dedupKeyInit(dedupKey *key, const char *spec);
+void dedupKeyFree(dedupKey *key);
+
+const char *dedupKeyHashName(void);
+void dedupKeyHash(const void *data, size_t len, uint64_t seed, unsigned char *out);
+
+// Replaces the ids and hashes of the parsed messages with their content keys, and repartitions
+// them. Does nothing for DEDUP_KEY_ID.
+void dedupKeyBatch(const dedupKey *key, messageBatch *batch);
+
+// Reports hashing throughput by input size, then the cost per message of payload and field keys
+// next to message_id decoding alone
+int dedupKeyBenchmark(void);
+
+#endif
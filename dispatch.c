@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "dispatch.h"
+#include "consumer.h"
+#include "uuid.h"
+#include "dedupkey.h"
+#include "jsonscan.h"
+#include "jsonbackend.h"
+#include "memtrack.h"
+#include "clock.h"
+
+int orderKeyInit(orderKey *key, const char *spec) {
+    memset(key, 0, sizeof(*key));
+    if (strcmp(spec, "id") == 0) {
+        key->mode = ORDER_KEY_ID;
+    } else if (strncmp(spec, "id-prefix:", 10) == 0) {
+        key->mode = ORDER_KEY_ID_PREFIX;
+        key->prefix_len = atoi(spec + 10);
+        if (key->prefix_len <= 0 || key->prefix_len > UUID_TEXT_SIZE) {
+            fprintf(stderr, "Ordering key prefix must be 1 to %d characters\n", UUID_TEXT_SIZE);
+            return -1;
+        }
+    } else if (strncmp(spec, "field:", 6) == 0 && spec[6] != '\0') {
+        key->mode = ORDER_KEY_FIELD;
+        key->field = spec + 6;
+        key->field_len = strlen(key->field);
+    } else {
+        fprintf(stderr, "Invalid ordering key: %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+// The bytes of message i that pick its worker. String fields are taken raw between the quotes.
+static size_t orderKeyValue(const orderKey *key, const messageBatch *batch, int i, const char **value) {
+    jsonMember member;
+    switch (key->mode) {
+        case ORDER_KEY_ID:
+            *value = batch->id_text[i];
+            return UUID_TEXT_SIZE;
+        case ORDER_KEY_ID_PREFIX:
+            *value = batch->id_text[i];
+            return (size_t)key->prefix_len;
+        default:
+            if (jsonObjectFind(messageBatchPayload(batch, i), batch->lengths[i], key->field, key->field_len, &member)) {
+                if (jsonValueKind(member.value) == JSON_KIND_STRING) {
+                    *value = member.value + 1;
+                    return member.value_len - 2;
+                }
+                *value = member.value;
+                return member.value_len;
+            }
+            *value = "null";
+            return 4;
+    }
+}
+
+// Skew detection
+
+// Space-Saving: a key not tracked takes over the least counted slot and inherits its count as the
+// error bound, so any key above messages / DISPATCH_HOT_KEYS is guaranteed to be tracked
+static void countKey(skewDetector *skew, uint64_t hash, const char *value, size_t len) {
+    hotKey *min = NULL;
+    for (int k = 0; k < skew->used; k++) {
+        if (skew->keys[k].hash == hash) {
+            skew->keys[k].count++;
+            return;
+        }
+        if (min == NULL || skew->keys[k].count < min->count) {
+            min = &skew->keys[k];
+        }
+    }
+    hotKey *slot;
+    if (skew->used < DISPATCH_HOT_KEYS) {
+        slot = &skew->keys[skew->used++];
+        slot->count = slot->error = 0;
+    } else {
+        slot = min;
+        slot->error = slot->count;
+    }
+    slot->hash = hash;
+    slot->count++;
+    len = len < DISPATCH_HOT_KEY_SIZE - 1 ? len : DISPATCH_HOT_KEY_SIZE - 1;
+    memcpy(slot->key, value, len);
+    slot->key[len] = '\0';
+}
+
+// Heaviest first by guaranteed count
+static int compareHotKeys(const void *a, const void *b) {
+    const hotKey *x = (const hotKey *)a, *y = (const hotKey *)b;
+    uint64_t cx = x->count - x->error, cy = y->count - y->error;
+    return cx < cy ? 1 : cx > cy ? -1 : 0;
+}
+
+void dispatcherRoute(dispatcher *d, messageBatch *batch) {
+    skewDetector *skew = &d->skew;
+    for (int i = 0; i < batch->count; i++) {
+        if (!(batch->status[i] & MESSAGE_PARSED)) {
+            continue;
+        }
+        const char *value;
+        size_t len = orderKeyValue(&d->key, batch, i, &value);
+        unsigned char digest[16];
+        uint64_t hash;
+        dedupKeyHash(value, len, 0, digest);
+        memcpy(&hash, digest, sizeof(hash));
+
+        int worker = (int)(hash % (uint64_t)d->workers);
+        batch->partitions[i] = (uint16_t)worker;
+        skew->worker_messages[worker]++;
+        skew->messages++;
+        countKey(skew, hash, value, len);
+    }
+}
+
+void dispatcherReport(dispatcher *d) {
+    skewDetector *skew = &d->skew;
+    if (skew->messages == 0) {
+        return;
+    }
+    uint64_t busiest = 0;
+    for (int w = 0; w < d->workers; w++) {
+        busiest = skew->worker_messages[w] > busiest ? skew->worker_messages[w] : busiest;
+    }
+    double even_share = (double)skew->messages / d->workers;
+    qsort(skew->keys, skew->used, sizeof(hotKey), compareHotKeys);
+    printf("Dispatch: %d workers, %llu messages, busiest worker %.1f%% (%.2fx an even share), hot keys:", d->workers,
+            (unsigned long long)skew->messages, 100.0 * busiest / skew->messages, busiest / even_share);
+    // Only keys whose guaranteed count, not the Space-Saving over-estimate, is a noticeable share
+    int hot = 0;
+    for (int k = 0; k < skew->used && hot < 3; k++) {
+        uint64_t count = skew->keys[k].count - skew->keys[k].error;
+        if (count * 100 >= skew->messages) {
+            printf(" \"%s\" %.1f%%", skew->keys[k].key, 100.0 * count / skew->messages);
+            hot++;
+        }
+    }
+    printf(hot == 0 ? " none above 1%%\n" : "\n");
+    if (hot > 0 && d->workers > 1 && skew->keys[0].count - skew->keys[0].error > even_share) {
+        printf("Warning: key \"%s\" alone is more than a worker's even share of messages; its worker bounds throughput\n",
+                skew->keys[0].key);
+    }
+    memset(skew, 0, sizeof(*skew));
+}
+
+// Workers
+
+typedef struct {
+    dispatcher *d;
+    int index;
+} dispatchThread;
+
+static void *dispatchWorker(void *arg) {
+    dispatchThread *t = (dispatchThread *)arg;
+    dispatcher *d = t->d;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (d->generation == seen && !d->stop) {
+            pthread_cond_wait(&d->start, &d->lock);
+        }
+        if (d->stop) {
+            break;
+        }
+        seen = d->generation;
+        messageBatch *batch = d->batch;
+        int flags = d->flags;
+        pthread_mutex_unlock(&d->lock);
+
+        d->fn(d->contexts[t->index], batch, t->index, flags);
+
+        pthread_mutex_lock(&d->lock);
+        if (--d->remaining == 0) {
+            pthread_cond_signal(&d->done);
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    memFree(t);
+    return NULL;
+}
+
+int dispatcherInit(dispatcher *d, int workers, const orderKey *key, dispatchFn fn, void **contexts) {
+    memset(d, 0, sizeof(*d));
+    if (workers < 1 || workers > DISPATCH_MAX_WORKERS) {
+        fprintf(stderr, "Workers must be 1 to %d\n", DISPATCH_MAX_WORKERS);
+        return -1;
+    }
+    d->workers = workers;
+    d->key = *key;
+    d->fn = fn;
+    d->contexts = contexts;
+    d->threads = (pthread_t *)memCalloc(MEM_OTHER, workers, sizeof(pthread_t));
+    if (d->threads == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->start, NULL);
+    pthread_cond_init(&d->done, NULL);
+
+    // Worker 0 is the calling thread. The others start with signals blocked, so shutdown signals
+    // interrupt the calling thread's reads and polls instead of landing on a worker.
+    sigset_t blocked, previous;
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_SETMASK, &blocked, &previous);
+    for (int w = 1; w < workers; w++) {
+        dispatchThread *t = (dispatchThread *)memAlloc(MEM_OTHER, sizeof(dispatchThread));
+        if (t != NULL) {
+            t->d = d;
+            t->index = w;
+        }
+        if (t == NULL || pthread_create(&d->threads[w], NULL, dispatchWorker, t) != 0) {
+            fprintf(stderr, "Error starting dispatch worker %d\n", w);
+            memFree(t);
+            pthread_sigmask(SIG_SETMASK, &previous, NULL);
+            d->workers = w;
+            dispatcherFree(d);
+            return -1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return 0;
+}
+
+void dispatcherFree(dispatcher *d) {
+    if (d->threads == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->start);
+    pthread_mutex_unlock(&d->lock);
+    for (int w = 1; w < d->workers; w++) {
+        pthread_join(d->threads[w], NULL);
+    }
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->start);
+    pthread_cond_destroy(&d->done);
+    memFree(d->threads);
+    d->threads = NULL;
+}
+
+void dispatcherRun(dispatcher *d, messageBatch *batch, int flags) {
+    if (d->workers > 1) {
+        pthread_mutex_lock(&d->lock);
+        d->batch = batch;
+        d->flags = flags;
+        d->remaining = d->workers - 1;
+        d->generation++;
+        pthread_cond_broadcast(&d->start);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    d->fn(d->contexts[0], batch, 0, flags);
+
+    // Everything the workers wrote is visible once they have checked in under the lock
+    if (d->workers > 1) {
+        pthread_mutex_lock(&d->lock);
+        while (d->remaining > 0) {
+            pthread_cond_wait(&d->done, &d->lock);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    d->jobs++;
+}
+
+// Benchmark
+
+typedef struct {
+    int worker;
+    const jsonBackend *backend;
+    jsonBuffer output;
+    uint64_t *last_seq;                 // Per key, +1 so 0 means none seen
+    int *owners;                        // Shared: the worker each key was first processed on
+    uint64_t processed;
+    uint64_t violations;
+} benchmarkWorker;
+
+// Stands in for the output stage: parse, serialize with an added member, then check the order
+static void benchmarkWork(void *ctx, messageBatch *batch, int worker, int flags) {
+    benchmarkWorker *w = (benchmarkWorker *)ctx;
+    (void)flags;
+    if (batch == NULL) {
+        return;
+    }
+    char error_text[128];
+    char extra[24];
+    size_t extra_len = snprintf(extra, sizeof(extra), "\"worker\":%d", worker);
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->partitions[i] != worker || !(batch->status[i] & MESSAGE_PARSED)) {
+            continue;
+        }
+        const char *payload = messageBatchPayload(batch, i);
+        jsonDocument *doc = &batch->docs[i];
+        w->output.len = 0;
+        if (jsonParse(w->backend, doc, payload, batch->lengths[i], error_text, sizeof(error_text)) == JSON_PARSE_OK) {
+            jsonSerialize(doc, NULL, 0, extra, extra_len, &w->output);
+        }
+        jsonRelease(doc);
+
+        jsonMember key, seq;
+        if (!jsonObjectFind(payload, batch->lengths[i], "key", 3, &key) || !jsonObjectFind(payload, batch->lengths[i], "seq", 3, &seq)) {
+            w->violations++;
+            continue;
+        }
+        int k = atoi(key.value + 2);    // "kN"
+        uint64_t s = strtoull(seq.value, NULL, 10) + 1;
+        int owner = -1;
+        if (!__atomic_compare_exchange_n(&w->owners[k], &owner, worker, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && owner != worker) {
+            w->violations++;
+        }
+        if (s <= w->last_seq[k]) {
+            w->violations++;
+        }
+        w->last_seq[k] = s;
+        w->processed++;
+    }
+}
+
+static uint64_t benchmarkRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Messages back to back, each NUL terminated like in the receive buffer. With skew, half of them
+// carry key 0.
+static char *benchmarkMessages(int skewed, uint32_t *offsets, uint32_t *lengths) {
+    size_t size = (size_t)DISPATCH_BENCHMARK_MESSAGES * 160;
+    char *buf = (char *)memAlloc(MEM_OTHER, size);
+    if (buf == NULL) {
+        return NULL;
+    }
+    uint64_t *seqs = (uint64_t *)memCalloc(MEM_OTHER, DISPATCH_BENCHMARK_KEYS, sizeof(uint64_t));
+    if (seqs == NULL) {
+        memFree(buf);
+        return NULL;
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    size_t len = 0;
+    for (int i = 0; i < DISPATCH_BENCHMARK_MESSAGES; i++) {
+        uint64_t r = benchmarkRandom(&state);
+        int k = skewed && (r & 1) ? 0 : (int)((r >> 1) % DISPATCH_BENCHMARK_KEYS);
+        offsets[i] = (uint32_t)len;
+        lengths[i] = (uint32_t)snprintf(buf + len, size - len,
+                "{\"message_id\":\"%08x-0000-4000-8000-%012llx\",\"key\":\"k%d\",\"seq\":%llu,\"value\":%llu}",
+                (unsigned)i, (unsigned long long)(r & 0xFFFFFFFFFFFFULL), k, (unsigned long long)seqs[k]++,
+                (unsigned long long)(r >> 20));
+        len += lengths[i] + 1;
+    }
+    memFree(seqs);
+    return buf;
+}
+
+static int benchmarkRun(int workers, int skewed, const char *buf, const uint32_t *offsets, const uint32_t *lengths,
+        double *rate, int report) {
+    orderKey key;
+    orderKeyInit(&key, "field:key");
+    benchmarkWorker *states = (benchmarkWorker *)memCalloc(MEM_OTHER, workers, sizeof(benchmarkWorker));
+    void **contexts = (void **)memCalloc(MEM_OTHER, workers, sizeof(void *));
+    int *owners = (int *)memAlloc(MEM_OTHER, DISPATCH_BENCHMARK_KEYS * sizeof(int));
+    messageBatch batch;
+    dispatcher d;
+    if (states == NULL || contexts == NULL || owners == NULL || messageBatchInit(&batch, PROCESS_BATCH_SIZE, workers) != 0) {
+        memFree(states);
+        memFree(contexts);
+        memFree(owners);
+        return -1;
+    }
+    for (int k = 0; k < DISPATCH_BENCHMARK_KEYS; k++) {
+        owners[k] = -1;
+    }
+    int res = 0;
+    for (int w = 0; w < workers; w++) {
+        states[w].worker = w;
+        states[w].backend = jsonDefaultBackend();
+        states[w].owners = owners;
+        states[w].last_seq = (uint64_t *)memCalloc(MEM_OTHER, DISPATCH_BENCHMARK_KEYS, sizeof(uint64_t));
+        res |= states[w].last_seq == NULL ? -1 : 0;
+        contexts[w] = &states[w];
+    }
+    if (res == 0 && dispatcherInit(&d, workers, &key, benchmarkWork, contexts) == 0) {
+        uint64_t start = monotonicNanos();
+        for (int i = 0; i < DISPATCH_BENCHMARK_MESSAGES; ) {
+            messageBatchReset(&batch, buf);
+            for (; i < DISPATCH_BENCHMARK_MESSAGES && batch.count < batch.capacity; i++) {
+                messageBatchAdd(&batch, buf + offsets[i], lengths[i]);
+                batch.status[batch.count - 1] = MESSAGE_PARSED;
+            }
+            dispatcherRoute(&d, &batch);
+            dispatcherRun(&d, &batch, 0);
+        }
+        *rate = DISPATCH_BENCHMARK_MESSAGES / ((monotonicNanos() - start) / 1e9);
+        if (report) {
+            dispatcherReport(&d);
+        }
+        dispatcherFree(&d);
+
+        uint64_t processed = 0, violations = 0;
+        for (int w = 0; w < workers; w++) {
+            processed += states[w].processed;
+            violations += states[w].violations;
+        }
+        if (processed != DISPATCH_BENCHMARK_MESSAGES || violations > 0) {
+            fprintf(stderr, "Dispatch order check failed with %d workers%s: %llu of %d messages processed, %llu out of order or on the wrong worker\n",
+                    workers, skewed ? " (skewed)" : "", (unsigned long long)processed, DISPATCH_BENCHMARK_MESSAGES,
+                    (unsigned long long)violations);
+            res = -1;
+        }
+    } else {
+        res = -1;
+    }
+    for (int w = 0; w < workers; w++) {
+        memFree(states[w].last_seq);
+        jsonBufferFree(&states[w].output);
+    }
+    messageBatchFree(&batch);
+    memFree(states);
+    memFree(contexts);
+    memFree(owners);
+    return res;
+}
+
+int dispatcherBenchmark(void) {
+    uint32_t *offsets = (uint32_t *)memAlloc(MEM_OTHER, DISPATCH_BENCHMARK_MESSAGES * sizeof(uint32_t));
+    uint32_t *lengths = (uint32_t *)memAlloc(MEM_OTHER, DISPATCH_BENCHMARK_MESSAGES * sizeof(uint32_t));
+    if (offsets == NULL || lengths == NULL) {
+        memFree(offsets);
+        memFree(lengths);
+        return -1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_workers = cpus > 0 && cpus * 2 < DISPATCH_MAX_WORKERS ? (int)cpus * 2 : DISPATCH_MAX_WORKERS;
+    int res = 0;
+    printf("Dispatching %d messages over %d keys, ordered by key, in batches of %d (%ld CPUs)\n",
+            DISPATCH_BENCHMARK_MESSAGES, DISPATCH_BENCHMARK_KEYS, PROCESS_BATCH_SIZE, cpus);
+    for (int skewed = 0; skewed < 2 && res == 0; skewed++) {
+        char *buf = benchmarkMessages(skewed, offsets, lengths);
+        if (buf == NULL) {
+            res = -1;
+            break;
+        }
+        double base = 0;
+        for (int workers = 1; workers <= max_workers && res == 0; workers *= 2) {
+            double rate = 0;
+            int last = workers * 2 > max_workers;
+            if (last) {
+                printf("%s keys, skew report at %d workers:\n", skewed ? "Skewed" : "Uniform", workers);
+            }
+            res = benchmarkRun(workers, skewed, buf, offsets, lengths, &rate, last);
+            base = workers == 1 ? rate : base;
+            if (res == 0) {
+                printf("%s keys, %2d workers: %.0f messages/s (%.2fx), per-key order held\n", skewed ? "Skewed" : "Uniform",
+                        workers, rate, rate / base);
+            }
+        }
+        memFree(buf);
+    }
+    memFree(offsets);
+    memFree(lengths);
+    return res;
+}
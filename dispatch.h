@@ -0,0 +1,95 @@
+#ifndef _DISPATCH_H
+#define _DISPATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "batch.h"
+
+// Spreads the messages of a batch over worker threads by an ordering key. Every message with
+// the same key hashes to the same worker, and each worker takes its messages in batch order, so
+// messages of one key are processed, and written, in the order they arrived while different keys
+// proceed in parallel. The calling thread is worker 0; the others wait for the next batch.
+//
+// Ordering keys:
+//   id               The message_id
+//   id-prefix:N      Its first N characters
+//   field:NAME       The raw value of a top level payload member, "null" when it is missing
+//
+// A key that carries a large share of the traffic pins that share to one worker, whatever the
+// worker count; the skew detector tracks the heaviest keys (Space-Saving) and the load of each
+// worker to show when that limits scaling.
+
+#define ORDER_KEY_ID 0
+#define ORDER_KEY_ID_PREFIX 1
+#define ORDER_KEY_FIELD 2
+
+#define DISPATCH_MAX_WORKERS 64
+#define DISPATCH_HOT_KEYS 16            // Heavy hitter counters; the top few are reported
+#define DISPATCH_HOT_KEY_SIZE 48        // Key text kept for the report
+#define DISPATCH_BENCHMARK_MESSAGES (1 << 18)
+#define DISPATCH_BENCHMARK_KEYS 1024
+
+// Work of one job. With a batch, handle the messages whose partition is worker; without one,
+// write out whatever is queued (DISPATCH_FORCE: regardless of flush deadlines).
+#define DISPATCH_FORCE 1
+typedef void (*dispatchFn)(void *ctx, messageBatch *batch, int worker, int flags);
+
+typedef struct {
+    int mode;
+    int prefix_len;
+    const char *field;
+    size_t field_len;
+} orderKey;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t count;
+    uint64_t error;                     // Over-estimate inherited from the key it replaced
+    char key[DISPATCH_HOT_KEY_SIZE];
+} hotKey;
+
+typedef struct {
+    hotKey keys[DISPATCH_HOT_KEYS];
+    int used;
+    uint64_t messages;                  // Since the last report
+    uint64_t worker_messages[DISPATCH_MAX_WORKERS];
+} skewDetector;
+
+typedef struct dispatcher {
+    int workers;
+    dispatchFn fn;
+    void **contexts;                    // One per worker
+    orderKey key;
+    skewDetector skew;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;                // Bumped for every job
+    int remaining;                      // Threads still busy with the current job
+    int stop;
+    messageBatch *batch;                // Current job
+    int flags;
+    uint64_t jobs;
+} dispatcher;
+
+// spec is "id", "id-prefix:N" or "field:NAME"; field names point into spec
+int orderKeyInit(orderKey *key, const char *spec);
+
+int dispatcherInit(dispatcher *d, int workers, const orderKey *key, dispatchFn fn, void **contexts);
+void dispatcherFree(dispatcher *d);
+// Sets the partition of every parsed message from its ordering key, and counts it for the skew report
+void dispatcherRoute(dispatcher *d, messageBatch *batch);
+// Runs fn on every worker and returns once all are done; batch NULL for a flush job
+void dispatcherRun(dispatcher *d, messageBatch *batch, int flags);
+// Worker load and the heaviest keys since the last report
+void dispatcherReport(dispatcher *d);
+
+// Checks per-key order under concurrency from 1 up to twice the CPU count of workers, with
+// uniform and with skewed keys, and reports throughput and the skew report. Returns -1 if any
+// key's messages were processed out of order or on more than one worker.
+int dispatcherBenchmark(void);
+
+#endif
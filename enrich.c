@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "enrich.h"
+#include "clock.h"
+#include "consumer.h"
+#include "memtrack.h"
+
+static uint64_t hashKey(const char *key, size_t len) {
+    // FNV-1a; 0 is reserved for free index slots
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static size_t buildKey(const enricher *e, const char *value, size_t len, char *key) {
+    size_t prefix_len = strlen(e->key_prefix);
+    if (prefix_len + len > ENRICH_MAX_KEY_SIZE) {
+        return 0;
+    }
+    memcpy(key, e->key_prefix, prefix_len);
+    memcpy(key + prefix_len, value, len);
+    return prefix_len + len;
+}
+
+static size_t findSlot(const enricher *e, uint64_t hash, const char *key, size_t len) {
+    size_t mask = e->index_capacity - 1;
+    size_t i = hash & mask;
+    while (e->hashes[i] != 0) {
+        const enrichEntry *entry = &e->entries[e->slots[i]];
+        if (e->hashes[i] == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Backward shift deletion: later members of the probe run move up so lookups never stop early
+static void indexRemove(enricher *e, size_t i) {
+    size_t mask = e->index_capacity - 1;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (e->hashes[j] == 0) {
+            break;
+        }
+        size_t home = e->hashes[j] & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            e->hashes[i] = e->hashes[j];
+            e->slots[i] = e->slots[j];
+            i = j;
+        }
+    }
+    e->hashes[i] = 0;
+}
+
+static void dropEntry(enricher *e, uint32_t n) {
+    enrichEntry *entry = &e->entries[n];
+    size_t i = findSlot(e, entry->hash, entry->key, entry->key_len);
+    if (e->hashes[i] != 0) {
+        indexRemove(e, i);
+    }
+    memFree(entry->key);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Without a working tracking connection invalidations may have been lost, so nothing cached can be trusted
+static void clearCache(enricher *e) {
+    for (size_t n = 0; n < e->max_entries; n++) {
+        if (e->entries[n].state == ENRICH_PENDING) {
+            e->entries[n].invalidated = 1;
+        } else if (e->entries[n].state == ENRICH_CACHED) {
+            dropEntry(e, (uint32_t)n);
+        }
+    }
+}
+
+static void handleInvalidation(enricher *e, const redisReply *reply) {
+    if (reply->type != REDIS_REPLY_PUSH || reply->elements < 2 || reply->element[0]->str == NULL
+            || strcmp(reply->element[0]->str, "invalidate") != 0) {
+        return;
+    }
+
+    // A nil key list means everything is invalid (FLUSHALL, or the server's tracking table overflowed)
+    const redisReply *keys = reply->element[1];
+    if (keys->type != REDIS_REPLY_ARRAY) {
+        e->invalidations++;
+        clearCache(e);
+        return;
+    }
+    for (size_t k = 0; k < keys->elements; k++) {
+        const redisReply *key = keys->element[k];
+        if (key->str == NULL) {
+            continue;
+        }
+        size_t i = findSlot(e, hashKey(key->str, key->len), key->str, key->len);
+        if (e->hashes[i] == 0) {
+            continue; // Evicted already
+        }
+        uint32_t n = e->slots[i];
+        e->invalidations++;
+        if (e->entries[n].state == ENRICH_PENDING) {
+            e->entries[n].invalidated = 1;
+        } else {
+            dropEntry(e, n);
+        }
+    }
+}
+
+static void handlePush(void *privdata, void *reply) {
+    handleInvalidation((enricher *)privdata, (redisReply *)reply);
+    freeReplyObject(reply);
+}
+
+// Handles replies hiredis already read past the last one we asked for
+static int drainPushes(enricher *e) {
+    int count = 0;
+    void *reply = NULL;
+    while (redisGetReplyFromReader(e->c, &reply) == REDIS_OK && reply != NULL) {
+        handleInvalidation(e, (redisReply *)reply);
+        freeReplyObject(reply);
+        reply = NULL;
+        count++;
+    }
+    return count;
+}
+
+static int enableTracking(enricher *e) {
+    redisReply *reply = redisCommand(e->c, "HELLO 3");
+    if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr, "Error switching the lookup connection to RESP3: %s\n", reply ? reply->str : e->c->errstr);
+        freeReplyObject(reply);
+        return -1;
+    }
+    freeReplyObject(reply);
+
+    reply = redisCommand(e->c, "CLIENT TRACKING ON");
+    if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr, "Error enabling client tracking: %s\n", reply ? reply->str : e->c->errstr);
+        freeReplyObject(reply);
+        return -1;
+    }
+    freeReplyObject(reply);
+
+    e->c->privdata = e;
+    redisSetPushCallback(e->c, handlePush);
+    return 0;
+}
+
+static int ensureConnected(enricher *e) {
+    if (e->c->err == 0) {
+        return 0;
+    }
+    clearCache(e);
+    if (redisReconnect(e->c) != REDIS_OK) {
+        return -1;
+    }
+    if (e->max_entries > 0 && enableTracking(e) != 0) {
+        e->c->err = REDIS_ERR;
+        return -1;
+    }
+    return 0;
+}
+
+int enricherInit(enricher *e, redisContext *c, const char *key_prefix, const char *fields, size_t max_entries) {
+    memset(e, 0, sizeof(*e));
+    e->c = c;
+    e->key_prefix = key_prefix;
+    e->max_entries = max_entries;
+
+    // The field names point into a private copy of the list
+    char *list = memStrdup(MEM_ENRICH, fields);
+    e->field_list = list;
+    if (list == NULL) {
+        return -1;
+    }
+    for (char *field = strtok(list, ","); field != NULL; field = strtok(NULL, ",")) {
+        if (e->field_count == ENRICH_MAX_FIELDS) {
+            fprintf(stderr, "Error: at most %d enrichment fields are supported\n", ENRICH_MAX_FIELDS);
+            return -1;
+        }
+        e->fields[e->field_count++] = field;
+    }
+    if (e->field_count == 0) {
+        fprintf(stderr, "Error: no enrichment fields given\n");
+        return -1;
+    }
+
+    if (max_entries == 0) {
+        return 0;
+    }
+    e->index_capacity = 1;
+    while (e->index_capacity < max_entries * 2) {
+        e->index_capacity <<= 1;
+    }
+    e->entries = (enrichEntry *)memCalloc(MEM_ENRICH, max_entries, sizeof(enrichEntry));
+    e->hashes = (uint64_t *)memCalloc(MEM_ENRICH, e->index_capacity, sizeof(uint64_t));
+    e->slots = (uint32_t *)memAlloc(MEM_ENRICH, e->index_capacity * sizeof(uint32_t));
+    e->pending = (uint32_t *)memAlloc(MEM_ENRICH, max_entries * sizeof(uint32_t));
+    if (e->entries == NULL || e->hashes == NULL || e->slots == NULL || e->pending == NULL) {
+        enricherFree(e);
+        return -1;
+    }
+    e->pending_capacity = max_entries;
+    return enableTracking(e);
+}
+
+void enricherFree(enricher *e) {
+    for (size_t n = 0; n < e->max_entries && e->entries != NULL; n++) {
+        memFree(e->entries[n].key);
+    }
+    memFree(e->field_list);
+    memFree(e->entries);
+    memFree(e->hashes);
+    memFree(e->slots);
+    memFree(e->pending);
+    memFree(e->scratch.key);
+    memset(e, 0, sizeof(*e));
+}
+
+// CLOCK: referenced entries get a second chance, pending ones are skipped until their reply is in
+static int allocateEntry(enricher *e) {
+    for (size_t sweep = 0; sweep < 2 * e->max_entries; sweep++) {
+        uint32_t n = (uint32_t)e->hand;
+        e->hand = (e->hand + 1) % e->max_entries;
+
+        enrichEntry *entry = &e->entries[n];
+        if (entry->state == ENRICH_FREE) {
+            return n;
+        }
+        if (entry->state == ENRICH_PENDING) {
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        dropEntry(e, n);
+        e->evictions++;
+        return n;
+    }
+    return -1;
+}
+
+static int requestEntry(enricher *e, const char *key, size_t key_len, uint64_t hash) {
+    int n = allocateEntry(e);
+    if (n < 0) {
+        return -1;
+    }
+    enrichEntry *entry = &e->entries[n];
+    entry->key = (char *)memAlloc(MEM_ENRICH, key_len);
+    if (entry->key == NULL) {
+        return -1;
+    }
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    entry->hash = hash;
+    entry->state = ENRICH_PENDING;
+    entry->referenced = 1;
+
+    // Eviction may have shifted the probe run, look the slot up again
+    size_t i = findSlot(e, hash, key, key_len);
+    e->hashes[i] = hash;
+    e->slots[i] = (uint32_t)n;
+    e->pending[e->pending_count++] = (uint32_t)n;
+    return n;
+}
+
+// Copies an HMGET reply behind the key; returns -1 if the reply is unusable
+static int fillEntry(enricher *e, enrichEntry *entry, const redisReply *reply) {
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != (size_t)e->field_count) {
+        return -1;
+    }
+    size_t size = entry->key_len;
+    for (int f = 0; f < e->field_count; f++) {
+        if (reply->element[f]->type == REDIS_REPLY_STRING) {
+            size += reply->element[f]->len + 1;
+        }
+    }
+    char *data = (char *)memRealloc(MEM_ENRICH, entry->key, size);
+    if (data == NULL) {
+        return -1;
+    }
+    entry->key = data;
+
+    char *p = data + entry->key_len;
+    for (int f = 0; f < e->field_count; f++) {
+        const redisReply *value = reply->element[f];
+        if (value->type != REDIS_REPLY_STRING) {
+            entry->values[f] = NULL;
+            entry->value_lens[f] = 0;
+            continue;
+        }
+        memcpy(p, value->str, value->len);
+        p[value->len] = '\0';
+        entry->values[f] = p;
+        entry->value_lens[f] = value->len;
+        p += value->len + 1;
+    }
+    entry->state = ENRICH_CACHED;
+    return 0;
+}
+
+static void hmgetArguments(const enricher *e, const enrichEntry *entry, const char **argv, size_t *argvlen) {
+    argv[0] = "HMGET";
+    argvlen[0] = 5;
+    argv[1] = entry->key;
+    argvlen[1] = entry->key_len;
+    for (int f = 0; f < e->field_count; f++) {
+        argv[f + 2] = e->fields[f];
+        argvlen[f + 2] = strlen(e->fields[f]);
+    }
+}
+
+void enricherPrefetch(enricher *e, const char *value, size_t len) {
+    char key[ENRICH_MAX_KEY_SIZE];
+    size_t key_len = buildKey(e, value, len, key);
+    if (e->max_entries == 0 || key_len == 0) {
+        return;
+    }
+
+    uint64_t hash = hashKey(key, key_len);
+    size_t i = findSlot(e, hash, key, key_len);
+    if (e->hashes[i] != 0) {
+        enrichEntry *entry = &e->entries[e->slots[i]];
+        if (entry->state == ENRICH_CACHED) {
+            entry->referenced = 1;
+            e->hits++;
+        } else {
+            e->coalesced++;
+        }
+        return;
+    }
+    e->misses++;
+    if (e->pending_count < e->pending_capacity) {
+        requestEntry(e, key, key_len, hash);
+    }
+}
+
+int enricherResolve(enricher *e) {
+    if (e->pending_count == 0) {
+        return 0;
+    }
+
+    uint64_t start = monotonicNanos();
+    const char *argv[ENRICH_MAX_FIELDS + 2];
+    size_t argvlen[ENRICH_MAX_FIELDS + 2];
+    size_t answered = 0;
+
+    if (ensureConnected(e) == 0) {
+        for (size_t p = 0; p < e->pending_count; p++) {
+            hmgetArguments(e, &e->entries[e->pending[p]], argv, argvlen);
+            redisAppendCommandArgv(e->c, e->field_count + 2, argv, argvlen);
+        }
+
+        // Invalidations interleaved with the replies are handled by the push callback
+        for (; answered < e->pending_count; answered++) {
+            uint32_t n = e->pending[answered];
+            redisReply *reply = NULL;
+            if (redisGetReply(e->c, (void **)&reply) != REDIS_OK) {
+                break;
+            }
+            // An entry invalidated before its reply arrived may hold a value older than the change
+            if (e->entries[n].invalidated || fillEntry(e, &e->entries[n], reply) != 0) {
+                if (!e->entries[n].invalidated) {
+                    e->failures++;
+                }
+                dropEntry(e, n);
+            }
+            freeReplyObject(reply);
+        }
+        e->round_trips++;
+        drainPushes(e);
+    }
+
+    int failed = (int)(e->pending_count - answered);
+    if (failed > 0) {
+        fprintf(stderr, "Error looking up enrichment data: %s\n", e->c->errstr);
+        for (size_t p = answered; p < e->pending_count; p++) {
+            dropEntry(e, e->pending[p]);
+        }
+        e->failures += failed;
+        clearCache(e);
+    }
+    e->pending_count = 0;
+    e->lookup_ns += monotonicNanos() - start;
+    return failed > 0 ? -1 : 0;
+}
+
+static const enrichEntry *uncachedLookup(enricher *e, const char *key, size_t key_len) {
+    const char *argv[ENRICH_MAX_FIELDS + 2];
+    size_t argvlen[ENRICH_MAX_FIELDS + 2];
+    enrichEntry *entry = &e->scratch;
+    uint64_t start = monotonicNanos();
+
+    memFree(entry->key);
+    memset(entry, 0, sizeof(*entry));
+    entry->key = (char *)memAlloc(MEM_ENRICH, key_len);
+    if (entry->key == NULL || ensureConnected(e) != 0) {
+        e->failures++;
+        return NULL;
+    }
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+
+    hmgetArguments(e, entry, argv, argvlen);
+    redisReply *reply = redisCommandArgv(e->c, e->field_count + 2, argv, argvlen);
+    e->misses++;
+    e->round_trips++;
+    int result = fillEntry(e, entry, reply);
+    freeReplyObject(reply);
+    e->lookup_ns += monotonicNanos() - start;
+    if (result != 0) {
+        e->failures++;
+        return NULL;
+    }
+    return entry;
+}
+
+const enrichEntry *enricherLookup(enricher *e, const char *value, size_t len) {
+    char key[ENRICH_MAX_KEY_SIZE];
+    size_t key_len = buildKey(e, value, len, key);
+    if (key_len == 0) {
+        e->failures++;
+        return NULL;
+    }
+    if (e->max_entries == 0) {
+        return uncachedLookup(e, key, key_len);
+    }
+
+    uint64_t hash = hashKey(key, key_len);
+    size_t i = findSlot(e, hash, key, key_len);
+    if (e->hashes[i] != 0 && e->entries[e->slots[i]].state == ENRICH_CACHED) {
+        return &e->entries[e->slots[i]];
+    }
+
+    // Not prefetched, or evicted or invalidated since: it costs a round trip of its own
+    e->late_misses++;
+    if (e->hashes[i] == 0 && requestEntry(e, key, key_len, hash) < 0) {
+        e->failures++;
+        return NULL;
+    }
+    enricherResolve(e);
+    i = findSlot(e, hash, key, key_len);
+    if (e->hashes[i] != 0 && e->entries[e->slots[i]].state == ENRICH_CACHED) {
+        return &e->entries[e->slots[i]];
+    }
+    return NULL;
+}
+
+int enricherPoll(enricher *e) {
+    if (e->c->err != 0) {
+        return 0; // Reconnected on the next lookup
+    }
+    if (redisBufferRead(e->c) != REDIS_OK) {
+        fprintf(stderr, "Error reading from the lookup connection: %s\n", e->c->errstr);
+        clearCache(e);
+        return -1;
+    }
+    return drainPushes(e);
+}
+
+void enricherReport(enricher *e, double seconds) {
+    uint64_t lookups = e->hits + e->misses + e->coalesced;
+    if (lookups == 0 && e->invalidations == 0) {
+        return;
+    }
+    printf("Enrichment: %.0f lookups/s, hit rate %.1f%%, %llu round trips (%llu for late misses), %.3f ms per round trip\n",
+            lookups / seconds, lookups ? 100.0 * e->hits / lookups : 0.0,
+            (unsigned long long)e->round_trips, (unsigned long long)e->late_misses,
+            e->round_trips ? e->lookup_ns / 1e6 / e->round_trips : 0.0);
+    printf("Enrichment cache: %.1f invalidations/s, %llu evictions, %llu failed lookups\n",
+            e->invalidations / seconds, (unsigned long long)e->evictions, (unsigned long long)e->failures);
+    e->hits = e->misses = e->coalesced = e->late_misses = 0;
+    e->invalidations = e->evictions = e->round_trips = e->lookup_ns = e->failures = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef _ENRICH_H
+#define _ENRICH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <hiredis.h>
+
+// Per-message metadata looked up in the hash <prefix><value of a message field>.
+// Hashes are cached locally with CLOCK eviction. The lookup connection speaks RESP3 with
+// CLIENT TRACKING on, so Redis pushes an invalidation whenever a cached hash changes and the
+// entry is dropped. Misses are not fetched one by one: enricherPrefetch() collects them while a
+// drain of messages is parsed and enricherResolve() fetches them with one pipelined round of HMGET.
+
+#define ENRICH_MAX_FIELDS 8
+#define ENRICH_MAX_KEY_SIZE 256
+
+// Cache entry states
+#define ENRICH_FREE 0
+#define ENRICH_PENDING 1  // Requested, HMGET not answered yet
+#define ENRICH_CACHED 2
+
+typedef struct {
+    char *key;             // Hash key, the values follow it in the same allocation
+    size_t key_len;
+    const char *values[ENRICH_MAX_FIELDS];  // NULL when the hash has no such field
+    size_t value_lens[ENRICH_MAX_FIELDS];
+    uint64_t hash;
+    uint8_t state;
+    uint8_t referenced;    // CLOCK bit, set on every hit
+    uint8_t invalidated;   // Invalidation arrived while pending; the reply may be stale
+} enrichEntry;
+
+typedef struct {
+    redisContext *c;
+    const char *key_prefix;
+    int field_count;
+    const char *fields[ENRICH_MAX_FIELDS];
+    char *field_list;      // Storage for the field names
+    enrichEntry *entries;
+    size_t max_entries;    // 0 disables the cache, every lookup is a blocking HMGET
+    size_t hand;           // CLOCK hand
+    uint64_t *hashes;      // Open addressing index over entries, 0 marks a free slot
+    uint32_t *slots;       // Entry number for each used hash
+    size_t index_capacity; // Power of two
+    uint32_t *pending;     // Entries waiting for the next enricherResolve
+    size_t pending_count;
+    size_t pending_capacity;
+    enrichEntry scratch;   // Result of the last uncached lookup
+    // Statistics since the last enricherReport
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;    // Requests for a hash already pending in the same drain
+    uint64_t late_misses;  // Lookups that were not prefetched (or evicted since) and needed their own round trip
+    uint64_t invalidations;
+    uint64_t evictions;
+    uint64_t round_trips;
+    uint64_t lookup_ns;
+    uint64_t failures;
+} enricher;
+
+// `fields` is a comma separated list of hash fields to fetch
+int enricherInit(enricher *e, redisContext *c, const char *key_prefix, const char *fields, size_t max_entries);
+void enricherFree(enricher *e);
+void enricherPrefetch(enricher *e, const char *value, size_t len);
+int enricherResolve(enricher *e);
+// Returns the cached hash for value, fetching it if it was not prefetched; NULL if the lookup failed.
+// The entry is valid until the next prefetch or lookup.
+const enrichEntry *enricherLookup(enricher *e, const char *value, size_t len);
+// Processes invalidations that arrived on the lookup connection; call when its fd is readable
+int enricherPoll(enricher *e);
+void enricherReport(enricher *e, double seconds);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hll.h"
+#include "clock.h"
+
+// Ranks run from 1 to 65 - HLL_PRECISION; 0 marks an empty register
+#define HLL_MAX_RANK (65 - HLL_PRECISION)
+
+void hllReset(hyperLogLog *hll) {
+    memset(hll->registers, 0, sizeof(hll->registers));
+}
+
+void hllMerge(hyperLogLog *dst, const hyperLogLog *src) {
+#ifdef __SSE2__
+    for (int i = 0; i < HLL_REGISTERS; i += 16) {
+        __m128i a = _mm_load_si128((const __m128i *)(dst->registers + i));
+        __m128i b = _mm_load_si128((const __m128i *)(src->registers + i));
+        _mm_store_si128((__m128i *)(dst->registers + i), _mm_max_epu8(a, b));
+    }
+#else
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        if (src->registers[i] > dst->registers[i]) {
+            dst->registers[i] = src->registers[i];
+        }
+    }
+#endif
+}
+
+double hllEstimate(const hyperLogLog *hll) {
+    // Registers holding each rank, then the sum of 2^-rank from the counts
+    uint32_t counts[HLL_MAX_RANK + 1] = { 0 };
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        counts[hll->registers[i]]++;
+    }
+    double sum = 0;
+    for (int rank = HLL_MAX_RANK; rank >= 0; rank--) {
+        sum = sum * 0.5 + counts[rank];
+    }
+    double m = HLL_REGISTERS;
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Few distinct hashes leave many registers empty: linear counting is more accurate there
+    if (estimate <= 2.5 * m && counts[0] > 0) {
+        estimate = m * log(m / counts[0]);
+    }
+    return estimate;
+}
+
+// Benchmark
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+int hllBenchmark(void) {
+    hyperLogLog *sketches = (hyperLogLog *)aligned_alloc(64, 2 * sizeof(hyperLogLog));
+    uint64_t *hashes = (uint64_t *)malloc(HLL_BENCHMARK_HASHES * sizeof(uint64_t));
+    if (sketches == NULL || hashes == NULL) {
+        fprintf(stderr, "Error allocating the HyperLogLog benchmark\n");
+        free(sketches);
+        free(hashes);
+        return -1;
+    }
+    uint64_t state = 1;
+    for (int i = 0; i < HLL_BENCHMARK_HASHES; i++) {
+        hashes[i] = splitmix64(&state);
+    }
+
+    int rounds = 32;
+    hllReset(&sketches[0]);
+    uint64_t start = monotonicNanos();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < HLL_BENCHMARK_HASHES; i++) {
+            hllAdd(&sketches[0], hashes[i]);
+        }
+    }
+    double add_ns = (double)(monotonicNanos() - start) / ((double)rounds * HLL_BENCHMARK_HASHES);
+
+    int merges = 10000;
+    hllReset(&sketches[1]);
+    start = monotonicNanos();
+    for (int r = 0; r < merges; r++) {
+        hllMerge(&sketches[1], &sketches[r & 1]);
+    }
+    double merge_ns = (double)(monotonicNanos() - start) / merges;
+
+    int estimates = 1000;
+    double sink = 0;
+    start = monotonicNanos();
+    for (int r = 0; r < estimates; r++) {
+        sink += hllEstimate(&sketches[r & 1]);
+    }
+    double estimate_ns = (double)(monotonicNanos() - start) / estimates;
+    printf("HyperLogLog, %d registers: add %.2f ns, merge %.0f ns, estimate %.1f us (%.0f)\n", HLL_REGISTERS,
+            add_ns, merge_ns, estimate_ns / 1e3, sink / estimates);
+
+    // Accuracy, with the distinct hashes repeated as duplicates would be
+    int res = 0;
+    double limit = 4 * 1.04 / sqrt(HLL_REGISTERS);
+    for (uint64_t distinct = 1000; distinct <= 10000000; distinct *= 10) {
+        hllReset(&sketches[0]);
+        for (int copy = 0; copy < 2; copy++) {
+            state = distinct;
+            for (uint64_t n = 0; n < distinct; n++) {
+                hllAdd(&sketches[0], splitmix64(&state));
+            }
+        }
+        double estimate = hllEstimate(&sketches[0]);
+        double error = (estimate - distinct) / distinct;
+        printf("%llu distinct: estimated %.0f (%+.2f%%)\n", (unsigned long long)distinct, estimate, error * 100);
+        if (fabs(error) > limit) {
+            res = -1;
+        }
+    }
+    free(sketches);
+    free(hashes);
+    return res;
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hugemem.h"
+#include "memtrack.h"
+
+#define HUGE_BASE_PAGE_SIZE 4096
+
+static int global_huge_mode = HUGE_PAGES_OFF;
+static int global_huge_lock = 0;
+static int global_explicit_warned = 0;
+static int global_lock_warned = 0;
+// Bytes of the regions mapped so far, by backing
+static size_t global_explicit_bytes = 0;
+static size_t global_transparent_bytes = 0;
+static size_t global_locked_bytes = 0;
+
+static const char *mode_names[] = { "off", "transparent", "explicit" };
+
+void hugeMemConfigure(int mode, int lock) {
+    global_huge_mode = mode;
+    global_huge_lock = lock;
+}
+
+int hugeMemMode(const char *name) {
+    for (int mode = HUGE_PAGES_OFF; mode <= HUGE_PAGES_EXPLICIT; mode++) {
+        if (strcmp(name, mode_names[mode]) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+const char *hugeMemModeName(void) {
+    return mode_names[global_huge_mode];
+}
+
+// Regions come from mmap whenever they are on huge pages or locked; otherwise from malloc
+static int mapped(void) {
+    return global_huge_mode != HUGE_PAGES_OFF || global_huge_lock;
+}
+
+size_t hugeRoundSize(size_t size) {
+    if (!mapped()) {
+        return size;
+    }
+    size_t page = global_huge_mode != HUGE_PAGES_OFF ? HUGE_PAGE_SIZE : HUGE_BASE_PAGE_SIZE;
+    size = size > 0 ? size : 1;
+    return (size + page - 1) / page * page;
+}
+
+static void warnOnce(int *warned, const char *what) {
+    if (!*warned) {
+        *warned = 1;
+        fprintf(stderr, "Warning: %s: %s\n", what, strerror(errno));
+    }
+}
+
+// Transparent huge pages only back 2 MiB aligned ranges, so map a page more and trim
+static void *mapTransparent(size_t size) {
+    char *p = (char *)mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > p) {
+        munmap(p, aligned - p);
+    }
+    munmap(aligned + size, p + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    global_transparent_bytes += size;
+    return aligned;
+}
+
+void *hugeAlloc(int tag, size_t size) {
+    if (!mapped()) {
+        return memCalloc(tag, 1, size);
+    }
+    size = hugeRoundSize(size);
+    void *p = NULL;
+    if (global_huge_mode == HUGE_PAGES_EXPLICIT) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            warnOnce(&global_explicit_warned, "explicit huge pages unavailable, using transparent huge pages");
+            p = NULL;
+        } else {
+            global_explicit_bytes += size;
+        }
+    }
+    if (p == NULL && global_huge_mode != HUGE_PAGES_OFF) {
+        p = mapTransparent(size);
+    } else if (p == NULL) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        p = p != MAP_FAILED ? p : NULL;
+    }
+    if (p != NULL && global_huge_lock) {
+        // Faults every page in now
+        if (mlock(p, size) == 0) {
+            global_locked_bytes += size;
+        } else {
+            warnOnce(&global_lock_warned, "locking memory failed (see ulimit -l)");
+        }
+    }
+    if (p != NULL) {
+        memCharge(tag, (int64_t)size);
+    }
+    return p;
+}
+
+void *hugeRealloc(int tag, void *p, size_t old_size, size_t size) {
+    if (!mapped()) {
+        return memRealloc(tag, p, size);
+    }
+    if (p != NULL && hugeRoundSize(old_size) == hugeRoundSize(size)) {
+        return p;
+    }
+    void *q = hugeAlloc(tag, size);
+    if (q != NULL && p != NULL) {
+        memcpy(q, p, old_size < size ? old_size : size);
+        hugeFree(tag, p, old_size);
+    }
+    return q;
+}
+
+void hugeFree(int tag, void *p, size_t size) {
+    if (p == NULL) {
+        return;
+    }
+    if (!mapped()) {
+        memFree(p);
+        return;
+    }
+    munmap(p, hugeRoundSize(size));
+    memCharge(tag, -(int64_t)hugeRoundSize(size));
+}
+
+void hugeAdvise(void *p, size_t size) {
+    if (global_huge_mode != HUGE_PAGES_OFF) {
+        madvise(p, size, MADV_HUGEPAGE);
+    }
+    if (global_huge_lock) {
+        if (mlock(p, size) == 0) {
+            global_locked_bytes += size;
+        } else {
+            warnOnce(&global_lock_warned, "locking memory failed (see ulimit -l)");
+        }
+    }
+}
+
+// Sums a "Name:   N kB" line of /proc/self/smaps_rollup
+static long smapsKilobytes(const char *field) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    size_t len = strlen(field);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kb = atol(line + len + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+void hugeMemReport(void) {
+    if (!mapped()) {
+        return;
+    }
+    printf("Huge pages %s: %.1f MiB on explicit huge pages, %.1f MiB advised for transparent ones",
+            hugeMemModeName(), global_explicit_bytes / 1048576.0, global_transparent_bytes / 1048576.0);
+    long backed = smapsKilobytes("AnonHugePages");
+    if (backed >= 0) {
+        printf(" (%.1f MiB backed)", backed / 1024.0);
+    }
+    printf(", %.1f MiB locked\n", global_locked_bytes / 1048576.0);
+}
+
+int hugeTlbCounterOpen(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t hugeTlbCounterRead(int fd) {
+    uint64_t count = 0;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
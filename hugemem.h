@@ -0,0 +1,44 @@
+#ifndef _HUGEMEM_H
+#define _HUGEMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memtrack.h"
+
+// Backing for the large, randomly accessed regions: the dedup hot table, the receive buffer and
+// the message batch columns. With 4 KiB pages nearly every dedup lookup also misses the TLB and
+// walks the page tables; a 2 MiB page covers 512 times as much memory per TLB entry. Regions are
+// then mmap'd in whole huge pages, either explicitly from the reserved hugetlb pool
+// (vm.nr_hugepages), falling back to transparent huge pages when the pool is empty, or
+// transparently only, with madvise(MADV_HUGEPAGE) on 2 MiB aligned memory. Locking pre-faults
+// each region and pins it, so the hot path takes no page faults. With huge pages off the regions
+// come from malloc as before.
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define HUGE_PAGES_OFF 0
+#define HUGE_PAGES_TRANSPARENT 1
+#define HUGE_PAGES_EXPLICIT 2
+
+// Call before the first hugeAlloc; regions keep the backing they were allocated with
+void hugeMemConfigure(int mode, int lock);
+int hugeMemMode(const char *name);
+const char *hugeMemModeName(void);
+
+// Size actually mapped for a request, all of which may be used
+size_t hugeRoundSize(size_t size);
+// Zeroed, like calloc, and accounted to tag (see memtrack.h)
+void *hugeAlloc(int tag, size_t size);
+void *hugeRealloc(int tag, void *p, size_t old_size, size_t size);
+void hugeFree(int tag, void *p, size_t size);
+// For mappings made elsewhere, such as shared memory: advises and locks them like hugeAlloc
+void hugeAdvise(void *p, size_t size);
+// Bytes per backing, and how much the kernel actually put on huge pages
+void hugeMemReport(void);
+
+// dTLB load misses of this process, from perf_event_open; -1 when the CPU or VM has no such counter
+int hugeTlbCounterOpen(void);
+uint64_t hugeTlbCounterRead(int fd);
+
+#endif
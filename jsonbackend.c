@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#include "jsonbackend.h"
+#include "memtrack.h"
+#include "jsonscan.h"
+#include "clock.h"
+#ifdef HAVE_SIMDJSON
+#include "simdjson_shim.h"
+#endif
+
+// Describes a payload a backend rejected the way jansson would, so the dead-letter stream does
+// not depend on the backend
+static int parseFailure(jsonDocument *doc, char *error_text, size_t error_size) {
+    json_error_t error;
+    json_t *root = json_loadb(doc->json, doc->len, 0, &error);
+    if (root != NULL) {
+        int object = json_is_object(root);
+        json_decref(root);
+        if (!object) {
+            snprintf(error_text, error_size, "JSON value is not an object");
+            return JSON_PARSE_NOT_OBJECT;
+        }
+        snprintf(error_text, error_size, "Rejected by the %s JSON backend", doc->backend->name);
+        return JSON_PARSE_INVALID;
+    }
+    snprintf(error_text, error_size, "Error parsing JSON on line %d: %s", error.line, error.text);
+    return JSON_PARSE_INVALID;
+}
+
+// jansson: the DOM reference
+
+static int janssonParse(jsonDocument *doc, char *error_text, size_t error_size) {
+    json_error_t error;
+    json_t *root = json_loadb(doc->json, doc->len, 0, &error);
+    if (root == NULL) {
+        snprintf(error_text, error_size, "Error parsing JSON on line %d: %s", error.line, error.text);
+        return JSON_PARSE_INVALID;
+    }
+    doc->handle = root;
+    if (!json_is_object(root)) {
+        snprintf(error_text, error_size, "JSON value is not an object");
+        return JSON_PARSE_NOT_OBJECT;
+    }
+    return JSON_PARSE_OK;
+}
+
+static int janssonGetString(jsonDocument *doc, const char *key, char *buf, size_t size, size_t *len) {
+    json_t *value = json_object_get((json_t *)doc->handle, key);
+    if (value == NULL) {
+        return 0;
+    }
+    if (!json_is_string(value) || json_string_length(value) >= size) {
+        return -1;
+    }
+    *len = json_string_length(value);
+    memcpy(buf, json_string_value(value), *len);
+    buf[*len] = '\0';
+    return 1;
+}
+
+static int janssonIterate(jsonDocument *doc, jsonMemberFn fn, void *ctx) {
+    const char *key;
+    json_t *value;
+    json_object_foreach((json_t *)doc->handle, key, value) {
+        char *raw = json_dumps(value, JSON_COMPACT | JSON_ENCODE_ANY);
+        if (raw == NULL) {
+            return -1;
+        }
+        int res = fn(ctx, key, strlen(key), raw, strlen(raw));
+        memFree(raw); // jansson allocates through memtrack, see memTrackHooks
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+static long janssonSerialize(jsonDocument *doc, const char **remove, int remove_count, const char *append, size_t append_len, jsonBuffer *out) {
+    json_t *root = (json_t *)doc->handle;
+    for (int i = 0; i < remove_count; i++) {
+        json_object_del(root, remove[i]);
+    }
+    if (append_len > 0) {
+        char *wrapped = (char *)memAlloc(MEM_JSON, append_len + 2);
+        if (wrapped == NULL) {
+            return -1;
+        }
+        wrapped[0] = '{';
+        memcpy(wrapped + 1, append, append_len);
+        wrapped[append_len + 1] = '}';
+        json_t *members = json_loadb(wrapped, append_len + 2, 0, NULL);
+        memFree(wrapped);
+        int res = members != NULL ? json_object_update(root, members) : -1;
+        json_decref(members);
+        if (res != 0) {
+            return -1;
+        }
+    }
+
+    size_t len = json_dumpb(root, NULL, 0, JSON_COMPACT);
+    if (len == 0 || jsonBufferReserve(out, out->len + len + 1) != 0) {
+        return -1;
+    }
+    json_dumpb(root, out->buf + out->len, len, JSON_COMPACT);
+    out->len += len;
+    out->buf[out->len] = '\0';
+    return len;
+}
+
+static void janssonRelease(jsonDocument *doc) {
+    if (doc->handle != NULL) {
+        json_decref((json_t *)doc->handle);
+    }
+}
+
+// scan: one validating pass that indexes the first members, output spliced into the input
+
+static int scanParse(jsonDocument *doc, char *error_text, size_t error_size) {
+    jsonObjectScan scan;
+    jsonMember member;
+    int res = -1;
+    if (jsonObjectBegin(&scan, doc->json, doc->len) == 0) {
+        while ((res = jsonObjectNext(&scan, &member)) == 1) {
+            if (doc->member_count < JSON_DOCUMENT_MAX_MEMBERS) {
+                doc->members[doc->member_count] = member;
+            }
+            doc->member_count++;
+        }
+    }
+    return res < 0 ? parseFailure(doc, error_text, error_size) : JSON_PARSE_OK;
+}
+
+static int scanGetString(jsonDocument *doc, const char *key, char *buf, size_t size, size_t *len) {
+    size_t key_len = strlen(key);
+    jsonMember member;
+    int found = 0;
+    if (doc->member_count <= JSON_DOCUMENT_MAX_MEMBERS) {
+        for (long i = doc->member_count - 1; i >= 0 && !found; i--) {
+            if (jsonKeyEquals(&doc->members[i], key, key_len)) {
+                member = doc->members[i];
+                found = 1;
+            }
+        }
+    } else {
+        found = jsonObjectFind(doc->json, doc->len, key, key_len, &member);
+    }
+    if (!found) {
+        return 0;
+    }
+    // The decoded string is never longer than its escaped form
+    if (jsonValueKind(member.value) != JSON_KIND_STRING || member.value_len - 2 >= size) {
+        return -1;
+    }
+    *len = jsonStringValue(member.value, member.value_len, buf);
+    buf[*len] = '\0';
+    return 1;
+}
+
+static int scanVisit(const jsonMember *member, jsonMemberFn fn, void *ctx) {
+    char local[256];
+    char *decoded = NULL;
+    const char *key = member->key;
+    size_t key_len = member->key_len;
+    if (memchr(member->key, '\\', member->key_len) != NULL) {
+        decoded = member->key_len <= sizeof(local) ? local : (char *)memAlloc(MEM_JSON, member->key_len);
+        if (decoded == NULL) {
+            return -1;
+        }
+        key_len = jsonStringValue(member->key - 1, member->key_len + 2, decoded);
+        key = decoded;
+    }
+    int res = fn(ctx, key, key_len, member->value, member->value_len);
+    if (decoded != local) {
+        memFree(decoded);
+    }
+    return res;
+}
+
+static int scanIterate(jsonDocument *doc, jsonMemberFn fn, void *ctx) {
+    int res;
+    if (doc->member_count <= JSON_DOCUMENT_MAX_MEMBERS) {
+        for (long i = 0; i < doc->member_count; i++) {
+            if ((res = scanVisit(&doc->members[i], fn, ctx)) != 0) {
+                return res;
+            }
+        }
+        return 0;
+    }
+
+    jsonObjectScan scan;
+    jsonMember member;
+    jsonObjectBegin(&scan, doc->json, doc->len);
+    while (jsonObjectNext(&scan, &member) == 1) {
+        if ((res = scanVisit(&member, fn, ctx)) != 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+static long scanSerialize(jsonDocument *doc, const char **remove, int remove_count, const char *append, size_t append_len, jsonBuffer *out) {
+    if (jsonBufferReserve(out, out->len + doc->len + append_len + 2) != 0) {
+        return -1;
+    }
+    long len = jsonObjectSplice(doc->json, doc->len, remove, remove_count, append, append_len, out->buf + out->len);
+    if (len == JSON_SPLICE_UNSUPPORTED) {
+        // Duplicate or escaped keys: let jansson resolve them
+        jsonDocument dom;
+        char error_text[128];
+        len = -1;
+        if (jsonParse(jsonBackendByName("jansson"), &dom, doc->json, doc->len, error_text, sizeof(error_text)) == JSON_PARSE_OK) {
+            len = janssonSerialize(&dom, remove, remove_count, append, append_len, out);
+        }
+        jsonRelease(&dom);
+        return len;
+    }
+    if (len < 0) {
+        return -1;
+    }
+    out->len += len;
+    return len;
+}
+
+static void scanRelease(jsonDocument *doc) {
+    (void)doc;
+}
+
+#ifdef HAVE_SIMDJSON
+// simdjson: members collected by the On-Demand shim, output rebuilt from their raw values
+
+// Copies bytes the shim left in its per-thread buffers into the document's block
+static const char *keepText(const jsonDocument *doc, const char *p, size_t len, char **text) {
+    if (p >= doc->json && p < doc->json + doc->len) {
+        return p;
+    }
+    memcpy(*text, p, len);
+    *text += len;
+    return *text - len;
+}
+
+static int simdjsonParse(jsonDocument *doc, char *error_text, size_t error_size) {
+    const simdjsonMember *members;
+    long count = simdjsonParseObject(doc->json, doc->len, &members, error_text, error_size);
+    if (count < 0) {
+        return parseFailure(doc, error_text, error_size);
+    }
+
+    // The shim's buffers are reused by the next parse, while a batch holds all its documents
+    // parsed at once: each document keeps its members, keys and unescaped strings in one block
+    size_t size = count * sizeof(simdjsonMember) + 1;
+    for (long i = 0; i < count; i++) {
+        size += members[i].key_len + (members[i].string != NULL ? members[i].string_len : 0);
+    }
+    simdjsonMember *copy = (simdjsonMember *)memAlloc(MEM_JSON, size);
+    if (copy == NULL) {
+        snprintf(error_text, error_size, "Out of memory parsing JSON");
+        return JSON_PARSE_INVALID;
+    }
+    char *text = (char *)(copy + count);
+    for (long i = 0; i < count; i++) {
+        copy[i] = members[i];
+        copy[i].key = keepText(doc, members[i].key, members[i].key_len, &text);
+        if (members[i].string != NULL) {
+            copy[i].string = keepText(doc, members[i].string, members[i].string_len, &text);
+        }
+    }
+    doc->handle = copy;
+    doc->member_count = count;
+    return JSON_PARSE_OK;
+}
+
+static int simdjsonGetString(jsonDocument *doc, const char *key, char *buf, size_t size, size_t *len) {
+    const simdjsonMember *members = (const simdjsonMember *)doc->handle;
+    size_t key_len = strlen(key);
+    for (long i = doc->member_count - 1; i >= 0; i--) {
+        const simdjsonMember *m = &members[i];
+        if (m->key_len == key_len && memcmp(m->key, key, key_len) == 0) {
+            if (m->string == NULL || m->string_len >= size) {
+                return -1;
+            }
+            memcpy(buf, m->string, m->string_len);
+            buf[m->string_len] = '\0';
+            *len = m->string_len;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int simdjsonIterate(jsonDocument *doc, jsonMemberFn fn, void *ctx) {
+    const simdjsonMember *members = (const simdjsonMember *)doc->handle;
+    for (long i = 0; i < doc->member_count; i++) {
+        int res = fn(ctx, members[i].key, members[i].key_len, members[i].value, members[i].value_len);
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+static int sameKey(const simdjsonMember *a, const char *key, size_t key_len) {
+    return a->key_len == key_len && memcmp(a->key, key, key_len) == 0;
+}
+
+static long simdjsonSerialize(jsonDocument *doc, const char **remove, int remove_count, const char *append, size_t append_len, jsonBuffer *out) {
+    const simdjsonMember *members = (const simdjsonMember *)doc->handle;
+    size_t size = append_len + 4;
+    for (long i = 0; i < doc->member_count; i++) {
+        size += 6 * members[i].key_len + members[i].value_len + 4;
+    }
+    if (jsonBufferReserve(out, out->len + size) != 0) {
+        return -1;
+    }
+
+    char *start = out->buf + out->len;
+    char *p = start;
+    int written = 0;
+    *p++ = '{';
+    for (long i = 0; i < doc->member_count; i++) {
+        const simdjsonMember *m = &members[i];
+        int skip = 0;
+        for (int r = 0; r < remove_count && !skip; r++) {
+            skip = sameKey(m, remove[r], strlen(remove[r]));
+        }
+        // With duplicate keys the last one wins, like jansson
+        for (long j = i + 1; j < doc->member_count && !skip; j++) {
+            skip = sameKey(&members[j], m->key, m->key_len);
+        }
+        if (skip) {
+            continue;
+        }
+        if (written++ > 0) {
+            *p++ = ',';
+        }
+        p += jsonWriteString(p, m->key, m->key_len);
+        *p++ = ':';
+        memcpy(p, m->value, m->value_len);
+        p += m->value_len;
+    }
+    if (append_len > 0) {
+        if (written > 0) {
+            *p++ = ',';
+        }
+        memcpy(p, append, append_len);
+        p += append_len;
+    }
+    *p++ = '}';
+    *p = '\0';
+    out->len += p - start;
+    return p - start;
+}
+
+static void simdjsonRelease(jsonDocument *doc) {
+    memFree(doc->handle);
+}
+#endif
+
+static const jsonBackend backends[] = {
+    { "scan", scanParse, scanGetString, scanIterate, scanSerialize, scanRelease },
+    { "jansson", janssonParse, janssonGetString, janssonIterate, janssonSerialize, janssonRelease },
+#ifdef HAVE_SIMDJSON
+    { "simdjson", simdjsonParse, simdjsonGetString, simdjsonIterate, simdjsonSerialize, simdjsonRelease },
+#endif
+};
+
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+const jsonBackend *jsonBackendByName(const char *name) {
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (strcmp(backends[i].name, name) == 0) {
+            return &backends[i];
+        }
+    }
+    return NULL;
+}
+
+const jsonBackend *jsonDefaultBackend(void) {
+    return &backends[0];
+}
+
+const char *jsonBackendNames(void) {
+#ifdef HAVE_SIMDJSON
+    return "scan, jansson, simdjson";
+#else
+    return "scan, jansson";
+#endif
+}
+
+int jsonParse(const jsonBackend *backend, jsonDocument *doc, const char *json, size_t len, char *error_text, size_t error_size) {
+    doc->backend = backend;
+    doc->json = json;
+    doc->len = len;
+    doc->handle = NULL;
+    doc->member_count = 0;
+    return backend->parse(doc, error_text, error_size);
+}
+
+int jsonGetString(jsonDocument *doc, const char *key, char *buf, size_t size, size_t *len) {
+    return doc->backend->getString(doc, key, buf, size, len);
+}
+
+int jsonIterate(jsonDocument *doc, jsonMemberFn fn, void *ctx) {
+    return doc->backend->iterate(doc, fn, ctx);
+}
+
+long jsonSerialize(jsonDocument *doc, const char **remove, int remove_count, const char *append, size_t append_len, jsonBuffer *out) {
+    return doc->backend->serialize(doc, remove, remove_count, append, append_len, out);
+}
+
+void jsonRelease(jsonDocument *doc) {
+    doc->backend->release(doc);
+    doc->handle = NULL;
+}
+
+// Benchmark
+
+typedef struct {
+    char **lines;
+    size_t *lens;
+    long count;
+    size_t bytes;
+} jsonCorpus;
+
+static int countMember(void *ctx, const char *key, size_t key_len, const char *value, size_t value_len) {
+    (void)key;
+    (void)key_len;
+    (void)value;
+    *(size_t *)ctx += value_len;
+    return 0;
+}
+
+// Keeps the benchmarked results observable so the work is not optimized away
+static volatile size_t benchmark_sink;
+
+// Runs passes over the corpus until JSON_BENCHMARK_NS elapsed; returns the nanoseconds per pass
+static double benchmarkPasses(const jsonBackend *backend, const jsonCorpus *corpus, int full, jsonBuffer *out, long *rejected) {
+    const char *remove[] = { "consumer_id" };
+    const char *append = "\"consumer_id\":1";
+    char error_text[256];
+    char id[256];
+    size_t id_len;
+    size_t sink = 0;
+    long passes = 0;
+    uint64_t start = monotonicNanos();
+    uint64_t elapsed;
+    *rejected = 0;
+    do {
+        for (long i = 0; i < corpus->count; i++) {
+            jsonDocument doc;
+            if (jsonParse(backend, &doc, corpus->lines[i], corpus->lens[i], error_text, sizeof(error_text)) != JSON_PARSE_OK) {
+                (*rejected)++;
+            } else if (full) {
+                out->len = 0;
+                jsonGetString(&doc, "message_id", id, sizeof(id), &id_len);
+                jsonIterate(&doc, countMember, &sink);
+                sink += jsonSerialize(&doc, remove, 1, append, strlen(append), out);
+            }
+            jsonRelease(&doc);
+        }
+        passes++;
+        elapsed = monotonicNanos() - start;
+    } while (elapsed < JSON_BENCHMARK_NS);
+    *rejected /= passes;
+    benchmark_sink = sink;
+    return (double)elapsed / passes;
+}
+
+// Differential check against jansson
+
+// Payloads on which backends are most likely to part ways, checked along with the corpus
+static const char *differential_cases[] = {
+    "{}", " {\n} ", "{\"message_id\":\"6f1c2b1e-5d3a-4c8e-9b0a-1f2e3d4c5b6a\",\"consumer_id\":3}",
+    "{\"message_id\":\"a\",\"message_id\":\"b\"}", "{\"consumer_id\":1,\"x\":1,\"consumer_id\":2}",
+    "{\"message_id\":\"\\u00e9\\ud83d\\ude00\\n\\\"\\/\"}", "{\"message_id\":\"\\ud800\"}", "{\"message_id\":\"\\udc00x\"}",
+    "{\"a\\u0062\":1,\"ab\":2}", "{\"\\u0063onsumer_id\":5}", "{\"message_id\":1}", "{\"message_id\":null}",
+    "{\"message_id\":[\"a\"]}", "{\"n\":-0,\"e\":1E+2,\"f\":-1.5e-3,\"g\":0.0}", "{\"big\":123456789012345678901234567890}",
+    "{\"n\":01}", "{\"n\":1.}", "{\"n\":.5}", "{\"n\":1e}", "{\"n\":+1}", "{\"n\":-}", "{\"n\":1e400}", "{\"n\":-1e400}", "{\"n\":1e-400}",
+    "{\"n\":9223372036854775807,\"m\":-9223372036854775808}", "{\"n\":9223372036854775808}", "{\"n\":-9223372036854775809}",
+    "{\"s\":\"\\x\"}", "{\"s\":\"\\u12\"}", "{\"s\":\"tab\there\"}", "{\"s\":\"\\u0000\"}", "{\"s\":\"\xc3\xa9\"}",
+    "{\"s\":\"\xc3\"}", "{\"s\":\"\xed\xa0\x80\"}", "{\"s\":\"\xf4\x90\x80\x80\"}", "{\"s\":\"\xc0\xaf\"}",
+    "{\"a\":[1,{\"b\":[]}],\"c\":{\"d\":{\"e\":[[[]]]}}}", "{\"a\":[1,]}", "{\"a\":{\"b\":1,}}",
+    "{\"a\":1,}", "{,}", "{\"a\":1", "{\"a\" 1}", "{\"a\":}", "{a:1}", "{'a':1}", "{\"a\":1}x", "{\"a\":1}{}",
+    "{\"a\":1}\n", "[1,2,3]", "\"message_id\"", "42", "null", "", "   ", "{\"a\":tru}", "{\"a\":nul}",
+    "{\"a\":true,\"b\":false,\"c\":null}", "{\"x\":1,\"consumer_id\":7}",
+};
+
+#define DIFFERENTIAL_CASE_COUNT (sizeof(differential_cases) / sizeof(differential_cases[0]))
+
+// Members as a jansson object, so raw values compare whatever their formatting
+static int collectMember(void *ctx, const char *key, size_t key_len, const char *value, size_t value_len) {
+    char local[256];
+    char *k = key_len < sizeof(local) ? local : (char *)memAlloc(MEM_JSON, key_len + 1);
+    json_t *v = json_loadb(value, value_len, JSON_DECODE_ANY, NULL);
+    int res = -1;
+    if (k != NULL && v != NULL) {
+        memcpy(k, key, key_len);
+        k[key_len] = '\0';
+        res = json_object_set_new((json_t *)ctx, k, v);
+        v = NULL;
+    }
+    json_decref(v);
+    if (k != local) {
+        memFree(k);
+    }
+    return res;
+}
+
+// Serializes the document the way a processed message is built and reloads it with jansson
+static json_t *reloadSerialized(jsonDocument *doc, jsonBuffer *out) {
+    const char *remove[] = { "consumer_id" };
+    const char *append = "\"consumer_id\":1";
+    out->len = 0;
+    long len = jsonSerialize(doc, remove, 1, append, strlen(append), out);
+    return len < 0 ? NULL : json_loadb(out->buf, len, 0, NULL);
+}
+
+// Compares everything message processing asks of a backend with jansson's answer. Returns what
+// differs, or NULL. The documents are modified.
+static const char *differentialCompare(jsonDocument *doc, int res, const char *error, jsonDocument *ref, int ref_res,
+        const char *ref_error, jsonBuffer *out) {
+    if (res != ref_res) {
+        return "parse result";
+    }
+    if (strcmp(error, ref_error) != 0) {
+        return "error text";
+    }
+    if (res != JSON_PARSE_OK) {
+        return NULL;
+    }
+
+    char id[128], ref_id[128];
+    size_t id_len = 0, ref_id_len = 0;
+    int found = jsonGetString(doc, "message_id", id, sizeof(id), &id_len);
+    if (found != jsonGetString(ref, "message_id", ref_id, sizeof(ref_id), &ref_id_len)
+            || (found == 1 && (id_len != ref_id_len || memcmp(id, ref_id, id_len) != 0))) {
+        return "message_id lookup";
+    }
+
+    json_t *members = json_object();
+    json_t *ref_members = json_object();
+    int equal = jsonIterate(doc, collectMember, members) == 0 && jsonIterate(ref, collectMember, ref_members) == 0
+            && json_equal(members, ref_members);
+    json_decref(members);
+    json_decref(ref_members);
+    if (!equal) {
+        return "member iteration";
+    }
+
+    json_t *serialized = reloadSerialized(doc, out);
+    json_t *ref_serialized = reloadSerialized(ref, out);
+    equal = serialized != NULL && ref_serialized != NULL && json_equal(serialized, ref_serialized);
+    json_decref(serialized);
+    json_decref(ref_serialized);
+    return equal ? NULL : "serialization";
+}
+
+// Checks every backend against jansson over the payloads, parsing JSON_DIFFERENTIAL_BATCH of them
+// before using any, as a message batch does. Returns the number of payloads with differences.
+static long differentialCheck(const jsonBackend *backend, char **payloads, const size_t *lens, long count, jsonBuffer *out) {
+    const jsonBackend *reference = jsonBackendByName("jansson");
+    jsonDocument docs[JSON_DIFFERENTIAL_BATCH], refs[JSON_DIFFERENTIAL_BATCH];
+    int results[JSON_DIFFERENTIAL_BATCH], ref_results[JSON_DIFFERENTIAL_BATCH];
+    char errors[JSON_DIFFERENTIAL_BATCH][256], ref_errors[JSON_DIFFERENTIAL_BATCH][256];
+    long mismatches = 0;
+
+    for (long start = 0; start < count; start += JSON_DIFFERENTIAL_BATCH) {
+        int n = count - start < JSON_DIFFERENTIAL_BATCH ? (int)(count - start) : JSON_DIFFERENTIAL_BATCH;
+        for (int i = 0; i < n; i++) {
+            errors[i][0] = ref_errors[i][0] = '\0';
+            results[i] = jsonParse(backend, &docs[i], payloads[start + i], lens[start + i], errors[i], sizeof(errors[i]));
+            ref_results[i] = jsonParse(reference, &refs[i], payloads[start + i], lens[start + i], ref_errors[i], sizeof(ref_errors[i]));
+        }
+        for (int i = 0; i < n; i++) {
+            const char *difference = differentialCompare(&docs[i], results[i], errors[i], &refs[i], ref_results[i],
+                    ref_errors[i], out);
+            if (difference != NULL && mismatches++ < JSON_DIFFERENTIAL_REPORT) {
+                fprintf(stderr, "%s differs from jansson in %s on: %.*s\n", backend->name, difference,
+                        lens[start + i] > 200 ? 200 : (int)lens[start + i], payloads[start + i]);
+            }
+            jsonRelease(&docs[i]);
+            jsonRelease(&refs[i]);
+        }
+    }
+    return mismatches;
+}
+
+int jsonBackendBenchmark(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    jsonCorpus corpus = { NULL, NULL, 0, 0 };
+    long capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_capacity, f)) != -1) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = '\0';
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (corpus.count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            corpus.lines = (char **)realloc(corpus.lines, capacity * sizeof(char *));
+            corpus.lens = (size_t *)realloc(corpus.lens, capacity * sizeof(size_t));
+            if (corpus.lines == NULL || corpus.lens == NULL) {
+                fprintf(stderr, "Error allocating the benchmark corpus\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        corpus.lines[corpus.count] = strdup(line);
+        corpus.lens[corpus.count] = n;
+        corpus.bytes += n;
+        corpus.count++;
+    }
+    free(line);
+    fclose(f);
+    if (corpus.count == 0) {
+        fprintf(stderr, "No JSON messages in %s\n", path);
+        return -1;
+    }
+
+    jsonBuffer out = { NULL, 0, 0, 0 };
+    char *cases[DIFFERENTIAL_CASE_COUNT];
+    size_t case_lens[DIFFERENTIAL_CASE_COUNT];
+    for (size_t i = 0; i < DIFFERENTIAL_CASE_COUNT; i++) {
+        cases[i] = (char *)differential_cases[i];
+        case_lens[i] = strlen(differential_cases[i]);
+    }
+    long mismatches = 0;
+    for (size_t b = 0; b < BACKEND_COUNT; b++) {
+        if (strcmp(backends[b].name, "jansson") == 0) {
+            continue;
+        }
+        long differ = differentialCheck(&backends[b], cases, case_lens, DIFFERENTIAL_CASE_COUNT, &out)
+                + differentialCheck(&backends[b], corpus.lines, corpus.lens, corpus.count, &out);
+        printf("%s against jansson: %ld of %ld payloads differ\n", backends[b].name, differ,
+                (long)DIFFERENTIAL_CASE_COUNT + corpus.count);
+        mismatches += differ;
+    }
+
+    printf("JSON backend benchmark over %s: %ld messages, %.0f bytes per message\n", path, corpus.count,
+            (double)corpus.bytes / corpus.count);
+    printf("%-10s %12s %14s %12s %14s\n", "backend", "parse GB/s", "parse msgs/s", "full GB/s", "full msgs/s");
+    for (size_t b = 0; b < BACKEND_COUNT; b++) {
+        long rejected;
+        double parse_ns = benchmarkPasses(&backends[b], &corpus, 0, &out, &rejected);
+        double full_ns = benchmarkPasses(&backends[b], &corpus, 1, &out, &rejected);
+        printf("%-10s %12.3f %14.0f %12.3f %14.0f", backends[b].name,
+                corpus.bytes / parse_ns, corpus.count * 1e9 / parse_ns,
+                corpus.bytes / full_ns, corpus.count * 1e9 / full_ns);
+        if (rejected > 0) {
+            printf("  (%ld rejected)", rejected);
+        }
+        printf("\n");
+    }
+
+    jsonBufferFree(&out);
+    for (long i = 0; i < corpus.count; i++) {
+        free(corpus.lines[i]);
+    }
+    free(corpus.lines);
+    free(corpus.lens);
+    return mismatches == 0 ? 0 : -1;
+}
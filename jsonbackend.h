@@ -0,0 +1,76 @@
+#ifndef _JSONBACKEND_H
+#define _JSONBACKEND_H
+
+#include <stddef.h>
+
+#include "jsonscan.h"
+
+// The JSON operations message processing needs, behind one interface so parsers can be swapped:
+//
+//   scan      The validating scanner; output is spliced into the original bytes (default)
+//   jansson   The DOM reference; output is re-serialized, so numbers and escapes are normalized
+//   simdjson  simdjson On-Demand through a C shim, when built with -DHAVE_SIMDJSON
+//
+// Every backend accepts the same payloads, and failures are described with jansson's error text,
+// so dead-lettered messages look the same whichever backend is in use.
+
+#define JSON_DOCUMENT_MAX_MEMBERS 32    // Members the scan backend indexes while parsing
+#define JSON_BENCHMARK_NS 1000000000ULL // Minimum run time of each benchmark measurement
+#define JSON_DIFFERENTIAL_BATCH 64       // Documents held parsed at once by the differential check, like a message batch
+#define JSON_DIFFERENTIAL_REPORT 5       // Mismatches printed per backend
+
+// Parse results
+#define JSON_PARSE_OK 0
+#define JSON_PARSE_INVALID -1
+#define JSON_PARSE_NOT_OBJECT -2        // Valid JSON, but not an object
+
+typedef struct jsonBackend jsonBackend;
+
+typedef struct {
+    const jsonBackend *backend;
+    const char *json;
+    size_t len;
+    void *handle;                       // jansson root, or simdjson members
+    long member_count;                  // Members indexed by the scan backend or found by simdjson
+    jsonMember members[JSON_DOCUMENT_MAX_MEMBERS];
+} jsonDocument;
+
+// Called with each top level member: the key unescaped, the value as raw JSON. A non-zero return
+// stops the iteration and is returned by jsonIterate.
+typedef int (*jsonMemberFn)(void *ctx, const char *key, size_t key_len, const char *value, size_t value_len);
+
+struct jsonBackend {
+    const char *name;
+    int (*parse)(jsonDocument *doc, char *error_text, size_t error_size);
+    int (*getString)(jsonDocument *doc, const char *key, char *buf, size_t size, size_t *len);
+    int (*iterate)(jsonDocument *doc, jsonMemberFn fn, void *ctx);
+    long (*serialize)(jsonDocument *doc, const char **remove, int remove_count, const char *append, size_t append_len, jsonBuffer *out);
+    void (*release)(jsonDocument *doc);
+};
+
+// NULL if the name is unknown or the backend was not built in
+const jsonBackend *jsonBackendByName(const char *name);
+const jsonBackend *jsonDefaultBackend(void);
+// Comma separated names of the backends built in
+const char *jsonBackendNames(void);
+
+// Parses the document in [json, json + len), which must outlive it; returns one of JSON_PARSE_*.
+// The document must be released whatever the result.
+int jsonParse(const jsonBackend *backend, jsonDocument *doc, const char *json, size_t len, char *error_text, size_t error_size);
+// Copies the decoded string member to buf, NUL terminated. Returns 1 if found, 0 if missing, -1 if
+// it is not a string or does not fit. With duplicate keys the last one wins.
+int jsonGetString(jsonDocument *doc, const char *key, char *buf, size_t size, size_t *len);
+int jsonIterate(jsonDocument *doc, jsonMemberFn fn, void *ctx);
+// Appends the object to out without the members named in remove, followed by the raw members in
+// append (comma separated), and NUL terminates it. Returns the length appended, or -1. The
+// document may be modified.
+long jsonSerialize(jsonDocument *doc, const char **remove, int remove_count, const char *append, size_t append_len, jsonBuffer *out);
+void jsonRelease(jsonDocument *doc);
+
+// Runs parse, message_id lookup, member iteration and serialization over every line of a corpus
+// file with each backend built in, reporting GB/s and messages per second. Before that, every
+// backend is checked against jansson on the corpus and on built-in edge cases; returns -1 if any
+// result differs.
+int jsonBackendBenchmark(const char *path);
+
+#endif
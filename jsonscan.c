@@ -0,0 +1,531 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonscan.h"
+#include "memtrack.h"
+
+const char *jsonSkipSpace(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static const char *skipUnicodeEscape(const char *p, const char *end, int *code) {
+    if (end - p < 5) {
+        return NULL;
+    }
+    *code = 0;
+    for (int i = 1; i <= 4; i++) {
+        int digit = hexValue(p[i]);
+        if (digit < 0) {
+            return NULL;
+        }
+        *code = (*code << 4) | digit;
+    }
+    return p + 5;
+}
+
+// Length of the UTF-8 sequence starting at p, 0 if it is malformed, overlong or a surrogate
+static size_t utf8Length(const unsigned char *p, const unsigned char *end) {
+    size_t len;
+    unsigned int code;
+    if (*p < 0x80) {
+        return 1;
+    } else if ((*p & 0xE0) == 0xC0) {
+        len = 2;
+        code = *p & 0x1F;
+    } else if ((*p & 0xF0) == 0xE0) {
+        len = 3;
+        code = *p & 0x0F;
+    } else if ((*p & 0xF8) == 0xF0) {
+        len = 4;
+        code = *p & 0x07;
+    } else {
+        return 0;
+    }
+    if ((size_t)(end - p) < len) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        code = (code << 6) | (p[i] & 0x3F);
+    }
+    if ((len == 2 && code < 0x80) || (len == 3 && code < 0x800) || (len == 4 && (code < 0x10000 || code > 0x10FFFF))
+            || (code >= 0xD800 && code <= 0xDFFF)) {
+        return 0;
+    }
+    return len;
+}
+
+// p points at the opening quote; returns the position after the closing quote
+static const char *skipString(const char *p, const char *end) {
+    p++;
+    while (p < end) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"') {
+            return p + 1;
+        }
+        if (c < 0x20) {
+            return NULL;
+        }
+        if (c == '\\') {
+            if (p + 1 >= end) {
+                return NULL;
+            }
+            char e = p[1];
+            if (e == 'u') {
+                int code;
+                p = skipUnicodeEscape(p + 1, end, &code);
+                if (p == NULL || code == 0) {
+                    return NULL;
+                }
+                if (code >= 0xDC00 && code <= 0xDFFF) {
+                    return NULL; // Low surrogate without a high one
+                }
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    int low;
+                    if (end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+                        return NULL;
+                    }
+                    p = skipUnicodeEscape(p + 1, end, &low);
+                    if (p == NULL || low < 0xDC00 || low > 0xDFFF) {
+                        return NULL;
+                    }
+                }
+                continue;
+            }
+            if (e != '"' && e != '\\' && e != '/' && e != 'b' && e != 'f' && e != 'n' && e != 'r' && e != 't') {
+                return NULL;
+            }
+            p += 2;
+            continue;
+        }
+        if (c < 0x80) {
+            p++;
+            continue;
+        }
+        size_t len = utf8Length((const unsigned char *)p, (const unsigned char *)end);
+        if (len == 0) {
+            return NULL;
+        }
+        p += len;
+    }
+    return NULL;
+}
+
+static const char *skipDigits(const char *p, const char *end) {
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        p++;
+    }
+    return p == start ? NULL : p;
+}
+
+// jansson rejects numbers it cannot represent: integers outside a long long and reals that overflow
+// a double. Only integers of 19 digits and reals with an exponent or hundreds of digits need a look.
+static int numberFits(const char *start, const char *end, int real) {
+    size_t len = end - start;
+    if (!real) {
+        int negative = *start == '-';
+        size_t digits = len - negative;
+        if (digits != 19) {
+            return digits < 19;
+        }
+        return memcmp(start + negative, negative ? "9223372036854775808" : "9223372036854775807", 19) <= 0;
+    }
+    if (len < 300 && memchr(start, 'e', len) == NULL && memchr(start, 'E', len) == NULL) {
+        return 1;
+    }
+    char local[64];
+    char *copy = len < sizeof(local) ? local : (char *)memAlloc(MEM_JSON, len + 1);
+    if (copy == NULL) {
+        return 0;
+    }
+    memcpy(copy, start, len);
+    copy[len] = '\0';
+    int fits = !isinf(strtod(copy, NULL));
+    if (copy != local) {
+        memFree(copy);
+    }
+    return fits;
+}
+
+static const char *skipNumber(const char *p, const char *end) {
+    const char *start = p;
+    int real = 0;
+    if (*p == '-') {
+        p++;
+    }
+    if (p < end && *p == '0') {
+        p++;
+    } else if ((p = skipDigits(p, end)) == NULL) {
+        return NULL;
+    }
+    if (p < end && *p == '.') {
+        if ((p = skipDigits(p + 1, end)) == NULL) {
+            return NULL;
+        }
+        real = 1;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+        if ((p = skipDigits(p, end)) == NULL) {
+            return NULL;
+        }
+        real = 1;
+    }
+    return numberFits(start, p, real) ? p : NULL;
+}
+
+static const char *skipLiteral(const char *p, const char *end, const char *literal, size_t len) {
+    if ((size_t)(end - p) < len || memcmp(p, literal, len) != 0) {
+        return NULL;
+    }
+    return p + len;
+}
+
+const char *jsonSkipValue(const char *p, const char *end, int depth) {
+    if (p >= end) {
+        return NULL;
+    }
+    switch (*p) {
+        case '"':
+            return skipString(p, end);
+        case 't':
+            return skipLiteral(p, end, "true", 4);
+        case 'f':
+            return skipLiteral(p, end, "false", 5);
+        case 'n':
+            return skipLiteral(p, end, "null", 4);
+        case '{':
+        case '[': {
+            char close = *p == '{' ? '}' : ']';
+            int object = *p == '{';
+            if (depth >= JSON_MAX_DEPTH) {
+                return NULL;
+            }
+            p = jsonSkipSpace(p + 1, end);
+            if (p < end && *p == close) {
+                return p + 1;
+            }
+            for (;;) {
+                if (object) {
+                    if (p >= end || *p != '"' || (p = skipString(p, end)) == NULL) {
+                        return NULL;
+                    }
+                    p = jsonSkipSpace(p, end);
+                    if (p >= end || *p != ':') {
+                        return NULL;
+                    }
+                    p = jsonSkipSpace(p + 1, end);
+                }
+                if ((p = jsonSkipValue(p, end, depth + 1)) == NULL) {
+                    return NULL;
+                }
+                p = jsonSkipSpace(p, end);
+                if (p >= end) {
+                    return NULL;
+                }
+                if (*p == close) {
+                    return p + 1;
+                }
+                if (*p != ',') {
+                    return NULL;
+                }
+                p = jsonSkipSpace(p + 1, end);
+            }
+        }
+        default:
+            if (*p == '-' || (*p >= '0' && *p <= '9')) {
+                return skipNumber(p, end);
+            }
+            return NULL;
+    }
+}
+
+int jsonValueKind(const char *value) {
+    switch (*value) {
+        case '{': return JSON_KIND_OBJECT;
+        case '[': return JSON_KIND_ARRAY;
+        case '"': return JSON_KIND_STRING;
+        case 't': return JSON_KIND_TRUE;
+        case 'f': return JSON_KIND_FALSE;
+        case 'n': return JSON_KIND_NULL;
+        default: return JSON_KIND_NUMBER;
+    }
+}
+
+int jsonObjectBegin(jsonObjectScan *scan, const char *json, size_t len) {
+    const char *end = json + len;
+    const char *p = jsonSkipSpace(json, end);
+    if (p >= end || *p != '{') {
+        return -1;
+    }
+    scan->p = p + 1;
+    scan->end = end;
+    scan->members = 0;
+    return 0;
+}
+
+int jsonObjectNext(jsonObjectScan *scan, jsonMember *member) {
+    const char *p = jsonSkipSpace(scan->p, scan->end);
+    const char *end = scan->end;
+    if (p >= end) {
+        return -1;
+    }
+    if (*p == '}') {
+        scan->p = p + 1;
+        return jsonSkipSpace(p + 1, end) == end ? 0 : -1;
+    }
+    if (scan->members > 0) {
+        if (*p != ',') {
+            return -1;
+        }
+        p = jsonSkipSpace(p + 1, end);
+    }
+
+    const char *key_end;
+    if (p >= end || *p != '"' || (key_end = skipString(p, end)) == NULL) {
+        return -1;
+    }
+    member->key = p + 1;
+    member->key_len = key_end - p - 2;
+
+    p = jsonSkipSpace(key_end, end);
+    if (p >= end || *p != ':') {
+        return -1;
+    }
+    p = jsonSkipSpace(p + 1, end);
+    const char *value_end = jsonSkipValue(p, end, 1);
+    if (value_end == NULL) {
+        return -1;
+    }
+    member->value = p;
+    member->value_len = value_end - p;
+    scan->p = value_end;
+    scan->members++;
+    return 1;
+}
+
+int jsonKeyEquals(const jsonMember *member, const char *key, size_t key_len) {
+    if (memchr(member->key, '\\', member->key_len) == NULL) {
+        return member->key_len == key_len && memcmp(member->key, key, key_len) == 0;
+    }
+    // An escape takes at most 6 bytes per decoded byte
+    char decoded[512];
+    if (member->key_len > sizeof(decoded) || member->key_len > 6 * key_len) {
+        return 0;
+    }
+    return jsonStringValue(member->key - 1, member->key_len + 2, decoded) == key_len && memcmp(decoded, key, key_len) == 0;
+}
+
+int jsonObjectFind(const char *object, size_t len, const char *key, size_t key_len, jsonMember *member) {
+    jsonObjectScan scan;
+    jsonMember m;
+    int found = 0;
+    if (jsonObjectBegin(&scan, object, len) != 0) {
+        return 0;
+    }
+    // The last occurrence wins, as with jansson
+    while (jsonObjectNext(&scan, &m) == 1) {
+        if (jsonKeyEquals(&m, key, key_len)) {
+            *member = m;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+static int keyIn(const jsonMember *member, const char **keys, int count) {
+    for (int i = 0; i < count; i++) {
+        if (strlen(keys[i]) == member->key_len && memcmp(keys[i], member->key, member->key_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+long jsonObjectSplice(const char *json, size_t len, const char **remove, int remove_count,
+        const char *append, size_t append_len, char *out) {
+    jsonObjectScan scan;
+    jsonMember members[JSON_SPLICE_MAX_MEMBERS];
+    int count = 0;
+    int removed = 0;
+    int res;
+
+    if (jsonObjectBegin(&scan, json, len) != 0) {
+        return JSON_SPLICE_INVALID;
+    }
+    while ((res = jsonObjectNext(&scan, &members[count])) == 1) {
+        // With duplicates the last value wins in a DOM; keeping both would change the meaning for some readers.
+        // Escaped keys could name the same member differently, so those are left to a DOM as well.
+        if (memchr(members[count].key, '\\', members[count].key_len) != NULL) {
+            return JSON_SPLICE_UNSUPPORTED;
+        }
+        for (int i = 0; i < count; i++) {
+            if (members[i].key_len == members[count].key_len
+                    && memcmp(members[i].key, members[count].key, members[i].key_len) == 0) {
+                return JSON_SPLICE_UNSUPPORTED;
+            }
+        }
+        removed += keyIn(&members[count], remove, remove_count);
+        if (++count == JSON_SPLICE_MAX_MEMBERS) {
+            return JSON_SPLICE_UNSUPPORTED;
+        }
+    }
+    if (res < 0) {
+        return JSON_SPLICE_INVALID;
+    }
+
+    char *p = out;
+    const char *close = scan.p - 1;
+    if (removed == 0) {
+        // Everything up to the closing brace is kept byte for byte
+        const char *start = jsonSkipSpace(json, json + len);
+        memcpy(p, start, close - start);
+        p += close - start;
+        if (count > 0 && append_len > 0) {
+            *p++ = ',';
+        }
+    } else {
+        int kept = 0;
+        *p++ = '{';
+        for (int i = 0; i < count; i++) {
+            if (keyIn(&members[i], remove, remove_count)) {
+                continue;
+            }
+            if (kept++ > 0) {
+                *p++ = ',';
+            }
+            // From the opening quote of the key to the end of the value, keeping the space around the colon
+            size_t member_len = members[i].value + members[i].value_len - (members[i].key - 1);
+            memcpy(p, members[i].key - 1, member_len);
+            p += member_len;
+        }
+        if (kept > 0 && append_len > 0) {
+            *p++ = ',';
+        }
+    }
+    memcpy(p, append, append_len);
+    p += append_len;
+    *p++ = '}';
+    *p = '\0';
+    return p - out;
+}
+
+size_t jsonStringValue(const char *value, size_t len, char *dst) {
+    const char *p = value + 1;
+    const char *end = value + len - 1;
+    char *out = dst;
+    while (p < end) {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        char e = p[1];
+        p += 2;
+        switch (e) {
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                int code, low;
+                p = skipUnicodeEscape(p - 1, end, &code);
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    p = skipUnicodeEscape(p + 1, end, &low);
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                if (code < 0x80) {
+                    *out++ = (char)code;
+                } else if (code < 0x800) {
+                    *out++ = (char)(0xC0 | (code >> 6));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                } else if (code < 0x10000) {
+                    *out++ = (char)(0xE0 | (code >> 12));
+                    *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                } else {
+                    *out++ = (char)(0xF0 | (code >> 18));
+                    *out++ = (char)(0x80 | ((code >> 12) & 0x3F));
+                    *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default: *out++ = e; break;
+        }
+    }
+    return out - dst;
+}
+
+size_t jsonWriteString(char *dst, const char *src, size_t len) {
+    char *out = dst;
+    *out++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)c;
+        } else if (c == '\n') {
+            *out++ = '\\';
+            *out++ = 'n';
+        } else if (c == '\r') {
+            *out++ = '\\';
+            *out++ = 'r';
+        } else if (c == '\t') {
+            *out++ = '\\';
+            *out++ = 't';
+        } else if (c < 0x20) {
+            out += sprintf(out, "\\u%04x", c);
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out++ = '"';
+    return out - dst;
+}
+
+int jsonBufferReserve(jsonBuffer *out, size_t size) {
+    if (size <= out->capacity) {
+        return 0;
+    }
+    size_t capacity = out->capacity ? out->capacity : 1024;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    char *buf = (char *)memRealloc(MEM_JSON, out->buf, capacity);
+    if (buf == NULL) {
+        return -1;
+    }
+    out->buf = buf;
+    out->capacity = capacity;
+    return 0;
+}
+
+void jsonBufferFree(jsonBuffer *out) {
+    memFree(out->buf);
+    memset(out, 0, sizeof(*out));
+}
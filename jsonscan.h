@@ -0,0 +1,77 @@
+#ifndef _JSONSCAN_H
+#define _JSONSCAN_H
+
+#include <stddef.h>
+
+// Single-pass validating scanner over JSON text. Nothing is allocated or decoded: members are
+// returned as spans of the input, keys without their quotes and still escaped. Validation follows
+// what jansson accepts by default (UTF-8, no \u0000, paired surrogates) so both agree on which
+// payloads are valid.
+
+#define JSON_MAX_DEPTH 2048
+#define JSON_SPLICE_MAX_MEMBERS 64
+
+// jsonObjectSplice results besides the output length
+#define JSON_SPLICE_INVALID -1      // Not a valid JSON object
+#define JSON_SPLICE_UNSUPPORTED -2  // Duplicate or escaped keys, or too many members; use a DOM instead
+
+// Value kinds, from the first character of a value span
+#define JSON_KIND_OBJECT 0
+#define JSON_KIND_ARRAY 1
+#define JSON_KIND_STRING 2
+#define JSON_KIND_NUMBER 3
+#define JSON_KIND_TRUE 4
+#define JSON_KIND_FALSE 5
+#define JSON_KIND_NULL 6
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int members;        // Members returned so far
+} jsonObjectScan;
+
+// Growable output buffer
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+    int members;        // Members written, for the writer's own bookkeeping
+} jsonBuffer;
+
+typedef struct {
+    const char *key;    // Raw key between the quotes
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+} jsonMember;
+
+const char *jsonSkipSpace(const char *p, const char *end);
+// Returns the end of the value starting at p, NULL if it is not valid JSON
+const char *jsonSkipValue(const char *p, const char *end, int depth);
+int jsonValueKind(const char *value);
+
+// Iterates the members of the object in [json, json + len). jsonObjectNext returns 1 with a
+// member, 0 after the closing brace if only whitespace follows, -1 if the text is not valid.
+int jsonObjectBegin(jsonObjectScan *scan, const char *json, size_t len);
+int jsonObjectNext(jsonObjectScan *scan, jsonMember *member);
+// Compares a member's key with an unescaped key
+int jsonKeyEquals(const jsonMember *member, const char *key, size_t key_len);
+// Finds a member in an object value span; returns 1 if found
+int jsonObjectFind(const char *object, size_t len, const char *key, size_t key_len, jsonMember *member);
+
+// Copies the object in [json, json + len) to out with the members named in `remove` left out and
+// the raw members in `append` (comma separated) added before the closing brace. Without members to
+// remove this is a single copy of the original bytes. out needs room for len + append_len + 2 bytes.
+// Returns the output length or one of the JSON_SPLICE_* errors.
+long jsonObjectSplice(const char *json, size_t len, const char **remove, int remove_count,
+        const char *append, size_t append_len, char *out);
+
+// Decodes a valid string value span (with quotes) to UTF-8; dst needs room for len bytes
+size_t jsonStringValue(const char *value, size_t len, char *dst);
+// Writes len bytes of UTF-8 as a quoted JSON string; dst needs room for 6 * len + 2 bytes
+size_t jsonWriteString(char *dst, const char *src, size_t len);
+
+int jsonBufferReserve(jsonBuffer *out, size_t size);
+void jsonBufferFree(jsonBuffer *out);
+
+#endif
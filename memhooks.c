@@ -0,0 +1,36 @@
+#include <hiredis.h>
+#include <jansson.h>
+
+#include "memhooks.h"
+
+static void *redisMalloc(size_t size) {
+    return memAlloc(MEM_REDIS, size);
+}
+
+static void *redisCalloc(size_t count, size_t size) {
+    return memCalloc(MEM_REDIS, count, size);
+}
+
+static void *redisRealloc(void *p, size_t size) {
+    return memRealloc(MEM_REDIS, p, size);
+}
+
+static char *redisStrdup(const char *s) {
+    return memStrdup(MEM_REDIS, s);
+}
+
+static void *jsonMalloc(size_t size) {
+    return memAlloc(MEM_JSON, size);
+}
+
+void memTrackHooks(void) {
+    hiredisAllocFuncs funcs = {
+        .mallocFn = redisMalloc,
+        .callocFn = redisCalloc,
+        .reallocFn = redisRealloc,
+        .strdupFn = redisStrdup,
+        .freeFn = memFree
+    };
+    hiredisSetAllocators(&funcs);
+    json_set_alloc_funcs(jsonMalloc, memFree);
+}
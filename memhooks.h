@@ -0,0 +1,11 @@
+#ifndef _MEMHOOKS_H
+#define _MEMHOOKS_H
+
+#include "memtrack.h"
+
+// Kept apart from memtrack.c so the accounting core, and records.c with it, builds without hiredis or jansson
+
+// Makes hiredis and jansson allocate through memAlloc. Call before either allocates anything.
+void memTrackHooks(void);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memtrack.h"
+
+const char *mem_tag_names[MEM_TAGS] = {
+    "dedup", "batch", "json", "redis", "output", "enrich", "aggregate", "other"
+};
+
+// Two words keep the block as aligned as malloc's own
+typedef struct {
+    uint64_t size;
+    uint64_t tag;
+} memHeader;
+
+static uint64_t global_live[MEM_TAGS];
+static uint64_t global_allocs[MEM_TAGS];      // Since the last report
+static uint64_t global_alloc_bytes[MEM_TAGS];
+static uint64_t global_total = 0;
+static uint64_t global_budget = 0;
+
+static void account(int tag, int64_t bytes) {
+    __atomic_fetch_add(&global_live[tag], (uint64_t)bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global_total, (uint64_t)bytes, __ATOMIC_RELAXED);
+    if (bytes > 0) {
+        __atomic_fetch_add(&global_allocs[tag], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&global_alloc_bytes[tag], (uint64_t)bytes, __ATOMIC_RELAXED);
+    }
+}
+
+static void *track(memHeader *h, int tag, size_t size) {
+    if (h == NULL) {
+        return NULL;
+    }
+    h->size = size;
+    h->tag = (uint64_t)tag;
+    account(tag, (int64_t)size);
+    return h + 1;
+}
+
+void *memAlloc(int tag, size_t size) {
+    return track((memHeader *)malloc(sizeof(memHeader) + size), tag, size);
+}
+
+void *memCalloc(int tag, size_t count, size_t size) {
+    if (size != 0 && count > (SIZE_MAX - sizeof(memHeader)) / size) {
+        return NULL;
+    }
+    return track((memHeader *)calloc(1, sizeof(memHeader) + count * size), tag, count * size);
+}
+
+void *memRealloc(int tag, void *p, size_t size) {
+    if (p == NULL) {
+        return memAlloc(tag, size);
+    }
+    memHeader *h = (memHeader *)p - 1;
+    int old_tag = (int)h->tag;
+    uint64_t old_size = h->size;
+    h = (memHeader *)realloc(h, sizeof(memHeader) + size);
+    if (h == NULL) {
+        return NULL;
+    }
+    account(old_tag, -(int64_t)old_size);
+    return track(h, old_tag, size);
+}
+
+char *memStrdup(int tag, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = (char *)memAlloc(tag, len);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+void memFree(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    memHeader *h = (memHeader *)p - 1;
+    account((int)h->tag, -(int64_t)h->size);
+    free(h);
+}
+
+void memCharge(int tag, int64_t bytes) {
+    account(tag, bytes);
+}
+
+uint64_t memLiveBytes(int tag) {
+    return __atomic_load_n(&global_live[tag], __ATOMIC_RELAXED);
+}
+
+uint64_t memTotalBytes(void) {
+    return __atomic_load_n(&global_total, __ATOMIC_RELAXED);
+}
+
+void memSetBudget(uint64_t bytes) {
+    global_budget = bytes;
+}
+
+uint64_t memBudget(void) {
+    return global_budget;
+}
+
+int memOverBudget(void) {
+    return global_budget > 0 && memTotalBytes() > global_budget;
+}
+
+void memTrackReport(double seconds) {
+    printf("Memory: %.1f MiB", memTotalBytes() / 1048576.0);
+    if (global_budget > 0) {
+        printf(" of %.1f MiB budget", global_budget / 1048576.0);
+    }
+    for (int tag = 0; tag < MEM_TAGS; tag++) {
+        uint64_t allocs = __atomic_exchange_n(&global_allocs[tag], 0, __ATOMIC_RELAXED);
+        uint64_t bytes = __atomic_exchange_n(&global_alloc_bytes[tag], 0, __ATOMIC_RELAXED);
+        if (memLiveBytes(tag) == 0 && allocs == 0) {
+            continue;
+        }
+        printf(", %s %.1f MiB (%.0f allocs/s, %.1f MB/s)", mem_tag_names[tag], memLiveBytes(tag) / 1048576.0,
+                allocs / seconds, bytes / 1e6 / seconds);
+    }
+    printf("\n");
+}
@@ -0,0 +1,45 @@
+#ifndef _MEMTRACK_H
+#define _MEMTRACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Heap accounting by subsystem. Blocks from memAlloc carry a 16 byte header with their size and
+// tag, so they can be freed without either, as hiredis and jansson free theirs; memTrackHooks()
+// (memhooks.h) routes both libraries through here. Regions mapped by hand (see hugemem.h) are
+// charged with memCharge. Counters are atomic, so any thread may allocate.
+
+// Allocation tags
+enum {
+    MEM_DEDUP,        // Processed id tables, run bookkeeping
+    MEM_BATCH,        // Receive buffer and message batch columns
+    MEM_JSON,         // jansson trees and serialized payloads
+    MEM_REDIS,        // hiredis contexts, reader buffers and replies
+    MEM_OUTPUT,       // Sinks, record batches, retries
+    MEM_ENRICH,       // Enrichment cache
+    MEM_AGGREGATE,    // Aggregation windows
+    MEM_OTHER,
+    MEM_TAGS
+};
+
+extern const char *mem_tag_names[MEM_TAGS];
+
+void *memAlloc(int tag, size_t size);
+void *memCalloc(int tag, size_t count, size_t size);
+// A NULL p allocates with tag; otherwise the block keeps the tag it was allocated with
+void *memRealloc(int tag, void *p, size_t size);
+char *memStrdup(int tag, const char *s);
+void memFree(void *p);
+// Adds or, with a negative count, removes bytes allocated outside memAlloc
+void memCharge(int tag, int64_t bytes);
+
+uint64_t memLiveBytes(int tag);
+uint64_t memTotalBytes(void);
+// 0 disables the budget
+void memSetBudget(uint64_t bytes);
+uint64_t memBudget(void);
+int memOverBudget(void);
+// Live bytes and allocation rate per tag since the last report
+void memTrackReport(double seconds);
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "receiver.h"
+#include "consumer.h"
+#include "hugemem.h"
+
+#define FRAME_MAX_ELEMENTS 3
+#define FRAME_MAX_BULK_SIZE (512LL * 1024 * 1024)   // Redis's own proto-max-bulk-len default
+
+int receiveBufferInit(receiveBuffer *rb, size_t capacity) {
+    // On huge pages the capacity is rounded up to whole pages, all of them usable
+    capacity = hugeRoundSize(capacity);
+    rb->buf = (char *)hugeAlloc(MEM_BATCH, capacity);
+    if (rb->buf == NULL) {
+        return -1;
+    }
+    rb->capacity = capacity;
+    rb->start = 0;
+    rb->end = 0;
+    rb->need = 0;
+    return 0;
+}
+
+void receiveBufferFree(receiveBuffer *rb) {
+    hugeFree(MEM_BATCH, rb->buf, rb->capacity);
+    rb->buf = NULL;
+    rb->capacity = 0;
+}
+
+// Make room for at least `needed` bytes counted from start, moving pending data to the front first
+static int reserve(receiveBuffer *rb, size_t needed) {
+    if (rb->start > 0) {
+        memmove(rb->buf, rb->buf + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+    if (needed <= rb->capacity) {
+        return 0;
+    }
+
+    size_t capacity = rb->capacity;
+    while (capacity < needed) {
+        if (capacity > SIZE_MAX / 2) {
+            fprintf(stderr, "Error growing receive buffer to %zu bytes\n", needed);
+            return -1;
+        }
+        capacity *= 2;
+    }
+    char *buf = (char *)hugeRealloc(MEM_BATCH, rb->buf, rb->capacity, capacity);
+    if (buf == NULL) {
+        fprintf(stderr, "Error growing receive buffer to %zu bytes\n", capacity);
+        return -1;
+    }
+    rb->buf = buf;
+    rb->capacity = capacity;
+    return 0;
+}
+
+int receiveBufferAppend(receiveBuffer *rb, const char *data, size_t len) {
+    if (reserve(rb, rb->end - rb->start + len) != 0) {
+        return -1;
+    }
+    memcpy(rb->buf + rb->end, data, len);
+    rb->end += len;
+    return 0;
+}
+
+// Reads straight into the buffer. Once the bulk length of a pending frame is known the
+// buffer is sized for the whole frame, so large payloads arrive without intermediate copies.
+ssize_t receiveBufferRead(receiveBuffer *rb, int fd) {
+    size_t pending = rb->end - rb->start;
+    size_t wanted = rb->need > pending ? rb->need : pending + MESSAGES_BUFFER_SIZE / 2;
+
+    size_t base_capacity = hugeRoundSize(MESSAGES_BUFFER_SIZE);
+    if (pending == 0 && rb->capacity > base_capacity * 16) {
+        // Give back the memory of an oversized frame once it has been consumed
+        char *buf = (char *)hugeRealloc(MEM_BATCH, rb->buf, rb->capacity, base_capacity);
+        if (buf != NULL) {
+            rb->buf = buf;
+            rb->capacity = base_capacity;
+        }
+        rb->start = rb->end = 0;
+    }
+    if (rb->capacity - rb->start < wanted && reserve(rb, wanted) != 0) {
+        return -1;
+    }
+
+    // Not retried on EINTR, so the caller sees a shutdown request instead of blocking on
+    ssize_t n = read(fd, rb->buf + rb->end, rb->capacity - rb->end);
+
+    if (n > 0) {
+        rb->end += n;
+    }
+    return n;
+}
+
+// Parses "<prefix><integer>\r\n" at p. Returns the offset past the line, 0 if incomplete, -1 on protocol error.
+static long long parseLine(const char *p, size_t len, char prefix, long long *value) {
+    if (len == 0) {
+        return 0;
+    }
+    if (p[0] != prefix) {
+        return -1;
+    }
+
+    const char *cr = memchr(p, '\r', len);
+    if (cr == NULL || (size_t)(cr - p) + 1 >= len) {
+        return len > 32 ? -1 : 0;
+    }
+    if (cr[1] != '\n') {
+        return -1;
+    }
+
+    char *endptr;
+    *value = strtoll(p + 1, &endptr, 10);
+    if (endptr != cr) {
+        return -1;
+    }
+    return (cr - p) + 2;
+}
+
+// Returns 1 with a complete frame, 0 if more data is needed, -1 on protocol error
+int receiveBufferNextFrame(receiveBuffer *rb, pubsubFrame *frame) {
+    size_t available = rb->end - rb->start;
+    if (available == 0 || available < rb->need) {
+        return 0; // Nothing new since the last scan could complete the frame
+    }
+
+    char *p = rb->buf + rb->start;
+    long long elements;
+    long long used = parseLine(p, available, '*', &elements);
+    if (used == 0) {
+        rb->need = available + 1;
+        return 0;
+    } else if (used < 0) {
+        return -1;
+    }
+    if (elements < 1 || elements > FRAME_MAX_ELEMENTS) {
+        fprintf(stderr, "Unexpected pub/sub frame with %lld elements\n", elements);
+        return -1;
+    }
+
+    char *values[FRAME_MAX_ELEMENTS] = { NULL };
+    size_t lengths[FRAME_MAX_ELEMENTS] = { 0 };
+    long long integer = 0;
+    size_t pos = used;
+
+    for (long long i = 0; i < elements; i++) {
+        long long value;
+        if (pos < available && p[pos] == ':') {
+            used = parseLine(p + pos, available - pos, ':', &value);
+            if (used == 0) {
+                rb->need = available + 1;
+                return 0;
+            } else if (used < 0) {
+                return -1;
+            }
+            integer = value;
+            pos += used;
+            continue;
+        }
+
+        used = parseLine(p + pos, available - pos, '$', &value);
+        if (used == 0) {
+            rb->need = available + 1;
+            return 0;
+        } else if (used < 0 || value < 0) {
+            return -1;
+        }
+        if (value > FRAME_MAX_BULK_SIZE) {
+            fprintf(stderr, "Unexpected pub/sub bulk string of %lld bytes\n", value);
+            return -1;
+        }
+        if (pos + used + value + 2 > available) {
+            // The header tells us exactly how much more is needed for this element
+            rb->need = pos + used + value + 2;
+            return 0;
+        }
+
+        values[i] = p + pos + used;
+        lengths[i] = value;
+        if (values[i][value] != '\r' || values[i][value + 1] != '\n') {
+            fprintf(stderr, "Unexpected pub/sub bulk string without a terminating CRLF\n");
+            return -1;
+        }
+        pos += used + value + 2;
+    }
+
+    // Every pub/sub push starts with its kind as a bulk string; anything else is not a push we understand
+    if (values[0] == NULL) {
+        fprintf(stderr, "Unexpected pub/sub frame without a kind\n");
+        return -1;
+    }
+
+    frame->kind = values[0];
+    frame->kind_len = lengths[0];
+    frame->channel = elements > 1 ? values[1] : NULL;
+    frame->channel_len = elements > 1 ? lengths[1] : 0;
+    frame->payload = elements > 2 ? values[2] : NULL;
+    frame->payload_len = elements > 2 ? lengths[2] : 0;
+    frame->count = integer;
+
+    // Terminate strings in place, overwriting the trailing \r of each bulk
+    for (long long i = 0; i < elements; i++) {
+        if (values[i] != NULL) {
+            values[i][lengths[i]] = '\0';
+        }
+    }
+
+    rb->start += pos;
+    rb->need = 0;
+    if (rb->start == rb->end) {
+        rb->start = rb->end = 0;
+    }
+    return 1;
+}
@@ -0,0 +1,34 @@
+#ifndef _RECEIVER_H
+#define _RECEIVER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Receive buffer for a subscribed connection. Frames are parsed in place, so pointers
+// handed out in pubsubFrame stay valid until the next receiveBufferRead call.
+typedef struct {
+    char *buf;
+    size_t capacity;
+    size_t start;  // First byte of the unconsumed data
+    size_t end;    // One past the last received byte
+    size_t need;   // Bytes (from start) required before scanning the pending frame is worthwhile
+} receiveBuffer;
+
+// One decoded pub/sub push: ["message", channel, payload] or ["subscribe", channel, count]
+typedef struct {
+    char *kind;         // Never NULL: frames whose first element is not a bulk string are protocol errors
+    size_t kind_len;
+    char *channel;
+    size_t channel_len;
+    char *payload;      // NUL terminated in place; NULL when the last element is an integer
+    size_t payload_len;
+    long long count;
+} pubsubFrame;
+
+int receiveBufferInit(receiveBuffer *rb, size_t capacity);
+void receiveBufferFree(receiveBuffer *rb);
+int receiveBufferAppend(receiveBuffer *rb, const char *data, size_t len);
+ssize_t receiveBufferRead(receiveBuffer *rb, int fd);
+int receiveBufferNextFrame(receiveBuffer *rb, pubsubFrame *frame);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "memtrack.h"
+
+// LEB128: 7 bits per byte, high bit set on every byte but the last
+size_t varintEncode(uint64_t value, unsigned char *out) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// Returns the number of bytes consumed, or -1 if the input is truncated or too long
+int varintDecode(const unsigned char *in, size_t len, uint64_t *value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < len && i < 10; i++) {
+        result |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            *value = result;
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Parses the canonical 8-4-4-4-12 form. Returns 0 on success, -1 if the text is not a UUID.
+int uuidParse(const char *text, unsigned char *out) {
+    int byte = 0;
+    for (int i = 0; i < UUID_TEXT_SIZE; i += 2) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (text[i] != '-') {
+                return -1;
+            }
+            i--;
+            continue;
+        }
+        int hi = hexValue(text[i]);
+        int lo = hi < 0 ? -1 : hexValue(text[i + 1]);
+        if (lo < 0) {
+            return -1;
+        }
+        out[byte++] = (unsigned char)((hi << 4) | lo);
+    }
+    return text[UUID_TEXT_SIZE] == '\0' ? 0 : -1;
+}
+
+void uuidFormat(const unsigned char *uuid, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    int pos = 0;
+    for (int i = 0; i < UUID_BINARY_SIZE; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            out[pos++] = '-';
+        }
+        out[pos++] = digits[uuid[i] >> 4];
+        out[pos++] = digits[uuid[i] & 0x0f];
+    }
+    out[pos] = '\0';
+}
+
+int recordEncode(int format, const streamRecord *record, unsigned char *out) {
+    size_t n = 0;
+
+    if (format == RECORD_FORMAT_BINARY) {
+        out[n++] = (unsigned char)(record->flags & (RECORD_HAS_TIMESTAMP | RECORD_HAS_PAYLOAD_LENGTH | RECORD_HAS_PAYLOAD | RECORD_CODEC_MASK));
+        if (uuidParse(record->message_id, out + n) != 0) {
+            fprintf(stderr, "Error: message_id %s is not a UUID and cannot be stored in binary format\n", record->message_id);
+            return -1;
+        }
+        n += UUID_BINARY_SIZE;
+        n += varintEncode(record->consumer_id, out + n);
+        if (record->flags & RECORD_HAS_TIMESTAMP) {
+            n += varintEncode(record->timestamp_ms, out + n);
+        }
+        if (record->flags & RECORD_HAS_PAYLOAD_LENGTH) {
+            n += varintEncode(record->payload_len, out + n);
+        }
+        if (record->flags & RECORD_HAS_PAYLOAD) {
+            n += varintEncode(record->payload_size, out + n);
+            memcpy(out + n, record->payload, record->payload_size);
+            n += record->payload_size;
+        }
+        return (int)n;
+    }
+
+    size_t id_len = strlen(record->message_id);
+    if (id_len > RECORD_MAX_ID_SIZE) {
+        fprintf(stderr, "Error: message_id longer than %d bytes cannot be packed\n", RECORD_MAX_ID_SIZE);
+        return -1;
+    }
+    n = varintEncode(id_len, out);
+    memcpy(out + n, record->message_id, id_len);
+    n += id_len;
+    n += varintEncode(record->consumer_id, out + n);
+    return (int)n;
+}
+
+int recordBatchInit(recordBatch *batch, int format, size_t capacity) {
+    batch->buf = (char *)memAlloc(MEM_OUTPUT, capacity);
+    if (batch->buf == NULL) {
+        return -1;
+    }
+    batch->format = format;
+    batch->capacity = capacity;
+    batch->len = 0;
+    batch->count = 0;
+    return 0;
+}
+
+void recordBatchReset(recordBatch *batch) {
+    batch->len = 0;
+    batch->count = 0;
+}
+
+void recordBatchFree(recordBatch *batch) {
+    memFree(batch->buf);
+    batch->buf = NULL;
+    batch->capacity = 0;
+}
+
+static int reserve(recordBatch *batch, size_t extra) {
+    if (batch->len + extra <= batch->capacity) {
+        return 0;
+    }
+    size_t capacity = batch->capacity * 2;
+    while (capacity < batch->len + extra) {
+        capacity *= 2;
+    }
+    char *buf = (char *)memRealloc(MEM_OUTPUT, batch->buf, capacity);
+    if (buf == NULL) {
+        fprintf(stderr, "Error growing record batch to %zu bytes\n", capacity);
+        return -1;
+    }
+    batch->buf = buf;
+    batch->capacity = capacity;
+    return 0;
+}
+
+int recordBatchAppend(recordBatch *batch, const streamRecord *record) {
+    size_t payload_size = (record->flags & RECORD_HAS_PAYLOAD) ? record->payload_size : 0;
+    if (reserve(batch, RECORD_MAX_ENCODED_SIZE + payload_size) != 0) {
+        return -1;
+    }
+
+    int n = recordEncode(batch->format, record, (unsigned char *)batch->buf + batch->len);
+    if (n < 0) {
+        return -1;
+    }
+    batch->len += n;
+    batch->count++;
+    return 0;
+}
+
+static int decodeText(const unsigned char *in, size_t len, streamRecord *record) {
+    uint64_t id_len;
+    int n = varintDecode(in, len, &id_len);
+    if (n < 0 || id_len > RECORD_MAX_ID_SIZE || n + id_len > len) {
+        return -1;
+    }
+    memcpy(record->message_id, in + n, id_len);
+    record->message_id[id_len] = '\0';
+    size_t p = n + id_len;
+
+    n = varintDecode(in + p, len - p, &record->consumer_id);
+    if (n < 0) {
+        return -1;
+    }
+    record->flags = 0;
+    record->payload = NULL;
+    record->payload_size = 0;
+    return (int)(p + n);
+}
+
+static int decodeBinary(const unsigned char *in, size_t len, streamRecord *record) {
+    if (len < 1 + UUID_BINARY_SIZE) {
+        return -1;
+    }
+    record->flags = in[0];
+    uuidFormat(in + 1, record->message_id);
+    size_t p = 1 + UUID_BINARY_SIZE;
+
+    int n = varintDecode(in + p, len - p, &record->consumer_id);
+    if (n < 0) {
+        return -1;
+    }
+    p += n;
+    if (record->flags & RECORD_HAS_TIMESTAMP) {
+        if ((n = varintDecode(in + p, len - p, &record->timestamp_ms)) < 0) {
+            return -1;
+        }
+        p += n;
+    }
+    if (record->flags & RECORD_HAS_PAYLOAD_LENGTH) {
+        if ((n = varintDecode(in + p, len - p, &record->payload_len)) < 0) {
+            return -1;
+        }
+        p += n;
+    }
+    record->payload = NULL;
+    record->payload_size = 0;
+    if (record->flags & RECORD_HAS_PAYLOAD) {
+        uint64_t size;
+        // varintDecode keeps n within len - p; compare the size against what is left so a huge one cannot wrap
+        if ((n = varintDecode(in + p, len - p, &size)) < 0 || size > len - p - n) {
+            return -1;
+        }
+        record->payload = (const char *)in + p + n;
+        record->payload_size = size;
+        p += n + size;
+    }
+    return (int)p;
+}
+
+int recordBatchNext(int format, const char *blob, size_t len, size_t *pos, streamRecord *record) {
+    if (*pos >= len) {
+        return 0;
+    }
+
+    const unsigned char *in = (const unsigned char *)blob + *pos;
+    int n = format == RECORD_FORMAT_BINARY
+        ? decodeBinary(in, len - *pos, record)
+        : decodeText(in, len - *pos, record);
+    if (n < 0) {
+        return -1;
+    }
+    *pos += n;
+    return 1;
+}
@@ -0,0 +1,82 @@
+#ifndef _RECORDS_H
+#define _RECORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Encodings of processed records written to STREAM_KEY.
+//
+// Text records (packed entries only):
+//   varint message_id length | message_id bytes | varint consumer_id
+//
+// Binary records:
+//   flags byte | 16 byte UUID | varint consumer_id
+//   [varint timestamp in ms, if RECORD_HAS_TIMESTAMP] [varint payload length, if RECORD_HAS_PAYLOAD_LENGTH]
+//   [varint stored size | stored payload, if RECORD_HAS_PAYLOAD]
+// The stored payload is compressed with the codec in RECORD_CODEC(flags), see compress.h.
+//
+// Entry layouts:
+//   text,   one per entry: message_id <id> consumer_id <n>
+//   binary, one per entry: r <binary record>
+//   packed:                count <n> records <text records>  or  count <n> brecords <binary records>
+// A packed binary entry compressed as a whole has an extra "codec" field naming the codec of brecords.
+// Readers decode record blobs with recordBatchNext() until it returns 0.
+
+#define RECORD_FIELD "r"
+#define RECORDS_FIELD "records"
+#define RECORDS_BINARY_FIELD "brecords"
+#define RECORDS_COUNT_FIELD "count"
+#define RECORDS_CODEC_FIELD "codec"
+
+#define RECORD_FORMAT_TEXT 0
+#define RECORD_FORMAT_BINARY 1
+
+#define RECORD_HAS_TIMESTAMP 0x01
+#define RECORD_HAS_PAYLOAD_LENGTH 0x02
+#define RECORD_HAS_PAYLOAD 0x04
+#define RECORD_CODEC_SHIFT 3
+#define RECORD_CODEC_MASK 0x18
+#define RECORD_CODEC(flags) (((flags) & RECORD_CODEC_MASK) >> RECORD_CODEC_SHIFT)
+
+// Longest supported message_id; UUIDs use MSG_ID_SIZE of it
+#define RECORD_MAX_ID_SIZE 64
+#define RECORD_MAX_ENCODED_SIZE (RECORD_MAX_ID_SIZE + 32)
+#define UUID_TEXT_SIZE 36
+#define UUID_BINARY_SIZE 16
+
+typedef struct {
+    char message_id[RECORD_MAX_ID_SIZE + 1];
+    uint64_t consumer_id;
+    int flags;
+    uint64_t timestamp_ms;
+    uint64_t payload_len;
+    const char *payload;  // Stored (possibly compressed) payload; points into the blob when decoding
+    size_t payload_size;
+} streamRecord;
+
+typedef struct {
+    int format;
+    char *buf;
+    size_t len;
+    size_t capacity;
+    int count;
+} recordBatch;
+
+int recordBatchInit(recordBatch *batch, int format, size_t capacity);
+void recordBatchReset(recordBatch *batch);
+void recordBatchFree(recordBatch *batch);
+int recordBatchAppend(recordBatch *batch, const streamRecord *record);
+
+// Decodes the record at *pos and advances it. Returns 1 on success, 0 at the end of the blob, -1 if malformed.
+int recordBatchNext(int format, const char *blob, size_t len, size_t *pos, streamRecord *record);
+
+// Encodes one record into out (at least RECORD_MAX_ENCODED_SIZE + payload_size bytes). Returns the encoded size or -1.
+int recordEncode(int format, const streamRecord *record, unsigned char *out);
+
+int uuidParse(const char *text, unsigned char *out);
+void uuidFormat(const unsigned char *uuid, char *out);
+
+size_t varintEncode(uint64_t value, unsigned char *out);
+int varintDecode(const unsigned char *in, size_t len, uint64_t *value);
+
+#endif
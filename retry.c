@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "retry.h"
+#include "consumer.h"
+#include "memtrack.h"
+
+static uint64_t nowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t currentTick(const retryQueue *q) {
+    return (nowNanos() - q->start_ns) / (RETRY_TICK_MS * 1000000ULL);
+}
+
+void retryQueueInit(retryQueue *q, size_t max_bytes) {
+    memset(q, 0, sizeof(*q));
+    q->start_ns = nowNanos();
+    q->max_bytes = max_bytes;
+    timerWheelInit(&q->wheel, 0);
+}
+
+void retryQueueFree(retryQueue *q) {
+    while (q->head != NULL) {
+        retryItem *next = q->head->next;
+        retryItemFree(q, q->head);
+        q->head = next;
+    }
+    q->tail = NULL;
+}
+
+// Exponential backoff with +-25% jitter so retries from a burst don't land on the same tick
+static uint64_t backoffTicks(int attempts) {
+    uint64_t ms = RETRY_BASE_BACKOFF_MS;
+    for (int i = 1; i < attempts && ms < RETRY_MAX_BACKOFF_MS; i++) {
+        ms *= 2;
+    }
+    if (ms > RETRY_MAX_BACKOFF_MS) {
+        ms = RETRY_MAX_BACKOFF_MS;
+    }
+    ms = ms * 3 / 4 + (uint64_t)rand() % (ms / 2 + 1);
+    return ms / RETRY_TICK_MS + 1;
+}
+
+retryItem *retryItemNew(retryQueue *q, const char *command, size_t len, int attempts) {
+    if (attempts > RETRY_MAX_ATTEMPTS || q->bytes + len > q->max_bytes) {
+        q->refused++;
+        return NULL;
+    }
+
+    retryItem *item = (retryItem *)memAlloc(MEM_OUTPUT, sizeof(retryItem) + len);
+    if (item == NULL) {
+        q->refused++;
+        return NULL;
+    }
+    item->next = NULL;
+    item->attempts = attempts;
+    item->len = len;
+    memcpy(item->command, command, len);
+    q->count++;
+    q->bytes += len;
+    q->scheduled++;
+    return item;
+}
+
+void retryQueuePush(retryQueue *q, retryItem *first, retryItem *last, int front) {
+    if (q->head == NULL) {
+        last->next = NULL;
+        q->head = first;
+        q->tail = last;
+    } else if (front) {
+        last->next = q->head;
+        q->head = first;
+    } else {
+        last->next = NULL;
+        q->tail->next = first;
+        q->tail = last;
+    }
+}
+
+void retryQueueHold(retryQueue *q, int attempts) {
+    // The timer cannot be moved once scheduled; a hold already running stays as it is
+    if (!retryQueueHeld(q)) {
+        timerWheelSchedule(&q->wheel, &q->resume, currentTick(q) + backoffTicks(attempts));
+        q->held = 1;
+    }
+}
+
+int retryQueueHeld(retryQueue *q) {
+    // The resume timer is the only one on the wheel
+    if (q->held && timerWheelAdvance(&q->wheel, currentTick(q)) != NULL) {
+        q->held = 0;
+    }
+    return q->held;
+}
+
+retryItem *retryQueueTake(retryQueue *q) {
+    if (q->head == NULL || retryQueueHeld(q)) {
+        return NULL;
+    }
+    retryItem *item = q->head;
+    q->head = item->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    return item;
+}
+
+void retryItemFree(retryQueue *q, retryItem *item) {
+    q->count--;
+    q->bytes -= item->len;
+    memFree(item);
+}
+
+int retryQueueTimeout(const retryQueue *q) {
+    uint64_t now = currentTick(q);
+    if (q->held) {
+        return q->resume.expires <= now ? 0 : (int)((q->resume.expires - now) * RETRY_TICK_MS);
+    }
+    return q->count > 0 ? 0 : -1;
+}
@@ -0,0 +1,52 @@
+#ifndef _RETRY_H
+#define _RETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timerwheel.h"
+
+// Failed writes waiting for another attempt, and the writes made after them, in the order they
+// were first made. Each item holds a formatted Redis command. After a failure the whole queue is
+// held back for an exponential backoff on a timer wheel, then handed out from the head, so no write
+// ever gets ahead of one made before it; items beyond the attempt or memory limits are refused so
+// the caller can dead-letter them instead.
+
+typedef struct retryItem {
+    struct retryItem *next;
+    int attempts;
+    size_t len;
+    char command[];
+} retryItem;
+
+typedef struct {
+    timerWheel wheel;
+    timerNode resume;    // On the wheel while the queue is held back
+    int held;
+    uint64_t start_ns;
+    retryItem *head;
+    retryItem *tail;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    uint64_t scheduled;  // Statistics
+    uint64_t refused;
+} retryQueue;
+
+void retryQueueInit(retryQueue *q, size_t max_bytes);
+void retryQueueFree(retryQueue *q);
+// A copy of command counted against the queue limits, NULL if it exceeds the attempt or memory
+// limit; add it with retryQueuePush, or release it with retryItemFree
+retryItem *retryItemNew(retryQueue *q, const char *command, size_t len, int attempts);
+// Adds items first..last, linked through next, behind everything queued, or with front ahead of it
+void retryQueuePush(retryQueue *q, retryItem *first, retryItem *last, int front);
+// Holds the queue back for the backoff of the given attempt, e.g. after a failed batch or reconnect
+void retryQueueHold(retryQueue *q, int attempts);
+int retryQueueHeld(retryQueue *q);
+// The head, unless the queue is held back; the caller frees it with retryItemFree
+retryItem *retryQueueTake(retryQueue *q);
+void retryItemFree(retryQueue *q, retryItem *item);
+// Milliseconds until the queue is released, 0 if something can be taken now, -1 if it is empty
+int retryQueueTimeout(const retryQueue *q);
+
+#endif
@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "shmdedup.h"
+#include "uuid.h"
+#include "clock.h"
+#include "hugemem.h"
+
+#if defined(__x86_64__)
+// cmpxchg16b, without building everything with -mcx16
+__attribute__((target("cx16")))
+static unsigned __int128 slotSwap(unsigned char *slot, unsigned __int128 expected, unsigned __int128 id) {
+    return __sync_val_compare_and_swap((unsigned __int128 *)slot, expected, id);
+}
+#else
+static unsigned __int128 slotSwap(unsigned char *slot, unsigned __int128 expected, unsigned __int128 id) {
+    __atomic_compare_exchange_n((unsigned __int128 *)slot, &expected, id, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
+#endif
+
+static int waitFor(int (*ready)(void *), void *arg) {
+    uint64_t deadline = monotonicNanos() + (uint64_t)SHARED_DEDUP_ATTACH_TIMEOUT_MS * 1000000;
+    while (!ready(arg)) {
+        if (monotonicNanos() > deadline) {
+            return -1;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+static int sizeReady(void *arg) {
+    struct stat st;
+    return fstat(*(int *)arg, &st) == 0 && st.st_size > (off_t)sizeof(sharedDedupHeader);
+}
+
+static int magicReady(void *arg) {
+    return __atomic_load_n(&((sharedDedupHeader *)arg)->magic, __ATOMIC_ACQUIRE) == SHARED_DEDUP_MAGIC;
+}
+
+int sharedDedupAttach(sharedDedupTable *table, const char *name, uint64_t capacity) {
+    memset(table, 0, sizeof(*table));
+    table->name = name;
+    uint64_t slots = 1;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    // The first process creates and sizes the segment; ftruncate leaves every slot free
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error opening shared dedup table %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if (created && ftruncate(fd, (off_t)(sizeof(sharedDedupHeader) + slots * UUID_BINARY_SIZE)) != 0) {
+        fprintf(stderr, "Error sizing shared dedup table %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        close(fd);
+        return -1;
+    }
+    struct stat st;
+    if ((!created && waitFor(sizeReady, &fd) != 0) || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: shared dedup table %s was never sized\n", name);
+        close(fd);
+        return -1;
+    }
+    table->map_size = (size_t)st.st_size;
+    void *map = mmap(NULL, table->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping shared dedup table %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    // tmpfs only uses huge pages for advised ranges when shmem_enabled is "advise"
+    hugeAdvise(map, table->map_size);
+    table->header = (sharedDedupHeader *)map;
+    if (created) {
+        table->header->capacity = slots;
+        __atomic_store_n(&table->header->magic, SHARED_DEDUP_MAGIC, __ATOMIC_RELEASE);
+    } else if (waitFor(magicReady, table->header) != 0
+            || table->map_size != sizeof(sharedDedupHeader) + table->header->capacity * UUID_BINARY_SIZE
+            || (table->header->capacity & (table->header->capacity - 1)) != 0) {
+        fprintf(stderr, "Error: %s is not a shared dedup table, or its creator died setting it up\n", name);
+        munmap(map, table->map_size);
+        return -1;
+    } else if (table->header->capacity != slots) {
+        fprintf(stderr, "Warning: shared dedup table %s has %llu slots, not %llu\n", name,
+                (unsigned long long)table->header->capacity, (unsigned long long)slots);
+    }
+    table->slots = (unsigned char (*)[UUID_BINARY_SIZE])((char *)map + sizeof(sharedDedupHeader));
+    table->mask = table->header->capacity - 1;
+    return 0;
+}
+
+void sharedDedupDetach(sharedDedupTable *table) {
+    if (table->header != NULL) {
+        munmap(table->header, table->map_size);
+    }
+    memset(table, 0, sizeof(*table));
+}
+
+int sharedDedupClaim(sharedDedupTable *table, const unsigned char *id, uint64_t hash) {
+    uint64_t halves[2];
+    memcpy(halves, id, UUID_BINARY_SIZE);
+    table->claims++;
+    if (halves[0] == 0 && halves[1] == 0) {
+        if (__atomic_exchange_n(&table->header->nil_claimed, 1, __ATOMIC_SEQ_CST)) {
+            table->present++;
+            return SHARED_DEDUP_PRESENT;
+        }
+        return SHARED_DEDUP_CLAIMED;
+    }
+    unsigned __int128 value;
+    memcpy(&value, id, UUID_BINARY_SIZE);
+    uint64_t i = hash & table->mask;
+    for (int probe = 0; probe < SHARED_DEDUP_MAX_PROBES; probe++, i = (i + 1) & table->mask) {
+        // Read as two atomic halves. A read racing the swap that fills the slot can pair a zero
+        // half with half of the new id, so a slot with a zero half is settled by the swap itself,
+        // which sees the whole slot at once.
+        uint64_t *slot = (uint64_t *)table->slots[i];
+        uint64_t lo = __atomic_load_n(&slot[0], __ATOMIC_ACQUIRE);
+        uint64_t hi = __atomic_load_n(&slot[1], __ATOMIC_ACQUIRE);
+        if (lo == halves[0] && hi == halves[1]) {
+            table->present++;
+            return SHARED_DEDUP_PRESENT;
+        }
+        if (lo == halves[0] || lo == ~halves[0]) {
+            // The id or its released complement, maybe read while changing from one to the other:
+            // the swap settles which, and takes a released slot back
+            unsigned __int128 previous = slotSwap(table->slots[i], ~value, value);
+            if (previous == ~value) {
+                return SHARED_DEDUP_CLAIMED;
+            }
+            if (previous == value) {
+                table->present++;
+                return SHARED_DEDUP_PRESENT;
+            }
+        }
+        if (lo != 0 && hi != 0) {
+            continue;
+        }
+        unsigned __int128 previous = slotSwap(table->slots[i], 0, value);
+        if (previous == 0) {
+            return SHARED_DEDUP_CLAIMED;
+        }
+        if (previous == value) {
+            table->present++;
+            return SHARED_DEDUP_PRESENT;
+        }
+        table->lost_races += lo == 0 && hi == 0;
+    }
+    table->untracked++;
+    return SHARED_DEDUP_FULL;
+}
+
+int sharedDedupRelease(sharedDedupTable *table, const unsigned char *id, uint64_t hash) {
+    uint64_t halves[2];
+    memcpy(halves, id, UUID_BINARY_SIZE);
+    table->released++;
+    if (halves[0] == 0 && halves[1] == 0) {
+        __atomic_store_n(&table->header->nil_claimed, 0, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    unsigned __int128 value;
+    memcpy(&value, id, UUID_BINARY_SIZE);
+    uint64_t i = hash & table->mask;
+    for (int probe = 0; probe < SHARED_DEDUP_MAX_PROBES; probe++, i = (i + 1) & table->mask) {
+        // The complement keeps the slot taken, so ids further along the probe sequence stay reachable
+        unsigned __int128 previous = slotSwap(table->slots[i], value, ~value);
+        if (previous == value) {
+            return 0;
+        }
+        if (previous == 0) {
+            break;
+        }
+    }
+    return -1;
+}
+
+void sharedDedupReport(sharedDedupTable *table) {
+    if (table->claims == 0) {
+        return;
+    }
+    printf("Host dedup: %llu claims, %llu already claimed on this host, %llu untracked (table full), %llu lost slot races, %llu released\n",
+            (unsigned long long)table->claims, (unsigned long long)table->present,
+            (unsigned long long)table->untracked, (unsigned long long)table->lost_races,
+            (unsigned long long)table->released);
+    table->claims = table->present = table->untracked = table->lost_races = table->released = 0;
+}
+
+// Benchmark ids carry a check on themselves, the high half a function of the low one, so a torn
+// slot would show
+static uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void benchmarkId(uint64_t n, unsigned char *id) {
+    uint64_t halves[2];
+    halves[0] = mix64(n + 1);
+    halves[1] = mix64(halves[0]);
+    memcpy(id, halves, UUID_BINARY_SIZE);
+}
+
+static uint64_t claimRange(sharedDedupTable *table, uint64_t first, uint64_t count) {
+    uint64_t claimed = 0;
+    for (uint64_t n = first; n < first + count; n++) {
+        unsigned char id[UUID_BINARY_SIZE];
+        benchmarkId(n, id);
+        claimed += sharedDedupClaim(table, id, uuidHash(id)) == SHARED_DEDUP_CLAIMED;
+    }
+    return claimed;
+}
+
+typedef struct {
+    uint64_t claimed;
+    uint64_t lost_races;
+    uint64_t nanos;
+} benchmarkResult;
+
+// Each process claims SHARED_DEDUP_BENCHMARK_IDS ids, three quarters of them shared with the next
+// process; they all start together once the parent closes the start pipe
+static int contentionRound(const char *name, int processes) {
+    uint64_t ids = SHARED_DEDUP_BENCHMARK_IDS;
+    uint64_t distinct = (uint64_t)(processes - 1) * ids / 4 + ids;
+    sharedDedupTable table;
+    shm_unlink(name);
+    if (sharedDedupAttach(&table, name, distinct * 2) != 0) {
+        return -1;
+    }
+    int start[2], results[2];
+    if (pipe(start) != 0 || pipe(results) != 0) {
+        perror("Error creating benchmark pipes");
+        sharedDedupDetach(&table);
+        return -1;
+    }
+    for (int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            char go;
+            close(start[1]);
+            if (read(start[0], &go, 1) < 0) {
+                _exit(1);
+            }
+            benchmarkResult result;
+            uint64_t begin = monotonicNanos();
+            result.claimed = claimRange(&table, (uint64_t)p * ids / 4, ids);
+            result.nanos = monotonicNanos() - begin;
+            result.lost_races = table.lost_races;
+            _exit(write(results[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+        } else if (pid < 0) {
+            perror("Error forking a benchmark process");
+            processes = p;
+            break;
+        }
+    }
+    close(start[0]);
+    close(start[1]);
+    close(results[1]);
+
+    benchmarkResult total = {0, 0, 0};
+    uint64_t slowest = 0;
+    int reported = 0;
+    benchmarkResult result;
+    while (read(results[0], &result, sizeof(result)) == sizeof(result)) {
+        total.claimed += result.claimed;
+        total.lost_races += result.lost_races;
+        total.nanos += result.nanos;
+        slowest = result.nanos > slowest ? result.nanos : slowest;
+        reported++;
+    }
+    close(results[0]);
+    while (wait(NULL) > 0) {
+    }
+    sharedDedupDetach(&table);
+    shm_unlink(name);
+    if (reported < processes || reported == 0) {
+        fprintf(stderr, "Error: %d of %d benchmark processes failed\n", processes - reported, processes);
+        return -1;
+    }
+    printf("%2d processes: %.1f M claims/s in total, %.1f M/s per process, %llu lost slot races, %llu of %llu ids claimed once\n",
+            processes, processes * ids * 1e3 / slowest, ids * 1e3 * reported / total.nanos,
+            (unsigned long long)total.lost_races, (unsigned long long)total.claimed, (unsigned long long)distinct);
+    return total.claimed == distinct ? 0 : -1;
+}
+
+// Kills a process part way through its claims, then checks every used slot holds a whole id and
+// that claiming the same ids again takes each of them exactly once
+static int crashRound(const char *name) {
+    uint64_t ids = SHARED_DEDUP_BENCHMARK_IDS * 4;
+    sharedDedupTable table;
+    shm_unlink(name);
+    if (sharedDedupAttach(&table, name, ids * 2) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        claimRange(&table, 0, ids);
+        _exit(0);
+    } else if (pid < 0) {
+        perror("Error forking a benchmark process");
+        sharedDedupDetach(&table);
+        return -1;
+    }
+    usleep(20000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    uint64_t used = 0, torn = 0;
+    for (uint64_t i = 0; i <= table.mask; i++) {
+        uint64_t halves[2];
+        memcpy(halves, table.slots[i], UUID_BINARY_SIZE);
+        if (halves[0] != 0 || halves[1] != 0) {
+            used++;
+            torn += halves[1] != mix64(halves[0]);
+        }
+    }
+    uint64_t claimed = claimRange(&table, 0, ids);
+    uint64_t total = 0;
+    for (uint64_t i = 0; i <= table.mask; i++) {
+        uint64_t halves[2];
+        memcpy(halves, table.slots[i], UUID_BINARY_SIZE);
+        total += halves[0] != 0 || halves[1] != 0;
+    }
+    sharedDedupDetach(&table);
+    shm_unlink(name);
+    printf("Crash check: process killed after claiming %llu of %llu ids, %llu torn slots; afterwards %llu claimed, %llu slots used\n",
+            (unsigned long long)used, (unsigned long long)ids, (unsigned long long)torn,
+            (unsigned long long)claimed, (unsigned long long)total);
+    return torn == 0 && used + claimed == ids && total == ids ? 0 : -1;
+}
+
+// Releases every other claimed id, the nil id among them, and checks that exactly the released
+// ones can be claimed again, in their old slots, while the others stay claimed
+static int releaseRound(const char *name) {
+    uint64_t ids = SHARED_DEDUP_BENCHMARK_IDS;
+    sharedDedupTable table;
+    shm_unlink(name);
+    if (sharedDedupAttach(&table, name, ids * 2) != 0) {
+        return -1;
+    }
+    unsigned char nil[UUID_BINARY_SIZE] = {0};
+    uint64_t claimed = claimRange(&table, 0, ids) + (sharedDedupClaim(&table, nil, uuidHash(nil)) == SHARED_DEDUP_CLAIMED);
+    uint64_t failed = sharedDedupRelease(&table, nil, uuidHash(nil)) != 0;
+    for (uint64_t n = 0; n < ids; n += 2) {
+        unsigned char id[UUID_BINARY_SIZE];
+        benchmarkId(n, id);
+        failed += sharedDedupRelease(&table, id, uuidHash(id)) != 0;
+    }
+    uint64_t reclaimed = 0, wrong = 0;
+    for (uint64_t n = 0; n < ids; n++) {
+        unsigned char id[UUID_BINARY_SIZE];
+        benchmarkId(n, id);
+        int res = sharedDedupClaim(&table, id, uuidHash(id));
+        reclaimed += res == SHARED_DEDUP_CLAIMED;
+        wrong += res == (n % 2 == 0 ? SHARED_DEDUP_PRESENT : SHARED_DEDUP_CLAIMED);
+    }
+    reclaimed += sharedDedupClaim(&table, nil, uuidHash(nil)) == SHARED_DEDUP_CLAIMED;
+    sharedDedupDetach(&table);
+    shm_unlink(name);
+    printf("Release check: %llu of %llu ids claimed, half released, then %llu claimed again, %llu wrong answers, %llu failed releases\n",
+            (unsigned long long)claimed, (unsigned long long)ids + 1, (unsigned long long)reclaimed,
+            (unsigned long long)wrong, (unsigned long long)failed);
+    return claimed == ids + 1 && wrong == 0 && failed == 0 && reclaimed == ids / 2 + 1 ? 0 : -1;
+}
+
+int sharedDedupBenchmark(int max_processes) {
+    char name[64];
+    snprintf(name, sizeof(name), "/consumer-dedup-benchmark-%d", (int)getpid());
+    int res = 0;
+    for (int processes = 1; processes <= max_processes && res == 0; processes *= 2) {
+        res = contentionRound(name, processes);
+    }
+    if (res == 0) {
+        res = crashRound(name);
+    }
+    if (res == 0) {
+        res = releaseRound(name);
+    }
+    return res;
+}
@@ -0,0 +1,71 @@
+#ifndef _SHMDEDUP_H
+#define _SHMDEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "records.h"
+
+// Host-wide dedup: a fixed-size open addressing table of binary message ids in a POSIX shared
+// memory segment that every consumer on the host maps. A slot is 16 bytes, all zero while free,
+// and is written exactly once, by a 128-bit compare-and-swap of the whole id. A process dying at
+// any point leaves every slot either free or holding a complete id, and there is no lock to
+// recover. Ids are claimed before processing rather than added after it, so when several
+// consumers receive the same id at once exactly one of them processes it. A consumer that fails
+// to store a message it claimed releases the claim, overwriting the id with its complement: the
+// slot stays taken so probe sequences through it are unchanged, and the next claim of the id
+// takes it back. The complement of a version 4 UUID is never one. A consumer that dies between
+// claiming and storing cannot release, so for its claimed messages host dedup is at-most-once.
+// An id whose SHARED_DEDUP_MAX_PROBES slots from its home are all taken is not tracked.
+// The segment outlives the consumers; remove /dev/shm/<name> to start over.
+
+#define SHARED_DEDUP_MAGIC 0x3150554445444853ULL  // "SHDEDUP1"
+#define SHARED_DEDUP_MAX_PROBES 64
+#define SHARED_DEDUP_ATTACH_TIMEOUT_MS 1000
+#define SHARED_DEDUP_BENCHMARK_IDS (1 << 20)      // Claimed by each benchmark process
+#define SHARED_DEDUP_BENCHMARK_PROCESSES 16
+
+// sharedDedupClaim results
+#define SHARED_DEDUP_CLAIMED 0
+#define SHARED_DEDUP_PRESENT 1
+#define SHARED_DEDUP_FULL -1
+
+typedef struct {
+    uint64_t magic;          // Stored last by the creating process
+    uint64_t capacity;       // Slots, a power of two
+    uint64_t nil_claimed;    // The all-zero id cannot live in a slot
+    char padding[40];
+} sharedDedupHeader;
+
+typedef struct {
+    const char *name;
+    sharedDedupHeader *header;
+    unsigned char (*slots)[UUID_BINARY_SIZE];
+    size_t map_size;
+    uint64_t mask;
+    // Statistics since the last sharedDedupReport
+    uint64_t claims;
+    uint64_t present;        // Already claimed, by this or another process
+    uint64_t untracked;      // No free slot within reach
+    uint64_t lost_races;     // Free slots taken by another id between the read and the swap
+    uint64_t released;
+} sharedDedupTable;
+
+// Creates the segment with capacity slots, rounded up to a power of two, or maps the existing one
+int sharedDedupAttach(sharedDedupTable *table, const char *name, uint64_t capacity);
+void sharedDedupDetach(sharedDedupTable *table);
+
+// hash is uuidHash(id). Returns SHARED_DEDUP_CLAIMED when the id was new and is now taken by the
+// caller, SHARED_DEDUP_PRESENT when it was already claimed, or SHARED_DEDUP_FULL.
+int sharedDedupClaim(sharedDedupTable *table, const unsigned char *id, uint64_t hash);
+// Gives up a claim of the caller's, so the id can be claimed again. Returns -1 if it is not claimed.
+int sharedDedupRelease(sharedDedupTable *table, const unsigned char *id, uint64_t hash);
+void sharedDedupReport(sharedDedupTable *table);
+
+// Claims overlapping id sets from 1, 2, 4, 8 and 16 processes at once and checks each id was
+// claimed exactly once, then kills a process in the middle of its claims and checks that the
+// table holds no torn ids, and finally checks that released ids and only those can be claimed
+// again. Returns -1 if any check fails.
+int sharedDedupBenchmark(int max_processes);
+
+#endif
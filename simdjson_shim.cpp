@@ -0,0 +1,142 @@
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include <simdjson.h>
+
+#include "simdjson_shim.h"
+extern "C" {
+#include "jsonscan.h"
+}
+
+using namespace simdjson;
+
+// The parser keeps its buffers between payloads; the input copy provides the padding simdjson
+// reads past the end of the document
+static thread_local ondemand::parser parser;
+static thread_local std::vector<char> input;
+static thread_local std::vector<simdjsonMember> members;
+
+static long fail(const char *message, char *error_text, size_t error_size) {
+    snprintf(error_text, error_size, "%s", message);
+    return -1;
+}
+
+// Raw tokens run up to the next token, so they may end in whitespace
+static std::string_view trimToken(std::string_view token) {
+    size_t len = token.size();
+    while (len > 0 && (token[len - 1] == ' ' || token[len - 1] == '\t' || token[len - 1] == '\n' || token[len - 1] == '\r')) {
+        len--;
+    }
+    return token.substr(0, len);
+}
+
+// simdjson checks structure and UTF-8 but is more lenient than jansson in places (number
+// ranges, \u0000, nesting depth); values it does not decode itself go through the scanner, so
+// every backend accepts the same payloads
+static int validSpan(std::string_view span) {
+    const char *end = span.data() + span.size();
+    return jsonSkipValue(span.data(), end, 1) == end;
+}
+
+static int validString(std::string_view s) {
+    return memchr(s.data(), '\0', s.size()) == NULL;
+}
+
+// The same bytes in the caller's json rather than in the padded copy, which the next parse overwrites
+static const char *original(const char *json, const char *p) {
+    return json + (p - input.data());
+}
+
+extern "C" long simdjsonParseObject(const char *json, size_t len, const simdjsonMember **out, char *error_text, size_t error_size) {
+    input.resize(len + SIMDJSON_PADDING);
+    memcpy(input.data(), json, len);
+    members.clear();
+
+    ondemand::document doc;
+    ondemand::object object;
+    error_code error = parser.iterate(input.data(), len, input.size()).get(doc);
+    if (!error) {
+        error = doc.get_object().get(object);
+    }
+    if (error) {
+        return fail(error_message(error), error_text, error_size);
+    }
+
+    for (auto field : object) {
+        std::string_view key;
+        ondemand::value value;
+        ondemand::json_type type;
+        std::string_view raw;
+        simdjsonMember member = {};
+
+        if ((error = field.unescaped_key().get(key)) || (error = field.value().get(value))
+                || (error = value.type().get(type))) {
+            return fail(error_message(error), error_text, error_size);
+        }
+        if (!validString(key)) {
+            return fail("NUL byte in object key", error_text, error_size);
+        }
+
+        switch (type) {
+            case ondemand::json_type::string: {
+                std::string_view s;
+                raw = trimToken(value.raw_json_token());
+                if ((error = value.get_string().get(s))) {
+                    return fail(error_message(error), error_text, error_size);
+                }
+                if (!validString(s)) {
+                    return fail("NUL byte in string", error_text, error_size);
+                }
+                if (memchr(raw.data(), '\\', raw.size()) == NULL) {
+                    member.string = original(json, raw.data() + 1);
+                } else {
+                    member.string = s.data();
+                }
+                member.string_len = s.size();
+                break;
+            }
+            case ondemand::json_type::object: {
+                ondemand::object nested;
+                if ((error = value.get_object().get(nested)) || (error = nested.raw_json().get(raw))) {
+                    return fail(error_message(error), error_text, error_size);
+                }
+                raw = trimToken(raw);
+                if (!validSpan(raw)) {
+                    return fail("invalid nested object", error_text, error_size);
+                }
+                break;
+            }
+            case ondemand::json_type::array: {
+                ondemand::array nested;
+                if ((error = value.get_array().get(nested)) || (error = nested.raw_json().get(raw))) {
+                    return fail(error_message(error), error_text, error_size);
+                }
+                raw = trimToken(raw);
+                if (!validSpan(raw)) {
+                    return fail("invalid nested array", error_text, error_size);
+                }
+                break;
+            }
+            default:
+                // Numbers, booleans and null are a single token
+                raw = trimToken(value.raw_json_token());
+                if (!validSpan(raw)) {
+                    return fail("invalid literal", error_text, error_size);
+                }
+                break;
+        }
+
+        member.key = key.data();
+        member.key_len = key.size();
+        member.value = original(json, raw.data());
+        member.value_len = raw.size();
+        members.push_back(member);
+    }
+    if (!doc.at_end()) {
+        return fail("trailing content after the object", error_text, error_size);
+    }
+
+    *out = members.data();
+    return (long)members.size();
+}
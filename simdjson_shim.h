@@ -0,0 +1,32 @@
+#ifndef _SIMDJSON_SHIM_H
+#define _SIMDJSON_SHIM_H
+
+#include <stddef.h>
+
+// C interface to the simdjson On-Demand parser (simdjson_shim.cpp, built with -DHAVE_SIMDJSON).
+// A parse walks the top level object once and records its members. Raw values, and strings
+// without escapes, point into the parsed json; the member array, keys and unescaped strings are
+// in per-thread parser buffers and stay valid only until the next parse on the same thread.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const char *key;        // Unescaped
+    size_t key_len;
+    const char *value;      // Raw JSON of the value
+    size_t value_len;
+    const char *string;     // Unescaped value when it is a string, NULL otherwise
+    size_t string_len;
+} simdjsonMember;
+
+// Returns the number of members of the object in [json, json + len), or -1 if it is not a valid
+// JSON object (including valid JSON of another type) with simdjson's error in error_text
+long simdjsonParseObject(const char *json, size_t len, const simdjsonMember **members, char *error_text, size_t error_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
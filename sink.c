@@ -0,0 +1,1086 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "sink.h"
+#include "retry.h"
+#include "consumer.h"
+#include "memtrack.h"
+
+void sinkEntryInit(sinkEntry *entry, const char *key) {
+    entry->command = NULL;
+    entry->key = key;
+    entry->field_count = 0;
+}
+
+void sinkCommandInit(sinkEntry *entry, const char *command, const char *key) {
+    entry->command = command;
+    entry->key = key;
+    entry->field_count = 0;
+}
+
+void sinkEntryAdd(sinkEntry *entry, const char *field, const char *value, size_t len) {
+    if (entry->field_count < SINK_MAX_FIELDS) {
+        entry->fields[entry->field_count] = field;
+        entry->values[entry->field_count] = value;
+        entry->value_lens[entry->field_count] = len;
+        entry->field_count++;
+    }
+}
+
+static size_t entryBytes(const sinkEntry *entry) {
+    size_t bytes = 0;
+    for (int i = 0; i < entry->field_count; i++) {
+        bytes += (entry->fields[i] ? strlen(entry->fields[i]) : 0) + entry->value_lens[i];
+    }
+    return bytes;
+}
+
+static sink *createSink(const char *name, int max_pending) {
+    sink *s = (sink *)memCalloc(MEM_OUTPUT, 1, sizeof(sink));
+    if (s != NULL) {
+        s->name = name;
+        s->max_pending = max_pending;
+    }
+    return s;
+}
+
+static void addPending(sink *s, int entries) {
+    uint64_t now = monotonicNanos();
+    if (s->pending == 0) {
+        s->oldest_pending_ns = now;
+    }
+    s->pending += entries;
+    s->pending_ns_sum += now * entries;
+}
+
+int sinkWrite(sink *s, const sinkEntry *entry) {
+    int res = s->write(s, entry);
+    if (res < 0) {
+        s->stats.errors++;
+        return -1;
+    }
+    s->stats.bytes += entryBytes(entry);
+    if (res > 0) {
+        // Held back; it becomes pending once poll queues it
+        return 0;
+    }
+    addPending(s, 1);
+
+    // Failed entries are the sink's to retry; only a broken sink fails the write
+    if (s->pending >= s->max_pending && sinkFlush(s, SINK_FLUSH_SIZE) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int sinkPoll(sink *s) {
+    int queued = s->poll ? s->poll(s) : 0;
+    if (queued > 0) {
+        addPending(s, queued);
+        if (s->pending >= s->max_pending) {
+            sinkFlush(s, SINK_FLUSH_SIZE);
+        }
+    }
+    return queued;
+}
+
+int sinkPollTimeout(sink *s) {
+    return s->timeout ? s->timeout(s) : -1;
+}
+
+void sinkSetController(sink *s, batchController *controller) {
+    s->controller = controller;
+    if (controller != NULL) {
+        s->max_pending = controller->batch_size;
+    }
+}
+
+// Milliseconds until the pending entries must be flushed: -1 with nothing pending, 0 for now.
+// Without a controller or a fixed deadline entries are flushed as soon as there is no more input.
+int sinkFlushWait(sink *s) {
+    if (s->pending == 0) {
+        return -1;
+    }
+    uint64_t deadline_ns = s->controller != NULL ? s->controller->flush_deadline_ns : s->flush_deadline_ns;
+    if (deadline_ns == 0) {
+        return 0;
+    }
+    uint64_t age = monotonicNanos() - s->oldest_pending_ns;
+    if (age >= deadline_ns) {
+        return 0;
+    }
+    return (int)((deadline_ns - age + 999999) / 1000000);
+}
+
+int sinkFlush(sink *s, int reason) {
+    if (s->pending == 0) {
+        return 0;
+    }
+
+    int failed = s->flush(s);
+    uint64_t now = monotonicNanos();
+    s->stats.flush_reasons[reason]++;
+    if (s->controller != NULL) {
+        batchControllerObserve(s->controller, now - s->oldest_pending_ns, s->pending, now);
+        s->max_pending = s->controller->batch_size;
+    }
+
+    // Every pending entry waited (now - its write time); summed without keeping per entry timestamps
+    s->stats.queue_ns_total += (uint64_t)s->pending * now - s->pending_ns_sum;
+    if (now - s->oldest_pending_ns > s->stats.queue_ns_max) {
+        s->stats.queue_ns_max = now - s->oldest_pending_ns;
+    }
+    s->stats.flushes++;
+    if (failed < 0) {
+        s->stats.errors += s->pending;
+    } else {
+        s->stats.entries += s->pending - failed;
+        s->stats.errors += failed;
+    }
+    s->pending = 0;
+    s->pending_ns_sum = 0;
+    return failed;
+}
+
+void sinkClose(sink *s) {
+    if (s != NULL) {
+        sinkFlush(s, SINK_FLUSH_IDLE);
+        s->close(s);
+        memFree(s);
+    }
+}
+
+void sinkReport(sink *s, double seconds) {
+    sinkStats *st = &s->stats;
+    uint64_t queued = st->entries + st->errors;
+    printf("Sink %s: %.0f entries/s, %.2f MB/s, %llu flushes, %llu errors, queueing latency avg %.3f ms max %.3f ms\n",
+            s->name, st->entries / seconds, st->bytes / 1e6 / seconds,
+            (unsigned long long)st->flushes, (unsigned long long)st->errors,
+            queued ? st->queue_ns_total / 1e6 / queued : 0.0, st->queue_ns_max / 1e6);
+    printf("Sink %s flushes by size: %llu, by deadline: %llu, when idle: %llu\n", s->name,
+            (unsigned long long)st->flush_reasons[SINK_FLUSH_SIZE], (unsigned long long)st->flush_reasons[SINK_FLUSH_DEADLINE],
+            (unsigned long long)st->flush_reasons[SINK_FLUSH_IDLE]);
+    if (s->controller != NULL) {
+        batchController *bc = s->controller;
+        printf("Sink %s batching: batch size %d, flush deadline %.1f ms, last p99 %.3f ms (target %.3f ms)\n", s->name,
+                bc->batch_size, bc->flush_deadline_ns / 1e6, bc->last_p99_ns / 1e6, bc->target_p99_ns / 1e6);
+    }
+    if (s->report) {
+        s->report(s);
+    }
+    memset(st, 0, sizeof(*st));
+}
+
+// Commands are formatted in RESP by the sinks themselves, so they can be kept for
+// retries (redis) or written out verbatim (file).
+
+static size_t bulkSize(size_t len) {
+    size_t digits = 1;
+    for (size_t n = len; n >= 10; n /= 10) {
+        digits++;
+    }
+    return 1 + digits + 2 + len + 2;
+}
+
+static size_t formattedCommandSize(const sinkEntry *entry) {
+    const char *command = entry->command ? entry->command : "XADD";
+    size_t size = 16 + bulkSize(strlen(command)) + bulkSize(strlen(entry->key)) + bulkSize(1);
+    for (int i = 0; i < entry->field_count; i++) {
+        if (entry->fields[i] != NULL) {
+            size += bulkSize(strlen(entry->fields[i]));
+        }
+        size += bulkSize(entry->value_lens[i]);
+    }
+    return size;
+}
+
+static size_t formatBulk(char *out, const char *data, size_t len) {
+    size_t n = sprintf(out, "$%zu\r\n", len);
+    memcpy(out + n, data, len);
+    n += len;
+    out[n++] = '\r';
+    out[n++] = '\n';
+    return n;
+}
+
+// out must hold formattedCommandSize(entry) bytes
+static size_t formatCommand(const sinkEntry *entry, char *out) {
+    int xadd = entry->command == NULL;
+    const char *command = xadd ? "XADD" : entry->command;
+    int argc = 2 + xadd;
+    for (int i = 0; i < entry->field_count; i++) {
+        argc += entry->fields[i] != NULL ? 2 : 1;
+    }
+
+    size_t n = sprintf(out, "*%d\r\n", argc);
+    n += formatBulk(out + n, command, strlen(command));
+    n += formatBulk(out + n, entry->key, strlen(entry->key));
+    if (xadd) {
+        n += formatBulk(out + n, "*", 1);
+    }
+    for (int i = 0; i < entry->field_count; i++) {
+        if (entry->fields[i] != NULL) {
+            n += formatBulk(out + n, entry->fields[i], strlen(entry->fields[i]));
+        }
+        n += formatBulk(out + n, entry->values[i], entry->value_lens[i]);
+    }
+    return n;
+}
+
+// Reads a RESP length line ("*3\r\n", "$5\r\n") at buf[*pos]: 1 and advances *pos, 0 if incomplete, -1 if malformed
+static int readLength(const char *buf, size_t len, size_t *pos, char prefix, size_t *value) {
+    size_t p = *pos;
+    if (p >= len) {
+        return 0;
+    }
+    if (buf[p++] != prefix) {
+        return -1;
+    }
+    size_t v = 0;
+    int digits = 0;
+    while (p < len && buf[p] >= '0' && buf[p] <= '9' && digits < 18) {
+        v = v * 10 + (buf[p++] - '0');
+        digits++;
+    }
+    if (p + 2 > len) {
+        return 0;
+    }
+    if (digits == 0 || buf[p] != '\r' || buf[p + 1] != '\n') {
+        return -1;
+    }
+    *pos = p + 2;
+    *value = v;
+    return 1;
+}
+
+int sinkReadCommand(const char *buf, size_t len, size_t *pos, const char **argv, size_t *lens, int max) {
+    size_t p = *pos;
+    size_t argc;
+    int res = readLength(buf, len, &p, '*', &argc);
+    if (res <= 0) {
+        return res;
+    }
+    if (argc == 0 || argc > (size_t)max) {
+        return -1;
+    }
+    for (size_t i = 0; i < argc; i++) {
+        size_t n;
+        if ((res = readLength(buf, len, &p, '$', &n)) <= 0) {
+            return res;
+        }
+        if (n + 2 > len - p) {
+            return 0;
+        }
+        if (buf[p + n] != '\r' || buf[p + n + 1] != '\n') {
+            return -1;
+        }
+        argv[i] = buf + p;
+        lens[i] = n;
+        p += n + 2;
+    }
+    *pos = p;
+    return (int)argc;
+}
+
+// Redis stream sink: XADDs are collected in one buffer and sent as one MULTI/EXEC transaction, so a
+// whole batch costs one round trip. Entries that fail wait in the retry queue, and every write made
+// after them waits behind them, so entries land in the order they were written; entries that run out
+// of attempts are dead-lettered, and dead letters that fail are dropped.
+
+#define DEAD_LETTER_ATTEMPT -1
+
+// Outcome of each command of a flushed batch
+#define WRITE_DONE 0
+#define WRITE_REFUSED 1   // Redis answered with an error; costs an attempt
+#define WRITE_AGAIN 2     // Aborted with the batch or lost with the connection; sent again as it is
+
+typedef struct {
+    redisContext *c;
+    const connectionOptions *options; // Reapplied on reconnect; NULL when the connection cannot be re-established
+    int failures;          // Failed batches and reconnect attempts in a row, for the backoff
+    char *buf;             // Formatted commands of the current batch
+    size_t len;
+    size_t capacity;
+    size_t *offsets;       // Start of each command in buf
+    int *attempts;         // Previous attempts of each command, DEAD_LETTER_ATTEMPT for dead letters
+    unsigned char *outcomes;
+    int count;
+    int max_count;
+    retryQueue retry;
+    retryItem *dead_letters; // Commands that ran out of attempts, dead-lettered on the next poll
+    uint64_t recovered;
+    uint64_t dead_lettered;
+    uint64_t dropped;
+} redisSinkState;
+
+static int redisSinkAppend(redisSinkState *rs, size_t size, int attempts, const char *command, const sinkEntry *entry) {
+    if (rs->count == rs->max_count) {
+        int max_count = rs->max_count * 2;
+        size_t *offsets = (size_t *)memRealloc(MEM_OUTPUT, rs->offsets, sizeof(size_t) * (max_count + 1));
+        int *attempts_list = offsets ? (int *)memRealloc(MEM_OUTPUT, rs->attempts, sizeof(int) * max_count) : NULL;
+        unsigned char *outcomes = attempts_list ? (unsigned char *)memRealloc(MEM_OUTPUT, rs->outcomes, max_count) : NULL;
+        if (offsets == NULL || attempts_list == NULL || outcomes == NULL) {
+            if (offsets) rs->offsets = offsets;
+            if (attempts_list) rs->attempts = attempts_list;
+            return -1;
+        }
+        rs->offsets = offsets;
+        rs->attempts = attempts_list;
+        rs->outcomes = outcomes;
+        rs->max_count = max_count;
+    }
+    if (rs->len + size > rs->capacity) {
+        size_t capacity = rs->capacity * 2;
+        while (capacity < rs->len + size) {
+            capacity *= 2;
+        }
+        char *buf = (char *)memRealloc(MEM_OUTPUT, rs->buf, capacity);
+        if (buf == NULL) {
+            return -1;
+        }
+        rs->buf = buf;
+        rs->capacity = capacity;
+    }
+
+    rs->offsets[rs->count] = rs->len;
+    rs->attempts[rs->count] = attempts;
+    if (command != NULL) {
+        memcpy(rs->buf + rs->len, command, size);
+        rs->len += size;
+    } else {
+        rs->len += formatCommand(entry, rs->buf + rs->len);
+    }
+    rs->count++;
+    rs->offsets[rs->count] = rs->len;
+    return 0;
+}
+
+// Keeps a command that cannot be retried for the dead-letter stream
+static void redisSinkDeadLetterLater(redisSinkState *rs, const char *command, size_t len, int attempts) {
+    retryItem *item = (retryItem *)memAlloc(MEM_OUTPUT, sizeof(retryItem) + len);
+    if (item == NULL) {
+        rs->dropped++;
+        return;
+    }
+    item->len = len;
+    item->attempts = attempts;
+    memcpy(item->command, command, len);
+    item->next = rs->dead_letters;
+    rs->dead_letters = item;
+}
+
+static int redisSinkWrite(sink *s, const sinkEntry *entry) {
+    redisSinkState *rs = (redisSinkState *)s->state;
+    if (redisSinkAppend(rs, formattedCommandSize(entry), 0, NULL, entry) != 0) {
+        return -1;
+    }
+    if (rs->retry.count == 0) {
+        return 0;
+    }
+
+    // Earlier writes are waiting to be retried: take the command back out of the batch and queue it behind them
+    rs->count--;
+    rs->len = rs->offsets[rs->count];
+    const char *command = rs->buf + rs->len;
+    size_t len = rs->offsets[rs->count + 1] - rs->len;
+    retryItem *item = retryItemNew(&rs->retry, command, len, 0);
+    if (item != NULL) {
+        retryQueuePush(&rs->retry, item, item, 0);
+    } else {
+        redisSinkDeadLetterLater(rs, command, len, 0);
+    }
+    return 1;
+}
+
+// Collects failed command i into the list first..last, which goes back to the front of the retry queue
+static void redisSinkFailed(redisSinkState *rs, int i, retryItem **first, retryItem **last) {
+    const char *command = rs->buf + rs->offsets[i];
+    size_t len = rs->offsets[i + 1] - rs->offsets[i];
+    int attempts = rs->attempts[i];
+    int refused = rs->outcomes[i] == WRITE_REFUSED;
+
+    if (attempts == DEAD_LETTER_ATTEMPT && refused) {
+        rs->dropped++;
+        return;
+    }
+    retryItem *item = retryItemNew(&rs->retry, command, len, refused && attempts != DEAD_LETTER_ATTEMPT ? attempts + 1 : attempts);
+    if (item != NULL) {
+        if (*first == NULL) {
+            *first = item;
+        } else {
+            (*last)->next = item;
+        }
+        *last = item;
+        return;
+    }
+
+    // Out of attempts or retry memory
+    if (attempts == DEAD_LETTER_ATTEMPT) {
+        rs->dropped++;
+    } else {
+        redisSinkDeadLetterLater(rs, command, len, attempts);
+    }
+}
+
+// Reads the replies of a batch sent as MULTI, the commands, EXEC into rs->outcomes, which start out
+// as WRITE_AGAIN for anything without a reply. A command refused while queueing (OOM, READONLY, ...)
+// makes EXEC abort the rest of the batch, so none of it lands ahead of the refused one; only commands
+// that fail while EXEC runs leave the others in place. Returns the first error, or NULL.
+static const char *redisSinkReplies(redisSinkState *rs, char *error, size_t error_size) {
+    redisContext *c = rs->c;
+    const char *first_error = NULL;
+    redisReply *reply = NULL;
+    if (redisGetReply(c, (void **)&reply) != REDIS_OK) {
+        return NULL;
+    }
+    // Without a transaction, say if MULTI itself was refused, the commands ran one by one
+    int transaction = reply->type != REDIS_REPLY_ERROR;
+    freeReplyObject(reply);
+
+    int queued = 0;
+    for (int i = 0; i < rs->count; i++) {
+        if (redisGetReply(c, (void **)&reply) != REDIS_OK) {
+            return first_error;
+        }
+        if (reply->type == REDIS_REPLY_ERROR) {
+            if (first_error == NULL) {
+                snprintf(error, error_size, "%s", reply->str);
+                first_error = error;
+            }
+            rs->outcomes[i] = WRITE_REFUSED;
+        } else if (!transaction) {
+            rs->outcomes[i] = WRITE_DONE;
+        } else {
+            queued++;
+        }
+        freeReplyObject(reply);
+    }
+
+    if (redisGetReply(c, (void **)&reply) != REDIS_OK) {
+        return first_error;
+    }
+    if (transaction && reply->type == REDIS_REPLY_ARRAY && reply->elements == (size_t)queued) {
+        size_t next = 0;
+        for (int i = 0; i < rs->count; i++) {
+            if (rs->outcomes[i] == WRITE_REFUSED) {
+                continue;
+            }
+            redisReply *result = reply->element[next++];
+            if (result->type == REDIS_REPLY_ERROR) {
+                if (first_error == NULL) {
+                    snprintf(error, error_size, "%s", result->str);
+                    first_error = error;
+                }
+                rs->outcomes[i] = WRITE_REFUSED;
+            } else {
+                rs->outcomes[i] = WRITE_DONE;
+            }
+        }
+    }
+    // Otherwise EXEC aborted, and everything that was not refused goes again as it is
+    freeReplyObject(reply);
+    return first_error;
+}
+
+static int redisSinkFlush(sink *s) {
+    redisSinkState *rs = (redisSinkState *)s->state;
+    redisContext *c = rs->c;
+    if (rs->count == 0) {
+        return 0;
+    }
+
+    char error[128];
+    const char *first_error = NULL;
+    memset(rs->outcomes, WRITE_AGAIN, rs->count);
+    if (c->err == 0 && redisAppendCommand(c, "MULTI") == REDIS_OK
+            && redisAppendFormattedCommand(c, rs->buf, rs->len) == REDIS_OK && redisAppendCommand(c, "EXEC") == REDIS_OK) {
+        first_error = redisSinkReplies(rs, error, sizeof(error));
+    }
+
+    int failed = 0;
+    retryItem *first = NULL, *last = NULL;
+    for (int i = 0; i < rs->count; i++) {
+        if (rs->outcomes[i] == WRITE_DONE) {
+            if (rs->attempts[i] > 0) {
+                rs->recovered++;
+            }
+            continue;
+        }
+        redisSinkFailed(rs, i, &first, &last);
+        failed++;
+    }
+
+    // One line per batch, so an error burst does not flood the log
+    if (c->err) {
+        fprintf(stderr, "Error storing processed messages in Redis: %s\n", c->errstr);
+    } else if (first_error != NULL) {
+        fprintf(stderr, "Error storing processed message in Redis: %s\n", first_error);
+    }
+    if (failed > 1) {
+        fprintf(stderr, "%d more writes in the same batch failed and will be retried\n", failed - 1);
+    }
+    if (first != NULL) {
+        // Ahead of the writes that queued up behind them meanwhile
+        retryQueuePush(&rs->retry, first, last, 1);
+    }
+    if (failed > 0) {
+        retryQueueHold(&rs->retry, ++rs->failures);
+    } else {
+        rs->failures = 0;
+    }
+
+    rs->len = 0;
+    rs->count = 0;
+    return failed;
+}
+
+static int redisSinkDeadLetter(redisSinkState *rs, retryItem *item) {
+    sinkEntry entry;
+    char attempts[16];
+    char timestamp[24];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    sinkEntryInit(&entry, DEAD_LETTER_KEY);
+    sinkEntryAdd(&entry, "payload", item->command, item->len);
+    sinkEntryAdd(&entry, "error_class", "write_failed", strlen("write_failed"));
+    sinkEntryAdd(&entry, "attempts", attempts, snprintf(attempts, sizeof(attempts), "%d", item->attempts + 1));
+    sinkEntryAdd(&entry, "timestamp", timestamp, snprintf(timestamp, sizeof(timestamp), "%llu",
+            (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000));
+    return redisSinkAppend(rs, formattedCommandSize(&entry), DEAD_LETTER_ATTEMPT, NULL, &entry);
+}
+
+static int redisSinkReconnect(redisSinkState *rs) {
+    if (rs->options == NULL || redisReconnect(rs->c) != REDIS_OK) {
+        return -1;
+    }
+    if (applySocketOptions(rs->c, rs->options) != 0) {
+        fprintf(stderr, "Error applying socket options after reconnecting\n");
+    }
+    return 0;
+}
+
+static int redisSinkPoll(sink *s) {
+    redisSinkState *rs = (redisSinkState *)s->state;
+    int queued = 0;
+
+    // After a failed batch or reconnect attempt nothing goes out until the backoff has passed
+    if (retryQueueHeld(&rs->retry)) {
+        return 0;
+    }
+    if (rs->c->err) {
+        // The connect timeout bounds each attempt, so a dead server costs neither a spin nor a stall
+        if (redisSinkReconnect(rs) != 0) {
+            retryQueueHold(&rs->retry, ++rs->failures);
+            return 0;
+        }
+        fprintf(stderr, "Reconnected to redis, retrying %zu failed writes\n", rs->retry.count);
+    }
+
+    // Queued writes go out in order, a batch at a time; later writes keep queueing behind them until they are all out
+    retryItem *item;
+    while (rs->count < s->max_pending && (item = retryQueueTake(&rs->retry)) != NULL) {
+        if (redisSinkAppend(rs, item->len, item->attempts, item->command, NULL) == 0) {
+            queued++;
+        } else {
+            rs->dropped++;
+        }
+        retryItemFree(&rs->retry, item);
+    }
+
+    item = rs->dead_letters;
+    rs->dead_letters = NULL;
+    while (item != NULL) {
+        retryItem *next = item->next;
+        if (redisSinkDeadLetter(rs, item) == 0) {
+            queued++;
+            rs->dead_lettered++;
+        } else {
+            rs->dropped++;
+        }
+        memFree(item);
+        item = next;
+    }
+    return queued;
+}
+
+static int redisSinkTimeout(sink *s) {
+    redisSinkState *rs = (redisSinkState *)s->state;
+    int timeout = retryQueueTimeout(&rs->retry);
+    // Dead letters, or a reconnect attempt, are due as soon as the queue is not held back
+    if (timeout < 0 && (rs->dead_letters != NULL || rs->c->err)) {
+        timeout = 0;
+    }
+    return timeout;
+}
+
+static void redisSinkReport(sink *s) {
+    redisSinkState *rs = (redisSinkState *)s->state;
+    printf("Sink %s retries: %zu pending (%zu bytes), %llu scheduled, %llu recovered, %llu dead-lettered, %llu dropped\n",
+            s->name, rs->retry.count, rs->retry.bytes, (unsigned long long)rs->retry.scheduled,
+            (unsigned long long)rs->recovered, (unsigned long long)rs->dead_lettered, (unsigned long long)rs->dropped);
+}
+
+static void redisSinkClose(sink *s) {
+    redisSinkState *rs = (redisSinkState *)s->state;
+    retryQueueFree(&rs->retry);
+    while (rs->dead_letters != NULL) {
+        retryItem *next = rs->dead_letters->next;
+        memFree(rs->dead_letters);
+        rs->dead_letters = next;
+    }
+    memFree(rs->buf);
+    memFree(rs->offsets);
+    memFree(rs->attempts);
+    memFree(rs->outcomes);
+    memFree(rs); // The connection is owned by the caller
+}
+
+sink *createRedisStreamSink(redisContext *c, const connectionOptions *options, size_t retry_max_bytes) {
+    redisSinkState *rs = (redisSinkState *)memCalloc(MEM_OUTPUT, 1, sizeof(redisSinkState));
+    if (rs == NULL) {
+        return NULL;
+    }
+    rs->c = c;
+    rs->options = options;
+    rs->capacity = MESSAGES_BUFFER_SIZE;
+    rs->max_count = SINK_PIPELINE_DEPTH;
+    rs->buf = (char *)memAlloc(MEM_OUTPUT, rs->capacity);
+    rs->offsets = (size_t *)memAlloc(MEM_OUTPUT, sizeof(size_t) * (rs->max_count + 1));
+    rs->attempts = (int *)memAlloc(MEM_OUTPUT, sizeof(int) * rs->max_count);
+    rs->outcomes = (unsigned char *)memAlloc(MEM_OUTPUT, rs->max_count);
+    retryQueueInit(&rs->retry, retry_max_bytes);
+
+    sink *s = createSink("redis", SINK_PIPELINE_DEPTH);
+    if (s == NULL || rs->buf == NULL || rs->offsets == NULL || rs->attempts == NULL || rs->outcomes == NULL) {
+        memFree(s);
+        memFree(rs->buf);
+        memFree(rs->offsets);
+        memFree(rs->attempts);
+        memFree(rs->outcomes);
+        memFree(rs);
+        return NULL;
+    }
+    s->state = rs;
+    s->write = redisSinkWrite;
+    s->flush = redisSinkFlush;
+    s->close = redisSinkClose;
+    s->poll = redisSinkPoll;
+    s->timeout = redisSinkTimeout;
+    s->report = redisSinkReport;
+    return s;
+}
+
+// Retry benchmark: the redis sink against an in-process stand-in for Redis on a socket pair, which
+// refuses every RETRY_BENCHMARK_FAIL_EVERY-th XADD while a burst is on, the way Redis refuses writes
+// over maxmemory as they are queued in a transaction, and records what it accepted
+
+typedef struct {
+    int fd;
+    int failing;                  // Set by the benchmark thread
+    int max_entries;
+    unsigned char *accepted;      // Per seq
+    int accepted_count;
+    int max_seq;                  // Highest seq accepted so far
+    int in_multi;
+    int aborted;                  // A command was refused since MULTI
+    int *queued;                  // Seqs queued since MULTI, -1 for dead letters
+    int queued_count;
+    int queued_capacity;
+    char *out;                    // Replies to send
+    size_t out_len;
+    size_t out_capacity;
+    uint64_t commands;
+    uint64_t refused;
+    uint64_t overtaken;           // Accepted after a higher seq
+    uint64_t violations;          // Duplicates, unknown commands, or reordered entries
+} fakeRedis;
+
+static void fakeRedisReply(fakeRedis *r, const char *reply, size_t len) {
+    if (r->out_len + len > r->out_capacity) {
+        size_t capacity = r->out_capacity * 2 > r->out_len + len ? r->out_capacity * 2 : r->out_len + len;
+        char *out = (char *)memRealloc(MEM_OTHER, r->out, capacity);
+        if (out == NULL) {
+            r->violations++;
+            return;
+        }
+        r->out = out;
+        r->out_capacity = capacity;
+    }
+    memcpy(r->out + r->out_len, reply, len);
+    r->out_len += len;
+}
+
+static void fakeRedisAccept(fakeRedis *r, int seq) {
+    if (seq < 0) {
+        return;
+    }
+    if (r->accepted[seq]) {
+        r->violations++;
+    }
+    if (seq < r->max_seq) {
+        r->overtaken++;
+        r->violations++;
+    } else {
+        r->max_seq = seq;
+    }
+    r->accepted[seq] = 1;
+    __atomic_add_fetch(&r->accepted_count, 1, __ATOMIC_RELEASE);
+}
+
+static int fakeRedisIs(const char **argv, const size_t *lens, int argc, const char *command) {
+    return argc == 1 && lens[0] == strlen(command) && memcmp(argv[0], command, lens[0]) == 0;
+}
+
+static void fakeRedisCommand(fakeRedis *r, const char **argv, const size_t *lens, int argc) {
+    if (fakeRedisIs(argv, lens, argc, "MULTI")) {
+        r->in_multi = 1;
+        r->aborted = 0;
+        r->queued_count = 0;
+        fakeRedisReply(r, "+OK\r\n", 5);
+        return;
+    }
+    if (fakeRedisIs(argv, lens, argc, "EXEC")) {
+        if (!r->in_multi) {
+            r->violations++;
+            fakeRedisReply(r, "-ERR EXEC without MULTI\r\n", 25);
+            return;
+        }
+        r->in_multi = 0;
+        if (r->aborted) {
+            fakeRedisReply(r, "-EXECABORT Transaction discarded because of previous errors.\r\n", 62);
+            return;
+        }
+        char header[16];
+        fakeRedisReply(r, header, snprintf(header, sizeof(header), "*%d\r\n", r->queued_count));
+        for (int i = 0; i < r->queued_count; i++) {
+            fakeRedisAccept(r, r->queued[i]);
+            fakeRedisReply(r, "$3\r\n0-1\r\n", 9);
+        }
+        return;
+    }
+
+    int seq = -1;
+    if (argc == 7 && lens[0] == 4 && memcmp(argv[0], "XADD", 4) == 0 && lens[1] == strlen(STREAM_KEY)
+            && memcmp(argv[1], STREAM_KEY, lens[1]) == 0 && lens[3] == 3 && memcmp(argv[3], "seq", 3) == 0) {
+        seq = atoi(argv[4]);
+    }
+    if (seq < 0 || seq >= r->max_entries) {
+        // Dead letters show up in the sink stats; anything else should not be sent at all
+        if (argc < 2 || lens[1] != strlen(DEAD_LETTER_KEY) || memcmp(argv[1], DEAD_LETTER_KEY, lens[1]) != 0) {
+            r->violations++;
+        }
+        seq = -1;
+    } else if (__atomic_load_n(&r->failing, __ATOMIC_ACQUIRE) && r->commands++ % RETRY_BENCHMARK_FAIL_EVERY == 0) {
+        r->refused++;
+        r->aborted |= r->in_multi;
+        fakeRedisReply(r, "-OOM command not allowed when used memory > 'maxmemory'.\r\n", 58);
+        return;
+    }
+
+    if (!r->in_multi) {
+        fakeRedisAccept(r, seq);
+        fakeRedisReply(r, "$3\r\n0-1\r\n", 9);
+        return;
+    }
+    if (r->queued_count == r->queued_capacity) {
+        int capacity = r->queued_capacity ? r->queued_capacity * 2 : 1024;
+        int *queued = (int *)memRealloc(MEM_OTHER, r->queued, sizeof(int) * capacity);
+        if (queued == NULL) {
+            r->violations++;
+            return;
+        }
+        r->queued = queued;
+        r->queued_capacity = capacity;
+    }
+    r->queued[r->queued_count++] = seq;
+    fakeRedisReply(r, "+QUEUED\r\n", 9);
+}
+
+static void *fakeRedisServe(void *arg) {
+    fakeRedis *r = (fakeRedis *)arg;
+    size_t capacity = 1 << 20;
+    char *buf = (char *)memAlloc(MEM_OTHER, capacity);
+    size_t len = 0;
+    while (buf != NULL) {
+        ssize_t n = read(r->fd, buf + len, capacity - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+
+        const char *argv[SINK_MAX_FIELDS * 2 + 3];
+        size_t lens[SINK_MAX_FIELDS * 2 + 3];
+        size_t pos = 0;
+        int argc;
+        while ((argc = sinkReadCommand(buf, len, &pos, argv, lens, SINK_MAX_FIELDS * 2 + 3)) > 0) {
+            fakeRedisCommand(r, argv, lens, argc);
+        }
+        if (argc < 0) {
+            r->violations++;
+            break;
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+        for (size_t written = 0; written < r->out_len; ) {
+            ssize_t w = write(r->fd, r->out + written, r->out_len - written);
+            if (w <= 0) {
+                break;
+            }
+            written += w;
+        }
+        r->out_len = 0;
+    }
+    memFree(buf);
+    return NULL;
+}
+
+static void retryBenchmarkWrite(sink *s, int seq) {
+    static const char payload[] = "{\"message_id\":\"00000000-0000-4000-8000-000000000000\",\"consumer_id\":1}";
+    char number[16];
+    sinkEntry entry;
+    sinkEntryInit(&entry, STREAM_KEY);
+    sinkEntryAdd(&entry, "seq", number, snprintf(number, sizeof(number), "%d", seq));
+    sinkEntryAdd(&entry, "payload", payload, sizeof(payload) - 1);
+    sinkWrite(s, &entry);
+    // Due retries join the next batch, as between reads in the main loop
+    if (seq % 16 == 0) {
+        sinkPoll(s);
+    }
+}
+
+// Flushes and retries until the stand-in holds accepted entries or the timeout passes; returns the milliseconds taken
+static double retryBenchmarkDrain(sink *s, fakeRedis *r, int accepted, uint64_t start) {
+    uint64_t deadline = start + (uint64_t)RETRY_BENCHMARK_TIMEOUT_MS * 1000000;
+    sinkFlush(s, SINK_FLUSH_IDLE);
+    while (__atomic_load_n(&r->accepted_count, __ATOMIC_ACQUIRE) < accepted && monotonicNanos() < deadline) {
+        int wait = sinkPollTimeout(s);
+        if (wait > 0) {
+            struct timespec ts = { wait / 1000, (wait % 1000) * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+        sinkPoll(s);
+        sinkFlush(s, SINK_FLUSH_IDLE);
+    }
+    return (monotonicNanos() - start) / 1e6;
+}
+
+int sinkRetryBenchmark(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("Error creating the retry benchmark socket pair");
+        return -1;
+    }
+    fakeRedis r;
+    memset(&r, 0, sizeof(r));
+    r.fd = fds[1];
+    r.max_entries = 3 * RETRY_BENCHMARK_ENTRIES;
+    r.max_seq = -1;
+    r.accepted = (unsigned char *)memCalloc(MEM_OTHER, r.max_entries, 1);
+    redisContext *c = redisConnectFd(fds[0]);
+    sink *s = c != NULL ? createRedisStreamSink(c, NULL, RETRY_MAX_BYTES) : NULL;
+    pthread_t server;
+    if (r.accepted == NULL || s == NULL || pthread_create(&server, NULL, fakeRedisServe, &r) != 0) {
+        fprintf(stderr, "Error setting up the retry benchmark\n");
+        if (s) sinkClose(s);
+        if (c) redisFree(c); else close(fds[0]);
+        close(fds[1]);
+        memFree(r.accepted);
+        return -1;
+    }
+    printf("Retry benchmark: %d entries, a %d ms burst failing every %d XADD, then %d entries more\n",
+            RETRY_BENCHMARK_ENTRIES, RETRY_BENCHMARK_BURST_MS, RETRY_BENCHMARK_FAIL_EVERY, RETRY_BENCHMARK_ENTRIES);
+
+    // Without errors
+    int seq = 0;
+    uint64_t start = monotonicNanos();
+    while (seq < RETRY_BENCHMARK_ENTRIES) {
+        retryBenchmarkWrite(s, seq++);
+    }
+    double clean_ms = retryBenchmarkDrain(s, &r, seq, start);
+
+    // During the burst, retries that come due fail again like any other write. Entries arrive at a
+    // steady rate rather than as fast as they can be queued, which would only measure the retry memory limit
+    __atomic_store_n(&r.failing, 1, __ATOMIC_RELEASE);
+    start = monotonicNanos();
+    int burst_start = seq;
+    uint64_t elapsed;
+    while ((elapsed = monotonicNanos() - start) < (uint64_t)RETRY_BENCHMARK_BURST_MS * 1000000) {
+        int due = burst_start + (int)(elapsed * RETRY_BENCHMARK_ENTRIES / ((uint64_t)RETRY_BENCHMARK_BURST_MS * 1000000));
+        while (seq < due) {
+            retryBenchmarkWrite(s, seq++);
+        }
+        sinkPoll(s);
+        sinkFlush(s, SINK_FLUSH_IDLE);
+        struct timespec ts = { 0, 100000 };
+        nanosleep(&ts, NULL);
+    }
+    double burst_ms = (monotonicNanos() - start) / 1e6;
+    int burst_accepted = __atomic_load_n(&r.accepted_count, __ATOMIC_ACQUIRE) - burst_start;
+    __atomic_store_n(&r.failing, 0, __ATOMIC_RELEASE);
+
+    // After it: the refused entries go out first, and new ones queue behind them until they have
+    start = monotonicNanos();
+    for (int i = 0; i < RETRY_BENCHMARK_ENTRIES; i++) {
+        retryBenchmarkWrite(s, seq++);
+    }
+    double recovery_ms = retryBenchmarkDrain(s, &r, seq, start);
+
+    redisSinkState *rs = (redisSinkState *)s->state;
+    uint64_t recovered = rs->recovered, dead_lettered = rs->dead_lettered, dropped = rs->dropped;
+    sinkClose(s);
+    redisFree(c);
+    pthread_join(server, NULL);
+    close(fds[1]);
+    memFree(r.queued);
+    memFree(r.out);
+
+    int missing = seq - r.accepted_count;
+    printf("No errors: %.0f entries/s\n", RETRY_BENCHMARK_ENTRIES / (clean_ms / 1e3));
+    printf("Burst: %d entries written, %llu writes refused, %.0f entries/s accepted\n", seq - burst_start - RETRY_BENCHMARK_ENTRIES,
+            (unsigned long long)r.refused, burst_accepted / (burst_ms / 1e3));
+    printf("Recovery: %s %.0f ms after the burst, %llu retried writes recovered, %llu dead-lettered, %llu dropped\n",
+            missing == 0 ? "all entries accepted" : "gave up", recovery_ms, (unsigned long long)recovered, (unsigned long long)dead_lettered, (unsigned long long)dropped);
+    printf("Order: %llu entries landed after later ones\n", (unsigned long long)r.overtaken);
+
+    int res = 0;
+    if (missing != 0 || r.violations != 0 || dead_lettered != 0 || dropped != 0) {
+        fprintf(stderr, "Retry benchmark failed: %d entries missing, %llu duplicated, unexpected or reordered\n",
+                missing, (unsigned long long)r.violations);
+        res = -1;
+    }
+    memFree(r.accepted);
+    return res;
+}
+
+// File sink: entries are appended as Redis commands in RESP, so the file can be replayed with
+// `redis-cli --pipe < file` once Redis is reachable again.
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t capacity;
+} fileSinkState;
+
+// Writes all of buf, across short writes and signals, so no command is ever left torn in the file
+static int fileSinkWriteAll(int fd, const char *buf, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, buf + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing sink file");
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+static int fileSinkDrain(fileSinkState *fs) {
+    if (fileSinkWriteAll(fs->fd, fs->buf, fs->len) != 0) {
+        return -1;
+    }
+    fs->len = 0;
+    return 0;
+}
+
+static int fileSinkWrite(sink *s, const sinkEntry *entry) {
+    fileSinkState *fs = (fileSinkState *)s->state;
+    size_t size = formattedCommandSize(entry);
+
+    if (fs->len + size > fs->capacity && fileSinkDrain(fs) != 0) {
+        return -1;
+    }
+    if (size > fs->capacity) {
+        // Larger than the whole buffer: format into a temporary one and write it straight out
+        char *command = (char *)memAlloc(MEM_OUTPUT, size);
+        if (command == NULL) {
+            return -1;
+        }
+        int res = fileSinkWriteAll(fs->fd, command, formatCommand(entry, command));
+        memFree(command);
+        return res;
+    }
+    fs->len += formatCommand(entry, fs->buf + fs->len);
+    return 0;
+}
+
+static int fileSinkFlush(sink *s) {
+    return fileSinkDrain((fileSinkState *)s->state) == 0 ? 0 : -1;
+}
+
+static void fileSinkClose(sink *s) {
+    fileSinkState *fs = (fileSinkState *)s->state;
+    fileSinkDrain(fs);
+    close(fs->fd);
+    memFree(fs->buf);
+    memFree(fs);
+}
+
+sink *createFileSink(const char *path) {
+    fileSinkState *fs = (fileSinkState *)memCalloc(MEM_OUTPUT, 1, sizeof(fileSinkState));
+    if (fs == NULL) {
+        return NULL;
+    }
+    fs->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    fs->buf = (char *)memAlloc(MEM_OUTPUT, SINK_FILE_BUFFER_SIZE);
+    fs->capacity = SINK_FILE_BUFFER_SIZE;
+    if (fs->fd < 0 || fs->buf == NULL) {
+        perror("Error opening sink file");
+        if (fs->fd >= 0) close(fs->fd);
+        memFree(fs->buf);
+        memFree(fs);
+        return NULL;
+    }
+
+    sink *s = createSink("file", SINK_FILE_MAX_PENDING);
+    if (s == NULL) {
+        close(fs->fd);
+        memFree(fs->buf);
+        memFree(fs);
+        return NULL;
+    }
+    s->state = fs;
+    s->write = fileSinkWrite;
+    s->flush = fileSinkFlush;
+    s->close = fileSinkClose;
+    return s;
+}
+
+// Null sink: accepts everything, for benchmarking processing without output costs
+
+static int nullSinkWrite(sink *s, const sinkEntry *entry) {
+    (void)s;
+    (void)entry;
+    return 0;
+}
+
+static int nullSinkFlush(sink *s) {
+    (void)s;
+    return 0;
+}
+
+static void nullSinkClose(sink *s) {
+    (void)s;
+}
+
+sink *createNullSink(void) {
+    sink *s = createSink("null", SINK_PIPELINE_DEPTH);
+    if (s != NULL) {
+        s->write = nullSinkWrite;
+        s->flush = nullSinkFlush;
+        s->close = nullSinkClose;
+    }
+    return s;
+}
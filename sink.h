@@ -0,0 +1,91 @@
+#ifndef _SINK_H
+#define _SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <hiredis.h>
+
+#include "batchctl.h"
+#include "connection.h"
+#include "clock.h"
+
+// Output sinks for stream entries. Entries are queued with sinkWrite() and become durable
+// on sinkFlush(), which a sink also triggers by itself once max_pending entries are queued.
+// An entry is an XADD to key unless sinkCommandInit() names another command; its fields and
+// values are then passed as arguments, with a NULL field passing only the value.
+
+#define SINK_MAX_FIELDS 8
+
+// Why a batch was flushed
+#define SINK_FLUSH_SIZE 0      // max_pending entries were queued
+#define SINK_FLUSH_DEADLINE 1  // The oldest entry reached the flush deadline
+#define SINK_FLUSH_IDLE 2      // No more input to wait for
+#define SINK_FLUSH_REASONS 3
+
+typedef struct {
+    const char *command;  // NULL for XADD
+    const char *key;
+    int field_count;
+    const char *fields[SINK_MAX_FIELDS];
+    const char *values[SINK_MAX_FIELDS];
+    size_t value_lens[SINK_MAX_FIELDS];
+} sinkEntry;
+
+typedef struct {
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t flushes;
+    uint64_t flush_reasons[SINK_FLUSH_REASONS];
+    uint64_t errors;
+    uint64_t queue_ns_total;  // Sum over entries of the time between write and flush
+    uint64_t queue_ns_max;
+} sinkStats;
+
+typedef struct sink {
+    const char *name;
+    void *state;
+    int max_pending;
+    batchController *controller;  // Optional: adapts max_pending and the flush deadline
+    uint64_t flush_deadline_ns;    // Without a controller: how long entries may wait for more, 0 flushes once input runs dry
+    int (*write)(struct sink *s, const sinkEntry *entry); // 1 if the entry waits for poll to queue it
+    int (*flush)(struct sink *s);  // Returns the number of entries that failed, or -1 if the sink is broken
+    void (*close)(struct sink *s);
+    int (*poll)(struct sink *s);    // Optional: queues deferred work (retries), returns the number of entries queued
+    int (*timeout)(struct sink *s); // Optional: milliseconds until poll has work, -1 for none
+    void (*report)(struct sink *s); // Optional: sink specific statistics
+
+    // Queueing bookkeeping shared by all sinks
+    int pending;
+    uint64_t pending_ns_sum;       // Sum of the write timestamps of pending entries
+    uint64_t oldest_pending_ns;
+    sinkStats stats;               // Since the last sinkReport
+} sink;
+
+void sinkEntryInit(sinkEntry *entry, const char *key);
+void sinkCommandInit(sinkEntry *entry, const char *command, const char *key);
+void sinkEntryAdd(sinkEntry *entry, const char *field, const char *value, size_t len);
+
+// options are reapplied whenever the sink reconnects c; with NULL it never reconnects
+sink *createRedisStreamSink(redisContext *c, const connectionOptions *options, size_t retry_max_bytes);
+sink *createFileSink(const char *path);
+sink *createNullSink(void);
+void sinkSetController(sink *s, batchController *controller);
+
+int sinkWrite(sink *s, const sinkEntry *entry);
+int sinkFlush(sink *s, int reason);
+int sinkFlushWait(sink *s);
+int sinkPoll(sink *s);
+int sinkPollTimeout(sink *s);
+void sinkClose(sink *s);
+void sinkReport(sink *s, double seconds);
+
+// Reads back one command as sinks format it, for replaying or checking file sink output: the
+// argument count with argv/lens (at most max) pointing into buf, 0 if incomplete, -1 if malformed
+int sinkReadCommand(const char *buf, size_t len, size_t *pos, const char **argv, size_t *lens, int max);
+
+// Writes through the redis sink to an in-process stand-in for Redis that fails every few writes for a
+// while, and reports throughput, recovery time and reordering. Returns -1 if an entry was lost,
+// duplicated, dead-lettered, or reordered.
+int sinkRetryBenchmark(void);
+
+#endif
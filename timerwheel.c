@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELAY (((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+void timerWheelInit(timerWheel *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+static void place(timerWheel *w, timerNode *node) {
+    int level = 0;
+    // Lowest level whose current block also contains the expiry
+    while (level < TIMER_WHEEL_LEVELS - 1
+            && (node->expires >> (TIMER_WHEEL_BITS * (level + 1))) != (w->now >> (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (node->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    node->next = w->slots[level][slot];
+    w->slots[level][slot] = node;
+}
+
+void timerWheelSchedule(timerWheel *w, timerNode *node, uint64_t expires) {
+    if (expires <= w->now) {
+        expires = w->now + 1;
+    } else if (expires - w->now > MAX_DELAY) {
+        expires = w->now + MAX_DELAY;
+    }
+    node->expires = expires;
+    place(w, node);
+    w->count++;
+}
+
+static void cascade(timerWheel *w, int level) {
+    int slot = (w->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    timerNode *node = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    while (node != NULL) {
+        timerNode *next = node->next;
+        place(w, node);
+        node = next;
+    }
+}
+
+timerNode *timerWheelAdvance(timerWheel *w, uint64_t now) {
+    timerNode *expired = NULL;
+
+    if (w->count == 0) {
+        w->now = now > w->now ? now : w->now;
+        return NULL;
+    }
+
+    while (w->now < now && w->count > 0) {
+        w->now++;
+
+        // Entering a new block at some level pulls that level's slot down, highest level first
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((w->now & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) == 0) {
+                cascade(w, level);
+            }
+        }
+
+        int slot = w->now & SLOT_MASK;
+        timerNode *node = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        while (node != NULL) {
+            timerNode *next = node->next;
+            node->next = expired;
+            expired = node;
+            w->count--;
+            node = next;
+        }
+    }
+    if (w->now < now) {
+        w->now = now;
+    }
+    return expired;
+}
+
+uint64_t timerWheelNextExpiry(const timerWheel *w) {
+    if (w->count == 0) {
+        return UINT64_MAX;
+    }
+
+    // Level 0 is exact; higher levels give the start of the earliest occupied block
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        uint64_t current = w->now >> shift;
+        for (int i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+            uint64_t block = current + i;
+            if ((block >> TIMER_WHEEL_BITS) != (current >> TIMER_WHEEL_BITS) && level < TIMER_WHEEL_LEVELS - 1) {
+                break; // Past this level's current block, timers live on the next level
+            }
+            if (w->slots[level][block & SLOT_MASK] != NULL) {
+                return block << shift;
+            }
+        }
+    }
+    return w->now + 1;
+}
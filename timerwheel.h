@@ -0,0 +1,33 @@
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Hierarchical timer wheel. Level l holds timers that expire within the current
+// TIMER_WHEEL_SLOTS^(l+1) tick block; they cascade one level down when their slot comes up,
+// so scheduling and expiring are O(1) regardless of how many timers are pending.
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct timerNode {
+    struct timerNode *next;
+    uint64_t expires;  // Absolute tick
+} timerNode;
+
+typedef struct {
+    uint64_t now;      // Last processed tick
+    size_t count;
+    timerNode *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timerWheel;
+
+void timerWheelInit(timerWheel *w, uint64_t now);
+void timerWheelSchedule(timerWheel *w, timerNode *node, uint64_t expires);
+// Advances to tick `now` and returns the expired timers as a list linked through next
+timerNode *timerWheelAdvance(timerWheel *w, uint64_t now);
+// Earliest tick at which timerWheelAdvance may return something, or UINT64_MAX when empty
+uint64_t timerWheelNextExpiry(const timerWheel *w);
+
+#endif
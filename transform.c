@@ -0,0 +1,615 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "transform.h"
+#include "jsonscan.h"
+
+typedef struct {
+    int op;             // TOP_* of the rule, TOP_COPY for keep
+    char *subject;      // Top level field, or dotted path for extract
+    char *arg;          // New name, literal, or coercion type
+    int type;
+} transformRule;
+
+static uint64_t hashKey(const char *key, size_t len) {
+    // FNV-1a; 0 is reserved for free slots
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static int emit(transformProgram *prog, uint16_t value) {
+    if (prog->code_len == prog->code_capacity) {
+        // Code offsets are 16 bit operands
+        size_t capacity = prog->code_capacity ? prog->code_capacity * 2 : 64;
+        uint16_t *code = capacity <= UINT16_MAX ? (uint16_t *)realloc(prog->code, capacity * sizeof(uint16_t)) : NULL;
+        if (code == NULL) {
+            return -1;
+        }
+        prog->code = code;
+        prog->code_capacity = capacity;
+    }
+    prog->code[prog->code_len++] = value;
+    return 0;
+}
+
+static int addString(transformProgram *prog, const char *str, size_t len) {
+    transformString *strings = (transformString *)realloc(prog->strings, (prog->string_count + 1) * sizeof(transformString));
+    if (strings == NULL) {
+        return -1;
+    }
+    prog->strings = strings;
+    char *copy = (char *)malloc(len + 1);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    strings[prog->string_count].str = copy;
+    strings[prog->string_count].len = len;
+    return prog->string_count++;
+}
+
+// Member names are stored quoted and followed by the colon
+static int addName(transformProgram *prog, const char *name) {
+    size_t len = strlen(name);
+    char *quoted = (char *)malloc(6 * len + 3);
+    if (quoted == NULL) {
+        return -1;
+    }
+    size_t quoted_len = jsonWriteString(quoted, name, len);
+    quoted[quoted_len++] = ':';
+    int index = addString(prog, quoted, quoted_len);
+    free(quoted);
+    return index;
+}
+
+static int parseType(const char *name) {
+    if (strcmp(name, "int") == 0) {
+        return TRANSFORM_INT;
+    } else if (strcmp(name, "number") == 0) {
+        return TRANSFORM_NUMBER;
+    } else if (strcmp(name, "string") == 0) {
+        return TRANSFORM_STRING;
+    } else if (strcmp(name, "bool") == 0) {
+        return TRANSFORM_BOOL;
+    }
+    return -1;
+}
+
+static char *nextToken(char **p) {
+    char *s = *p;
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    if (*s == '\0') {
+        return NULL;
+    }
+    char *token = s;
+    while (*s != '\0' && !isspace((unsigned char)*s)) {
+        s++;
+    }
+    if (*s != '\0') {
+        *s++ = '\0';
+    }
+    *p = s;
+    return token;
+}
+
+static int addRule(transformRule *rules, int *count, int op, const char *subject, const char *arg, int type) {
+    if (*count == TRANSFORM_MAX_RULES) {
+        fprintf(stderr, "Error: more than %d transform rules\n", TRANSFORM_MAX_RULES);
+        return -1;
+    }
+    transformRule *rule = &rules[(*count)++];
+    rule->op = op;
+    rule->subject = strdup(subject);
+    rule->arg = arg ? strdup(arg) : NULL;
+    rule->type = type;
+    return rule->subject == NULL || (arg && rule->arg == NULL) ? -1 : 0;
+}
+
+// Parses the rules that apply to channel; returns the number of rules or -1
+static int parseRules(const char *path, const char *channel, transformRule *rules, int *project) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening transform rules");
+        return -1;
+    }
+
+    char line[4096];
+    int count = 0;
+    int line_number = 0;
+    int applies = 1;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char *p = line;
+        char *op = nextToken(&p);
+        if (op == NULL || op[0] == '#') {
+            continue;
+        }
+        if (op[0] == '[') {
+            char *close = strchr(op, ']');
+            if (close == NULL) {
+                fprintf(stderr, "%s:%d: malformed channel header\n", path, line_number);
+                result = -1;
+                break;
+            }
+            *close = '\0';
+            applies = strcmp(op + 1, channel) == 0;
+            continue;
+        }
+        if (!applies) {
+            continue;
+        }
+
+        char *subject = nextToken(&p);
+        char *arg = NULL;
+        if (subject == NULL) {
+            fprintf(stderr, "%s:%d: '%s' needs a field\n", path, line_number, op);
+            result = -1;
+        } else if (strcmp(op, "keep") == 0) {
+            *project = 1;
+            for (char *field = subject; field != NULL && result == 0; field = nextToken(&p)) {
+                result = addRule(rules, &count, TOP_COPY, field, NULL, 0);
+            }
+        } else if (strcmp(op, "drop") == 0) {
+            result = addRule(rules, &count, TOP_DROP, subject, NULL, 0);
+        } else if (strcmp(op, "set") == 0) {
+            // The literal is the rest of the line and must be a single JSON value
+            while (isspace((unsigned char)*p)) {
+                p++;
+            }
+            size_t len = strlen(p);
+            while (len > 0 && isspace((unsigned char)p[len - 1])) {
+                p[--len] = '\0';
+            }
+            if (len == 0 || jsonSkipValue(p, p + len, 0) != p + len) {
+                fprintf(stderr, "%s:%d: 'set' needs a JSON value\n", path, line_number);
+                result = -1;
+            } else {
+                result = addRule(rules, &count, TOP_SET, subject, p, 0);
+            }
+        } else if ((arg = nextToken(&p)) == NULL) {
+            fprintf(stderr, "%s:%d: '%s' needs two arguments\n", path, line_number, op);
+            result = -1;
+        } else if (strcmp(op, "rename") == 0) {
+            result = addRule(rules, &count, TOP_RENAME, subject, arg, 0);
+        } else if (strcmp(op, "extract") == 0) {
+            if (strchr(subject, '.') == NULL) {
+                fprintf(stderr, "%s:%d: 'extract' needs a nested path, use rename for top level fields\n", path, line_number);
+                result = -1;
+            } else {
+                result = addRule(rules, &count, TOP_EXTRACT, subject, arg, 0);
+            }
+        } else if (strcmp(op, "coerce") == 0) {
+            int type = parseType(arg);
+            if (type < 0) {
+                fprintf(stderr, "%s:%d: unknown type '%s'\n", path, line_number, arg);
+                result = -1;
+            } else {
+                result = addRule(rules, &count, TOP_COERCE, subject, NULL, type);
+            }
+        } else {
+            fprintf(stderr, "%s:%d: unknown rule '%s'\n", path, line_number, op);
+            result = -1;
+        }
+    }
+    fclose(file);
+    if (result != 0) {
+        for (int i = 0; i < count; i++) {
+            free(rules[i].subject);
+            free(rules[i].arg);
+        }
+        return -1;
+    }
+    return count;
+}
+
+static size_t findSlot(const transformProgram *prog, uint64_t hash, const char *key, size_t len) {
+    size_t mask = prog->capacity - 1;
+    size_t i = hash & mask;
+    while (prog->hashes[i] != 0) {
+        const transformString *stored = &prog->strings[prog->keys[i]];
+        if (prog->hashes[i] == hash && stored->len == len && memcmp(stored->str, key, len) == 0) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Top level key a rule dispatches on; extract paths start with it
+static size_t subjectKeyLength(const transformRule *rule) {
+    if (rule->op == TOP_EXTRACT) {
+        return strchr(rule->subject, '.') - rule->subject;
+    }
+    return strlen(rule->subject);
+}
+
+// Emits the code for one top level key from every rule about it
+static int compileKey(transformProgram *prog, const transformRule *rules, int count, const char *key, size_t key_len) {
+    int primary = -1;       // Explicit drop or rename
+    int rename = -1;
+    int replaced = 0;       // set or the consumer_id epilogue adds the key again
+    int kept = 0;
+    int coerce = -1;
+
+    replaced = key_len == strlen("consumer_id") && memcmp(key, "consumer_id", key_len) == 0;
+    for (int i = 0; i < count; i++) {
+        const transformRule *rule = &rules[i];
+        if (subjectKeyLength(rule) != key_len || memcmp(rule->subject, key, key_len) != 0) {
+            continue;
+        }
+        switch (rule->op) {
+            case TOP_COPY: kept = 1; break;
+            case TOP_DROP: primary = TOP_DROP; break;
+            case TOP_RENAME: primary = TOP_RENAME; rename = i; break;
+            case TOP_SET: replaced = 1; break;
+            case TOP_COERCE: coerce = rule->type; break;
+        }
+    }
+    if (primary < 0) {
+        primary = replaced ? TOP_DROP : kept ? TOP_COPY : prog->default_op;
+    }
+
+    if (coerce >= 0 && primary != TOP_DROP && (emit(prog, TOP_COERCE) != 0 || emit(prog, (uint16_t)coerce) != 0)) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        const transformRule *rule = &rules[i];
+        if (rule->op != TOP_EXTRACT || subjectKeyLength(rule) != key_len || memcmp(rule->subject, key, key_len) != 0) {
+            continue;
+        }
+        // The remaining path segments go to the constant pool back to back
+        int first = -1;
+        int segments = 0;
+        for (const char *segment = rule->subject + key_len + 1; ; segments++) {
+            const char *dot = strchr(segment, '.');
+            size_t len = dot ? (size_t)(dot - segment) : strlen(segment);
+            int index = addString(prog, segment, len);
+            if (index < 0) {
+                return -1;
+            }
+            if (first < 0) {
+                first = index;
+            }
+            if (dot == NULL) {
+                segments++;
+                break;
+            }
+            segment = dot + 1;
+        }
+        int name = addName(prog, rule->arg);
+        if (name < 0 || emit(prog, TOP_EXTRACT) != 0 || emit(prog, (uint16_t)first) != 0
+                || emit(prog, (uint16_t)segments) != 0 || emit(prog, (uint16_t)name) != 0) {
+            return -1;
+        }
+    }
+    if (emit(prog, (uint16_t)primary) != 0) {
+        return -1;
+    }
+    if (primary == TOP_RENAME) {
+        int name = addName(prog, rules[rename].arg);
+        if (name < 0 || emit(prog, (uint16_t)name) != 0) {
+            return -1;
+        }
+    }
+    return emit(prog, TOP_END);
+}
+
+int transformCompile(transformProgram *prog, const char *path, const char *channel) {
+    transformRule rules[TRANSFORM_MAX_RULES];
+    int project = 0;
+
+    memset(prog, 0, sizeof(*prog));
+    int count = parseRules(path, channel, rules, &project);
+    if (count < 0) {
+        return -1;
+    }
+    prog->rule_count = count;
+    prog->default_op = project ? TOP_DROP : TOP_COPY;
+
+    prog->capacity = 16;
+    while (prog->capacity < (size_t)(count + 1) * 2) {
+        prog->capacity <<= 1;
+    }
+    prog->hashes = (uint64_t *)calloc(prog->capacity, sizeof(uint64_t));
+    prog->targets = (uint16_t *)malloc(prog->capacity * sizeof(uint16_t));
+    prog->keys = (uint16_t *)malloc(prog->capacity * sizeof(uint16_t));
+    int result = prog->hashes && prog->targets && prog->keys ? 0 : -1;
+
+    // One dispatch entry per distinct top level key; consumer_id always has one since it is replaced
+    for (int i = 0; i <= count && result == 0; i++) {
+        const char *key = i < count ? rules[i].subject : "consumer_id";
+        size_t key_len = i < count ? subjectKeyLength(&rules[i]) : strlen("consumer_id");
+        uint64_t hash = hashKey(key, key_len);
+        size_t slot = findSlot(prog, hash, key, key_len);
+        if (prog->hashes[slot] != 0) {
+            continue;
+        }
+        int index = addString(prog, key, key_len);
+        if (index < 0) {
+            result = -1;
+            break;
+        }
+        prog->hashes[slot] = hash;
+        prog->keys[slot] = (uint16_t)index;
+        prog->targets[slot] = (uint16_t)prog->code_len;
+        result = compileKey(prog, rules, count, key, key_len);
+    }
+
+    prog->epilogue = (uint16_t)prog->code_len;
+    for (int i = 0; i < count && result == 0; i++) {
+        if (rules[i].op == TOP_SET) {
+            int name = addName(prog, rules[i].subject);
+            int literal = addString(prog, rules[i].arg, strlen(rules[i].arg));
+            if (name < 0 || literal < 0 || emit(prog, TOP_SET) != 0 || emit(prog, (uint16_t)name) != 0
+                    || emit(prog, (uint16_t)literal) != 0) {
+                result = -1;
+            }
+        }
+    }
+    if (result == 0 && (emit(prog, TOP_CONSUMER_ID) != 0 || emit(prog, TOP_EXTRA) != 0 || emit(prog, TOP_END) != 0)) {
+        result = -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(rules[i].subject);
+        free(rules[i].arg);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error compiling transform rules\n");
+        transformFree(prog);
+    }
+    return result;
+}
+
+void transformFree(transformProgram *prog) {
+    for (int i = 0; i < prog->string_count; i++) {
+        free(prog->strings[i].str);
+    }
+    free(prog->strings);
+    free(prog->code);
+    free(prog->hashes);
+    free(prog->targets);
+    free(prog->keys);
+    memset(prog, 0, sizeof(*prog));
+}
+
+static void append(jsonBuffer *out, const char *data, size_t len) {
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+// Reserves room for a member and writes the separator; the caller appends name and value
+static int beginMember(jsonBuffer *out, size_t size) {
+    if (jsonBufferReserve(out, out->len + size + 2) != 0) {
+        return -1;
+    }
+    if (out->members++ > 0) {
+        out->buf[out->len++] = ',';
+    }
+    return 0;
+}
+
+// Strings holding a JSON number or literal can be coerced to it; escapes never occur in those
+static int stringContent(const char *value, size_t len, const char **content, size_t *content_len) {
+    *content = value + 1;
+    *content_len = len - 2;
+    return memchr(*content, '\\', *content_len) == NULL;
+}
+
+static void appendCoerced(jsonBuffer *out, const char *value, size_t len, int type) {
+    int kind = jsonValueKind(value);
+    const char *content;
+    size_t content_len;
+
+    switch (type) {
+        case TRANSFORM_STRING:
+            if (kind == JSON_KIND_STRING || kind == JSON_KIND_NULL) {
+                append(out, value, len);
+            } else {
+                out->len += jsonWriteString(out->buf + out->len, value, len);
+            }
+            return;
+        case TRANSFORM_INT:
+        case TRANSFORM_NUMBER:
+            if (kind == JSON_KIND_TRUE || kind == JSON_KIND_FALSE) {
+                append(out, kind == JSON_KIND_TRUE ? "1" : "0", 1);
+                return;
+            }
+            if (kind == JSON_KIND_NUMBER) {
+                content = value;
+                content_len = len;
+            } else if (kind != JSON_KIND_STRING || !stringContent(value, len, &content, &content_len)
+                    || content_len == 0 || jsonSkipValue(content, content + content_len, 0) != content + content_len
+                    || jsonValueKind(content) != JSON_KIND_NUMBER) {
+                append(out, "null", 4);
+                return;
+            }
+            if (type == TRANSFORM_NUMBER || (memchr(content, '.', content_len) == NULL
+                    && memchr(content, 'e', content_len) == NULL && memchr(content, 'E', content_len) == NULL)) {
+                append(out, content, content_len);
+            } else {
+                char number[64];
+                size_t n = content_len < sizeof(number) - 1 ? content_len : sizeof(number) - 1;
+                memcpy(number, content, n);
+                number[n] = '\0';
+                out->len += sprintf(out->buf + out->len, "%lld", (long long)strtod(number, NULL));
+            }
+            return;
+        case TRANSFORM_BOOL:
+            if (kind == JSON_KIND_TRUE || kind == JSON_KIND_FALSE) {
+                append(out, value, len);
+            } else if (kind == JSON_KIND_NUMBER) {
+                char number[64];
+                size_t n = len < sizeof(number) - 1 ? len : sizeof(number) - 1;
+                memcpy(number, value, n);
+                number[n] = '\0';
+                append(out, strtod(number, NULL) != 0 ? "true" : "false", strtod(number, NULL) != 0 ? 4 : 5);
+            } else if (kind == JSON_KIND_STRING && (len == 6 && memcmp(value, "\"true\"", 6) == 0)) {
+                append(out, "true", 4);
+            } else if (kind == JSON_KIND_STRING && (len == 7 && memcmp(value, "\"false\"", 7) == 0)) {
+                append(out, "false", 5);
+            } else {
+                append(out, "null", 4);
+            }
+            return;
+    }
+}
+
+static int emitValue(jsonBuffer *out, const transformString *name, const char *value, size_t len, int coerce) {
+    // Coercing to string may escape every byte
+    if (beginMember(out, name->len + (coerce >= 0 ? 6 * len + 24 : len)) != 0) {
+        return -1;
+    }
+    append(out, name->str, name->len);
+    if (coerce >= 0) {
+        appendCoerced(out, value, len, coerce);
+    } else {
+        append(out, value, len);
+    }
+    return 0;
+}
+
+// The raw key keeps its quotes and escapes
+static int copyMember(jsonBuffer *out, const jsonMember *member, int coerce) {
+    if (beginMember(out, member->key_len + 3 + (coerce >= 0 ? 6 * member->value_len + 24 : member->value_len)) != 0) {
+        return -1;
+    }
+    append(out, member->key - 1, member->key_len + 2);
+    out->buf[out->len++] = ':';
+    if (coerce >= 0) {
+        appendCoerced(out, member->value, member->value_len, coerce);
+    } else {
+        append(out, member->value, member->value_len);
+    }
+    return 0;
+}
+
+static int runMember(const transformProgram *prog, size_t pc, const jsonMember *member, jsonBuffer *out) {
+    const uint16_t *code = prog->code;
+    int coerce = -1;
+    for (;;) {
+        switch (code[pc]) {
+            case TOP_END:
+            case TOP_DROP:
+                return 0;
+            case TOP_COPY:
+                return copyMember(out, member, coerce);
+            case TOP_RENAME:
+                return emitValue(out, &prog->strings[code[pc + 1]], member->value, member->value_len, coerce);
+            case TOP_COERCE:
+                coerce = code[pc + 1];
+                pc += 2;
+                break;
+            case TOP_EXTRACT: {
+                const char *value = member->value;
+                size_t len = member->value_len;
+                int found = 1;
+                for (int s = 0; s < code[pc + 2] && found; s++) {
+                    const transformString *segment = &prog->strings[code[pc + 1] + s];
+                    jsonMember nested;
+                    found = jsonValueKind(value) == JSON_KIND_OBJECT
+                            && jsonObjectFind(value, len, segment->str, segment->len, &nested);
+                    value = nested.value;
+                    len = nested.value_len;
+                }
+                if (found && emitValue(out, &prog->strings[code[pc + 3]], value, len, -1) != 0) {
+                    return -1;
+                }
+                pc += 4;
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+}
+
+int transformApply(const transformProgram *prog, const char *json, size_t len, int consumer_id,
+        const char *extra, size_t extra_len, jsonBuffer *out) {
+    jsonObjectScan scan;
+    jsonMember member;
+    int res;
+
+    out->members = 0;
+    if (jsonBufferReserve(out, out->len + len + 64) != 0 || jsonObjectBegin(&scan, json, len) != 0) {
+        return -1;
+    }
+    out->buf[out->len++] = '{';
+
+    size_t mask = prog->capacity - 1;
+    while ((res = jsonObjectNext(&scan, &member)) == 1) {
+        uint64_t hash = hashKey(member.key, member.key_len);
+        size_t i = hash & mask;
+        size_t pc = SIZE_MAX;
+        while (prog->hashes[i] != 0) {
+            const transformString *key = &prog->strings[prog->keys[i]];
+            if (prog->hashes[i] == hash && key->len == member.key_len && memcmp(key->str, member.key, key->len) == 0) {
+                pc = prog->targets[i];
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        int result;
+        if (pc != SIZE_MAX) {
+            result = runMember(prog, pc, &member, out);
+        } else if (prog->default_op == TOP_COPY) {
+            result = copyMember(out, &member, -1);
+        } else {
+            result = 0;
+        }
+        if (result != 0) {
+            return -1;
+        }
+    }
+    if (res < 0) {
+        return -1;
+    }
+
+    for (size_t pc = prog->epilogue; prog->code[pc] != TOP_END; ) {
+        switch (prog->code[pc]) {
+            case TOP_SET: {
+                const transformString *literal = &prog->strings[prog->code[pc + 2]];
+                if (emitValue(out, &prog->strings[prog->code[pc + 1]], literal->str, literal->len, -1) != 0) {
+                    return -1;
+                }
+                pc += 3;
+                break;
+            }
+            case TOP_CONSUMER_ID:
+                if (beginMember(out, 32) != 0) {
+                    return -1;
+                }
+                out->len += sprintf(out->buf + out->len, "\"consumer_id\":%d", consumer_id);
+                pc++;
+                break;
+            case TOP_EXTRA:
+                if (extra_len > 0) {
+                    if (beginMember(out, extra_len) != 0) {
+                        return -1;
+                    }
+                    append(out, extra, extra_len);
+                }
+                pc++;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (jsonBufferReserve(out, out->len + 2) != 0) {
+        return -1;
+    }
+    out->buf[out->len++] = '}';
+    out->buf[out->len] = '\0';
+    return 0;
+}
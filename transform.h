@@ -0,0 +1,70 @@
+#ifndef _TRANSFORM_H
+#define _TRANSFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jsonscan.h"
+
+// Field transform rules, compiled once into bytecode and run over a single scan of each payload.
+// The rules file has one rule per line; lines after a "[channel]" header only apply to that
+// channel, lines before any header to every channel, and lines starting with '#' are comments:
+//
+//   keep FIELD...              Project: members without a rule are dropped instead of copied
+//   drop FIELD
+//   rename FIELD NAME
+//   extract FIELD.SUB... NAME  Copy a nested value to a top level member
+//   set NAME JSON              Add a constant member (replacing one already present)
+//   coerce FIELD TYPE          Convert the value to int, number, string or bool (null if impossible)
+//
+// Every top level member of the payload dispatches through a hash table on its raw key to the
+// code compiled for it, or to the default (copy, or drop when projecting). The program ends by
+// appending consumer_id, which replaces any consumer_id in the payload like the built-in path.
+
+#define TRANSFORM_MAX_RULES 256
+
+// Opcodes; operands follow the opcode in the code array
+#define TOP_END 0
+#define TOP_COPY 1
+#define TOP_DROP 2
+#define TOP_RENAME 3        // name
+#define TOP_COERCE 4        // type, applied by the COPY or RENAME that follows
+#define TOP_EXTRACT 5       // first remaining path segment, segment count, name
+#define TOP_SET 6           // name, literal
+#define TOP_CONSUMER_ID 7
+#define TOP_EXTRA 8         // Members supplied by the caller
+
+#define TRANSFORM_INT 0
+#define TRANSFORM_NUMBER 1
+#define TRANSFORM_STRING 2
+#define TRANSFORM_BOOL 3
+
+typedef struct {
+    char *str;
+    size_t len;
+} transformString;
+
+typedef struct {
+    uint16_t *code;
+    size_t code_len;
+    size_t code_capacity;
+    uint16_t default_op;      // TOP_COPY, or TOP_DROP when projecting
+    uint16_t epilogue;        // Code run after the last member
+    // Dispatch on top level keys
+    uint64_t *hashes;         // 0 marks a free slot
+    uint16_t *targets;        // Code offset for each key
+    uint16_t *keys;           // String holding the raw key
+    size_t capacity;          // Power of two
+    // Constant pool: member names as "name": and literals, stored ready to copy
+    transformString *strings;
+    int string_count;
+    int rule_count;
+} transformProgram;
+
+int transformCompile(transformProgram *prog, const char *path, const char *channel);
+void transformFree(transformProgram *prog);
+// Appends the transformed payload (a JSON object) to out; returns -1 if the payload is not a valid object
+int transformApply(const transformProgram *prog, const char *json, size_t len, int consumer_id,
+        const char *extra, size_t extra_len, jsonBuffer *out);
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uuid.h"
+#include "clock.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define UUID_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define UUID_HASH_K1 0x9E3779B97F4A7C15ULL
+#define UUID_HASH_K2 0xD6E8FEB86659FD93ULL
+
+uint64_t uuidHash(const unsigned char *id) {
+    // UUIDs are mostly random already; one multiply-xorshift round folds the halves and the fixed
+    // version bits into every bit of the result
+    uint64_t hi, lo;
+    memcpy(&hi, id, sizeof(hi));
+    memcpy(&lo, id + sizeof(hi), sizeof(lo));
+    uint64_t h = hi ^ (lo * UUID_HASH_K1);
+    h ^= h >> 32;
+    h *= UUID_HASH_K2;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef void (*uuidKernel)(const char *texts, size_t stride, int count, unsigned char (*ids)[UUID_BINARY_SIZE],
+        uint64_t *hashes, uint8_t *valid);
+
+static void decodeScalar(const char *texts, size_t stride, int count, unsigned char (*ids)[UUID_BINARY_SIZE],
+        uint64_t *hashes, uint8_t *valid) {
+    for (int i = 0; i < count; i++) {
+        char text[UUID_TEXT_SIZE + 1];
+        memcpy(text, texts + i * stride, UUID_TEXT_SIZE);
+        text[UUID_TEXT_SIZE] = '\0';
+        valid[i] = uuidParse(text, ids[i]) == 0;
+        hashes[i] = uuidHash(ids[i]);
+    }
+}
+
+#ifdef UUID_HAVE_AVX2
+#define UUID_HYPHENS ((1u << 8) | (1u << 13) | (1u << 18) | (1u << 23))
+
+// Nibble values of hex digits, and a mask of the bytes that are hex digits
+__attribute__((target("avx2")))
+static inline __m256i hexNibbles256(__m256i v, __m256i *is_hex) {
+    __m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i alpha = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+    __m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+    *is_hex = _mm256_or_si256(is_digit, is_alpha);
+    return _mm256_blendv_epi8(_mm256_add_epi8(alpha, _mm256_set1_epi8(10)), digit, is_digit);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i hexNibbles128(__m128i v, __m128i *is_hex) {
+    __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    *is_hex = _mm_or_si128(is_digit, is_alpha);
+    return _mm_blendv_epi8(_mm_add_epi8(alpha, _mm_set1_epi8(10)), digit, is_digit);
+}
+
+// One id: bytes 0-31 in a 256-bit load give the first 10 bytes of the UUID, bytes 20-35 in a
+// 128-bit load the last 6. Each lane gathers the high and low nibbles of its pairs with a shuffle
+// and merges them; pairs never straddle the lanes.
+__attribute__((target("avx2")))
+static inline int decodeOneAvx2(const char *text, unsigned char *out) {
+    const __m256i high_index = _mm256_setr_epi8(
+            0, 2, 4, 6, 9, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            0, 3, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i low_index = _mm256_setr_epi8(
+            1, 3, 5, 7, 10, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            1, 4, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i tail_high_index = _mm_setr_epi8(4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i tail_low_index = _mm_setr_epi8(5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    __m256i head = _mm256_loadu_si256((const __m256i *)text);
+    __m128i tail = _mm_loadu_si128((const __m128i *)(text + 20));
+    __m256i head_hex;
+    __m128i tail_hex;
+    __m256i head_nibbles = hexNibbles256(head, &head_hex);
+    __m128i tail_nibbles = hexNibbles128(tail, &tail_hex);
+
+    uint32_t hyphens = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(head, _mm256_set1_epi8('-')));
+    uint32_t hex = (uint32_t)_mm256_movemask_epi8(head_hex);
+    // The tail load starts at offset 20; its bytes 4-15 are text 24-35
+    uint32_t hex_tail = (uint32_t)_mm_movemask_epi8(tail_hex);
+    int ok = hyphens == UUID_HYPHENS && hex == ~UUID_HYPHENS && (hex_tail & 0xfff0) == 0xfff0;
+
+    __m256i bytes = _mm256_or_si256(_mm256_slli_epi16(_mm256_shuffle_epi8(head_nibbles, high_index), 4),
+            _mm256_shuffle_epi8(head_nibbles, low_index));
+    __m128i tail_bytes = _mm_or_si128(_mm_slli_epi16(_mm_shuffle_epi8(tail_nibbles, tail_high_index), 4),
+            _mm_shuffle_epi8(tail_nibbles, tail_low_index));
+    __m128i id = _mm_or_si128(_mm256_castsi256_si128(bytes), _mm_slli_si128(_mm256_extracti128_si256(bytes, 1), 7));
+    id = _mm_or_si128(id, _mm_slli_si128(tail_bytes, 10));
+    _mm_storeu_si128((__m128i *)out, id);
+    return ok;
+}
+
+// Low 64 bits of a 64x64 bit product, which AVX2 lacks, from three 32x32 bit products
+__attribute__((target("avx2")))
+static inline __m256i mul64(__m256i a, __m256i b) {
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+            _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+// uuidHash of 4 consecutive ids
+__attribute__((target("avx2")))
+static inline void hash4Avx2(unsigned char (*ids)[UUID_BINARY_SIZE], uint64_t *hashes) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)ids[0]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)ids[2]);
+    // Halves in the order of ids 0, 2, 1, 3
+    __m256i hi = _mm256_unpacklo_epi64(a, b);
+    __m256i lo = _mm256_unpackhi_epi64(a, b);
+    __m256i h = _mm256_xor_si256(hi, mul64(lo, _mm256_set1_epi64x((long long)UUID_HASH_K1)));
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 32));
+    h = mul64(h, _mm256_set1_epi64x((long long)UUID_HASH_K2));
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 32));
+    _mm256_storeu_si256((__m256i *)hashes, _mm256_permute4x64_epi64(h, 0xd8));
+}
+
+__attribute__((target("avx2")))
+static void decodeAvx2(const char *texts, size_t stride, int count, unsigned char (*ids)[UUID_BINARY_SIZE],
+        uint64_t *hashes, uint8_t *valid) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        for (int k = 0; k < 8; k++) {
+            valid[i + k] = (uint8_t)decodeOneAvx2(texts + (i + k) * stride, ids[i + k]);
+        }
+        hash4Avx2(ids + i, hashes + i);
+        hash4Avx2(ids + i + 4, hashes + i + 4);
+    }
+    decodeScalar(texts + i * stride, stride, count - i, ids + i, hashes + i, valid + i);
+}
+#endif
+
+static uuidKernel kernel;
+static const char *kernel_name;
+
+static void selectKernel(void) {
+    kernel = decodeScalar;
+    kernel_name = "scalar";
+#ifdef UUID_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = decodeAvx2;
+        kernel_name = "avx2";
+    }
+#endif
+}
+
+void uuidDecodeBatch(const char *texts, size_t stride, int count, unsigned char (*ids)[UUID_BINARY_SIZE],
+        uint64_t *hashes, uint8_t *valid) {
+    if (kernel == NULL) {
+        selectKernel();
+    }
+    kernel(texts, stride, count, ids, hashes, valid);
+}
+
+const char *uuidKernelName(void) {
+    if (kernel == NULL) {
+        selectKernel();
+    }
+    return kernel_name;
+}
+
+// Benchmark
+
+static void randomUuid(char *text) {
+    static const char digits[] = "0123456789abcdefABCDEF";
+    for (int i = 0; i < UUID_TEXT_SIZE; i++) {
+        text[i] = (i == 8 || i == 13 || i == 18 || i == 23) ? '-' : digits[rand() % (sizeof(digits) - 1)];
+    }
+    text[UUID_TEXT_SIZE] = '\0';
+}
+
+// Replaces one character with a near miss: a character next to a hex digit range, a hyphen where
+// a digit belongs or the reverse, or a byte with the high bit set
+static void corruptUuid(char *text) {
+    static const char near_misses[] = "/:@`GgzZ- \x7f\x80\xff";
+    int pos = rand() % UUID_TEXT_SIZE;
+    if (rand() % 4 == 0) {
+        text[pos] = (text[pos] == '-') ? 'a' : '-';
+    } else {
+        text[pos] = near_misses[rand() % (sizeof(near_misses) - 1)];
+    }
+}
+
+static double benchmarkKernel(uuidKernel run, const char *texts, int count, unsigned char (*ids)[UUID_BINARY_SIZE],
+        uint64_t *hashes, uint8_t *valid) {
+    long passes = 0;
+    uint64_t start = monotonicNanos();
+    uint64_t elapsed;
+    do {
+        run(texts, UUID_TEXT_SIZE + 1, count, ids, hashes, valid);
+        passes++;
+        elapsed = monotonicNanos() - start;
+    } while (elapsed < 1000000000ULL);
+    return (double)count * passes * 1e9 / elapsed;
+}
+
+int uuidBenchmark(void) {
+    int count = UUID_BENCHMARK_IDS;
+    char *texts = (char *)malloc((size_t)count * (UUID_TEXT_SIZE + 1));
+    unsigned char (*ids)[UUID_BINARY_SIZE] = (unsigned char (*)[UUID_BINARY_SIZE])malloc((size_t)count * 2 * UUID_BINARY_SIZE);
+    uint64_t *hashes = (uint64_t *)malloc((size_t)count * 2 * sizeof(uint64_t));
+    uint8_t *valid = (uint8_t *)malloc((size_t)count * 2);
+    if (texts == NULL || ids == NULL || hashes == NULL || valid == NULL) {
+        fprintf(stderr, "Error allocating the UUID benchmark\n");
+        free(texts);
+        free(ids);
+        free(hashes);
+        free(valid);
+        return -1;
+    }
+
+    // A quarter of the ids are malformed, one or two characters each
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        char *text = texts + (size_t)i * (UUID_TEXT_SIZE + 1);
+        randomUuid(text);
+        if (i % 4 == 3) {
+            corruptUuid(text);
+            if (rand() % 2) {
+                corruptUuid(text);
+            }
+        }
+    }
+
+    int res = 0;
+    printf("UUID decoding: %s kernel selected\n", uuidKernelName());
+    decodeScalar(texts, UUID_TEXT_SIZE + 1, count, ids, hashes, valid);
+    double scalar_rate = benchmarkKernel(decodeScalar, texts, count, ids, hashes, valid);
+    printf("scalar: %.1f M ids/s\n", scalar_rate / 1e6);
+#ifdef UUID_HAVE_AVX2
+    if (kernel == decodeAvx2) {
+        long mismatches = 0;
+        long invalid = 0;
+        decodeAvx2(texts, UUID_TEXT_SIZE + 1, count, ids + count, hashes + count, valid + count);
+        for (int i = 0; i < count; i++) {
+            invalid += !valid[i];
+            if (valid[i] != valid[count + i]
+                    || (valid[i] && (memcmp(ids[i], ids[count + i], UUID_BINARY_SIZE) != 0 || hashes[i] != hashes[count + i]))) {
+                if (mismatches++ < 5) {
+                    fprintf(stderr, "UUID kernels disagree on %.36s\n", texts + (size_t)i * (UUID_TEXT_SIZE + 1));
+                }
+            }
+        }
+        printf("avx2 checked against scalar on %d ids (%ld malformed): %ld mismatches\n", count, invalid, mismatches);
+        res = mismatches == 0 ? 0 : -1;
+        double avx2_rate = benchmarkKernel(decodeAvx2, texts, count, ids, hashes, valid);
+        printf("avx2: %.1f M ids/s (%.1fx)\n", avx2_rate / 1e6, avx2_rate / scalar_rate);
+    }
+#endif
+
+    free(texts);
+    free(ids);
+    free(hashes);
+    free(valid);
+    return res;
+}
@@ -0,0 +1,28 @@
+#ifndef _UUID_H
+#define _UUID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "records.h"
+
+// Batch message_id decoding: validates 36-character UUID strings (hyphens at 8, 13, 18 and 23,
+// hex digits in either case elsewhere, as uuidParse), packs them to 16 bytes and hashes the
+// binary ids. On x86-64 CPUs with AVX2 a vector kernel does 8 ids at a time; the scalar kernel
+// is used everywhere else. The kernel is picked once, at the first call.
+
+#define UUID_BENCHMARK_IDS (1 << 20)
+
+uint64_t uuidHash(const unsigned char *id);
+
+// texts holds count strings of at least UUID_TEXT_SIZE bytes, stride bytes apart. Sets valid[i] to
+// 1 or 0; ids and hashes of invalid strings are unspecified.
+void uuidDecodeBatch(const char *texts, size_t stride, int count, unsigned char (*ids)[UUID_BINARY_SIZE],
+        uint64_t *hashes, uint8_t *valid);
+const char *uuidKernelName(void);
+
+// Checks the vector kernel against the scalar one on random and malformed ids, then reports the
+// ids per second of each. Returns -1 if they disagree.
+int uuidBenchmark(void);
+
+#endif